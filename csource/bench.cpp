@@ -0,0 +1,413 @@
+// Headless benchmarks for libmembraneskia.
+//
+// Runs a set of standard scenes through the exported skia_* api on a cpu
+// surface (or a headless EGL pbuffer when built with -DMEMBRANE_BENCH_EGL)
+// and prints the results as json.
+//
+// usage: bench [--gl] [--frames N] [--width W] [--height H] [--scene NAME]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "SkData.h"
+#include "SkImage.h"
+#include "SkSurface.h"
+#include "include/core/SkCanvas.h"
+#include "include/encode/SkPngEncoder.h"
+#include "modules/skparagraph/include/Paragraph.h"
+#include "modules/skparagraph/include/ParagraphBuilder.h"
+
+#include "skia.h"
+#include "headless_gl.h"
+
+using namespace skia::textlayout;
+
+// paragraph api exported by skia.cpp
+extern "C" {
+    ParagraphBuilder* skia_ParagraphBuilder_make(ParagraphStyle* paragraphStyle);
+    void skia_ParagraphBuilder_delete(ParagraphBuilder* pb);
+    void skia_ParagraphBuilder_pushStyle(ParagraphBuilder *pb, TextStyle* style);
+    void skia_ParagraphBuilder_addText(ParagraphBuilder *pb, char* text, int len);
+    Paragraph* skia_ParagraphBuilder_build(ParagraphBuilder *pb);
+    void skia_Paragraph_delete(Paragraph* p);
+    void skia_Paragraph_layout(Paragraph* para, float width);
+    void skia_Paragraph_paint(Paragraph* para, SkiaResource* resource, float x, float y);
+    float skia_Paragraph_getHeight(Paragraph* para);
+    ParagraphStyle* skia_ParagraphStyle_make();
+    void skia_ParagraphStyle_delete(ParagraphStyle* ps);
+    TextStyle* skia_TextStyle_make();
+    void skia_TextStyle_delete(TextStyle* style);
+    void skia_TextStyle_setFontSize(TextStyle* style, float fontSize);
+    void skia_TextStyle_setColor(TextStyle* style, uint32_t color);
+    SkImage* skia_load_image_from_memory(const unsigned char *const buffer,int buffer_length);
+    void skia_flush_and_submit(SkiaResource* resource);
+    SkPath* skia_make_path();
+    void skia_delete_path(SkPath* path);
+    void skia_skpath_moveto(SkPath* path, double x, double y);
+    void skia_skpath_cubicto(SkPath* path, double x1, double y1, double x2, double y2, double x3, double y3);
+    void skia_skpath_draw(SkiaResource* resource, SkPath* path);
+}
+
+// Allocation counting.
+// Only counts operator new. skia's own sk_malloc calls go straight to malloc.
+static std::atomic<int64_t> allocationCount(0);
+
+void* operator new(size_t size){
+    allocationCount.fetch_add(1, std::memory_order_relaxed);
+    void* p = malloc(size ? size : 1);
+    if ( !p ){
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void* p) noexcept {
+    free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+    free(p);
+}
+
+struct BenchContext {
+    SkiaResource* resource;
+    SkFont* font;
+    SkImage* image;
+    SkImage* cachedImage;
+    TerminalGrid* grid;
+    int width;
+    int height;
+    bool gpu;
+};
+
+typedef void (*SceneFn)(BenchContext& ctx, int frame);
+
+static void textTableScene(BenchContext& ctx, int frame){
+    const int rows = 60;
+    const int columns = 8;
+    char cell[64];
+    float lineHeight = skia_line_height(ctx.font);
+
+    skia_set_color(ctx.resource, 0, 0, 0, 1);
+    for (int row = 0; row < rows; row++){
+        skia_save(ctx.resource);
+        skia_translate(ctx.resource, 0, row * lineHeight);
+        for (int column = 0; column < columns; column++){
+            int len = snprintf(cell, sizeof(cell), "r%dc%d %d.%02d", row, column, (row * 31 + column * 7 + frame) % 1000, column);
+            skia_render_line(ctx.resource, ctx.font, cell, len, column * 100.0f, lineHeight);
+        }
+        skia_restore(ctx.resource);
+    }
+}
+
+static void paragraphScene(BenchContext& ctx, int frame){
+    static const char* words[] = {"membrane", "skia", "paragraph", "layout", "the", "quick", "brown", "fox", "jumps", "over", "lazy", "dog"};
+    const int paragraphs = 12;
+
+    ParagraphStyle* paragraphStyle = skia_ParagraphStyle_make();
+    TextStyle* textStyle = skia_TextStyle_make();
+    skia_TextStyle_setFontSize(textStyle, 14);
+    skia_TextStyle_setColor(textStyle, 0xFF202020);
+
+    float y = 0;
+    for (int i = 0; i < paragraphs; i++){
+        std::string text;
+        for (int w = 0; w < 60; w++){
+            text += words[(i * 7 + w * 3 + frame) % 12];
+            text += ' ';
+        }
+
+        ParagraphBuilder* pb = skia_ParagraphBuilder_make(paragraphStyle);
+        skia_ParagraphBuilder_pushStyle(pb, textStyle);
+        skia_ParagraphBuilder_addText(pb, (char*)text.data(), text.size());
+        Paragraph* para = skia_ParagraphBuilder_build(pb);
+        skia_Paragraph_layout(para, ctx.width - 20.0f);
+        skia_Paragraph_paint(para, ctx.resource, 10, y);
+        y += skia_Paragraph_getHeight(para);
+
+        skia_Paragraph_delete(para);
+        skia_ParagraphBuilder_delete(pb);
+    }
+
+    skia_TextStyle_delete(textStyle);
+    skia_ParagraphStyle_delete(paragraphStyle);
+}
+
+static void pathScene(BenchContext& ctx, int frame){
+    const int lines = 40;
+    const int pointCount = 100;
+    std::vector<float> points(pointCount * 2);
+
+    skia_set_style(ctx.resource, SkPaint::kStroke_Style);
+    skia_set_stroke_width(ctx.resource, 1.5);
+    for (int line = 0; line < lines; line++){
+        for (int i = 0; i < pointCount; i++){
+            points[i * 2] = i * (ctx.width / (float)pointCount);
+            points[i * 2 + 1] = line * 15 + 10 + ((i * 13 + line * 7 + frame) % 11);
+        }
+        skia_set_color(ctx.resource, (line % 5) / 5.0f, 0.3f, 0.6f, 1);
+        skia_draw_path(ctx.resource, points.data(), points.size());
+    }
+
+    SkPath* path = skia_make_path();
+    for (int i = 0; i < 50; i++){
+        float x = (i * 37) % ctx.width;
+        float y = (i * 53 + frame) % ctx.height;
+        skia_skpath_moveto(path, x, y);
+        skia_skpath_cubicto(path, x + 30, y - 40, x + 60, y + 40, x + 90, y);
+    }
+    skia_skpath_draw(ctx.resource, path);
+    skia_delete_path(path);
+
+    skia_set_style(ctx.resource, SkPaint::kFill_Style);
+}
+
+static void imageScene(BenchContext& ctx, int frame){
+    const int images = 100;
+    for (int i = 0; i < images; i++){
+        skia_save(ctx.resource);
+        skia_translate(ctx.resource, (i % 10) * 70.0f + (frame % 5), (i / 10) * 70.0f);
+        skia_draw_image_rect(ctx.resource, ctx.image, 64, 64);
+        skia_restore(ctx.resource);
+    }
+}
+
+static void drawSubtree(SkiaResource* resource, SkFont* font){
+    skia_set_color(resource, 0.2f, 0.4f, 0.8f, 1);
+    skia_draw_rounded_rect(resource, 180, 60, 8);
+    skia_set_color(resource, 1, 1, 1, 1);
+    skia_render_line(resource, font, "cached subtree", 14, 10, 30);
+}
+
+// The subtree is rendered once into an offscreen buffer, then drawn
+// many times per frame. Every 30th frame invalidates the cache.
+static void cachedOffscreenScene(BenchContext& ctx, int frame){
+    if ( !ctx.cachedImage || frame % 30 == 0 ){
+        if ( ctx.cachedImage ){
+            ctx.cachedImage->unref();
+        }
+        SkiaResource* buffer = skia_offscreen_buffer(ctx.resource, 200, 80);
+        drawSubtree(buffer, ctx.font);
+        ctx.cachedImage = skia_offscreen_image(buffer);
+    }
+
+    for (int i = 0; i < 60; i++){
+        skia_save(ctx.resource);
+        skia_translate(ctx.resource, (i % 4) * 200.0f, (i / 4) * 80.0f);
+        skia_draw_image_rect(ctx.resource, ctx.cachedImage, 200, 80);
+        skia_restore(ctx.resource);
+    }
+}
+
+static void paintStackScene(BenchContext& ctx, int frame){
+    const int cells = 2000;
+    for (int i = 0; i < cells; i++){
+        skia_push_paint(ctx.resource);
+        skia_set_color(ctx.resource, (i % 7) / 7.0f, ((i + frame) % 5) / 5.0f, 0.5f, 1);
+        skia_set_alpha(ctx.resource, 200);
+        skia_save(ctx.resource);
+        skia_translate(ctx.resource, (i % 50) * 16.0f, (i / 50) * 16.0f);
+        skia_draw_rounded_rect(ctx.resource, 14, 14, 3);
+        skia_restore(ctx.resource);
+        skia_pop_paint(ctx.resource);
+    }
+}
+
+// A full screen terminal that scrolls a line per frame and rewrites its
+// status line in place, like a build log.
+static void terminalGridScene(BenchContext& ctx, int frame){
+    const int rows = 60;
+    const int columns = 120;
+    static std::vector<TerminalCell> row(columns);
+    if ( !ctx.grid ){
+        ctx.grid = skia_terminal_grid_make(ctx.font, rows, columns);
+    }
+
+    auto fillRow = [&](int seed){
+        for (int column = 0; column < columns; column++){
+            TerminalCell& cell = row[column];
+            cell.codepoint = 'a' + (seed * 7 + column * 3) % 26;
+            cell.fg = column % 10 == 0 ? 0xFFFF8040 : 0;
+            cell.bg = column % 40 == 0 ? 0xFF203040 : 0;
+            cell.attrs = column % 17 == 0 ? 1 : 0;
+        }
+    };
+
+    skia_terminal_grid_scroll(ctx.grid, 0, rows - 1, 1);
+    fillRow(frame);
+    skia_terminal_grid_set_cells(ctx.grid, rows - 2, 1, row.data());
+    fillRow(frame * 13);
+    skia_terminal_grid_set_cells(ctx.grid, rows - 1, 1, row.data());
+    skia_terminal_grid_draw(ctx.resource, ctx.grid);
+}
+
+struct Scene {
+    const char* name;
+    SceneFn fn;
+};
+
+static const Scene scenes[] = {
+    {"text_table", textTableScene},
+    {"paragraphs", paragraphScene},
+    {"paths", pathScene},
+    {"images", imageScene},
+    {"cached_offscreen", cachedOffscreenScene},
+    {"paint_stack", paintStackScene},
+    {"terminal_grid", terminalGridScene},
+};
+
+static SkImage* makeTestImage(){
+    sk_sp<SkSurface> surface(SkSurfaces::Raster(SkImageInfo::MakeN32Premul(256, 256)));
+    SkCanvas* canvas = surface->getCanvas();
+    SkPaint paint;
+    for (int i = 0; i < 16; i++){
+        paint.setColor(SkColorSetARGB(255, i * 16, 255 - i * 16, (i * 40) % 256));
+        canvas->drawRect(SkRect::MakeXYWH(i * 16, 0, 16, 256), paint);
+    }
+    sk_sp<SkImage> snapshot = surface->makeImageSnapshot();
+    sk_sp<SkData> png = SkPngEncoder::Encode(nullptr, snapshot.get(), SkPngEncoder::Options());
+    return skia_load_image_from_memory(png->bytes(), png->size());
+}
+
+static double percentile(std::vector<double> sorted, double p){
+    if ( sorted.empty() ){
+        return 0;
+    }
+    size_t index = std::min(sorted.size() - 1, (size_t)(p * (sorted.size() - 1) + 0.5));
+    return sorted[index];
+}
+
+int main(int argc, char** argv){
+    int frames = 300;
+    int warmupFrames = 30;
+    int width = 800;
+    int height = 1000;
+    bool gl = false;
+    const char* only = NULL;
+
+    for (int i = 1; i < argc; i++){
+        if ( !strcmp(argv[i], "--gl") ){
+            gl = true;
+        } else if ( !strcmp(argv[i], "--frames") && i + 1 < argc ){
+            frames = atoi(argv[++i]);
+        } else if ( !strcmp(argv[i], "--width") && i + 1 < argc ){
+            width = atoi(argv[++i]);
+        } else if ( !strcmp(argv[i], "--height") && i + 1 < argc ){
+            height = atoi(argv[++i]);
+        } else if ( !strcmp(argv[i], "--scene") && i + 1 < argc ){
+            only = argv[++i];
+        } else {
+            fprintf(stderr, "usage: %s [--gl] [--frames N] [--width W] [--height H] [--scene NAME]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    BenchContext ctx = {};
+    ctx.width = width;
+    ctx.height = height;
+
+    if ( gl ){
+#ifdef MEMBRANE_BENCH_EGL
+        if ( !makeHeadlessGLContext(width, height) ){
+            fprintf(stderr, "Could not create headless gl context.\n");
+            return 1;
+        }
+        ctx.resource = skia_init();
+        skia_reshape(ctx.resource, width, height, 1, 1);
+        if ( !ctx.resource->surface ){
+            fprintf(stderr, "Could not create gpu surface.\n");
+            return 1;
+        }
+        ctx.gpu = true;
+#else
+        fprintf(stderr, "bench was built without -DMEMBRANE_BENCH_EGL.\n");
+        return 1;
+#endif
+    } else {
+        ctx.resource = skia_init_cpu(width, height);
+    }
+
+    ctx.font = skia_load_font2(NULL, 14, -1, -1, -1);
+    ctx.image = makeTestImage();
+
+    printf("{\"library\":\"libmembraneskia\",\"backend\":\"%s\",\"width\":%d,\"height\":%d,\"frames\":%d,\"scenes\":[",
+           ctx.gpu ? "gl" : "cpu", width, height, frames);
+
+    bool first = true;
+    for (const Scene& scene : scenes){
+        if ( only && strcmp(only, scene.name) ){
+            continue;
+        }
+
+        std::vector<double> frameMillis;
+        frameMillis.reserve(frames);
+        int64_t allocations = 0;
+
+        auto sceneStart = std::chrono::steady_clock::now();
+        for (int frame = 0; frame < warmupFrames + frames; frame++){
+            int64_t allocationsBefore = allocationCount.load(std::memory_order_relaxed);
+            auto start = std::chrono::steady_clock::now();
+
+            skia_clear(ctx.resource);
+            skia_save(ctx.resource);
+            scene.fn(ctx, frame);
+            skia_restore(ctx.resource);
+            if ( ctx.gpu ){
+                skia_flush_and_submit(ctx.resource);
+            }
+
+            auto end = std::chrono::steady_clock::now();
+            if ( frame == warmupFrames ){
+                sceneStart = start;
+            }
+            if ( frame >= warmupFrames ){
+                frameMillis.push_back(std::chrono::duration<double, std::milli>(end - start).count());
+                allocations += allocationCount.load(std::memory_order_relaxed) - allocationsBefore;
+            }
+        }
+        if ( ctx.gpu ){
+            ctx.resource->grContext->flushAndSubmit(GrSyncCpu::kYes);
+        }
+        double totalSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - sceneStart).count();
+
+        std::vector<double> sorted(frameMillis);
+        std::sort(sorted.begin(), sorted.end());
+        double sum = 0;
+        for (double ms : frameMillis){
+            sum += ms;
+        }
+
+        printf("%s\n  {\"name\":\"%s\",\"fps\":%.2f,\"mean_ms\":%.4f,\"p50_ms\":%.4f,\"p90_ms\":%.4f,\"p99_ms\":%.4f,\"max_ms\":%.4f,\"allocations_per_frame\":%.1f}",
+               first ? "" : ",",
+               scene.name,
+               frames / totalSeconds,
+               frames ? sum / frames : 0,
+               percentile(sorted, 0.5),
+               percentile(sorted, 0.9),
+               percentile(sorted, 0.99),
+               sorted.empty() ? 0 : sorted.back(),
+               frames ? (double)allocations / frames : 0);
+        first = false;
+    }
+    printf("\n]}\n");
+
+    if ( ctx.cachedImage ){
+        ctx.cachedImage->unref();
+    }
+    if ( ctx.grid ){
+        skia_terminal_grid_delete(ctx.grid);
+    }
+    ctx.image->unref();
+    skia_font_release(ctx.font);
+    skia_cleanup(ctx.resource);
+
+    return 0;
+}
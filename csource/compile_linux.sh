@@ -32,6 +32,7 @@ c++ \
     -lskunicode_core \
     -lskunicode_icu \
     -lskshaper \
+    -lutil \
     -lsvg \
     skia.cpp
 
@@ -0,0 +1,56 @@
+#!/bin/bash
+
+# usage: compile_tool_linux.sh bench|replay
+# Builds one of the headless tools against skia.cpp.
+
+set -e
+set -x
+
+DIR="$( cd "$( dirname "${BASH_SOURCE[0]}" )" >/dev/null 2>&1 && pwd )"
+cd "$DIR"
+
+target="$1"
+if [ "${target}" != "bench" ] && [ "${target}" != "replay" ]; then
+    echo "usage: $0 bench|replay" >&2
+    exit 1
+fi
+
+skia_root="./libs/skia"
+arch="${arch:-x86_64}"
+
+# set egl=1 to enable the headless gl backend (--gl)
+egl_flags=""
+if [ "${egl}" = "1" ]; then
+    egl_flags="-DMEMBRANE_BENCH_EGL=1 -lEGL"
+fi
+
+c++ \
+    -O2 \
+    -I "$skia_root" \
+    -I "$skia_root"/include/gpu \
+    -I "$skia_root"/include/gpu/gl \
+    -I "$skia_root"/include/core \
+    -I "$skia_root"/include/utils \
+    -I "$skia_root"/include/private \
+    -I "$skia_root"/include/codec \
+    -L "$skia_root"/out/Release-${arch} \
+    -std=c++17 \
+    -o "${target}" \
+    -DSK_GL=1 \
+    "${target}.cpp" \
+    skia.cpp \
+    -Wl,--whole-archive \
+    "$skia_root"/out/Release-${arch}/libskia.a \
+    "$skia_root"/out/Release-${arch}/libskparagraph.a \
+    "$skia_root"/out/Release-${arch}/libsvg.a \
+    -Wl,--no-whole-archive \
+    -lGL \
+    -lfontconfig \
+    -lskunicode_core \
+    -lskunicode_icu \
+    -lskshaper \
+    -lutil \
+    -lpthread \
+    ${egl_flags}
+
+echo 'done'
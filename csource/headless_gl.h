@@ -0,0 +1,49 @@
+// Headless gl context for the benchmark and replay tools.
+// Only available when built with -DMEMBRANE_BENCH_EGL and linked with -lEGL.
+
+#pragma once
+
+#ifdef MEMBRANE_BENCH_EGL
+#include <EGL/egl.h>
+
+static inline bool makeHeadlessGLContext(int width, int height){
+    EGLDisplay display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    if ( display == EGL_NO_DISPLAY || !eglInitialize(display, NULL, NULL) ){
+        return false;
+    }
+
+    const EGLint configAttribs[] = {
+        EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+        EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+        EGL_RED_SIZE, 8,
+        EGL_GREEN_SIZE, 8,
+        EGL_BLUE_SIZE, 8,
+        EGL_ALPHA_SIZE, 8,
+        EGL_STENCIL_SIZE, 8,
+        EGL_NONE
+    };
+    EGLConfig config;
+    EGLint configCount = 0;
+    if ( !eglChooseConfig(display, configAttribs, &config, 1, &configCount) || configCount == 0 ){
+        return false;
+    }
+
+    const EGLint pbufferAttribs[] = {
+        EGL_WIDTH, width,
+        EGL_HEIGHT, height,
+        EGL_NONE
+    };
+    EGLSurface surface = eglCreatePbufferSurface(display, config, pbufferAttribs);
+    if ( surface == EGL_NO_SURFACE ){
+        return false;
+    }
+
+    eglBindAPI(EGL_OPENGL_API);
+    EGLContext context = eglCreateContext(display, config, EGL_NO_CONTEXT, NULL);
+    if ( context == EGL_NO_CONTEXT ){
+        return false;
+    }
+
+    return eglMakeCurrent(display, surface, surface, context);
+}
+#endif
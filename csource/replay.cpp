@@ -0,0 +1,281 @@
+// Plays back a frame captured with skia_capture_next_frame.
+//
+// Replays the .skp N times on a cpu surface (or a headless EGL pbuffer when
+// built with -DMEMBRANE_BENCH_EGL) and prints the time spent in each kind
+// of draw op as json. On gl, op times measure recording the gpu work;
+// the gpu execution time shows up under "flush".
+//
+// usage: replay FILE.skp [--gl] [--iterations N]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <string>
+
+#include "SkData.h"
+#include "SkImage.h"
+#include "SkStream.h"
+#include "SkSurface.h"
+#include "include/core/SkCanvas.h"
+#include "include/core/SkFontMgr.h"
+#include "include/core/SkPicture.h"
+#include "include/core/SkSerialProcs.h"
+#include "include/core/SkTypeface.h"
+#include "include/utils/SkNWayCanvas.h"
+
+#include "skia.h"
+#include "headless_gl.h"
+
+// defined in skia.cpp
+sk_sp<SkFontMgr> SkFontMgr_RefDefault();
+
+struct OpTiming {
+    int64_t count = 0;
+    int64_t nanos = 0;
+};
+
+// Forwards every op to the target canvas and times it.
+// Ops that skia implements by calling another op (a text blob becomes a
+// glyph run list) are only counted once, under the outer op.
+class TimingCanvas : public SkNWayCanvas {
+public:
+    TimingCanvas(SkCanvas* target): SkNWayCanvas(target->imageInfo().width(), target->imageInfo().height()){
+        this->addCanvas(target);
+        this->setMatrix(target->getLocalToDevice());
+    }
+
+    std::map<std::string, OpTiming> timings;
+
+protected:
+    template <typename F>
+    void time(const char* op, F f){
+        if ( fDepth > 0 ){
+            f();
+            return;
+        }
+        fDepth++;
+        auto start = std::chrono::steady_clock::now();
+        f();
+        auto end = std::chrono::steady_clock::now();
+        fDepth--;
+        OpTiming& timing = timings[op];
+        timing.count++;
+        timing.nanos += std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+    }
+
+    void onDrawPaint(const SkPaint& paint) override {
+        time("drawPaint", [&]{ SkNWayCanvas::onDrawPaint(paint); });
+    }
+    void onDrawPoints(PointMode mode, size_t count, const SkPoint pts[], const SkPaint& paint) override {
+        time("drawPoints", [&]{ SkNWayCanvas::onDrawPoints(mode, count, pts, paint); });
+    }
+    void onDrawRect(const SkRect& rect, const SkPaint& paint) override {
+        time("drawRect", [&]{ SkNWayCanvas::onDrawRect(rect, paint); });
+    }
+    void onDrawOval(const SkRect& rect, const SkPaint& paint) override {
+        time("drawOval", [&]{ SkNWayCanvas::onDrawOval(rect, paint); });
+    }
+    void onDrawRRect(const SkRRect& rrect, const SkPaint& paint) override {
+        time("drawRRect", [&]{ SkNWayCanvas::onDrawRRect(rrect, paint); });
+    }
+    void onDrawDRRect(const SkRRect& outer, const SkRRect& inner, const SkPaint& paint) override {
+        time("drawDRRect", [&]{ SkNWayCanvas::onDrawDRRect(outer, inner, paint); });
+    }
+    void onDrawPath(const SkPath& path, const SkPaint& paint) override {
+        time("drawPath", [&]{ SkNWayCanvas::onDrawPath(path, paint); });
+    }
+    void onDrawImage2(const SkImage* image, SkScalar x, SkScalar y,
+                      const SkSamplingOptions& sampling, const SkPaint* paint) override {
+        time("drawImage", [&]{ SkNWayCanvas::onDrawImage2(image, x, y, sampling, paint); });
+    }
+    void onDrawImageRect2(const SkImage* image, const SkRect& src, const SkRect& dst,
+                          const SkSamplingOptions& sampling, const SkPaint* paint,
+                          SrcRectConstraint constraint) override {
+        time("drawImageRect", [&]{ SkNWayCanvas::onDrawImageRect2(image, src, dst, sampling, paint, constraint); });
+    }
+    void onDrawTextBlob(const SkTextBlob* blob, SkScalar x, SkScalar y, const SkPaint& paint) override {
+        time("drawTextBlob", [&]{ SkNWayCanvas::onDrawTextBlob(blob, x, y, paint); });
+    }
+    void onDrawArc(const SkRect& rect, SkScalar startAngle, SkScalar sweepAngle, bool useCenter,
+                   const SkPaint& paint) override {
+        time("drawArc", [&]{ SkNWayCanvas::onDrawArc(rect, startAngle, sweepAngle, useCenter, paint); });
+    }
+    void onDrawRegion(const SkRegion& region, const SkPaint& paint) override {
+        time("drawRegion", [&]{ SkNWayCanvas::onDrawRegion(region, paint); });
+    }
+    void onDrawBehind(const SkPaint& paint) override {
+        time("drawBehind", [&]{ SkNWayCanvas::onDrawBehind(paint); });
+    }
+    void onDrawVerticesObject(const SkVertices* vertices, SkBlendMode mode, const SkPaint& paint) override {
+        time("drawVertices", [&]{ SkNWayCanvas::onDrawVerticesObject(vertices, mode, paint); });
+    }
+    void onDrawPatch(const SkPoint cubics[12], const SkColor colors[4], const SkPoint texCoords[4],
+                     SkBlendMode mode, const SkPaint& paint) override {
+        time("drawPatch", [&]{ SkNWayCanvas::onDrawPatch(cubics, colors, texCoords, mode, paint); });
+    }
+    void onDrawImageLattice2(const SkImage* image, const Lattice& lattice, const SkRect& dst,
+                             SkFilterMode filter, const SkPaint* paint) override {
+        time("drawImageLattice", [&]{ SkNWayCanvas::onDrawImageLattice2(image, lattice, dst, filter, paint); });
+    }
+    void onDrawAtlas2(const SkImage* image, const SkRSXform xform[], const SkRect src[], const SkColor colors[],
+                      int count, SkBlendMode mode, const SkSamplingOptions& sampling, const SkRect* cull,
+                      const SkPaint* paint) override {
+        time("drawAtlas", [&]{ SkNWayCanvas::onDrawAtlas2(image, xform, src, colors, count, mode, sampling, cull, paint); });
+    }
+    void onDrawShadowRec(const SkPath& path, const SkDrawShadowRec& rec) override {
+        time("drawShadowRec", [&]{ SkNWayCanvas::onDrawShadowRec(path, rec); });
+    }
+    void onDrawEdgeAAQuad(const SkRect& rect, const SkPoint clip[4], QuadAAFlags aa,
+                          const SkColor4f& color, SkBlendMode mode) override {
+        time("drawEdgeAAQuad", [&]{ SkNWayCanvas::onDrawEdgeAAQuad(rect, clip, aa, color, mode); });
+    }
+    void onDrawEdgeAAImageSet2(const ImageSetEntry set[], int count, const SkPoint dstClips[],
+                               const SkMatrix preViewMatrices[], const SkSamplingOptions& sampling,
+                               const SkPaint* paint, SrcRectConstraint constraint) override {
+        time("drawEdgeAAImageSet", [&]{
+                SkNWayCanvas::onDrawEdgeAAImageSet2(set, count, dstClips, preViewMatrices, sampling, paint, constraint);
+            });
+    }
+    void onDrawMesh(const SkMesh& mesh, sk_sp<SkBlender> blender, const SkPaint& paint) override {
+        time("drawMesh", [&]{ SkNWayCanvas::onDrawMesh(mesh, blender, paint); });
+    }
+    void onDrawGlyphRunList(const sktext::GlyphRunList& list, const SkPaint& paint) override {
+        time("drawGlyphRunList", [&]{ SkNWayCanvas::onDrawGlyphRunList(list, paint); });
+    }
+    void onDrawDrawable(SkDrawable* drawable, const SkMatrix* matrix) override {
+        time("drawDrawable", [&]{ SkNWayCanvas::onDrawDrawable(drawable, matrix); });
+    }
+    void onDrawAnnotation(const SkRect& rect, const char key[], SkData* value) override {
+        time("drawAnnotation", [&]{ SkNWayCanvas::onDrawAnnotation(rect, key, value); });
+    }
+    void onDrawPicture(const SkPicture* picture, const SkMatrix* matrix, const SkPaint* paint) override {
+        // play back nested pictures through this canvas so their ops are counted too
+        SkCanvas::onDrawPicture(picture, matrix, paint);
+    }
+
+private:
+    int fDepth = 0;
+};
+
+static sk_sp<SkImage> deserializeImage(const void* data, size_t length, void* ctx){
+    return SkImages::DeferredFromEncodedData(SkData::MakeWithCopy(data, length));
+}
+
+static sk_sp<SkTypeface> deserializeTypeface(const void* data, size_t length, void* ctx){
+    SkMemoryStream stream(data, length, false);
+    return SkTypeface::MakeDeserialize(&stream, SkFontMgr_RefDefault());
+}
+
+int main(int argc, char** argv){
+    const char* path = NULL;
+    int iterations = 100;
+    bool gl = false;
+
+    for (int i = 1; i < argc; i++){
+        if ( !strcmp(argv[i], "--gl") ){
+            gl = true;
+        } else if ( !strcmp(argv[i], "--iterations") && i + 1 < argc ){
+            iterations = atoi(argv[++i]);
+        } else if ( !path && argv[i][0] != '-' ){
+            path = argv[i];
+        } else {
+            path = NULL;
+            break;
+        }
+    }
+    if ( !path ){
+        fprintf(stderr, "usage: %s FILE.skp [--gl] [--iterations N]\n", argv[0]);
+        return 1;
+    }
+
+    sk_sp<SkData> data = SkData::MakeFromFileName(path);
+    if ( !data ){
+        fprintf(stderr, "Could not read %s.\n", path);
+        return 1;
+    }
+
+    SkDeserialProcs procs;
+    procs.fImageProc = deserializeImage;
+    procs.fTypefaceProc = deserializeTypeface;
+    sk_sp<SkPicture> picture = SkPicture::MakeFromData(data.get(), &procs);
+    if ( !picture ){
+        fprintf(stderr, "Could not deserialize %s.\n", path);
+        return 1;
+    }
+
+    SkIRect bounds = picture->cullRect().roundOut();
+    int width = std::max(1, bounds.right());
+    int height = std::max(1, bounds.bottom());
+
+    SkiaResource* resource;
+    if ( gl ){
+#ifdef MEMBRANE_BENCH_EGL
+        if ( !makeHeadlessGLContext(width, height) ){
+            fprintf(stderr, "Could not create headless gl context.\n");
+            return 1;
+        }
+        resource = skia_init();
+        skia_reshape(resource, width, height, 1, 1);
+        if ( !resource->surface ){
+            fprintf(stderr, "Could not create gpu surface.\n");
+            return 1;
+        }
+        // the capture already includes the content scale
+        resource->surface->getCanvas()->resetMatrix();
+#else
+        fprintf(stderr, "replay was built without -DMEMBRANE_BENCH_EGL.\n");
+        return 1;
+#endif
+    } else {
+        resource = skia_init_cpu(width, height);
+    }
+
+    SkCanvas* surfaceCanvas = resource->surface->getCanvas();
+    TimingCanvas canvas(surfaceCanvas);
+
+    OpTiming total;
+    OpTiming flush;
+    for (int i = 0; i < iterations; i++){
+        auto start = std::chrono::steady_clock::now();
+
+        surfaceCanvas->clear(SK_ColorWHITE);
+        canvas.drawPicture(picture);
+
+        auto flushStart = std::chrono::steady_clock::now();
+        if ( resource->grContext ){
+            resource->grContext->flushAndSubmit(GrSyncCpu::kYes);
+        }
+        auto end = std::chrono::steady_clock::now();
+
+        flush.count++;
+        flush.nanos += std::chrono::duration_cast<std::chrono::nanoseconds>(end - flushStart).count();
+        total.count++;
+        total.nanos += std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+    }
+
+    printf("{\"file\":\"%s\",\"backend\":\"%s\",\"width\":%d,\"height\":%d,\"iterations\":%d,\"ops\":%d,",
+           path, resource->grContext ? "gl" : "cpu", width, height, iterations, picture->approximateOpCount(true));
+    printf("\"frame_ms\":%.4f,\"flush_ms\":%.4f,\"op_types\":[",
+           total.count ? total.nanos / 1e6 / total.count : 0,
+           flush.count ? flush.nanos / 1e6 / flush.count : 0);
+
+    bool first = true;
+    for (auto& entry : canvas.timings){
+        const OpTiming& timing = entry.second;
+        printf("%s\n  {\"op\":\"%s\",\"count_per_frame\":%.1f,\"ms_per_frame\":%.4f,\"us_per_op\":%.3f}",
+               first ? "" : ",",
+               entry.first.c_str(),
+               (double)timing.count / iterations,
+               timing.nanos / 1e6 / iterations,
+               timing.count ? timing.nanos / 1e3 / timing.count : 0);
+        first = false;
+    }
+    printf("\n]}\n");
+
+    skia_cleanup(resource);
+    return 0;
+}
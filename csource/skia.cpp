@@ -1,4 +1,5 @@
 #include "skia.h"
+#include "text_index.h"
 
 
 #if defined(__APPLE__)
@@ -38,6 +39,60 @@
 #include "include/gpu/ganesh/GrDirectContext.h"
 #include "include/gpu/ganesh/gl/GrGLInterface.h"
 #include "include/gpu/ganesh/SkSurfaceGanesh.h"
+#include "include/gpu/ganesh/SkImageGanesh.h"
+#include "include/gpu/ganesh/GrYUVABackendTextures.h"
+#include "include/core/SkYUVAInfo.h"
+#include "include/core/SkBitmap.h"
+#include "include/gpu/ganesh/GrContextOptions.h"
+#include "include/core/SkMilestone.h"
+#include "include/utils/SkEventTracer.h"
+#include "include/core/SkPicture.h"
+#include "include/core/SkSerialProcs.h"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <condition_variable>
+
+#if !defined(_WIN32)
+#define MEMBRANE_HAS_POSIX 1
+#include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <unistd.h>
+#include <utime.h>
+#endif
+
+#ifdef __APPLE__
+#include <TargetConditionals.h>
+#endif
+
+#if defined(MEMBRANE_HAS_POSIX) && (defined(__linux__) || (defined(__APPLE__) && !TARGET_OS_IPHONE))
+#define MEMBRANE_HAS_PTY 1
+#if defined(__APPLE__)
+#include <util.h>
+#else
+#include <pty.h>
+#endif
+extern char** environ;
+#endif
+
+#ifdef __APPLE__
+#include <dispatch/dispatch.h>
+#endif
+
+#include "include/core/SkGraphics.h"
+#include "include/core/SkBBHFactory.h"
+#include "include/core/SkVertices.h"
+#include "src/text/GlyphRun.h"
+#include "include/core/SkExecutor.h"
+#include "include/codec/SkCodec.h"
 
 
 // FONT STUFF //
@@ -55,58 +110,4948 @@
 #include "include/ports/SkTypeface_win.h"
 #endif
 
+#include <deque>
 #include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <atomic>
 
 namespace {
 
 bool g_factory_called = false;
 
-}  // namespace
+}  // namespace
+
+static sk_sp<SkFontMgr> fontmgr_factory() {
+#if defined(__APPLE__)
+  return SkFontMgr_New_CoreText(nullptr);
+#elif defined(__linux__)
+  return SkFontMgr_New_FontConfig(NULL);
+#elif defined(_WIN32)
+  return SkFontMgr_New_DirectWrite();
+#else
+  return SkFontMgr_New_Custom_Empty(); /* last resort: SkFontMgr::RefEmpty(); */
+#endif
+}
+
+sk_sp<SkFontMgr> SkFontMgr_RefDefault() {
+  static std::once_flag flag;
+  static sk_sp<SkFontMgr> mgr;
+  std::call_once(flag, [] {
+    mgr = fontmgr_factory();
+    g_factory_called = true;
+  });
+  return mgr;
+}
+
+// Process wide font cache.
+// Typeface lookups (fontconfig matches on linux) are memoized by
+// (name or path, weight, width, slant), including failed lookups.
+// SkFonts are shared between windows and freed by reference count.
+namespace {
+
+struct TypefaceKey {
+    std::string name;
+    bool hasName;
+    int weight;
+    int width;
+    int slant;
+
+    bool operator==(const TypefaceKey& other) const {
+        return hasName == other.hasName
+            && weight == other.weight
+            && width == other.width
+            && slant == other.slant
+            && name == other.name;
+    }
+};
+
+struct TypefaceKeyHash {
+    size_t operator()(const TypefaceKey& key) const {
+        size_t h = std::hash<std::string>()(key.name);
+        h = h * 31 + key.hasName;
+        h = h * 31 + key.weight;
+        h = h * 31 + key.width;
+        h = h * 31 + key.slant;
+        return h;
+    }
+};
+
+struct FontKey {
+    TypefaceKey typeface;
+    float size;
+
+    bool operator==(const FontKey& other) const {
+        return size == other.size && typeface == other.typeface;
+    }
+};
+
+struct FontKeyHash {
+    size_t operator()(const FontKey& key) const {
+        return TypefaceKeyHash()(key.typeface) * 31 + std::hash<float>()(key.size);
+    }
+};
+
+struct CachedFont {
+    SkFont* font;
+    int refCount;
+};
+
+std::mutex g_font_cache_mutex;
+std::unordered_map<TypefaceKey, sk_sp<SkTypeface>, TypefaceKeyHash> g_typeface_cache;
+std::unordered_map<FontKey, CachedFont, FontKeyHash> g_font_cache;
+std::unordered_map<SkFont*, FontKey> g_font_keys;
+
+SkFontStyle::Slant toSkSlant(int slant){
+    switch ( slant ){
+    case 2:
+        return SkFontStyle::kItalic_Slant;
+    case 3:
+        return SkFontStyle::kOblique_Slant;
+    case -1:
+    case 1:
+    default:
+        return SkFontStyle::kUpright_Slant;
+    }
+}
+
+// Must be called with g_font_cache_mutex held.
+sk_sp<SkTypeface> findTypeface(const TypefaceKey& key){
+    auto it = g_typeface_cache.find(key);
+    if ( it != g_typeface_cache.end() ){
+        return it->second;
+    }
+
+    sk_sp<SkTypeface> typeface;
+    if ( key.hasName ){
+        typeface = SkFontMgr_RefDefault()->makeFromFile(key.name.c_str());
+        if ( !typeface ){
+            int width = key.width == -1 ? SkFontStyle::kNormal_Width : key.width;
+            int weight = key.weight == -1 ? SkFontStyle::kNormal_Weight : key.weight;
+            SkFontStyle style(weight, width, toSkSlant(key.slant));
+            typeface = SkFontMgr_RefDefault()->legacyMakeTypeface(key.name.c_str(), style);
+        }
+    } else {
+        typeface = SkFontMgr_RefDefault()->matchFamilyStyle(NULL, SkFontStyle());
+    }
+
+    // misses aren't cached, the font may be installed later
+    if ( typeface ){
+        g_typeface_cache.emplace(key, typeface);
+    }
+    return typeface;
+}
+
+struct FontWarmup {
+    std::string name;
+    bool hasName;
+    float size;
+    int weight;
+    int width;
+    int slant;
+};
+
+// The warmup thread is detached so a warmup still running at exit
+// doesn't terminate the process. g_warmup_running tracks it instead.
+std::mutex g_warmup_mutex;
+std::condition_variable g_warmup_done;
+bool g_warmup_running = false;
+
+}  // namespace
+
+// END FONT STUFF //
+
+#if defined(__APPLE__)
+#import <CoreFoundation/CoreFoundation.h>
+#endif
+
+#define LOG(fmt, ...) \
+            do {FILE *fp; fp = fopen("/var/tmp/membrane.log", "a");fprintf(fp, fmt, __VA_ARGS__); fclose(fp);} while (0)
+
+typedef struct _cef_rect_t {
+  int x;
+  int y;
+  int width;
+  int height;
+} cef_rect_t;
+
+using namespace skia::textlayout;
+
+// SHADER CACHE //
+// Persists compiled shader programs between launches.
+// Entries live in <dir>/membrane-shader-cache/<version>/ where version is
+// derived from the GL driver strings and skia milestone, so a driver or
+// skia update starts with a fresh cache. Least recently used entries are
+// evicted once the directory grows beyond the configured size.
+// Only available on posix platforms.
+namespace {
+
+#ifdef MEMBRANE_HAS_POSIX
+
+uint64_t fnv1a(const void* data, size_t size, uint64_t h = 0xcbf29ce484222325ULL){
+    const uint8_t* bytes = (const uint8_t*)data;
+    for (size_t i = 0; i < size; i++){
+        h ^= bytes[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+std::string hexString(uint64_t h){
+    char buf[17];
+    snprintf(buf, sizeof(buf), "%016llx", (unsigned long long)h);
+    return std::string(buf);
+}
+
+const char kShaderCacheMagic[4] = {'M', 'B', 'S', 'C'};
+const int kShaderCacheFormatVersion = 1;
+// the cache only ever deletes directories inside this one
+const char* kShaderCacheDirName = "membrane-shader-cache";
+
+// Matches the "v" + 16 hex digit names made by setVersionFromCurrentContext.
+bool isShaderCacheVersionName(const std::string& name){
+    if ( name.size() != 17 || name[0] != 'v' ){
+        return false;
+    }
+    for (size_t i = 1; i < name.size(); i++){
+        char c = name[i];
+        if ( !((c >= '0' && c <= '9') || (c >= 'a' && c <= 'f')) ){
+            return false;
+        }
+    }
+    return true;
+}
+
+class DiskShaderCache : public GrContextOptions::PersistentCache {
+public:
+    DiskShaderCache(std::string root, int64_t maxBytes)
+        : fParent(root), fRoot(root + "/" + kShaderCacheDirName), fMaxBytes(maxBytes), fTotalBytes(0){}
+
+    // Must be called with a GL context current.
+    void setVersionFromCurrentContext(){
+        std::lock_guard<std::mutex> lock(fMutex);
+        if ( !fDir.empty() ){
+            return;
+        }
+
+        uint64_t h = fnv1a(&kShaderCacheFormatVersion, sizeof(kShaderCacheFormatVersion));
+        int milestone = SK_MILESTONE;
+        h = fnv1a(&milestone, sizeof(milestone), h);
+        const GLenum names[] = {GL_VENDOR, GL_RENDERER, GL_VERSION};
+        for (GLenum name : names){
+            const char* s = (const char*)glGetString(name);
+            if ( s ){
+                h = fnv1a(s, strlen(s), h);
+            }
+        }
+        std::string version = "v" + hexString(h);
+
+        mkdir(fParent.c_str(), 0755);
+        mkdir(fRoot.c_str(), 0755);
+        removeStaleVersions(version);
+
+        fDir = fRoot + "/" + version;
+        mkdir(fDir.c_str(), 0755);
+
+        fTotalBytes = 0;
+        forEachEntry([this](const std::string& path, const struct stat& st){
+            fTotalBytes += st.st_size;
+        });
+    }
+
+    sk_sp<SkData> load(const SkData& key) override {
+        std::lock_guard<std::mutex> lock(fMutex);
+        if ( fDir.empty() ){
+            return nullptr;
+        }
+
+        fLoads++;
+        std::string path = entryPath(key);
+        sk_sp<SkData> file = SkData::MakeFromFileName(path.c_str());
+        if ( !file ){
+            return nullptr;
+        }
+
+        const uint8_t* bytes = file->bytes();
+        size_t headerSize = sizeof(kShaderCacheMagic) + sizeof(uint32_t);
+        if ( file->size() < headerSize || memcmp(bytes, kShaderCacheMagic, sizeof(kShaderCacheMagic)) ){
+            return nullptr;
+        }
+        uint32_t keySize;
+        memcpy(&keySize, bytes + sizeof(kShaderCacheMagic), sizeof(keySize));
+        if ( keySize != key.size()
+             || file->size() < headerSize + keySize
+             || memcmp(bytes + headerSize, key.data(), keySize) ){
+            return nullptr;
+        }
+
+        // bump the modification time so eviction is least recently used
+        utime(path.c_str(), NULL);
+        fHits++;
+
+        size_t offset = headerSize + keySize;
+        return SkData::MakeSubset(file.get(), offset, file->size() - offset);
+    }
+
+    void store(const SkData& key, const SkData& data, const SkString& description) override {
+        std::lock_guard<std::mutex> lock(fMutex);
+        if ( fDir.empty() ){
+            return;
+        }
+
+        std::string path = entryPath(key);
+        std::string tmpPath = path + ".tmp";
+        FILE* fp = fopen(tmpPath.c_str(), "wb");
+        if ( !fp ){
+            return;
+        }
+
+        uint32_t keySize = key.size();
+        bool ok = fwrite(kShaderCacheMagic, sizeof(kShaderCacheMagic), 1, fp) == 1
+            && fwrite(&keySize, sizeof(keySize), 1, fp) == 1
+            && fwrite(key.data(), key.size(), 1, fp) == 1
+            && fwrite(data.data(), data.size(), 1, fp) == 1;
+        ok = (fclose(fp) == 0) && ok;
+
+        // an entry with the same key hash is replaced, so its size no longer counts
+        struct stat old;
+        int64_t oldBytes = stat(path.c_str(), &old) == 0 ? old.st_size : 0;
+
+        if ( !ok || rename(tmpPath.c_str(), path.c_str()) ){
+            unlink(tmpPath.c_str());
+            return;
+        }
+
+        fStores++;
+        fTotalBytes += sizeof(kShaderCacheMagic) + sizeof(keySize) + key.size() + data.size() - oldBytes;
+        if ( fMaxBytes > 0 && fTotalBytes > fMaxBytes ){
+            evict();
+        }
+    }
+
+    // loads, hits, stores, total bytes
+    void stats(int64_t* out){
+        std::lock_guard<std::mutex> lock(fMutex);
+        out[0] = fLoads;
+        out[1] = fHits;
+        out[2] = fStores;
+        out[3] = fTotalBytes;
+    }
+
+private:
+    std::string entryPath(const SkData& key){
+        return fDir + "/" + hexString(fnv1a(key.data(), key.size()));
+    }
+
+    template <typename F>
+    void forEachEntry(F f){
+        DIR* dir = opendir(fDir.c_str());
+        if ( !dir ){
+            return;
+        }
+        while ( struct dirent* entry = readdir(dir) ){
+            if ( entry->d_name[0] == '.' ){
+                continue;
+            }
+            std::string path = fDir + "/" + entry->d_name;
+            struct stat st;
+            if ( stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode) ){
+                f(path, st);
+            }
+        }
+        closedir(dir);
+    }
+
+    // Removes entries, oldest first, until the cache is at 3/4 of its budget.
+    void evict(){
+        std::vector<std::pair<time_t, std::pair<std::string, int64_t>>> entries;
+        fTotalBytes = 0;
+        forEachEntry([&](const std::string& path, const struct stat& st){
+            entries.push_back({st.st_mtime, {path, (int64_t)st.st_size}});
+            fTotalBytes += st.st_size;
+        });
+        std::sort(entries.begin(), entries.end());
+
+        int64_t target = fMaxBytes / 4 * 3;
+        for (auto& entry : entries){
+            if ( fTotalBytes <= target ){
+                break;
+            }
+            if ( unlink(entry.second.first.c_str()) == 0 ){
+                fTotalBytes -= entry.second.second;
+            }
+        }
+    }
+
+    void removeStaleVersions(const std::string& version){
+        DIR* dir = opendir(fRoot.c_str());
+        if ( !dir ){
+            return;
+        }
+        while ( struct dirent* entry = readdir(dir) ){
+            std::string name = entry->d_name;
+            if ( !isShaderCacheVersionName(name) || name == version ){
+                continue;
+            }
+            std::string path = fRoot + "/" + name;
+            DIR* stale = opendir(path.c_str());
+            if ( !stale ){
+                continue;
+            }
+            while ( struct dirent* staleEntry = readdir(stale) ){
+                if ( staleEntry->d_name[0] != '.' ){
+                    unlink((path + "/" + staleEntry->d_name).c_str());
+                }
+            }
+            closedir(stale);
+            rmdir(path.c_str());
+        }
+        closedir(dir);
+    }
+
+    std::mutex fMutex;
+    std::string fParent;
+    std::string fRoot;
+    std::string fDir;
+    int64_t fMaxBytes;
+    int64_t fTotalBytes;
+    int64_t fLoads = 0;
+    int64_t fHits = 0;
+    int64_t fStores = 0;
+};
+
+std::mutex g_shader_cache_mutex;
+std::unique_ptr<DiskShaderCache> g_shader_cache;
+GrContextOptions::ShaderCacheStrategy g_shader_cache_strategy = GrContextOptions::ShaderCacheStrategy::kBackendBinary;
+
+#endif
+
+// Makes a gpu context for the current gl context.
+sk_sp<GrDirectContext> makeGLDirectContext(){
+    // https://skia.org/docs/user/api/skcanvas_creation/#gpu
+    sk_sp<const GrGLInterface> interface = GrGLMakeNativeInterface();
+
+    GrContextOptions options;
+#ifdef MEMBRANE_HAS_POSIX
+    {
+        std::lock_guard<std::mutex> lock(g_shader_cache_mutex);
+        if ( g_shader_cache ){
+            g_shader_cache->setVersionFromCurrentContext();
+            options.fPersistentCache = g_shader_cache.get();
+            options.fShaderCacheStrategy = g_shader_cache_strategy;
+        }
+    }
+#endif
+
+    return GrDirectContexts::MakeGL(interface, options);
+}
+
+}  // namespace
+
+// END SHADER CACHE //
+
+// TRACING //
+// Records scoped events for the exported entry points and for skia's own
+// TRACE_EVENT macros, and writes them out in the chrome trace event format
+// (chrome://tracing, ui.perfetto.dev).
+// When no capture is running, a trace scope costs one relaxed atomic load.
+// A capture keeps the most recent kMaxTraceEvents events.
+namespace {
+
+struct TraceEvent {
+    const char* name;
+    const char* category;
+    char phase;
+    int64_t startNanos;
+    int64_t durationNanos;
+    int tid;
+};
+
+// about 40MB of events
+const size_t kMaxTraceEvents = 1 << 20;
+
+std::atomic<bool> g_tracing(false);
+std::mutex g_trace_mutex;
+// a ring buffer once it reaches kMaxTraceEvents
+std::vector<TraceEvent> g_trace_events;
+// events recorded in this capture, including overwritten ones
+uint64_t g_trace_event_count = 0;
+// incremented for every capture so stale skia handles are ignored
+uint32_t g_trace_generation = 0;
+const std::chrono::steady_clock::time_point g_trace_epoch = std::chrono::steady_clock::now();
+std::atomic<int> g_trace_next_tid(1);
+
+int64_t traceNow(){
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - g_trace_epoch).count();
+}
+
+int traceThreadId(){
+    thread_local int tid = g_trace_next_tid.fetch_add(1);
+    return tid;
+}
+
+// names that aren't string literals are copied here, for one capture
+std::unordered_set<std::string> g_trace_strings;
+
+// Returns the index of the recorded event within the capture or -1 if not capturing.
+int64_t recordTraceEvent(const char* category, const char* name, char phase, int64_t start, int64_t duration, bool copyName = false){
+    std::lock_guard<std::mutex> lock(g_trace_mutex);
+    if ( !g_tracing.load(std::memory_order_relaxed) ){
+        return -1;
+    }
+    if ( copyName ){
+        name = g_trace_strings.insert(name).first->c_str();
+    }
+    TraceEvent event = {name, category, phase, start, duration, traceThreadId()};
+    if ( g_trace_events.size() < kMaxTraceEvents ){
+        g_trace_events.push_back(event);
+    } else {
+        g_trace_events[g_trace_event_count % kMaxTraceEvents] = event;
+    }
+    return g_trace_event_count++;
+}
+
+// The event at `index` if it hasn't been overwritten yet.
+TraceEvent* traceEventAt(uint64_t index){
+    if ( index >= g_trace_event_count || g_trace_event_count - index > g_trace_events.size() ){
+        return nullptr;
+    }
+    return &g_trace_events[index % kMaxTraceEvents];
+}
+
+class ScopedTrace {
+public:
+    ScopedTrace(const char* name): fName(name), fActive(g_tracing.load(std::memory_order_relaxed)){
+        if ( fActive ){
+            fStart = traceNow();
+        }
+    }
+
+    ~ScopedTrace(){
+        if ( fActive ){
+            recordTraceEvent("membrane", fName, 'X', fStart, traceNow() - fStart);
+        }
+    }
+
+private:
+    const char* fName;
+    bool fActive;
+    int64_t fStart;
+};
+
+#define SKIA_TRACE_FN() ScopedTrace skia_trace_scope_(__func__)
+
+// Forwards skia's internal trace events into the same buffer.
+class MembraneEventTracer : public SkEventTracer {
+public:
+    void setEnabled(bool enabled){
+        fEnabled = enabled ? SkEventTracer::kEnabledForRecording_CategoryGroupEnabledFlags : 0;
+    }
+
+    const uint8_t* getCategoryGroupEnabled(const char* name) override {
+        return &fEnabled;
+    }
+
+    const char* getCategoryGroupName(const uint8_t* categoryEnabledFlag) override {
+        return "skia";
+    }
+
+    SkEventTracer::Handle addTraceEvent(char phase,
+                                        const uint8_t* categoryEnabledFlag,
+                                        const char* name,
+                                        uint64_t id,
+                                        int numArgs,
+                                        const char** argNames,
+                                        const uint8_t* argTypes,
+                                        const uint64_t* argValues,
+                                        uint8_t flags) override {
+        // TRACE_EVENT_FLAG_COPY
+        bool copyName = flags & 1;
+        int64_t index = recordTraceEvent("skia", name, phase, traceNow(), 0, copyName);
+        if ( index < 0 || index >= 0xFFFFFFFF ){
+            return 0;
+        }
+        // handle 0 is reserved for "no event"
+        return ((uint64_t)g_trace_generation << 32) | (uint64_t)(index + 1);
+    }
+
+    void updateTraceEventDuration(const uint8_t* categoryEnabledFlag,
+                                  const char* name,
+                                  SkEventTracer::Handle handle) override {
+        if ( !handle ){
+            return;
+        }
+        int64_t now = traceNow();
+        std::lock_guard<std::mutex> lock(g_trace_mutex);
+        uint32_t generation = handle >> 32;
+        uint64_t index = (handle & 0xFFFFFFFF) - 1;
+        TraceEvent* event = generation == g_trace_generation ? traceEventAt(index) : nullptr;
+        if ( event ){
+            event->durationNanos = now - event->startNanos;
+        }
+    }
+
+    void newTracingSection(const char* name) override {}
+
+private:
+    uint8_t fEnabled = 0;
+};
+
+MembraneEventTracer* g_event_tracer = nullptr;
+
+void writeJSONString(FILE* fp, const char* s){
+    fputc('"', fp);
+    for (; s && *s; s++){
+        unsigned char c = *s;
+        if ( c == '"' || c == '\\' ){
+            fputc('\\', fp);
+            fputc(c, fp);
+        } else if ( c < 0x20 ){
+            fprintf(fp, "\\u%04x", c);
+        } else {
+            fputc(c, fp);
+        }
+    }
+    fputc('"', fp);
+}
+
+}  // namespace
+
+// END TRACING //
+
+// TERMINAL GRID //
+// Renders a packed grid of terminal cells.
+// Cells are merged into runs that share a style and each row is built
+// into text blobs once per distinct row content, so rows that scroll or
+// repeat reuse their blobs (and skia's gpu blob cache). On raster
+// surfaces the grid is kept in an offscreen buffer and only rows that
+// changed are repainted.
+namespace {
+
+enum TerminalCellAttr : uint32_t {
+    kTerminalBold = 1 << 0,
+    kTerminalItalic = 1 << 1,
+    kTerminalUnderline = 1 << 2,
+    kTerminalStrike = 1 << 3,
+    kTerminalInverse = 1 << 4,
+    kTerminalConceal = 1 << 5,
+};
+
+struct TerminalGlyph {
+    uint16_t font;
+    SkGlyphID glyph;
+};
+
+struct TerminalRowRender {
+    struct Background {
+        float left;
+        float right;
+        SkColor color;
+    };
+    struct Text {
+        sk_sp<SkTextBlob> blob;
+        SkColor color;
+    };
+    struct Line {
+        float left;
+        float right;
+        float y;
+        SkColor color;
+    };
+
+    // kept to rule out hash collisions
+    std::vector<TerminalCell> cells;
+    std::vector<Background> backgrounds;
+    std::vector<Text> texts;
+    std::vector<Line> lines;
+};
+
+struct TerminalRow {
+    uint64_t hash = 0;
+    std::shared_ptr<const TerminalRowRender> render;
+    bool pixelsDirty = true;
+};
+
+bool sameCells(const TerminalCell* a, const TerminalCell* b, int count){
+    return memcmp(a, b, sizeof(TerminalCell) * count) == 0;
+}
+
+}  // namespace
+
+class TerminalGrid {
+public:
+    TerminalGrid(const SkFont& font, int rows, int columns){
+        for (int style = 0; style < 4; style++){
+            fFonts.push_back(styledFont(font, style));
+        }
+        fAsciiGlyphs.fill({0, 0});
+        fAsciiResolved.fill(false);
+
+        SkFontMetrics metrics;
+        font.getMetrics(&metrics);
+        SkGlyphID m = font.unicharToGlyph('M');
+        font.getWidths(&m, 1, &fCellWidth);
+        // whole pixel rows let scrolling shift the offscreen buffer
+        fCellHeight = std::ceil(font.getSpacing());
+        fBaseline = -metrics.fAscent + (fCellHeight - font.getSpacing()) / 2;
+        SkScalar underlinePosition;
+        if ( !metrics.hasUnderlinePosition(&underlinePosition) ){
+            underlinePosition = metrics.fDescent / 2;
+        }
+        fUnderlineY = fBaseline + underlinePosition;
+        if ( !metrics.hasUnderlineThickness(&fLineThickness) || fLineThickness <= 0 ){
+            fLineThickness = 1;
+        }
+        fStrikeY = fBaseline + metrics.fXHeight * -0.5f;
+
+        resize(rows, columns);
+    }
+
+    void resize(int rows, int columns){
+        rows = std::max(rows, 0);
+        columns = std::max(columns, 0);
+        if ( rows == fRows && columns == fColumns ){
+            return;
+        }
+        std::vector<TerminalCell> cells(rows * columns, TerminalCell{});
+        for (int row = 0; row < std::min(rows, fRows); row++){
+            memcpy(&cells[row * columns], &fCells[row * fColumns],
+                   sizeof(TerminalCell) * std::min(columns, fColumns));
+        }
+        fCells.swap(cells);
+        fRows = rows;
+        fColumns = columns;
+
+        fRowState.assign(rows, TerminalRow());
+        for (int row = 0; row < rows; row++){
+            fRowState[row].hash = fnv1a(rowCells(row), sizeof(TerminalCell) * columns);
+        }
+        fRowCache.clear();
+        fOffscreen.reset();
+    }
+
+    int setCells(int startRow, int rowCount, const TerminalCell* cells){
+        int changed = 0;
+        int endRow = std::min(fRows, startRow + rowCount);
+        for (int row = std::max(startRow, 0); row < endRow; row++){
+            const TerminalCell* src = cells + (row - startRow) * fColumns;
+            TerminalCell* dst = rowCells(row);
+            if ( sameCells(src, dst, fColumns) ){
+                continue;
+            }
+            memcpy(dst, src, sizeof(TerminalCell) * fColumns);
+            TerminalRow& state = fRowState[row];
+            state.hash = fnv1a(dst, sizeof(TerminalCell) * fColumns);
+            state.render.reset();
+            state.pixelsDirty = true;
+            changed++;
+        }
+        return changed;
+    }
+
+    // Moves rows [top, bottom) up by `count` (down if negative) and blanks
+    // the rows that are uncovered.
+    void scroll(int top, int bottom, int count){
+        top = std::max(top, 0);
+        bottom = std::min(bottom, fRows);
+        int height = bottom - top;
+        if ( height <= 0 || count == 0 ){
+            return;
+        }
+        if ( std::abs(count) >= height ){
+            clearRows(top, bottom);
+            return;
+        }
+
+        int shift = count > 0 ? count : height + count;
+        std::rotate(fCells.begin() + top * fColumns,
+                    fCells.begin() + (top + shift) * fColumns,
+                    fCells.begin() + bottom * fColumns);
+        std::rotate(fRowState.begin() + top,
+                    fRowState.begin() + top + shift,
+                    fRowState.begin() + bottom);
+        shiftOffscreen(top, bottom, count);
+
+        if ( count > 0 ){
+            clearRows(bottom - count, bottom);
+        } else {
+            clearRows(top, top - count);
+        }
+    }
+
+    void setDefaultColors(SkColor fg, SkColor bg){
+        if ( fg == fDefaultFg && bg == fDefaultBg ){
+            return;
+        }
+        fDefaultFg = fg;
+        fDefaultBg = bg;
+        for (TerminalRow& state : fRowState){
+            state.render.reset();
+            state.pixelsDirty = true;
+        }
+        fRowCache.clear();
+    }
+
+    float cellWidth() const { return fCellWidth; }
+    float cellHeight() const { return fCellHeight; }
+    int rows() const { return fRows; }
+    int columns() const { return fColumns; }
+
+    void draw(SkiaResource* resource){
+        SkCanvas* canvas = resource->getCanvas();
+        SkMatrix matrix = canvas->getTotalMatrix();
+        // A recorded frame would hold on to the offscreen snapshot, so the
+        // next repaint of a dirty row would have to copy the whole buffer.
+        // Recorded frames get the row blobs instead.
+        if ( !resource->surface->recordingContext()
+             && !resource->defersDrawing()
+             && matrix.isScaleTranslate()
+             && matrix.getScaleX() > 0
+             && matrix.getScaleY() > 0 ){
+            drawOffscreen(resource, canvas, matrix.getScaleX(), matrix.getScaleY());
+            return;
+        }
+
+        resource->stats->drawRectCalls++;
+        canvas->drawRect(SkRect::MakeWH(fColumns * fCellWidth, fRows * fCellHeight), backgroundPaint());
+        for (int row = 0; row < fRows; row++){
+            drawRow(resource, canvas, *rowRender(row), row * fCellHeight);
+        }
+    }
+
+private:
+    static SkFont styledFont(const SkFont& font, int style){
+        SkFont styled(font);
+        if ( style & kTerminalBold ){
+            styled.setEmbolden(true);
+        }
+        if ( style & kTerminalItalic ){
+            styled.setSkewX(-0.25f);
+        }
+        return styled;
+    }
+
+    TerminalCell* rowCells(int row){
+        return &fCells[row * fColumns];
+    }
+
+    void clearRows(int top, int bottom){
+        std::fill(fCells.begin() + top * fColumns, fCells.begin() + bottom * fColumns, TerminalCell{});
+        uint64_t hash = fnv1a(rowCells(top), sizeof(TerminalCell) * fColumns);
+        for (int row = top; row < bottom; row++){
+            fRowState[row].hash = hash;
+            fRowState[row].render.reset();
+            fRowState[row].pixelsDirty = true;
+        }
+    }
+
+    TerminalGlyph glyphFor(uint32_t codepoint, int style){
+        if ( codepoint < 128 && fAsciiResolved[codepoint * 4 + style] ){
+            return fAsciiGlyphs[codepoint * 4 + style];
+        }
+        uint64_t key = ((uint64_t)codepoint << 2) | style;
+        auto it = fGlyphs.find(key);
+        if ( it != fGlyphs.end() ){
+            return it->second;
+        }
+
+        TerminalGlyph glyph = {(uint16_t)style, fFonts[style].unicharToGlyph(codepoint)};
+        if ( !glyph.glyph ){
+            glyph = fallbackGlyph(codepoint, style);
+        }
+
+        if ( codepoint < 128 ){
+            fAsciiGlyphs[codepoint * 4 + style] = glyph;
+            fAsciiResolved[codepoint * 4 + style] = true;
+        } else {
+            fGlyphs[key] = glyph;
+        }
+        return glyph;
+    }
+
+    TerminalGlyph fallbackGlyph(uint32_t codepoint, int style){
+        sk_sp<SkTypeface> typeface = SkFontMgr_RefDefault()->matchFamilyStyleCharacter(
+            nullptr, SkFontStyle(), nullptr, 0, codepoint);
+        if ( !typeface ){
+            return {(uint16_t)style, 0};
+        }
+
+        uint64_t key = ((uint64_t)typeface->uniqueID() << 2) | style;
+        auto it = fFallbackFonts.find(key);
+        uint16_t index;
+        if ( it != fFallbackFonts.end() ){
+            index = it->second;
+        } else {
+            SkFont font(fFonts[0]);
+            font.setTypeface(typeface);
+            index = (uint16_t)fFonts.size();
+            fFonts.push_back(styledFont(font, style));
+            fFallbackFonts[key] = index;
+        }
+        return {index, fFonts[index].unicharToGlyph(codepoint)};
+    }
+
+    std::shared_ptr<const TerminalRowRender> rowRender(int row){
+        TerminalRow& state = fRowState[row];
+        if ( state.render ){
+            return state.render;
+        }
+
+        const TerminalCell* cells = rowCells(row);
+        auto it = fRowCache.find(state.hash);
+        if ( it != fRowCache.end() && sameCells(it->second->cells.data(), cells, fColumns) ){
+            state.render = it->second;
+            return state.render;
+        }
+
+        state.render = buildRow(cells);
+        if ( fRowCache.size() >= std::max<size_t>(256, fRows * 8) ){
+            // drop renders that no visible row is using
+            for (auto cached = fRowCache.begin(); cached != fRowCache.end(); ){
+                if ( cached->second.use_count() == 1 ){
+                    cached = fRowCache.erase(cached);
+                } else {
+                    ++cached;
+                }
+            }
+        }
+        fRowCache[state.hash] = state.render;
+        return state.render;
+    }
+
+    std::shared_ptr<const TerminalRowRender> buildRow(const TerminalCell* cells){
+        struct PositionedGlyph {
+            TerminalGlyph glyph;
+            float x;
+        };
+        // one group per foreground color, so each color is a single draw
+        std::vector<std::pair<SkColor, std::vector<PositionedGlyph>>> groups;
+
+        auto render = std::make_shared<TerminalRowRender>();
+        render->cells.assign(cells, cells + fColumns);
+
+        for (int col = 0; col < fColumns; col++){
+            const TerminalCell& cell = cells[col];
+            SkColor fg = cell.fg ? cell.fg : fDefaultFg;
+            SkColor bg = cell.bg ? cell.bg : fDefaultBg;
+            if ( cell.attrs & kTerminalInverse ){
+                std::swap(fg, bg);
+            }
+            float left = col * fCellWidth;
+            float right = left + fCellWidth;
+
+            if ( bg != fDefaultBg ){
+                auto& backgrounds = render->backgrounds;
+                if ( !backgrounds.empty() && backgrounds.back().color == bg && backgrounds.back().right == left ){
+                    backgrounds.back().right = right;
+                } else {
+                    backgrounds.push_back({left, right, bg});
+                }
+            }
+
+            if ( cell.attrs & kTerminalConceal ){
+                continue;
+            }
+
+            if ( cell.codepoint > ' ' && cell.codepoint != 0x7f ){
+                int style = cell.attrs & (kTerminalBold | kTerminalItalic);
+                TerminalGlyph glyph = glyphFor(cell.codepoint, style);
+                auto group = std::find_if(groups.begin(), groups.end(),
+                                          [fg](const auto& g){ return g.first == fg; });
+                if ( group == groups.end() ){
+                    groups.emplace_back(fg, std::vector<PositionedGlyph>());
+                    group = groups.end() - 1;
+                }
+                group->second.push_back({glyph, left});
+            }
+
+            float lineYs[2] = {fUnderlineY, fStrikeY};
+            uint32_t lineAttrs[2] = {kTerminalUnderline, kTerminalStrike};
+            for (int i = 0; i < 2; i++){
+                if ( !(cell.attrs & lineAttrs[i]) ){
+                    continue;
+                }
+                auto& lines = render->lines;
+                auto line = std::find_if(lines.rbegin(), lines.rend(), [&](const auto& l){
+                        return l.y == lineYs[i] && l.right == left && l.color == fg;
+                    });
+                if ( line != lines.rend() ){
+                    line->right = right;
+                } else {
+                    lines.push_back({left, right, lineYs[i], fg});
+                }
+            }
+        }
+
+        for (auto& group : groups){
+            const std::vector<PositionedGlyph>& glyphs = group.second;
+            SkTextBlobBuilder builder;
+            size_t start = 0;
+            while ( start < glyphs.size() ){
+                // split runs where the font changes
+                size_t end = start + 1;
+                while ( end < glyphs.size() && glyphs[end].glyph.font == glyphs[start].glyph.font ){
+                    end++;
+                }
+                const auto& run = builder.allocRunPosH(fFonts[glyphs[start].glyph.font], end - start, 0);
+                for (size_t i = start; i < end; i++){
+                    run.glyphs[i - start] = glyphs[i].glyph.glyph;
+                    run.pos[i - start] = glyphs[i].x;
+                }
+                start = end;
+            }
+            render->texts.push_back({builder.make(), group.first});
+        }
+
+        return render;
+    }
+
+    SkPaint backgroundPaint() const {
+        SkPaint paint;
+        paint.setColor(fDefaultBg);
+        return paint;
+    }
+
+    void drawRow(SkiaResource* resource, SkCanvas* canvas, const TerminalRowRender& render, float y){
+        SkPaint paint;
+        for (const auto& background : render.backgrounds){
+            paint.setColor(background.color);
+            canvas->drawRect(SkRect::MakeLTRB(background.left, y, background.right, y + fCellHeight), paint);
+        }
+
+        paint.setAntiAlias(true);
+        for (const auto& text : render.texts){
+            paint.setColor(text.color);
+            canvas->drawTextBlob(text.blob, 0, y + fBaseline, paint);
+        }
+
+        paint.setAntiAlias(false);
+        for (const auto& line : render.lines){
+            paint.setColor(line.color);
+            canvas->drawRect(SkRect::MakeLTRB(line.left, y + line.y, line.right, y + line.y + fLineThickness), paint);
+        }
+
+        resource->stats->drawRectCalls += render.backgrounds.size() + render.lines.size();
+        resource->stats->drawTextCalls += render.texts.size();
+    }
+
+    void drawOffscreen(SkiaResource* resource, SkCanvas* canvas, float sx, float sy){
+        int width = (int)std::ceil(fColumns * fCellWidth * sx);
+        int height = (int)std::ceil(fRows * fCellHeight * sy);
+        if ( width <= 0 || height <= 0 ){
+            return;
+        }
+
+        if ( !fOffscreen
+             || fOffscreen->width() != width
+             || fOffscreen->height() != height
+             || fOffscreenScaleX != sx
+             || fOffscreenScaleY != sy ){
+            fOffscreen = SkSurfaces::Raster(SkImageInfo::MakeN32Premul(width, height));
+            if ( !fOffscreen ){
+                return;
+            }
+            fOffscreenScaleX = sx;
+            fOffscreenScaleY = sy;
+            resource->stats->offscreenSurfaces++;
+            for (TerminalRow& state : fRowState){
+                state.pixelsDirty = true;
+            }
+        }
+
+        SkCanvas* offscreenCanvas = fOffscreen->getCanvas();
+        SkPaint clearPaint = backgroundPaint();
+        clearPaint.setBlendMode(SkBlendMode::kSrc);
+        for (int row = 0; row < fRows; row++){
+            TerminalRow& state = fRowState[row];
+            if ( !state.pixelsDirty ){
+                continue;
+            }
+            float y = row * fCellHeight;
+            SkRect rowRect = SkRect::MakeXYWH(0, y, fColumns * fCellWidth, fCellHeight);
+
+            offscreenCanvas->save();
+            offscreenCanvas->scale(sx, sy);
+            offscreenCanvas->clipRect(rowRect);
+            offscreenCanvas->drawRect(rowRect, clearPaint);
+            drawRow(resource, offscreenCanvas, *rowRender(row), y);
+            offscreenCanvas->restore();
+            state.pixelsDirty = false;
+        }
+
+        // The snapshot shares the offscreen pixels. It's released as soon as
+        // the draw returns, so painting dirty rows next frame doesn't copy.
+        resource->stats->drawSurfaceCalls++;
+        canvas->save();
+        canvas->scale(1 / sx, 1 / sy);
+        canvas->drawImage(fOffscreen->makeImageSnapshot(), 0, 0);
+        canvas->restore();
+    }
+
+    // Keeps the offscreen pixels in step with scroll() so moved rows
+    // don't have to be repainted.
+    void shiftOffscreen(int top, int bottom, int count){
+        if ( !fOffscreen ){
+            return;
+        }
+        float rowPixels = fCellHeight * fOffscreenScaleY;
+        int rowHeight = (int)std::lround(rowPixels);
+        SkPixmap pixmap;
+        if ( std::fabs(rowPixels - rowHeight) > 1e-3f ){
+            // rows don't line up with pixels, repaint instead
+            for (int row = top; row < bottom; row++){
+                fRowState[row].pixelsDirty = true;
+            }
+            return;
+        }
+
+        fOffscreen->notifyContentWillChange(SkSurface::kRetain_ContentChangeMode);
+        if ( !fOffscreen->peekPixels(&pixmap) ){
+            for (int row = top; row < bottom; row++){
+                fRowState[row].pixelsDirty = true;
+            }
+            return;
+        }
+
+        int moved = bottom - top - std::abs(count);
+        int srcRow = count > 0 ? top + count : top;
+        int dstRow = count > 0 ? top : top - count;
+        memmove(pixmap.writable_addr(0, dstRow * rowHeight),
+                pixmap.addr(0, srcRow * rowHeight),
+                pixmap.rowBytes() * moved * rowHeight);
+    }
+
+    std::vector<SkFont> fFonts;
+    std::unordered_map<uint64_t, uint16_t> fFallbackFonts;
+    std::array<TerminalGlyph, 128 * 4> fAsciiGlyphs;
+    std::array<bool, 128 * 4> fAsciiResolved;
+    std::unordered_map<uint64_t, TerminalGlyph> fGlyphs;
+
+    float fCellWidth = 0;
+    float fCellHeight = 0;
+    float fBaseline = 0;
+    float fUnderlineY = 0;
+    float fStrikeY = 0;
+    float fLineThickness = 1;
+    SkColor fDefaultFg = SK_ColorWHITE;
+    SkColor fDefaultBg = SK_ColorBLACK;
+
+    int fRows = 0;
+    int fColumns = 0;
+    std::vector<TerminalCell> fCells;
+    std::vector<TerminalRow> fRowState;
+    std::unordered_map<uint64_t, std::shared_ptr<const TerminalRowRender>> fRowCache;
+
+    sk_sp<SkSurface> fOffscreen;
+    float fOffscreenScaleX = 0;
+    float fOffscreenScaleY = 0;
+};
+
+// END TERMINAL GRID //
+
+// PTY //
+// Runs a shell on a pseudo terminal. A reader thread drains the pty into a
+// single producer/single consumer ring buffer and the owner parses it into
+// a screen model with skia_pty_session_poll, a bounded number of bytes at a
+// time. When the ring is full the reader stops reading, so a program that
+// writes faster than the ui can keep up blocks in write() instead of being
+// buffered without bound.
+namespace {
+
+class SpscRing {
+public:
+    explicit SpscRing(size_t capacity){
+        size_t size = 4096;
+        while ( size < capacity ){
+            size <<= 1;
+        }
+        fData.resize(size);
+        fMask = size - 1;
+    }
+
+    // producer side
+    size_t writable(uint8_t** ptr){
+        size_t head = fHead.load(std::memory_order_relaxed);
+        size_t tail = fTail.load(std::memory_order_acquire);
+        size_t space = fData.size() - (head - tail);
+        size_t offset = head & fMask;
+        *ptr = &fData[offset];
+        return std::min(space, fData.size() - offset);
+    }
+
+    void commit(size_t n){
+        fHead.store(fHead.load(std::memory_order_relaxed) + n, std::memory_order_release);
+    }
+
+    // consumer side
+    size_t readable(const uint8_t** ptr){
+        size_t tail = fTail.load(std::memory_order_relaxed);
+        size_t head = fHead.load(std::memory_order_acquire);
+        size_t offset = tail & fMask;
+        *ptr = &fData[offset];
+        return std::min(head - tail, fData.size() - offset);
+    }
+
+    void consume(size_t n){
+        fTail.store(fTail.load(std::memory_order_relaxed) + n, std::memory_order_release);
+    }
+
+    bool empty() const {
+        return fHead.load(std::memory_order_acquire) == fTail.load(std::memory_order_acquire);
+    }
+
+    bool full() const {
+        return fHead.load() - fTail.load() == fData.size();
+    }
+
+private:
+    std::vector<uint8_t> fData;
+    size_t fMask;
+    alignas(64) std::atomic<size_t> fHead{0};
+    alignas(64) std::atomic<size_t> fTail{0};
+};
+
+SkColor xtermColor(int index){
+    static const SkColor kBase[16] = {
+        0xFF000000, 0xFFCD0000, 0xFF00CD00, 0xFFCDCD00,
+        0xFF0000EE, 0xFFCD00CD, 0xFF00CDCD, 0xFFE5E5E5,
+        0xFF7F7F7F, 0xFFFF0000, 0xFF00FF00, 0xFFFFFF00,
+        0xFF5C5CFF, 0xFFFF00FF, 0xFF00FFFF, 0xFFFFFFFF,
+    };
+    if ( index < 16 ){
+        return kBase[std::max(index, 0)];
+    }
+    if ( index < 232 ){
+        static const uint8_t kLevels[6] = {0, 95, 135, 175, 215, 255};
+        index -= 16;
+        return SkColorSetRGB(kLevels[index / 36], kLevels[(index / 6) % 6], kLevels[index % 6]);
+    }
+    uint8_t gray = 8 + 10 * (std::min(index, 255) - 232);
+    return SkColorSetRGB(gray, gray, gray);
+}
+
+// A VT100/xterm subset: cursor movement, erasing, insert/delete,
+// scroll regions, SGR with 256 and true color, the alternate screen
+// and the status reports shells ask for. Every codepoint takes one cell.
+class VtScreen {
+public:
+    VtScreen(int rows, int columns){
+        resize(rows, columns);
+    }
+
+    void resize(int rows, int columns){
+        rows = std::max(rows, 1);
+        columns = std::max(columns, 1);
+        resizeCells(fCells, rows, columns);
+        resizeCells(fAltCells, rows, columns);
+        fDirty.assign(rows, 1);
+        fRows = rows;
+        fColumns = columns;
+        fScrollTop = 0;
+        fScrollBottom = rows;
+        fRow = std::min(fRow, rows - 1);
+        fCol = std::min(fCol, columns - 1);
+        fWrapPending = false;
+        fScrollValid = false;
+    }
+
+    void feed(const uint8_t* data, size_t length){
+        for (size_t i = 0; i < length; i++){
+            uint8_t b = data[i];
+            if ( fState == kGround && fUtf8Remaining == 0 ){
+                // fast path for runs of printable ascii
+                size_t end = i;
+                while ( end < length && data[end] >= 0x20 && data[end] < 0x7f ){
+                    putChar(data[end]);
+                    end++;
+                }
+                if ( end != i ){
+                    i = end - 1;
+                    continue;
+                }
+            }
+            feedByte(b);
+        }
+    }
+
+    std::string takeResponses(){
+        std::string responses;
+        responses.swap(fResponses);
+        return responses;
+    }
+
+    // Number of rows the whole screen scrolled up since the last call,
+    // or 0 if anything other than full screen scrolling happened.
+    int takeScroll(){
+        int scroll = fScrollValid ? fPendingScroll : 0;
+        fPendingScroll = 0;
+        fScrollValid = true;
+        return scroll;
+    }
+
+    int rows() const { return fRows; }
+    int columns() const { return fColumns; }
+    int cursorRow() const { return fRow; }
+    int cursorColumn() const { return fCol; }
+    bool cursorVisible() const { return fCursorVisible; }
+
+    const TerminalCell* row(int row) const {
+        return &fCells[row * fColumns];
+    }
+
+    bool takeDirty(int row){
+        bool dirty = fDirty[row];
+        fDirty[row] = 0;
+        return dirty;
+    }
+
+private:
+    enum State {
+        kGround,
+        kEscape,
+        kCharset,
+        kCsi,
+        kOsc,
+        kOscEscape,
+    };
+
+    struct SavedCursor {
+        int row = 0;
+        int col = 0;
+        TerminalCell pen = {};
+    };
+
+    // keeps the overlapping top left region
+    void resizeCells(std::vector<TerminalCell>& cells, int rows, int columns) const {
+        std::vector<TerminalCell> resized(rows * columns, TerminalCell{});
+        if ( !cells.empty() ){
+            for (int row = 0; row < std::min(rows, fRows); row++){
+                std::copy(cells.begin() + row * fColumns,
+                          cells.begin() + row * fColumns + std::min(columns, fColumns),
+                          resized.begin() + row * columns);
+            }
+        }
+        cells.swap(resized);
+    }
+
+    TerminalCell blank() const {
+        return TerminalCell{0, 0, fPen.bg, 0};
+    }
+
+    TerminalCell* rowCells(int row){
+        return &fCells[row * fColumns];
+    }
+
+    void markDirty(int top, int bottom){
+        for (int row = std::max(top, 0); row < std::min(bottom, fRows); row++){
+            fDirty[row] = 1;
+        }
+    }
+
+    void clearCells(int row, int start, int end){
+        TerminalCell* cells = rowCells(row);
+        std::fill(cells + std::max(start, 0), cells + std::min(end, fColumns), blank());
+        fDirty[row] = 1;
+    }
+
+    void putChar(uint32_t codepoint){
+        if ( fWrapPending ){
+            fCol = 0;
+            lineFeed();
+            fWrapPending = false;
+        }
+        TerminalCell* cells = rowCells(fRow);
+        if ( fInsertMode ){
+            std::move_backward(cells + fCol, cells + fColumns - 1, cells + fColumns);
+        }
+        cells[fCol] = TerminalCell{codepoint, fPen.fg, fPen.bg, fPen.attrs};
+        fDirty[fRow] = 1;
+        if ( fCol == fColumns - 1 ){
+            fWrapPending = fAutowrap;
+        } else {
+            fCol++;
+        }
+    }
+
+    void scrollUp(int top, int bottom, int count){
+        count = std::min(count, bottom - top);
+        if ( count <= 0 ){
+            return;
+        }
+        std::move(fCells.begin() + (top + count) * fColumns,
+                  fCells.begin() + bottom * fColumns,
+                  fCells.begin() + top * fColumns);
+        std::fill(fCells.begin() + (bottom - count) * fColumns,
+                  fCells.begin() + bottom * fColumns,
+                  blank());
+        markDirty(top, bottom);
+        if ( top == 0 && bottom == fRows ){
+            fPendingScroll += count;
+        } else {
+            fScrollValid = false;
+        }
+    }
+
+    void scrollDown(int top, int bottom, int count){
+        count = std::min(count, bottom - top);
+        if ( count <= 0 ){
+            return;
+        }
+        std::move_backward(fCells.begin() + top * fColumns,
+                           fCells.begin() + (bottom - count) * fColumns,
+                           fCells.begin() + bottom * fColumns);
+        std::fill(fCells.begin() + top * fColumns,
+                  fCells.begin() + (top + count) * fColumns,
+                  blank());
+        markDirty(top, bottom);
+        fScrollValid = false;
+    }
+
+    void lineFeed(){
+        if ( fRow == fScrollBottom - 1 ){
+            scrollUp(fScrollTop, fScrollBottom, 1);
+        } else if ( fRow < fRows - 1 ){
+            fRow++;
+        }
+    }
+
+    void reverseIndex(){
+        if ( fRow == fScrollTop ){
+            scrollDown(fScrollTop, fScrollBottom, 1);
+        } else if ( fRow > 0 ){
+            fRow--;
+        }
+    }
+
+    void moveCursor(int row, int col){
+        fRow = std::max(0, std::min(row, fRows - 1));
+        fCol = std::max(0, std::min(col, fColumns - 1));
+        fWrapPending = false;
+    }
+
+    void reset(){
+        fPen = TerminalCell{};
+        fScrollTop = 0;
+        fScrollBottom = fRows;
+        fAutowrap = true;
+        fInsertMode = false;
+        fCursorVisible = true;
+        if ( fAltScreen ){
+            fCells.swap(fAltCells);
+            fAltScreen = false;
+        }
+        std::fill(fCells.begin(), fCells.end(), TerminalCell{});
+        markDirty(0, fRows);
+        fScrollValid = false;
+        moveCursor(0, 0);
+    }
+
+    void setAltScreen(bool enabled){
+        if ( enabled == fAltScreen ){
+            return;
+        }
+        fCells.swap(fAltCells);
+        fAltScreen = enabled;
+        if ( enabled ){
+            std::fill(fCells.begin(), fCells.end(), blank());
+        }
+        markDirty(0, fRows);
+        fScrollValid = false;
+    }
+
+    void feedByte(uint8_t b){
+        // control characters are executed in every state but strings
+        if ( b < 0x20 && fState != kOsc && fState != kOscEscape ){
+            executeControl(b);
+            return;
+        }
+
+        switch (fState){
+        case kGround:
+            feedUtf8(b);
+            break;
+        case kEscape:
+            escapeDispatch(b);
+            break;
+        case kCharset:
+            fState = kGround;
+            break;
+        case kCsi:
+            if ( b >= '0' && b <= '9' ){
+                int& param = fParams[fParamCount];
+                param = (param < 0 ? 0 : param) * 10 + (b - '0');
+                param = std::min(param, 65535);
+            } else if ( b == ';' || b == ':' ){
+                if ( fParamCount < kMaxParams - 1 ){
+                    fParams[++fParamCount] = -1;
+                }
+            } else if ( b >= '<' && b <= '?' ){
+                fPrivate = b;
+            } else if ( b >= 0x20 && b <= 0x2f ){
+                fIntermediate = b;
+            } else if ( b >= 0x40 && b <= 0x7e ){
+                fParamCount++;
+                csiDispatch(b);
+                fState = kGround;
+            } else {
+                fState = kGround;
+            }
+            break;
+        case kOsc:
+            // titles and other strings are ignored
+            if ( b == 0x07 ){
+                fState = kGround;
+            } else if ( b == 0x1b ){
+                fState = kOscEscape;
+            }
+            break;
+        case kOscEscape:
+            fState = b == '\\' ? kGround : kOsc;
+            break;
+        }
+    }
+
+    void executeControl(uint8_t b){
+        switch (b){
+        case 0x08:
+            if ( fCol > 0 ){
+                fCol--;
+            }
+            fWrapPending = false;
+            break;
+        case 0x09:
+            fCol = std::min(fColumns - 1, (fCol / 8 + 1) * 8);
+            fWrapPending = false;
+            break;
+        case 0x0a:
+        case 0x0b:
+        case 0x0c:
+            lineFeed();
+            fWrapPending = false;
+            break;
+        case 0x0d:
+            fCol = 0;
+            fWrapPending = false;
+            break;
+        case 0x18:
+        case 0x1a:
+            fState = kGround;
+            break;
+        case 0x1b:
+            fState = kEscape;
+            break;
+        default:
+            break;
+        }
+    }
+
+    void feedUtf8(uint8_t b){
+        if ( b < 0x80 ){
+            if ( b != 0x7f ){
+                putChar(b);
+            }
+            fUtf8Remaining = 0;
+            return;
+        }
+        if ( (b & 0xc0) == 0x80 ){
+            if ( fUtf8Remaining == 0 ){
+                putChar(0xfffd);
+                return;
+            }
+            fUtf8Codepoint = (fUtf8Codepoint << 6) | (b & 0x3f);
+            if ( --fUtf8Remaining == 0 ){
+                putChar(fUtf8Codepoint);
+            }
+            return;
+        }
+        if ( fUtf8Remaining != 0 ){
+            putChar(0xfffd);
+        }
+        if ( (b & 0xe0) == 0xc0 ){
+            fUtf8Codepoint = b & 0x1f;
+            fUtf8Remaining = 1;
+        } else if ( (b & 0xf0) == 0xe0 ){
+            fUtf8Codepoint = b & 0x0f;
+            fUtf8Remaining = 2;
+        } else if ( (b & 0xf8) == 0xf0 ){
+            fUtf8Codepoint = b & 0x07;
+            fUtf8Remaining = 3;
+        } else {
+            fUtf8Remaining = 0;
+            putChar(0xfffd);
+        }
+    }
+
+    void escapeDispatch(uint8_t b){
+        fState = kGround;
+        switch (b){
+        case '[':
+            fState = kCsi;
+            fParamCount = 0;
+            fParams[0] = -1;
+            fPrivate = 0;
+            fIntermediate = 0;
+            break;
+        case ']':
+        case 'P':
+        case '_':
+        case '^':
+            fState = kOsc;
+            break;
+        case '(':
+        case ')':
+        case '*':
+        case '+':
+            fState = kCharset;
+            break;
+        case '7':
+            fSaved = {fRow, fCol, fPen};
+            break;
+        case '8':
+            fPen = fSaved.pen;
+            moveCursor(fSaved.row, fSaved.col);
+            break;
+        case 'D':
+            lineFeed();
+            break;
+        case 'E':
+            fCol = 0;
+            lineFeed();
+            break;
+        case 'M':
+            reverseIndex();
+            break;
+        case 'c':
+            reset();
+            break;
+        default:
+            break;
+        }
+    }
+
+    int param(int index, int defaultValue) const {
+        if ( index >= fParamCount || fParams[index] <= 0 ){
+            return defaultValue;
+        }
+        return fParams[index];
+    }
+
+    void csiDispatch(uint8_t final){
+        if ( fIntermediate ){
+            return;
+        }
+        if ( fPrivate == '?' ){
+            if ( final == 'h' || final == 'l' ){
+                for (int i = 0; i < fParamCount; i++){
+                    setPrivateMode(fParams[i], final == 'h');
+                }
+            }
+            return;
+        }
+        if ( fPrivate == '>' ){
+            if ( final == 'c' ){
+                fResponses += "\x1b[>0;0;0c";
+            }
+            return;
+        }
+        if ( fPrivate ){
+            return;
+        }
+
+        int n = param(0, 1);
+        switch (final){
+        case 'A': moveCursor(fRow - n, fCol); break;
+        case 'B': moveCursor(fRow + n, fCol); break;
+        case 'C': moveCursor(fRow, fCol + n); break;
+        case 'D': moveCursor(fRow, fCol - n); break;
+        case 'E': moveCursor(fRow + n, 0); break;
+        case 'F': moveCursor(fRow - n, 0); break;
+        case 'G':
+        case '`':
+            moveCursor(fRow, n - 1);
+            break;
+        case 'H':
+        case 'f':
+            moveCursor(param(0, 1) - 1, param(1, 1) - 1);
+            break;
+        case 'd': moveCursor(n - 1, fCol); break;
+        case 'J': eraseInDisplay(param(0, 0)); break;
+        case 'K': eraseInLine(param(0, 0)); break;
+        case 'X': clearCells(fRow, fCol, fCol + n); break;
+        case 'L':
+            if ( fRow >= fScrollTop && fRow < fScrollBottom ){
+                scrollDown(fRow, fScrollBottom, n);
+            }
+            break;
+        case 'M':
+            if ( fRow >= fScrollTop && fRow < fScrollBottom ){
+                scrollUp(fRow, fScrollBottom, n);
+            }
+            break;
+        case 'P': {
+            TerminalCell* cells = rowCells(fRow);
+            n = std::min(n, fColumns - fCol);
+            std::move(cells + fCol + n, cells + fColumns, cells + fCol);
+            clearCells(fRow, fColumns - n, fColumns);
+            break;
+        }
+        case '@': {
+            TerminalCell* cells = rowCells(fRow);
+            n = std::min(n, fColumns - fCol);
+            std::move_backward(cells + fCol, cells + fColumns - n, cells + fColumns);
+            clearCells(fRow, fCol, fCol + n);
+            break;
+        }
+        case 'S': scrollUp(fScrollTop, fScrollBottom, n); break;
+        case 'T': scrollDown(fScrollTop, fScrollBottom, n); break;
+        case 'm': selectGraphicRendition(); break;
+        case 'r': {
+            int top = param(0, 1) - 1;
+            int bottom = param(1, fRows);
+            if ( top < bottom - 1 && bottom <= fRows ){
+                fScrollTop = top;
+                fScrollBottom = bottom;
+            }
+            moveCursor(0, 0);
+            break;
+        }
+        case 's': fSaved = {fRow, fCol, fPen}; break;
+        case 'u':
+            fPen = fSaved.pen;
+            moveCursor(fSaved.row, fSaved.col);
+            break;
+        case 'h':
+        case 'l':
+            if ( param(0, 0) == 4 ){
+                fInsertMode = final == 'h';
+            }
+            break;
+        case 'n':
+            if ( param(0, 0) == 5 ){
+                fResponses += "\x1b[0n";
+            } else if ( param(0, 0) == 6 ){
+                char buf[32];
+                snprintf(buf, sizeof(buf), "\x1b[%d;%dR", fRow + 1, fCol + 1);
+                fResponses += buf;
+            }
+            break;
+        case 'c':
+            fResponses += "\x1b[?1;2c";
+            break;
+        default:
+            break;
+        }
+    }
+
+    void setPrivateMode(int mode, bool enabled){
+        switch (mode){
+        case 7:
+            fAutowrap = enabled;
+            break;
+        case 25:
+            fCursorVisible = enabled;
+            break;
+        case 47:
+        case 1047:
+            setAltScreen(enabled);
+            break;
+        case 1049:
+            if ( enabled ){
+                fSaved = {fRow, fCol, fPen};
+                setAltScreen(true);
+            } else {
+                setAltScreen(false);
+                fPen = fSaved.pen;
+                moveCursor(fSaved.row, fSaved.col);
+            }
+            break;
+        default:
+            break;
+        }
+    }
+
+    void eraseInDisplay(int mode){
+        switch (mode){
+        case 0:
+            clearCells(fRow, fCol, fColumns);
+            for (int row = fRow + 1; row < fRows; row++){
+                clearCells(row, 0, fColumns);
+            }
+            break;
+        case 1:
+            for (int row = 0; row < fRow; row++){
+                clearCells(row, 0, fColumns);
+            }
+            clearCells(fRow, 0, fCol + 1);
+            break;
+        case 2:
+        case 3:
+            for (int row = 0; row < fRows; row++){
+                clearCells(row, 0, fColumns);
+            }
+            break;
+        }
+    }
+
+    void eraseInLine(int mode){
+        switch (mode){
+        case 0: clearCells(fRow, fCol, fColumns); break;
+        case 1: clearCells(fRow, 0, fCol + 1); break;
+        case 2: clearCells(fRow, 0, fColumns); break;
+        }
+    }
+
+    void selectGraphicRendition(){
+        if ( fParamCount == 0 ){
+            fPen = TerminalCell{};
+            return;
+        }
+        for (int i = 0; i < fParamCount; i++){
+            int code = std::max(fParams[i], 0);
+            switch (code){
+            case 0: fPen = TerminalCell{}; break;
+            case 1: fPen.attrs |= kTerminalBold; break;
+            case 3: fPen.attrs |= kTerminalItalic; break;
+            case 4: fPen.attrs |= kTerminalUnderline; break;
+            case 7: fPen.attrs |= kTerminalInverse; break;
+            case 8: fPen.attrs |= kTerminalConceal; break;
+            case 9: fPen.attrs |= kTerminalStrike; break;
+            case 22: fPen.attrs &= ~kTerminalBold; break;
+            case 23: fPen.attrs &= ~kTerminalItalic; break;
+            case 24: fPen.attrs &= ~kTerminalUnderline; break;
+            case 27: fPen.attrs &= ~kTerminalInverse; break;
+            case 28: fPen.attrs &= ~kTerminalConceal; break;
+            case 29: fPen.attrs &= ~kTerminalStrike; break;
+            case 39: fPen.fg = 0; break;
+            case 49: fPen.bg = 0; break;
+            case 38:
+            case 48: {
+                SkColor color = 0;
+                if ( i + 2 < fParamCount && fParams[i + 1] == 5 ){
+                    color = xtermColor(std::max(fParams[i + 2], 0));
+                    i += 2;
+                } else if ( i + 4 < fParamCount && fParams[i + 1] == 2 ){
+                    color = SkColorSetRGB(std::max(fParams[i + 2], 0) & 0xff,
+                                          std::max(fParams[i + 3], 0) & 0xff,
+                                          std::max(fParams[i + 4], 0) & 0xff);
+                    i += 4;
+                } else {
+                    i = fParamCount;
+                    break;
+                }
+                (code == 38 ? fPen.fg : fPen.bg) = color;
+                break;
+            }
+            default:
+                if ( code >= 30 && code <= 37 ){
+                    fPen.fg = xtermColor(code - 30);
+                } else if ( code >= 40 && code <= 47 ){
+                    fPen.bg = xtermColor(code - 40);
+                } else if ( code >= 90 && code <= 97 ){
+                    fPen.fg = xtermColor(code - 90 + 8);
+                } else if ( code >= 100 && code <= 107 ){
+                    fPen.bg = xtermColor(code - 100 + 8);
+                }
+                break;
+            }
+        }
+    }
+
+    static const int kMaxParams = 32;
+
+    int fRows = 0;
+    int fColumns = 0;
+    std::vector<TerminalCell> fCells;
+    std::vector<TerminalCell> fAltCells;
+    std::vector<uint8_t> fDirty;
+    int fPendingScroll = 0;
+    bool fScrollValid = true;
+
+    int fRow = 0;
+    int fCol = 0;
+    bool fWrapPending = false;
+    TerminalCell fPen = {};
+    SavedCursor fSaved;
+    int fScrollTop = 0;
+    int fScrollBottom = 0;
+    bool fAutowrap = true;
+    bool fInsertMode = false;
+    bool fCursorVisible = true;
+    bool fAltScreen = false;
+
+    State fState = kGround;
+    int fParams[kMaxParams];
+    int fParamCount = 0;
+    uint8_t fPrivate = 0;
+    uint8_t fIntermediate = 0;
+    uint32_t fUtf8Codepoint = 0;
+    int fUtf8Remaining = 0;
+
+    std::string fResponses;
+};
+
+}  // namespace
+
+class PtySession {
+public:
+    PtySession(int rows, int columns, size_t bufferBytes): fRing(bufferBytes), fScreen(rows, columns){}
+
+    ~PtySession(){
+        stop();
+    }
+
+    bool start(const char* shell){
+#ifdef MEMBRANE_HAS_PTY
+        // pipe2 isn't available on macos
+        if ( pipe(fWakePipe) != 0 ){
+            return false;
+        }
+        // keep the pipe out of the shell and anything else forked later
+        for (int fd : fWakePipe){
+            fcntl(fd, F_SETFD, FD_CLOEXEC);
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        }
+
+        // The child of a multithreaded process may only make async signal
+        // safe calls, so the shell and its environment are built here.
+        if ( !shell ){
+            shell = getenv("SHELL");
+        }
+        if ( !shell ){
+            shell = "/bin/sh";
+        }
+        std::string shellPath = shell;
+        std::vector<std::string> env;
+        for (char** var = environ; *var; var++){
+            if ( strncmp(*var, "TERM=", 5) ){
+                env.push_back(*var);
+            }
+        }
+        env.push_back("TERM=xterm-256color");
+        std::vector<char*> envp;
+        for (std::string& var : env){
+            envp.push_back(&var[0]);
+        }
+        envp.push_back(NULL);
+        char* argv[] = {&shellPath[0], NULL};
+
+        struct winsize ws = {};
+        ws.ws_row = fScreen.rows();
+        ws.ws_col = fScreen.columns();
+        pid_t pid = forkpty(&fFd, NULL, NULL, &ws);
+        if ( pid < 0 ){
+            return false;
+        }
+        if ( pid == 0 ){
+            signal(SIGCHLD, SIG_DFL);
+            execve(argv[0], argv, envp.data());
+            _exit(127);
+        }
+        fcntl(fFd, F_SETFD, FD_CLOEXEC);
+        // the reader thread writes too, and must never block on a full pty
+        fcntl(fFd, F_SETFL, fcntl(fFd, F_GETFL) | O_NONBLOCK);
+        fPid = pid;
+        fReader = std::thread(&PtySession::readLoop, this);
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    int64_t poll(int64_t maxBytes){
+        int64_t processed = 0;
+        while ( processed < maxBytes ){
+            const uint8_t* data;
+            size_t n = fRing.readable(&data);
+            if ( n == 0 ){
+                break;
+            }
+            n = std::min<int64_t>(n, maxBytes - processed);
+            fScreen.feed(data, n);
+            fRing.consume(n);
+            processed += n;
+
+            // Pairs with the reader publishing fReaderWaiting before it
+            // checks for space: either it sees this consume or we see it waiting.
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if ( fReaderWaiting.load() ){
+                std::lock_guard<std::mutex> lock(fMutex);
+                fSpaceAvailable.notify_one();
+            }
+        }
+
+        // answers to queries like cursor position reports
+        std::string responses = fScreen.takeResponses();
+        if ( !responses.empty() ){
+            write(responses.data(), responses.size());
+        }
+
+        if ( processed == 0 && fEof.load() && fRing.empty() ){
+            return -1;
+        }
+        return processed;
+    }
+
+    // Blocks until there's output to poll or the shell exits.
+    bool waitForOutput(int timeoutMillis){
+        std::unique_lock<std::mutex> lock(fMutex);
+        fConsumerWaiting = true;
+        bool ready = fDataAvailable.wait_for(lock, std::chrono::milliseconds(timeoutMillis), [&]{
+                return !fRing.empty() || fEof.load();
+            });
+        fConsumerWaiting = false;
+        return ready;
+    }
+
+    // Queues `data` for the reader thread to write to the shell, so the
+    // caller never blocks on a shell that isn't reading its input.
+    int write(const char* data, size_t length){
+#ifdef MEMBRANE_HAS_PTY
+        if ( fFd < 0 || fEof.load() ){
+            return -1;
+        }
+        {
+            std::lock_guard<std::mutex> lock(fMutex);
+            fOutput.append(data, length);
+            fSpaceAvailable.notify_one();
+        }
+        wakeReader();
+        return (int)length;
+#else
+        return -1;
+#endif
+    }
+
+    void resize(int rows, int columns){
+        fScreen.resize(rows, columns);
+#ifdef MEMBRANE_HAS_PTY
+        if ( fFd >= 0 ){
+            struct winsize ws = {};
+            ws.ws_row = fScreen.rows();
+            ws.ws_col = fScreen.columns();
+            ioctl(fFd, TIOCSWINSZ, &ws);
+        }
+#endif
+    }
+
+    VtScreen& screen(){
+        return fScreen;
+    }
+
+private:
+    void readLoop(){
+#ifdef MEMBRANE_HAS_PTY
+        while ( !fStopping.load() ){
+            uint8_t* buffer;
+            size_t space = fRing.writable(&buffer);
+            bool pending;
+            {
+                std::lock_guard<std::mutex> lock(fMutex);
+                pending = !fOutput.empty();
+            }
+            if ( space == 0 && !pending ){
+                // backpressure: stop draining the pty until the consumer catches up
+                std::unique_lock<std::mutex> lock(fMutex);
+                fReaderWaiting = true;
+                fSpaceAvailable.wait(lock, [&]{ return fStopping.load() || !fRing.full() || !fOutput.empty(); });
+                fReaderWaiting = false;
+                continue;
+            }
+
+            short events = (space > 0 ? POLLIN : 0) | (pending ? POLLOUT : 0);
+            struct pollfd fds[2] = {{fFd, events, 0}, {fWakePipe[0], POLLIN, 0}};
+            if ( ::poll(fds, 2, -1) < 0 ){
+                if ( errno == EINTR ){
+                    continue;
+                }
+                break;
+            }
+            if ( fds[1].revents ){
+                // stopping or more input queued, checked on the next turn
+                char drain[64];
+                while ( ::read(fWakePipe[0], drain, sizeof(drain)) > 0 ){
+                }
+                continue;
+            }
+            if ( fds[0].revents & POLLOUT ){
+                writeOutput();
+            }
+            if ( space == 0 || !(fds[0].revents & (POLLIN | POLLHUP | POLLERR)) ){
+                continue;
+            }
+
+            ssize_t n = ::read(fFd, buffer, space);
+            if ( n < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK) ){
+                continue;
+            }
+            if ( n <= 0 ){
+                break;
+            }
+            fRing.commit(n);
+
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if ( fConsumerWaiting.load() ){
+                std::lock_guard<std::mutex> lock(fMutex);
+                fDataAvailable.notify_all();
+            }
+        }
+#endif
+
+        std::lock_guard<std::mutex> lock(fMutex);
+        fEof = true;
+        fDataAvailable.notify_all();
+    }
+
+    void stop(){
+        fStopping = true;
+        wakeReader();
+        {
+            std::lock_guard<std::mutex> lock(fMutex);
+            fSpaceAvailable.notify_all();
+        }
+        if ( fReader.joinable() ){
+            fReader.join();
+        }
+#ifdef MEMBRANE_HAS_PTY
+        for (int fd : {fFd, fWakePipe[0], fWakePipe[1]}){
+            if ( fd >= 0 ){
+                close(fd);
+            }
+        }
+        if ( fPid > 0 ){
+            reap(fPid);
+            fPid = -1;
+        }
+#endif
+        fFd = -1;
+        fWakePipe[0] = fWakePipe[1] = -1;
+    }
+
+    void wakeReader(){
+#ifdef MEMBRANE_HAS_PTY
+        if ( fWakePipe[1] >= 0 ){
+            char b = 0;
+            ::write(fWakePipe[1], &b, 1);
+        }
+#endif
+    }
+
+#ifdef MEMBRANE_HAS_PTY
+    // Writes as much queued input as the pty takes without blocking.
+    // Input is dropped if the pty can't be written anymore.
+    void writeOutput(){
+        std::lock_guard<std::mutex> lock(fMutex);
+        size_t written = 0;
+        while ( written < fOutput.size() ){
+            ssize_t n = ::write(fFd, fOutput.data() + written, fOutput.size() - written);
+            if ( n < 0 ){
+                if ( errno == EINTR ){
+                    continue;
+                }
+                if ( errno != EAGAIN && errno != EWOULDBLOCK ){
+                    written = fOutput.size();
+                }
+                break;
+            }
+            written += n;
+        }
+        fOutput.erase(0, written);
+    }
+
+    // Hangs up on the shell and waits for it to exit so it doesn't linger
+    // as a zombie. Shells that ignore the hangup are killed after 200ms.
+    static void reap(pid_t pid){
+        kill(pid, SIGHUP);
+        for (int i = 0; i < 100; i++){
+            pid_t result = waitpid(pid, NULL, WNOHANG);
+            if ( result == pid || (result < 0 && errno != EINTR) ){
+                return;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(2));
+        }
+        kill(pid, SIGKILL);
+        while ( waitpid(pid, NULL, 0) < 0 && errno == EINTR ){
+        }
+    }
+#endif
+
+    int fFd = -1;
+    int fPid = -1;
+    int fWakePipe[2] = {-1, -1};
+    std::thread fReader;
+
+    SpscRing fRing;
+    std::mutex fMutex;
+    std::condition_variable fSpaceAvailable;
+    std::condition_variable fDataAvailable;
+    std::atomic<bool> fStopping{false};
+    std::atomic<bool> fEof{false};
+    std::atomic<bool> fReaderWaiting{false};
+    std::atomic<bool> fConsumerWaiting{false};
+    // input queued by write, guarded by fMutex
+    std::string fOutput;
+
+    VtScreen fScreen;
+};
+
+// END PTY //
+
+// SHARED PIXELS //
+// A triple buffered pixel surface in shared memory for producers that
+// render on another thread or in another process (browsers, video).
+// The producer writes into its own buffer and publishes it by swapping
+// it into the ready slot. The consumer swaps the ready slot with the
+// buffer it last drew, so neither side blocks and neither side ever
+// sees a buffer the other is using. Frames are drawn straight out of
+// the shared buffer instead of being copied into the surface first.
+namespace {
+
+const uint32_t kSharedPixelsMagic = 0x4d425350; // MBSP
+const uint32_t kSharedPixelsFresh = 0x4;
+const uint32_t kSharedPixelsIndexMask = 0x3;
+const int kSharedPixelsBufferCount = 3;
+
+struct SharedPixelsHeader {
+    uint32_t magic;
+    int32_t width;
+    int32_t height;
+    int32_t rowBytes;
+    int32_t alphaType;
+    uint32_t bufferOffset;
+    uint64_t bufferBytes;
+    // index of the ready buffer | kSharedPixelsFresh if it hasn't been drawn
+    std::atomic<uint32_t> ready;
+    std::atomic<uint64_t> published;
+};
+
+static_assert(std::atomic<uint32_t>::is_always_lock_free, "shared memory atomics must be lock free");
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "shared memory atomics must be lock free");
+
+#ifdef MEMBRANE_HAS_POSIX
+int makeSharedMemoryFd(size_t size){
+#if defined(__linux__)
+    int fd = memfd_create("membrane-shared-pixels", MFD_CLOEXEC);
+#else
+    char name[64];
+    snprintf(name, sizeof(name), "/membrane-%d-%p", (int)getpid(), (void*)&name);
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if ( fd >= 0 ){
+        shm_unlink(name);
+    }
+#endif
+    if ( fd < 0 ){
+        return -1;
+    }
+    if ( ftruncate(fd, size) != 0 ){
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+#endif
+
+}  // namespace
+
+class SharedPixels {
+public:
+    ~SharedPixels(){
+        if ( fTextureContext && fTexture.isValid() && !fTextureContext->abandoned() ){
+            fTextureContext->deleteBackendTexture(fTexture);
+        }
+#ifdef MEMBRANE_HAS_POSIX
+        if ( fBase ){
+            munmap(fBase, fSize);
+        }
+        if ( fFd >= 0 ){
+            close(fFd);
+        }
+#endif
+    }
+
+    // Shared pixels need posix shared memory. Returns null elsewhere.
+    static SharedPixels* create(int width, int height, SkAlphaType alphaType){
+#ifdef MEMBRANE_HAS_POSIX
+        if ( width <= 0 || height <= 0 ){
+            return nullptr;
+        }
+        size_t rowBytes = (size_t)width * 4;
+        size_t bufferBytes = rowBytes * height;
+        size_t offset = 4096;
+        size_t size = offset + bufferBytes * kSharedPixelsBufferCount;
+
+        int fd = makeSharedMemoryFd(size);
+        if ( fd < 0 ){
+            return nullptr;
+        }
+        SharedPixels* pixels = map(fd, size);
+        if ( !pixels ){
+            close(fd);
+            return nullptr;
+        }
+
+        SharedPixelsHeader* header = new (pixels->fBase) SharedPixelsHeader();
+        header->width = width;
+        header->height = height;
+        header->rowBytes = rowBytes;
+        header->alphaType = alphaType;
+        header->bufferOffset = offset;
+        header->bufferBytes = bufferBytes;
+        header->ready.store(1);
+        header->published.store(0);
+        std::atomic_thread_fence(std::memory_order_release);
+        header->magic = kSharedPixelsMagic;
+        pixels->fHeader = header;
+        return pixels;
+#else
+        return nullptr;
+#endif
+    }
+
+    // Maps a buffer created by `create`, possibly in another process.
+    // Takes ownership of `fd` on success.
+    static SharedPixels* open(int fd){
+#ifdef MEMBRANE_HAS_POSIX
+        struct stat st;
+        if ( fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(SharedPixelsHeader) ){
+            return nullptr;
+        }
+        SharedPixels* pixels = map(fd, st.st_size);
+        if ( !pixels ){
+            return nullptr;
+        }
+        SharedPixelsHeader* header = (SharedPixelsHeader*)pixels->fBase;
+        if ( header->magic != kSharedPixelsMagic
+             || header->bufferOffset + header->bufferBytes * kSharedPixelsBufferCount > (uint64_t)st.st_size ){
+            pixels->fFd = -1;
+            delete pixels;
+            return nullptr;
+        }
+        pixels->fHeader = header;
+        return pixels;
+#else
+        return nullptr;
+#endif
+    }
+
+    int fd() const { return fFd; }
+    int width() const { return fHeader->width; }
+    int height() const { return fHeader->height; }
+    int rowBytes() const { return fHeader->rowBytes; }
+
+    // producer side
+
+    void* writeBuffer(){
+        return buffer(fWriteIndex);
+    }
+
+    void publish(){
+        uint32_t previous = fHeader->ready.exchange(fWriteIndex | kSharedPixelsFresh, std::memory_order_acq_rel);
+        fWriteIndex = previous & kSharedPixelsIndexMask;
+        fHeader->published.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // consumer side
+
+    // Swaps in the newest published frame, if any. Returns true if it's new.
+    bool acquire(){
+        if ( !(fHeader->ready.load(std::memory_order_acquire) & kSharedPixelsFresh) ){
+            return false;
+        }
+        uint32_t previous = fHeader->ready.exchange(fReadIndex, std::memory_order_acq_rel);
+        fReadIndex = previous & kSharedPixelsIndexMask;
+        fReadGeneration++;
+        return true;
+    }
+
+    bool hasFrame() const {
+        return fReadGeneration > 0;
+    }
+
+    SkPixmap readPixmap() const {
+        SkImageInfo info = SkImageInfo::Make(width(), height(), kBGRA_8888_SkColorType, (SkAlphaType)fHeader->alphaType);
+        return SkPixmap(info, buffer(fReadIndex), rowBytes());
+    }
+
+    // The current frame as a texture, uploaded once per new frame.
+    sk_sp<SkImage> textureImage(GrDirectContext* context, bool* uploaded){
+        *uploaded = false;
+        if ( fTextureContext.get() != context ){
+            if ( fTextureContext && fTexture.isValid() && !fTextureContext->abandoned() ){
+                fTextureContext->deleteBackendTexture(fTexture);
+            }
+            fTextureContext = sk_ref_sp(context);
+            fTexture = context->createBackendTexture(width(), height(), kBGRA_8888_SkColorType,
+                                                     skgpu::Mipmapped::kNo, GrRenderable::kNo);
+            fTextureImage.reset();
+            fUploadedGeneration = 0;
+        }
+        if ( !fTexture.isValid() ){
+            return nullptr;
+        }
+        if ( fUploadedGeneration != fReadGeneration || !fTextureImage ){
+            SkPixmap pixmap = readPixmap();
+            if ( !context->updateBackendTexture(fTexture, &pixmap, 1, kTopLeft_GrSurfaceOrigin) ){
+                return nullptr;
+            }
+            fTextureImage = SkImages::BorrowTextureFrom(context, fTexture, kTopLeft_GrSurfaceOrigin,
+                                                        kBGRA_8888_SkColorType, pixmap.alphaType(), nullptr);
+            fUploadedGeneration = fReadGeneration;
+            *uploaded = true;
+        }
+        return fTextureImage;
+    }
+
+private:
+    SharedPixels(int fd, void* base, size_t size): fFd(fd), fBase(base), fSize(size){}
+
+#ifdef MEMBRANE_HAS_POSIX
+    static SharedPixels* map(int fd, size_t size){
+        void* base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if ( base == MAP_FAILED ){
+            return nullptr;
+        }
+        return new SharedPixels(fd, base, size);
+    }
+#endif
+
+    void* buffer(uint32_t index) const {
+        return (uint8_t*)fBase + fHeader->bufferOffset + fHeader->bufferBytes * index;
+    }
+
+    int fFd;
+    void* fBase;
+    size_t fSize;
+    SharedPixelsHeader* fHeader = nullptr;
+
+    // each side keeps the index of the buffer it owns locally
+    uint32_t fWriteIndex = 0;
+    uint32_t fReadIndex = 2;
+    uint64_t fReadGeneration = 0;
+
+    sk_sp<GrDirectContext> fTextureContext;
+    GrBackendTexture fTexture;
+    sk_sp<SkImage> fTextureImage;
+    uint64_t fUploadedGeneration = 0;
+};
+
+// END SHARED PIXELS //
+
+// YUV VIDEO //
+// Draws planar (I420) and semi-planar (NV12) frames. On gpu surfaces the
+// planes are uploaded into two sets of textures, used in turn and kept
+// between frames, and the conversion happens in the shader. On raster
+// surfaces the frame is converted into a reused BGRA buffer. The color
+// math runs on 4 pixels at a time; loading the pixels is scalar.
+namespace {
+
+enum YuvFormat {
+    kYuvI420 = 0,
+    kYuvNV12 = 1,
+};
+
+struct YuvCoefficients {
+    int32_t yScale;
+    int32_t yOffset;
+    int32_t rv;
+    int32_t gu;
+    int32_t gv;
+    int32_t bu;
+};
+
+// 8.8 fixed point, indexed by the colorSpace argument
+const YuvCoefficients kYuvCoefficients[] = {
+    {298, 16, 409, 100, 208, 516}, // BT.601 limited range
+    {298, 16, 459, 55, 136, 541},  // BT.709 limited range
+    {256, 0, 359, 88, 183, 454},   // JPEG full range
+};
+
+const SkYUVColorSpace kYuvColorSpaces[] = {
+    kRec601_Limited_SkYUVColorSpace,
+    kRec709_Limited_SkYUVColorSpace,
+    kJPEG_Full_SkYUVColorSpace,
+};
+
+// 4 lanes fit in sse2 and neon registers
+typedef int32_t YuvLanes __attribute__((vector_size(16)));
+
+inline YuvLanes clampByte(YuvLanes v){
+    v &= ~(v >> 31);           // max(v, 0)
+    v |= (255 - v) >> 31;      // values over 255 become all ones
+    return v & 255;
+}
+
+void convertYuvRow(const YuvCoefficients& k,
+                   const uint8_t* y, const uint8_t* u, const uint8_t* v, int chromaStep,
+                   uint32_t* out, int width){
+    int x = 0;
+    for (; x + 4 <= width; x += 4){
+        // gathered one lane at a time, since chroma is shared by pixel pairs
+        YuvLanes Y, U, V;
+        for (int i = 0; i < 4; i++){
+            int c = ((x + i) >> 1) * chromaStep;
+            Y[i] = y[x + i];
+            U[i] = u[c];
+            V[i] = v[c];
+        }
+        Y = (Y - k.yOffset) * k.yScale + 128;
+        U -= 128;
+        V -= 128;
+        YuvLanes r = clampByte((Y + k.rv * V) >> 8);
+        YuvLanes g = clampByte((Y - k.gu * U - k.gv * V) >> 8);
+        YuvLanes b = clampByte((Y + k.bu * U) >> 8);
+        YuvLanes bgra = (YuvLanes{} + (int32_t)0xff000000) | (r << 16) | (g << 8) | b;
+        memcpy(out + x, &bgra, sizeof(bgra));
+    }
+    for (; x < width; x++){
+        int c = (x >> 1) * chromaStep;
+        int Y = (y[x] - k.yOffset) * k.yScale + 128;
+        int U = u[c] - 128;
+        int V = v[c] - 128;
+        int r = std::clamp((Y + k.rv * V) >> 8, 0, 255);
+        int g = std::clamp((Y - k.gu * U - k.gv * V) >> 8, 0, 255);
+        int b = std::clamp((Y + k.bu * U) >> 8, 0, 255);
+        out[x] = 0xff000000 | (r << 16) | (g << 8) | b;
+    }
+}
+
+}  // namespace
+
+class YuvVideo {
+public:
+    ~YuvVideo(){
+        releaseTextures();
+    }
+
+    // planes/strides hold y, u, v for I420 and y, uv for NV12.
+    sk_sp<SkImage> frameImage(SkiaResource* resource, int format, int width, int height,
+                              const void* const* planes, const int* strides, int colorSpace){
+        if ( width <= 0 || height <= 0 || (format != kYuvI420 && format != kYuvNV12) ){
+            return nullptr;
+        }
+        colorSpace = std::max(0, std::min(colorSpace, 2));
+
+        if ( resource->surface->recordingContext() && resource->grContext ){
+            return textureImage(resource, format, width, height, planes, strides, colorSpace);
+        }
+        return rasterImage(resource, format, width, height, planes, strides, colorSpace);
+    }
+
+private:
+    sk_sp<SkImage> textureImage(SkiaResource* resource, int format, int width, int height,
+                                const void* const* planes, const int* strides, int colorSpace){
+        GrDirectContext* context = resource->grContext.get();
+        SkYUVAInfo::PlaneConfig config = format == kYuvI420
+            ? SkYUVAInfo::PlaneConfig::kY_U_V
+            : SkYUVAInfo::PlaneConfig::kY_UV;
+        SkYUVAInfo info({width, height}, config, SkYUVAInfo::Subsampling::k420, kYuvColorSpaces[colorSpace]);
+
+        SkISize planeSizes[SkYUVAInfo::kMaxPlanes];
+        int planeCount = info.planeDimensions(planeSizes);
+        SkColorType planeTypes[SkYUVAInfo::kMaxPlanes] = {kAlpha_8_SkColorType, kAlpha_8_SkColorType, kAlpha_8_SkColorType};
+        if ( format == kYuvNV12 ){
+            planeTypes[1] = kR8G8_unorm_SkColorType;
+        }
+
+        if ( fContext.get() != context || fFormat != format || fWidth != width || fHeight != height ){
+            releaseTextures();
+            fContext = sk_ref_sp(context);
+            fFormat = format;
+            fWidth = width;
+            fHeight = height;
+            for (auto& set : fTextures){
+                for (int i = 0; i < planeCount; i++){
+                    set[i] = context->createBackendTexture(planeSizes[i].width(), planeSizes[i].height(),
+                                                           planeTypes[i], skgpu::Mipmapped::kNo, GrRenderable::kNo);
+                    if ( !set[i].isValid() ){
+                        releaseTextures();
+                        return nullptr;
+                    }
+                }
+            }
+        }
+
+        // The other set may still be read by the last frame's draws while
+        // this one is written. Draws of this set that haven't been flushed
+        // yet, from drawing more than one video frame in a ui frame, are
+        // submitted first so the upload is ordered after them.
+        fCurrent = (fCurrent + 1) % kTextureSets;
+        if ( fUploadFrame[fCurrent] == resource->frameStart ){
+            context->flushAndSubmit();
+        }
+        fUploadFrame[fCurrent] = resource->frameStart;
+
+        GrBackendTexture* set = fTextures[fCurrent];
+        for (int i = 0; i < planeCount; i++){
+            SkImageInfo planeInfo = SkImageInfo::Make(planeSizes[i], planeTypes[i], kPremul_SkAlphaType);
+            SkPixmap pixmap(planeInfo, planes[i], strides[i]);
+            resource->stats->pixelBytes += pixmap.computeByteSize();
+            if ( !context->updateBackendTexture(set[i], &pixmap, 1, kTopLeft_GrSurfaceOrigin) ){
+                return nullptr;
+            }
+        }
+
+        GrYUVABackendTextures textures(info, set, kTopLeft_GrSurfaceOrigin);
+        return SkImages::TextureFromYUVATextures(context, textures, nullptr);
+    }
+
+    sk_sp<SkImage> rasterImage(SkiaResource* resource, int format, int width, int height,
+                               const void* const* planes, const int* strides, int colorSpace){
+        SkImageInfo info = SkImageInfo::Make(width, height, kBGRA_8888_SkColorType, kOpaque_SkAlphaType);
+        if ( fRaster.info() != info ){
+            fRaster.allocPixels(info);
+        }
+
+        const YuvCoefficients& k = kYuvCoefficients[colorSpace];
+        const uint8_t* y = (const uint8_t*)planes[0];
+        for (int row = 0; row < height; row++){
+            const uint8_t* yRow = y + (size_t)row * strides[0];
+            uint32_t* out = fRaster.getAddr32(0, row);
+            if ( format == kYuvI420 ){
+                const uint8_t* uRow = (const uint8_t*)planes[1] + (size_t)(row >> 1) * strides[1];
+                const uint8_t* vRow = (const uint8_t*)planes[2] + (size_t)(row >> 1) * strides[2];
+                convertYuvRow(k, yRow, uRow, vRow, 1, out, width);
+            } else {
+                const uint8_t* uvRow = (const uint8_t*)planes[1] + (size_t)(row >> 1) * strides[1];
+                convertYuvRow(k, yRow, uvRow, uvRow + 1, 2, out, width);
+            }
+        }
+        resource->stats->pixelBytes += (int64_t)width * height * 3 / 2;
+
+        if ( resource->defersDrawing() ){
+            // the buffer is reused next frame, so recorded draws need their own copy
+            return SkImages::RasterFromPixmapCopy(fRaster.pixmap());
+        }
+        return SkImages::RasterFromPixmap(fRaster.pixmap(), nullptr, nullptr);
+    }
+
+    void releaseTextures(){
+        if ( fContext && !fContext->abandoned() && fTextures[0][0].isValid() ){
+            // draws reading the textures have to finish before they're deleted
+            fContext->flushAndSubmit(GrSyncCpu::kYes);
+        }
+        for (auto& set : fTextures){
+            for (GrBackendTexture& texture : set){
+                if ( texture.isValid() && fContext && !fContext->abandoned() ){
+                    fContext->deleteBackendTexture(texture);
+                }
+                texture = GrBackendTexture();
+            }
+        }
+        for (auto& frame : fUploadFrame){
+            frame = {};
+        }
+        fContext.reset();
+    }
+
+    static constexpr int kTextureSets = 2;
+
+    sk_sp<GrDirectContext> fContext;
+    GrBackendTexture fTextures[kTextureSets][SkYUVAInfo::kMaxPlanes];
+    // the set written by the last upload
+    int fCurrent = 0;
+    // the frame, see SkiaResource::frameStart, each set was last written in
+    std::chrono::steady_clock::time_point fUploadFrame[kTextureSets];
+    int fFormat = -1;
+    int fWidth = 0;
+    int fHeight = 0;
+
+    SkBitmap fRaster;
+};
+
+// END YUV VIDEO //
+
+// FRAME SCHEDULER //
+// Paces repaints to the display refresh. Repaint requests from any
+// thread only mark the window dirty; the run loop asks how long it may
+// wait for events and draws at most one frame per refresh period, and
+// only when something was requested. Frames that present after the
+// refresh they were meant for are counted as missed.
+class FrameScheduler {
+public:
+    // wake is called after every request so a run loop blocked waiting
+    // for events notices it, e.g. glfwPostEmptyEvent. May be null.
+    FrameScheduler(double refreshHz, void (*wake)())
+        : fWake(wake){
+        setRefreshRate(refreshHz);
+        fNextSlot = std::chrono::steady_clock::now();
+    }
+
+    void setRefreshRate(double refreshHz){
+        if ( refreshHz <= 0 ){
+            refreshHz = 60;
+        }
+        fPeriod = std::chrono::nanoseconds((int64_t)(1e9 / refreshHz));
+    }
+
+    void request(){
+        fRequests.fetch_add(1, std::memory_order_relaxed);
+        fDirty.store(true, std::memory_order_release);
+        if ( fWake ){
+            fWake();
+        }
+    }
+
+    // Seconds until the next frame should start, or -1 if nothing is dirty.
+    double waitTimeout(){
+        if ( !fDirty.load(std::memory_order_acquire) ){
+            return -1;
+        }
+        auto now = std::chrono::steady_clock::now();
+        if ( now >= fNextSlot ){
+            return 0;
+        }
+        return std::chrono::duration<double>(fNextSlot - now).count();
+    }
+
+    bool beginFrame(){
+        auto now = std::chrono::steady_clock::now();
+        if ( now < fNextSlot || !fDirty.exchange(false, std::memory_order_acq_rel) ){
+            return false;
+        }
+        fFrameStart = now;
+        // stay on the grid of refresh periods unless the loop was idle
+        fSlot = now - fNextSlot < fPeriod ? fNextSlot : now;
+        // the refresh this frame is aiming for
+        fDeadline = fSlot + fPeriod;
+        return true;
+    }
+
+    // Call after the buffers have been swapped.
+    void endFrame(){
+        auto now = std::chrono::steady_clock::now();
+        int64_t frameNanos = std::chrono::duration_cast<std::chrono::nanoseconds>(now - fFrameStart).count();
+
+        fStats.frames++;
+        fStats.lastFrameNanos = frameNanos;
+        fStats.worstFrameNanos = std::max(fStats.worstFrameNanos, frameNanos);
+        // allow for scheduling jitter around the refresh
+        if ( now > fDeadline + fPeriod / 8 ){
+            fStats.missedDeadlines++;
+        }
+
+        // The run loop never waits on the swap, so frames start a period
+        // apart. A frame that ran long pushes the next one back instead of
+        // letting frames bunch up to catch up.
+        fNextSlot = std::max(fSlot + fPeriod, now);
+    }
+
+    void stats(SkiaFrameSchedulerStats* stats){
+        *stats = fStats;
+        stats->requests = fRequests.load(std::memory_order_relaxed);
+        stats->periodNanos = fPeriod.count();
+    }
+
+private:
+    void (*fWake)();
+    std::atomic<bool> fDirty{true};
+    std::atomic<int64_t> fRequests{0};
+    std::chrono::nanoseconds fPeriod;
+    std::chrono::steady_clock::time_point fNextSlot;
+    std::chrono::steady_clock::time_point fFrameStart;
+    std::chrono::steady_clock::time_point fSlot;
+    std::chrono::steady_clock::time_point fDeadline;
+    SkiaFrameSchedulerStats fStats = {};
+};
+
+// END FRAME SCHEDULER //
+
+// DOCUMENT LAYOUT //
+// Lays out long text as one paragraph per line so only what is on
+// screen has to be shaped. Line heights live in a fenwick tree, which
+// maps a scroll offset to a line and back in O(log n). Lines that
+// haven't been laid out yet count with the height of an empty line.
+// Paragraphs far from the last painted region are freed, but their
+// measured heights are kept.
+class DocumentLayout {
+public:
+    DocumentLayout(const ParagraphStyle& style, float width)
+        : fStyle(style),
+          fWidth(width){
+        fFontCollection = sk_make_sp<FontCollection>();
+        fFontCollection->setDefaultFontManager(SkFontMgr_RefDefault());
+        fBuilder = ParagraphBuilder::make(fStyle, fFontCollection);
+        fEstimatedHeight = buildParagraph(std::string())->getHeight();
+    }
+
+    void setText(const char* text, size_t length){
+        fLines.clear();
+        fLive.clear();
+        appendLines(&fLines, text, length);
+        rebuildIndex();
+    }
+
+    // Replaces `count` lines starting at `start` with the lines of
+    // `text`. A null `text` only removes lines.
+    void replaceLines(int start, int count, const char* text, size_t length){
+        start = std::clamp(start, 0, (int)fLines.size());
+        count = std::clamp(count, 0, (int)fLines.size() - start);
+
+        std::vector<Line> lines;
+        if ( text ){
+            appendLines(&lines, text, length);
+        }
+        int added = (int)lines.size();
+
+        if ( added == count ){
+            // edits inside lines keep their heights until laid out again
+            for (int i = 0; i < count; i++){
+                fLines[start + i].text = std::move(lines[i].text);
+                fLines[start + i].paragraph.reset();
+            }
+            // paragraph() adds them back when they are laid out again
+            fLive.erase(std::remove_if(fLive.begin(), fLive.end(), [&](int index){
+                            return index >= start && index < start + count;
+                        }),
+                        fLive.end());
+            return;
+        }
+
+        fLines.erase(fLines.begin() + start, fLines.begin() + start + count);
+        fLines.insert(fLines.begin() + start,
+                      std::make_move_iterator(lines.begin()),
+                      std::make_move_iterator(lines.end()));
+
+        std::vector<int> live;
+        for (int index : fLive){
+            if ( index < start ){
+                live.push_back(index);
+            } else if ( index >= start + count ){
+                live.push_back(index + added - count);
+            }
+        }
+        fLive = std::move(live);
+        rebuildIndex();
+    }
+
+    void setWidth(float width){
+        if ( width == fWidth ){
+            return;
+        }
+        fWidth = width;
+        // old heights stay as estimates so the scroll position doesn't jump
+        for (int index : fLive){
+            fLines[index].paragraph.reset();
+        }
+        fLive.clear();
+    }
+
+    int lineCount(){
+        return (int)fLines.size();
+    }
+
+    float height(){
+        return (float)top((int)fLines.size());
+    }
+
+    // Offset of the top of `line`.
+    double top(int line){
+        return fIndex.start(line);
+    }
+
+    // The line at offset `y`.
+    int lineAt(double y){
+        return fIndex.lineAt(y);
+    }
+
+    // Lays out `line` if needed.
+    Paragraph* paragraph(int line){
+        Line& l = fLines[line];
+        if ( !l.paragraph ){
+            l.paragraph = buildParagraph(l.text);
+            fLive.push_back(line);
+            setHeight(line, l.paragraph->getHeight());
+        }
+        return l.paragraph.get();
+    }
+
+    // Paints the lines that intersect the canvas's clip. Lines within
+    // half a screen of it are laid out too, so scrolling finds them ready.
+    void paint(SkCanvas* canvas, float x, float y){
+        if ( fLines.empty() ){
+            return;
+        }
+        SkRect clip = canvas->getLocalClipBounds();
+        double visibleTop = clip.top() - y;
+        double visibleBottom = clip.bottom() - y;
+        double margin = (visibleBottom - visibleTop) / 2;
+
+        int n = (int)fLines.size();
+        int first = lineAt(std::max(0.0, visibleTop - margin));
+        int last = first;
+        for (int i = first; i < n && top(i) < visibleBottom + margin; i++){
+            paragraph(i);
+            last = i;
+        }
+
+        for (int i = lineAt(std::max(0.0, visibleTop)); i <= last; i++){
+            double lineTop = top(i);
+            if ( lineTop >= visibleBottom ){
+                break;
+            }
+            fLines[i].paragraph->paint(canvas, x, y + (float)lineTop);
+        }
+
+        evict(first, last);
+    }
+
+private:
+    struct Line {
+        std::string text;
+        std::unique_ptr<Paragraph> paragraph;
+        float height = -1;
+    };
+
+    static const int kKeptLines = 512;
+
+    std::unique_ptr<Paragraph> buildParagraph(const std::string& text){
+        fBuilder->Reset();
+        fBuilder->addText(text.data(), text.size());
+        std::unique_ptr<Paragraph> paragraph = fBuilder->Build();
+        paragraph->layout(fWidth);
+        return paragraph;
+    }
+
+    static void appendLines(std::vector<Line>* lines, const char* text, size_t length){
+        size_t start = 0;
+        while (true){
+            const char* newline = (const char*)memchr(text + start, '\n', length - start);
+            size_t end = newline ? newline - text : length;
+            Line line;
+            line.text.assign(text + start, end - start);
+            lines->push_back(std::move(line));
+            if ( !newline ){
+                break;
+            }
+            start = end + 1;
+        }
+    }
+
+    void rebuildIndex(){
+        std::vector<float> heights;
+        heights.reserve(fLines.size());
+        for (Line& line : fLines){
+            if ( line.height < 0 ){
+                line.height = fEstimatedHeight;
+            }
+            heights.push_back(line.height);
+        }
+        fIndex.assign(heights);
+    }
+
+    void setHeight(int line, float height){
+        double delta = height - fLines[line].height;
+        fLines[line].height = height;
+        if ( delta != 0 ){
+            fIndex.add(line, delta);
+        }
+    }
+
+    // Frees paragraphs far outside the last painted lines.
+    void evict(int first, int last){
+        if ( (int)fLive.size() <= (last - first + 1) + 2 * kKeptLines ){
+            return;
+        }
+        std::vector<int> live;
+        for (int index : fLive){
+            if ( index >= first - kKeptLines && index <= last + kKeptLines ){
+                live.push_back(index);
+            } else {
+                fLines[index].paragraph.reset();
+            }
+        }
+        fLive = std::move(live);
+    }
+
+    ParagraphStyle fStyle;
+    float fWidth;
+    sk_sp<FontCollection> fFontCollection;
+    std::unique_ptr<ParagraphBuilder> fBuilder;
+    float fEstimatedHeight;
+
+    std::vector<Line> fLines;
+    // indices of lines that have a paragraph
+    std::vector<int> fLive;
+    LineIndex fIndex;
+};
+
+// END DOCUMENT LAYOUT //
+
+// EDITABLE PARAGRAPH //
+// Styled text that is edited in place. skparagraph shapes a paragraph as
+// a whole, so the text is kept as one paragraph per hard line break and
+// edits only reshape the lines they touch. Lines longer than kChunkBytes
+// are split into chunks that are shaped separately, so an edit in a long
+// line only reshapes its chunk. Changing the width re-breaks the existing
+// paragraphs without shaping them again. Offsets are utf-16 code units,
+// like the skia_Paragraph_ functions.
+//
+// Chunks of a line are placed side by side when the width is unbounded.
+// Otherwise each chunk starts a new row, so a wrapped long line can
+// break early where one chunk ends.
+class EditableParagraph {
+public:
+    // Chunks end after a space near this size when the line has one.
+    static constexpr size_t kChunkBytes = 4096;
+
+    EditableParagraph(const ParagraphStyle& style, float width)
+        : fStyle(style),
+          fWidth(width){
+        fFontCollection = sk_make_sp<FontCollection>();
+        fFontCollection->setDefaultFontManager(SkFontMgr_RefDefault());
+        fBuilder = ParagraphBuilder::make(fStyle, fFontCollection);
+        fBlocks.emplace_back();
+        updateOffsets();
+    }
+
+    // Replaces [from, to) with utf-8 `text`. Text inserted where a style
+    // run ends continues that run, see adjustRuns.
+    void replaceText(int from, int to, const char* text, size_t length){
+        int total = utf16Length();
+        from = std::clamp(from, 0, total);
+        to = std::clamp(to, from, total);
+
+        int first = blockAt(from);
+        int last = blockAt(to);
+        // text inserted where a chunk starts may continue a run of the chunk before
+        if ( from == blockStart(first) && first > 0 && !fBlocks[first - 1].endsLine ){
+            first--;
+        }
+        int blockStart = this->blockStart(first);
+        bool endsLine = fBlocks[last].endsLine;
+
+        // join the touched blocks, edit them and split them up again
+        Block merged = std::move(fBlocks[first]);
+        for (int i = first + 1; i <= last; i++){
+            Block& block = fBlocks[i];
+            if ( fBlocks[i - 1].endsLine ){
+                merged.text += '\n';
+            }
+            size_t offset = merged.text.size();
+            merged.text += block.text;
+            for (StyleRun& run : block.runs){
+                merged.runs.push_back({run.start + offset, run.end + offset, run.style});
+            }
+        }
+        merged.endsLine = endsLine;
+
+        size_t a = utf8Offset(merged.text, from - blockStart);
+        size_t b = utf8Offset(merged.text, to - blockStart);
+        merged.text.replace(a, b - a, text, length);
+        adjustRuns(&merged.runs, a, b, length);
+
+        std::vector<Block> blocks = split(merged);
+        bool sameCount = (int)blocks.size() == last - first + 1;
+        std::vector<int> oldSizes;
+        for (int i = first; sameCount && i <= last; i++){
+            oldSizes.push_back(offsetSize(fBlocks[i]));
+        }
+
+        fBlocks.erase(fBlocks.begin() + first, fBlocks.begin() + last + 1);
+        fBlocks.insert(fBlocks.begin() + first,
+                       std::make_move_iterator(blocks.begin()),
+                       std::make_move_iterator(blocks.end()));
+
+        if ( sameCount ){
+            for (size_t i = 0; i < oldSizes.size(); i++){
+                fOffsets.add(first + (int)i, offsetSize(fBlocks[first + i]) - oldSizes[i]);
+            }
+        } else {
+            updateOffsets();
+        }
+    }
+
+    // Sets the style of [from, to), or restores the default style when
+    // `style` is null.
+    void setStyle(int from, int to, const TextStyle* style){
+        int total = utf16Length();
+        from = std::clamp(from, 0, total);
+        to = std::clamp(to, from, total);
+
+        int last = blockAt(to);
+        for (int i = blockAt(from); i <= last; i++){
+            Block& block = fBlocks[i];
+            int blockStart = this->blockStart(i);
+            int blockEnd = blockStart + block.utf16Length;
+            size_t a = utf8Offset(block.text, std::max(from, blockStart) - blockStart);
+            size_t b = utf8Offset(block.text, std::min(to, blockEnd) - blockStart);
+            if ( a < b ){
+                restyle(&block, a, b, style);
+            }
+        }
+    }
+
+    void setWidth(float width){
+        fWidth = width;
+    }
+
+    float height(){
+        layout();
+        return fHeight;
+    }
+
+    float maxIntrinsicWidth(){
+        layout();
+        return fMaxIntrinsicWidth;
+    }
+
+    void paint(SkCanvas* canvas, float x, float y){
+        layout();
+        SkRect clip = canvas->getLocalClipBounds();
+        for (Block& block : fBlocks){
+            float top = y + block.top;
+            if ( top >= clip.bottom() ){
+                break;
+            }
+            if ( top + block.paragraph->getHeight() > clip.top() ){
+                block.paragraph->paint(canvas, x + block.x, top);
+            }
+        }
+    }
+
+    std::vector<TextBox> rectsForRange(int start, int end, RectHeightStyle heightStyle, RectWidthStyle widthStyle){
+        layout();
+        std::vector<TextBox> boxes;
+        int total = utf16Length();
+        start = std::clamp(start, 0, total);
+        end = std::clamp(end, start, total);
+
+        int last = blockAt(end);
+        for (int i = blockAt(start); i <= last; i++){
+            Block& block = fBlocks[i];
+            int blockStart = this->blockStart(i);
+            int localStart = std::max(start, blockStart) - blockStart;
+            int localEnd = std::min(end, blockStart + block.utf16Length) - blockStart;
+            for (TextBox& box : block.paragraph->getRectsForRange(localStart, localEnd, heightStyle, widthStyle)){
+                box.rect.offset(block.x, block.top);
+                boxes.push_back(box);
+            }
+        }
+        return boxes;
+    }
+
+    PositionWithAffinity positionAt(float dx, float dy){
+        layout();
+        // the last block that starts before `dx` in the last row that starts above `dy`
+        size_t found = 0;
+        for (size_t i = 1; i < fBlocks.size(); i++){
+            Block& block = fBlocks[i];
+            if ( block.top > dy ){
+                break;
+            }
+            if ( block.top != fBlocks[found].top || block.x <= dx ){
+                found = i;
+            }
+        }
+        Block& block = fBlocks[found];
+        PositionWithAffinity position = block.paragraph->getGlyphPositionAtCoordinate(dx - block.x, dy - block.top);
+        position.position += blockStart(found);
+        return position;
+    }
+
+private:
+    struct StyleRun {
+        // utf-8 offsets into the block's text
+        size_t start;
+        size_t end;
+        TextStyle style;
+    };
+
+    // A hard line, or a chunk of one.
+    struct Block {
+        std::string text;
+        // sorted and non overlapping
+        std::vector<StyleRun> runs;
+        std::unique_ptr<Paragraph> paragraph;
+        float layoutWidth = 0;
+        int utf16Length = 0;
+        // false for a chunk that the next block continues
+        bool endsLine = true;
+        // position set by layout
+        float x = 0;
+        float top = 0;
+    };
+
+    // Utf-16 units of `block` including the newline after it. The last
+    // block counts a newline too, see utf16Length.
+    static int offsetSize(const Block& block){
+        return block.utf16Length + (block.endsLine ? 1 : 0);
+    }
+
+    void updateOffsets(){
+        std::vector<float> sizes;
+        sizes.reserve(fBlocks.size());
+        for (const Block& block : fBlocks){
+            sizes.push_back(offsetSize(block));
+        }
+        fOffsets.assign(sizes);
+    }
+
+    int utf16Length(){
+        return (int)fOffsets.start(fOffsets.size()) - 1;
+    }
+
+    int blockStart(int index){
+        return (int)fOffsets.start(index);
+    }
+
+    // The block containing utf-16 offset `offset`. The end of a line
+    // belongs to that line, the end of a chunk to the next chunk.
+    int blockAt(int offset){
+        return fOffsets.lineAt(offset);
+    }
+
+    // Where to end a chunk of `text` that starts at `start` and would be
+    // too long past `limit`: after the last space, or else on a character
+    // boundary.
+    static size_t chunkEnd(const std::string& text, size_t start, size_t limit){
+        size_t space = text.rfind(' ', limit - 1);
+        if ( space != std::string::npos && space > start ){
+            return space + 1;
+        }
+        while ( limit > start + 1 && ((unsigned char)text[limit] & 0xC0) == 0x80 ){
+            limit--;
+        }
+        return limit;
+    }
+
+    static std::vector<Block> split(const Block& merged){
+        struct Piece {
+            size_t start;
+            size_t end;
+            bool endsLine;
+        };
+        std::vector<Piece> pieces;
+        size_t start = 0;
+        while (true){
+            size_t newline = merged.text.find('\n', start);
+            size_t end = newline == std::string::npos ? merged.text.size() : newline;
+
+            while ( end - start > kChunkBytes ){
+                size_t cut = chunkEnd(merged.text, start, start + kChunkBytes);
+                pieces.push_back({start, cut, false});
+                start = cut;
+            }
+            bool endsLine = newline != std::string::npos || merged.endsLine;
+            // an empty chunk would only add an empty row
+            if ( endsLine || end > start ){
+                pieces.push_back({start, end, endsLine});
+            }
+
+            if ( newline == std::string::npos ){
+                break;
+            }
+            start = newline + 1;
+        }
+
+        std::vector<Block> blocks;
+        for (const Piece& piece : pieces){
+            Block block;
+            block.text = merged.text.substr(piece.start, piece.end - piece.start);
+            block.utf16Length = ::utf16Length(block.text);
+            block.endsLine = piece.endsLine;
+            for (const StyleRun& run : merged.runs){
+                size_t runStart = std::max(run.start, piece.start);
+                size_t runEnd = std::min(run.end, piece.end);
+                if ( runStart < runEnd ){
+                    block.runs.push_back({runStart - piece.start, runEnd - piece.start, run.style});
+                }
+            }
+            blocks.push_back(std::move(block));
+        }
+        return blocks;
+    }
+
+    static void restyle(Block* block, size_t a, size_t b, const TextStyle* style){
+        std::vector<StyleRun> runs;
+        for (StyleRun& run : block->runs){
+            if ( run.end <= a || run.start >= b ){
+                runs.push_back(std::move(run));
+                continue;
+            }
+            if ( run.start < a ){
+                runs.push_back({run.start, a, run.style});
+            }
+            if ( run.end > b ){
+                runs.push_back({b, run.end, run.style});
+            }
+        }
+        if ( style ){
+            runs.push_back({a, b, *style});
+        }
+        std::sort(runs.begin(), runs.end(), [](const StyleRun& x, const StyleRun& y){
+            return x.start < y.start;
+        });
+        block->runs = std::move(runs);
+        block->paragraph.reset();
+    }
+
+    // Shapes blocks that changed, re-breaks blocks laid out at another
+    // width and places them.
+    void layout(){
+        bool unbounded = !std::isfinite(fWidth);
+        float top = 0;
+        float rowHeight = 0;
+        float x = 0;
+        float lineWidth = 0;
+        fMaxIntrinsicWidth = 0;
+        for (size_t i = 0; i < fBlocks.size(); i++){
+            Block& block = fBlocks[i];
+            if ( !block.paragraph ){
+                fBuilder->Reset();
+                size_t pos = 0;
+                for (const StyleRun& run : block.runs){
+                    if ( run.start > pos ){
+                        fBuilder->addText(block.text.data() + pos, run.start - pos);
+                    }
+                    fBuilder->pushStyle(run.style);
+                    fBuilder->addText(block.text.data() + run.start, run.end - run.start);
+                    fBuilder->pop();
+                    pos = run.end;
+                }
+                if ( pos < block.text.size() ){
+                    fBuilder->addText(block.text.data() + pos, block.text.size() - pos);
+                }
+                block.paragraph = fBuilder->Build();
+                block.paragraph->layout(fWidth);
+                block.layoutWidth = fWidth;
+            } else if ( block.layoutWidth != fWidth ){
+                block.paragraph->layout(fWidth);
+                block.layoutWidth = fWidth;
+            }
+
+            bool continued = i > 0 && !fBlocks[i - 1].endsLine;
+            if ( !(unbounded && continued) ){
+                top += rowHeight;
+                rowHeight = 0;
+                x = 0;
+            }
+            if ( !continued ){
+                lineWidth = 0;
+            }
+            block.x = x;
+            block.top = top;
+
+            float width = block.paragraph->getMaxIntrinsicWidth();
+            x += width;
+            lineWidth += width;
+            rowHeight = std::max(rowHeight, block.paragraph->getHeight());
+            fMaxIntrinsicWidth = std::max(fMaxIntrinsicWidth, lineWidth);
+        }
+        fHeight = top + rowHeight;
+    }
+
+    ParagraphStyle fStyle;
+    float fWidth;
+    sk_sp<FontCollection> fFontCollection;
+    std::unique_ptr<ParagraphBuilder> fBuilder;
+    std::vector<Block> fBlocks;
+    // utf-16 offsets of the blocks, see offsetSize
+    LineIndex fOffsets;
+    float fHeight = 0;
+    float fMaxIntrinsicWidth = 0;
+};
+
+// END EDITABLE PARAGRAPH //
+
+// PARALLEL LAYOUT //
+// Lays out independent paragraphs on a shared pool of worker threads.
+// FontCollection caches typefaces without locking, so every thread shapes
+// with its own collection, shared by all the paragraphs built on that
+// thread. Builders only record their calls, which lets a paragraph be
+// built and laid out on whichever worker picks it up. Fonts, typefaces
+// and glyph caches are shared by every collection and are thread safe.
+static sk_sp<FontCollection> threadFontCollection(){
+    thread_local sk_sp<FontCollection> collection = []{
+        auto fontCollection = sk_make_sp<FontCollection>();
+        fontCollection->setDefaultFontManager(SkFontMgr_RefDefault());
+        return fontCollection;
+    }();
+    return collection;
+}
+
+static SkExecutor& layoutExecutor(){
+    static std::unique_ptr<SkExecutor> executor =
+        SkExecutor::MakeFIFOThreadPool(std::max(1u, std::thread::hardware_concurrency()));
+    return *executor;
+}
+
+class ParagraphRecorder {
+public:
+    ParagraphRecorder(const ParagraphStyle& style)
+        : fStyle(style){}
+
+    void pushStyle(const TextStyle& style){
+        fOps.push_back({Op::kPushStyle, fStyles.size(), 0});
+        fStyles.push_back(style);
+    }
+
+    void pop(){
+        fOps.push_back({Op::kPop, 0, 0});
+    }
+
+    void addText(const char* text, size_t length){
+        fOps.push_back({Op::kText, fText.size(), length});
+        fText.append(text, length);
+    }
+
+    void addPlaceholder(const PlaceholderStyle& style){
+        fOps.push_back({Op::kPlaceholder, fPlaceholders.size(), 0});
+        fPlaceholders.push_back(style);
+    }
+
+    void reset(){
+        fOps.clear();
+        fStyles.clear();
+        fPlaceholders.clear();
+        fText.clear();
+    }
+
+    // Shapes with the calling thread's font collection, so the paragraph
+    // should be laid out on the thread that built it.
+    std::unique_ptr<Paragraph> build() const {
+        auto builder = ParagraphBuilder::make(fStyle, threadFontCollection());
+        for (const Op& op : fOps){
+            switch ( op.kind ){
+            case Op::kPushStyle:
+                builder->pushStyle(fStyles[op.index]);
+                break;
+            case Op::kPop:
+                builder->pop();
+                break;
+            case Op::kText:
+                builder->addText(fText.data() + op.index, op.length);
+                break;
+            case Op::kPlaceholder:
+                builder->addPlaceholder(fPlaceholders[op.index]);
+                break;
+            }
+        }
+        return builder->Build();
+    }
+
+private:
+    struct Op {
+        enum Kind { kPushStyle, kPop, kText, kPlaceholder } kind;
+        // into fStyles, fPlaceholders or fText
+        size_t index;
+        size_t length;
+    };
+
+    ParagraphStyle fStyle;
+    std::vector<Op> fOps;
+    std::vector<TextStyle> fStyles;
+    std::vector<PlaceholderStyle> fPlaceholders;
+    std::string fText;
+};
+
+// Builds and lays out each recorded paragraph. Writes the paragraphs to
+// `paragraphs` and the height and max intrinsic width of each to `metrics`.
+static void layoutParagraphs(const ParagraphRecorder* const* recorders, const float* widths, int count,
+                             Paragraph** paragraphs, float* metrics){
+    auto layoutOne = [&](int i){
+        std::unique_ptr<Paragraph> paragraph = recorders[i]->build();
+        paragraph->layout(widths[i]);
+        metrics[i*2+0] = paragraph->getHeight();
+        metrics[i*2+1] = paragraph->getMaxIntrinsicWidth();
+        paragraphs[i] = paragraph.release();
+    };
+
+    int helpers = std::min(count, (int)std::thread::hardware_concurrency()) - 1;
+    if ( helpers <= 0 ){
+        for (int i = 0; i < count; i++){
+            layoutOne(i);
+        }
+        return;
+    }
+
+    std::atomic<int> next{0};
+    auto work = [&]{
+        for (int i = next++; i < count; i = next++){
+            layoutOne(i);
+        }
+    };
+
+    std::mutex mutex;
+    std::condition_variable done;
+    int running = helpers;
+    for (int h = 0; h < helpers; h++){
+        layoutExecutor().add([&]{
+            work();
+            std::lock_guard<std::mutex> lock(mutex);
+            if ( --running == 0 ){
+                done.notify_one();
+            }
+        });
+    }
+
+    // the calling thread helps out while it waits
+    work();
+    std::unique_lock<std::mutex> lock(mutex);
+    done.wait(lock, [&]{ return running == 0; });
+}
+
+// END PARALLEL LAYOUT //
+
+// ANIMATED IMAGE //
+// Animated gif/webp/apng images decoded a frame at a time. Decoding
+// happens on a worker ahead of display, and only the last few frames are
+// kept. A frame that builds on an earlier one is decoded on top of a
+// copy of that frame's pixels instead of from the start of the animation.
+static SkExecutor& decodeExecutor(){
+    static std::unique_ptr<SkExecutor> executor = SkExecutor::MakeFIFOThreadPool(2);
+    return *executor;
+}
+
+class AnimatedImageDecoder : public std::enable_shared_from_this<AnimatedImageDecoder> {
+public:
+    static constexpr size_t kMaxCachedFrames = 4;
+
+    AnimatedImageDecoder(std::unique_ptr<SkCodec> codec)
+        : fCodec(std::move(codec)),
+          fFrames(fCodec->getFrameInfo()){
+        fInfo = fCodec->getInfo().makeColorType(kN32_SkColorType).makeAlphaType(kPremul_SkAlphaType);
+        if ( fFrames.empty() ){
+            // still images have no frame info
+            SkCodec::FrameInfo frame = {};
+            frame.fRequiredFrame = SkCodec::kNoFrame;
+            fFrames.push_back(frame);
+        }
+    }
+
+    const SkImageInfo& info() const { return fInfo; }
+    int frameCount() const { return fFrames.size(); }
+    int repetitionCount() { return fCodec->getRepetitionCount(); }
+    int frameDuration(int frame) const { return fFrames[frame].fDuration; }
+
+    // The frame showing `ms` milliseconds into the animation.
+    int frameAt(double ms) const {
+        double total = 0;
+        for (const SkCodec::FrameInfo& frame : fFrames){
+            total += frame.fDuration;
+        }
+        if ( total <= 0 || ms <= 0 ){
+            return 0;
+        }
+        double loops = std::floor(ms / total);
+        int repetitions = fCodec->getRepetitionCount();
+        if ( repetitions != SkCodec::kRepetitionCountInfinite && loops > repetitions ){
+            return fFrames.size() - 1;
+        }
+        double t = ms - loops * total;
+        for (size_t i = 0; i < fFrames.size(); i++){
+            t -= fFrames[i].fDuration;
+            if ( t < 0 ){
+                return i;
+            }
+        }
+        return fFrames.size() - 1;
+    }
+
+    // Returns the frame if it has been decoded.
+    sk_sp<SkImage> cachedFrame(int frame){
+        std::lock_guard<std::mutex> lock(fCacheMutex);
+        for (auto it = fCache.begin(); it != fCache.end(); ++it){
+            if ( it->first == frame ){
+                // most recently used at the front
+                std::rotate(fCache.begin(), it, it + 1);
+                return fCache.front().second;
+            }
+        }
+        return nullptr;
+    }
+
+    sk_sp<SkImage> decodeNow(int frame){
+        std::lock_guard<std::mutex> lock(fCodecMutex);
+        return decode(frame);
+    }
+
+    // Decodes `frame` on a worker unless it is already cached. Only the
+    // latest request is kept while a decode is running.
+    void prefetch(int frame){
+        {
+            std::lock_guard<std::mutex> lock(fCacheMutex);
+            for (auto& [index, image] : fCache){
+                if ( index == frame ){
+                    return;
+                }
+            }
+            fWanted = frame;
+            if ( fDecoding ){
+                return;
+            }
+            fDecoding = true;
+        }
+
+        auto self = shared_from_this();
+        decodeExecutor().add([self](){
+            while (true){
+                int frame;
+                {
+                    std::lock_guard<std::mutex> lock(self->fCacheMutex);
+                    if ( self->fWanted < 0 ){
+                        self->fDecoding = false;
+                        return;
+                    }
+                    frame = self->fWanted;
+                    self->fWanted = -1;
+                }
+                self->decodeNow(frame);
+            }
+        });
+    }
+
+private:
+    // Callers hold fCodecMutex. SkCodec is not thread safe.
+    sk_sp<SkImage> decode(int frame){
+        // walk back to the nearest cached frame, or one that needs no
+        // prior frame, then decode forward from there
+        std::vector<int> chain;
+        sk_sp<SkImage> image;
+        for (int i = frame; !(image = cachedFrame(i)); i = fFrames[i].fRequiredFrame){
+            chain.push_back(i);
+            if ( fFrames[i].fRequiredFrame == SkCodec::kNoFrame ){
+                break;
+            }
+        }
+        for (auto it = chain.rbegin(); it != chain.rend(); ++it){
+            image = decodeFrame(*it, image.get());
+            if ( !image ){
+                return nullptr;
+            }
+        }
+        return image;
+    }
+
+    // Decodes `frame` on top of `prior`, the frame it requires, or from
+    // scratch if it requires none.
+    sk_sp<SkImage> decodeFrame(int frame, SkImage* prior){
+        SkBitmap bitmap;
+        if ( !bitmap.tryAllocPixels(fInfo) ){
+            return nullptr;
+        }
+
+        SkCodec::Options options;
+        options.fFrameIndex = frame;
+        if ( prior ){
+            if ( !prior->readPixels(nullptr, bitmap.pixmap(), 0, 0) ){
+                return nullptr;
+            }
+            options.fPriorFrame = fFrames[frame].fRequiredFrame;
+        }
+
+        SkCodec::Result result = fCodec->getPixels(fInfo, bitmap.getPixels(), bitmap.rowBytes(), &options);
+        if ( result != SkCodec::kSuccess && result != SkCodec::kIncompleteInput && result != SkCodec::kErrorInInput ){
+            return nullptr;
+        }
+
+        bitmap.setImmutable();
+        sk_sp<SkImage> image = SkImages::RasterFromBitmap(bitmap);
+
+        std::lock_guard<std::mutex> lock(fCacheMutex);
+        fCache.insert(fCache.begin(), {frame, image});
+        if ( fCache.size() > kMaxCachedFrames ){
+            fCache.pop_back();
+        }
+        return image;
+    }
+
+    std::mutex fCodecMutex;
+    std::unique_ptr<SkCodec> fCodec;
+    std::vector<SkCodec::FrameInfo> fFrames;
+    SkImageInfo fInfo;
+
+    std::mutex fCacheMutex;
+    // most recently used first
+    std::vector<std::pair<int, sk_sp<SkImage>>> fCache;
+    int fWanted = -1;
+    bool fDecoding = false;
+};
+
+class AnimatedImage {
+public:
+    static AnimatedImage* Make(sk_sp<SkData> data){
+        if ( !data ){
+            return nullptr;
+        }
+        std::unique_ptr<SkCodec> codec = SkCodec::MakeFromData(std::move(data));
+        if ( !codec ){
+            return nullptr;
+        }
+        return new AnimatedImage(std::make_shared<AnimatedImageDecoder>(std::move(codec)));
+    }
+
+    AnimatedImageDecoder* decoder() { return fDecoder.get(); }
+
+    // Draws `frame`, or the last frame drawn while `frame` is still being
+    // decoded, and starts decoding the frame after it.
+    void draw(SkCanvas* canvas, int frame, const SkRect& dst, const SkPaint* paint){
+        frame = std::clamp(frame, 0, fDecoder->frameCount() - 1);
+
+        sk_sp<SkImage> image = fDecoder->cachedFrame(frame);
+        if ( image ){
+            fShown = image;
+        } else if ( !fShown ){
+            // nothing to show yet
+            fShown = fDecoder->decodeNow(frame);
+        } else {
+            fDecoder->prefetch(frame);
+        }
+
+        if ( fDecoder->frameCount() > 1 ){
+            fDecoder->prefetch((frame + 1) % fDecoder->frameCount());
+        }
+
+        if ( fShown ){
+            canvas->drawImageRect(fShown, dst, SkSamplingOptions(), paint);
+        }
+    }
+
+private:
+    AnimatedImage(std::shared_ptr<AnimatedImageDecoder> decoder)
+        : fDecoder(std::move(decoder)){}
+
+    // shared with decodes still running on a worker
+    std::shared_ptr<AnimatedImageDecoder> fDecoder;
+    sk_sp<SkImage> fShown;
+};
+
+// END ANIMATED IMAGE //
+
+// FRAME ARENA //
+// Bump allocator for short lived objects made while drawing a frame, like
+// the styles and builders used to build a paragraph. Everything is
+// destroyed at once when the frame ends and the blocks are reused.
+//
+// In debug mode, a finished frame's blocks are never reused. Instead they
+// are made inaccessible, so using an object after its frame crashes
+// right where it is used rather than corrupting a later frame.
+static std::atomic<bool> g_frame_arena_debug{false};
+
+class FrameArena {
+public:
+    static constexpr size_t kBlockSize = 64 * 1024;
+    // debug mode keeps this many retired blocks mapped before unmapping
+    static constexpr size_t kMaxRetiredBlocks = 256;
+
+    ~FrameArena(){
+        reset();
+        for (Block& block : fBlocks){
+            unmapBlock(block);
+        }
+        for (Block& block : fRetired){
+            unmapBlock(block);
+        }
+    }
+
+    template <typename T, typename... Args>
+    T* make(Args&&... args){
+        void* p = allocate(sizeof(T), alignof(T));
+        T* t = new (p) T(std::forward<Args>(args)...);
+        if ( !std::is_trivially_destructible<T>::value ){
+            fDestructors.push_back({[](void* o){ static_cast<T*>(o)->~T(); }, t});
+        }
+        return t;
+    }
+
+    // Takes ownership of an object that can't be constructed in place.
+    template <typename T>
+    T* adopt(std::unique_ptr<T> object){
+        return make<std::unique_ptr<T>>(std::move(object))->get();
+    }
+
+    void reset(){
+        for (auto it = fDestructors.rbegin(); it != fDestructors.rend(); ++it){
+            it->first(it->second);
+        }
+        fDestructors.clear();
+
+        if ( g_frame_arena_debug ){
+            for (size_t i = 0; i < fBlocks.size(); i++){
+                if ( i < fBlock || (i == fBlock && fUsed > 0) ){
+                    retireBlock(fBlocks[i]);
+                } else {
+                    unmapBlock(fBlocks[i]);
+                }
+            }
+            fBlocks.clear();
+            while ( fRetired.size() > kMaxRetiredBlocks ){
+                unmapBlock(fRetired.front());
+                fRetired.pop_front();
+            }
+        }
+        fBlock = 0;
+        fUsed = 0;
+    }
+
+private:
+    struct Block {
+        char* data;
+        size_t size;
+    };
+
+    void* allocate(size_t size, size_t align){
+        while ( fBlock < fBlocks.size() ){
+            Block& block = fBlocks[fBlock];
+            size_t start = (fUsed + align - 1) & ~(align - 1);
+            if ( start + size <= block.size ){
+                fUsed = start + size;
+                return block.data + start;
+            }
+            fBlock++;
+            fUsed = 0;
+        }
+
+        size_t blockSize = std::max(kBlockSize, (size + align + 4095) & ~(size_t)4095);
+        void* data = mapBlock(blockSize);
+        fBlocks.push_back({(char*)data, blockSize});
+        fBlock = fBlocks.size() - 1;
+        fUsed = size;
+        return data;
+    }
+
+    // Blocks are mapped directly on posix so debug mode can protect them.
+    static void* mapBlock(size_t size){
+#ifdef MEMBRANE_HAS_POSIX
+        void* data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if ( data == MAP_FAILED ){
+            SK_ABORT("FrameArena: could not map %zu bytes", size);
+        }
+#else
+        void* data = sk_malloc_throw(size);
+#endif
+        return data;
+    }
+
+    static void unmapBlock(const Block& block){
+#ifdef MEMBRANE_HAS_POSIX
+        munmap(block.data, block.size);
+#else
+        sk_free(block.data);
+#endif
+    }
+
+    // Keeps a used block around so stale pointers into it fault.
+    // Without mprotect the block is released instead.
+    void retireBlock(const Block& block){
+#ifdef MEMBRANE_HAS_POSIX
+        mprotect(block.data, block.size, PROT_NONE);
+        fRetired.push_back(block);
+#else
+        unmapBlock(block);
+#endif
+    }
+
+    std::vector<Block> fBlocks;
+    size_t fBlock = 0;
+    size_t fUsed = 0;
+    std::vector<std::pair<void (*)(void*), void*>> fDestructors;
+    std::deque<Block> fRetired;
+};
+
+SkiaResource::~SkiaResource(){
+    captureCanvas.reset();
+    hitCanvas.reset();
+    captureRecorder.reset();
+    delete frameArena;
+    grContext.reset();
+    surface.reset();
+}
+
+FrameArena* SkiaResource::getFrameArena(){
+    if ( !frameArena ){
+        frameArena = new FrameArena();
+    }
+    return frameArena;
+}
+
+void SkiaResource::endFrame(){
+    if ( frameArena ){
+        frameArena->reset();
+    }
+}
+
+// END FRAME ARENA //
+
+// HIT INDEX //
+// Optional spatial index of what was drawn. While an index is attached
+// to a resource, draws made inside skia_save_id record their device
+// space bounds under the innermost id. The bounds are bulk loaded into
+// an r-tree when the frame is finished, so a hit test doesn't have to
+// walk the component tree.
+class HitIndex {
+public:
+    struct Entry {
+        SkRect bounds;
+        int64_t id;
+    };
+
+    void beginFrame(){
+        fRecording.clear();
+    }
+
+    void add(const SkRect& bounds, int64_t id){
+        fRecording.push_back({bounds, id});
+    }
+
+    void endFrame(){
+        std::swap(fEntries, fRecording);
+        fRecording.clear();
+        fTree.reset();
+    }
+
+    // Writes the ids of entries intersecting `query`, topmost first and
+    // without duplicates. `exact` also requires containing the query's
+    // top left, for point queries.
+    int query(const SkRect& query, bool exact, int64_t* ids, int maxIds){
+        if ( fEntries.empty() ){
+            return 0;
+        }
+        if ( !fTree ){
+            std::vector<SkRect> bounds;
+            bounds.reserve(fEntries.size());
+            for (const Entry& entry : fEntries){
+                bounds.push_back(entry.bounds);
+            }
+            fTree = SkRTreeFactory()();
+            fTree->insert(bounds.data(), bounds.size());
+        }
+
+        fResults.clear();
+        fTree->search(query, &fResults);
+        // entries are in draw order
+        std::sort(fResults.begin(), fResults.end(), std::greater<int>());
+
+        int count = 0;
+        for (int index : fResults){
+            const Entry& entry = fEntries[index];
+            if ( exact && !entry.bounds.contains(query.left(), query.top()) ){
+                continue;
+            }
+            if ( std::find(ids, ids + count, entry.id) != ids + count ){
+                continue;
+            }
+            ids[count++] = entry.id;
+            if ( count == maxIds ){
+                break;
+            }
+        }
+        return count;
+    }
+
+private:
+    std::vector<Entry> fRecording;
+    std::vector<Entry> fEntries;
+    sk_sp<SkBBoxHierarchy> fTree;
+    std::vector<int> fResults;
+};
+
+namespace {
+
+// Forwards every op to the target canvas and adds its device bounds to
+// the hit index.
+class HitRecordingCanvas : public SkNWayCanvas {
+public:
+    HitRecordingCanvas(SkCanvas* target, HitIndex* index)
+        : SkNWayCanvas(target->imageInfo().width(), target->imageInfo().height()),
+          fIndex(index){
+        this->addCanvas(target);
+        this->setMatrix(target->getLocalToDevice());
+    }
+
+    // Tags draws until the current save is restored.
+    void pushId(int64_t id){
+        hasId();
+        fIds.push_back({this->getSaveCount(), id});
+    }
+
+protected:
+
+    void onDrawPaint(const SkPaint& paint) override {
+        if ( hasId() ){
+            addDevice(SkRect::Make(this->getDeviceClipBounds()));
+        }
+        SkNWayCanvas::onDrawPaint(paint);
+    }
+    void onDrawPoints(PointMode mode, size_t count, const SkPoint pts[], const SkPaint& paint) override {
+        if ( count > 0 && hasId() ){
+            SkRect bounds;
+            bounds.setBounds(pts, (int)count);
+            add(bounds, &paint);
+        }
+        SkNWayCanvas::onDrawPoints(mode, count, pts, paint);
+    }
+    void onDrawRect(const SkRect& rect, const SkPaint& paint) override {
+        add(rect, &paint);
+        SkNWayCanvas::onDrawRect(rect, paint);
+    }
+    void onDrawRegion(const SkRegion& region, const SkPaint& paint) override {
+        add(SkRect::Make(region.getBounds()), &paint);
+        SkNWayCanvas::onDrawRegion(region, paint);
+    }
+    void onDrawOval(const SkRect& rect, const SkPaint& paint) override {
+        add(rect, &paint);
+        SkNWayCanvas::onDrawOval(rect, paint);
+    }
+    void onDrawArc(const SkRect& rect, SkScalar startAngle, SkScalar sweepAngle, bool useCenter, const SkPaint& paint) override {
+        add(rect, &paint);
+        SkNWayCanvas::onDrawArc(rect, startAngle, sweepAngle, useCenter, paint);
+    }
+    void onDrawRRect(const SkRRect& rrect, const SkPaint& paint) override {
+        add(rrect.getBounds(), &paint);
+        SkNWayCanvas::onDrawRRect(rrect, paint);
+    }
+    void onDrawDRRect(const SkRRect& outer, const SkRRect& inner, const SkPaint& paint) override {
+        add(outer.getBounds(), &paint);
+        SkNWayCanvas::onDrawDRRect(outer, inner, paint);
+    }
+    void onDrawPath(const SkPath& path, const SkPaint& paint) override {
+        if ( !path.isInverseFillType() ){
+            add(path.getBounds(), &paint);
+        } else if ( hasId() ){
+            addDevice(SkRect::Make(this->getDeviceClipBounds()));
+        }
+        SkNWayCanvas::onDrawPath(path, paint);
+    }
+    void onDrawImage2(const SkImage* image, SkScalar x, SkScalar y,
+                      const SkSamplingOptions& sampling, const SkPaint* paint) override {
+        add(SkRect::MakeXYWH(x, y, image->width(), image->height()), paint);
+        SkNWayCanvas::onDrawImage2(image, x, y, sampling, paint);
+    }
+    void onDrawImageRect2(const SkImage* image, const SkRect& src, const SkRect& dst,
+                          const SkSamplingOptions& sampling, const SkPaint* paint,
+                          SrcRectConstraint constraint) override {
+        add(dst, paint);
+        SkNWayCanvas::onDrawImageRect2(image, src, dst, sampling, paint, constraint);
+    }
+    void onDrawImageLattice2(const SkImage* image, const Lattice& lattice, const SkRect& dst,
+                             SkFilterMode filter, const SkPaint* paint) override {
+        add(dst, paint);
+        SkNWayCanvas::onDrawImageLattice2(image, lattice, dst, filter, paint);
+    }
+    void onDrawVerticesObject(const SkVertices* vertices, SkBlendMode mode, const SkPaint& paint) override {
+        add(vertices->bounds(), &paint);
+        SkNWayCanvas::onDrawVerticesObject(vertices, mode, paint);
+    }
+    void onDrawTextBlob(const SkTextBlob* blob, SkScalar x, SkScalar y, const SkPaint& paint) override {
+        add(blob->bounds().makeOffset(x, y), &paint);
+        SkNWayCanvas::onDrawTextBlob(blob, x, y, paint);
+    }
+    void onDrawGlyphRunList(const sktext::GlyphRunList& glyphRunList, const SkPaint& paint) override {
+        add(glyphRunList.sourceBounds().makeOffset(glyphRunList.origin()), &paint);
+        SkNWayCanvas::onDrawGlyphRunList(glyphRunList, paint);
+    }
+    void onDrawPicture(const SkPicture* picture, const SkMatrix* matrix, const SkPaint* paint) override {
+        if ( hasId() ){
+            SkRect bounds = picture->cullRect();
+            if ( matrix ){
+                bounds = matrix->mapRect(bounds);
+            }
+            add(bounds, paint);
+        }
+        SkNWayCanvas::onDrawPicture(picture, matrix, paint);
+    }
+
+private:
+    struct Id {
+        int saveCount;
+        int64_t id;
+    };
+
+    // Saves that haven't changed the matrix or clip yet are deferred and
+    // never reach willRestore, so ids are dropped by comparing save counts.
+    bool hasId(){
+        int saveCount = this->getSaveCount();
+        while ( !fIds.empty() && fIds.back().saveCount > saveCount ){
+            fIds.pop_back();
+        }
+        return !fIds.empty();
+    }
+
+    void add(const SkRect& localBounds, const SkPaint* paint){
+        if ( !hasId() ){
+            return;
+        }
+        SkRect bounds = localBounds;
+        if ( paint ){
+            if ( !paint->canComputeFastBounds() ){
+                addDevice(SkRect::Make(this->getDeviceClipBounds()));
+                return;
+            }
+            SkRect storage;
+            bounds = paint->computeFastBounds(localBounds, &storage);
+        }
+        addDevice(this->getLocalToDeviceAs3x3().mapRect(bounds));
+    }
+
+    void addDevice(SkRect bounds){
+        if ( bounds.intersect(SkRect::Make(this->getDeviceClipBounds())) ){
+            fIndex->add(bounds, fIds.back().id);
+        }
+    }
+
+    HitIndex* fIndex;
+    std::vector<Id> fIds;
+};
+
+void beginHitRecording(SkiaResource* resource){
+    if ( !resource->hitIndex ){
+        return;
+    }
+    SkCanvas* target = resource->frameCanvas ? resource->frameCanvas : resource->surface->getCanvas();
+    resource->hitIndex->beginFrame();
+    resource->hitCanvas.reset(new HitRecordingCanvas(target, resource->hitIndex));
+}
+
+void finishHitRecording(SkiaResource* resource){
+    if ( resource->hitCanvas ){
+        resource->hitCanvas.reset();
+        resource->hitIndex->endFrame();
+    }
+}
+
+}  // namespace
+
+// END HIT INDEX //
+
+namespace {
+
+// Tees drawing into a picture recorder in addition to the surface.
+void beginCapture(SkiaResource* resource){
+    SkCanvas* surfaceCanvas = resource->getTargetCanvas();
+    int width = resource->surface->width();
+    int height = resource->surface->height();
+
+    resource->captureRecorder.reset(new SkPictureRecorder());
+    SkCanvas* recordingCanvas = resource->captureRecorder->beginRecording(SkRect::MakeIWH(width, height));
+
+    resource->captureCanvas.reset(new SkNWayCanvas(width, height));
+    resource->captureCanvas->addCanvas(surfaceCanvas);
+    resource->captureCanvas->addCanvas(recordingCanvas);
+    // carry over the content scale set by skia_reshape
+    resource->captureCanvas->setMatrix(surfaceCanvas->getLocalToDevice());
+}
+
+sk_sp<SkData> serializeCaptureImage(SkImage* image, void* ctx){
+    if ( sk_sp<SkData> encoded = image->refEncodedData() ){
+        return encoded;
+    }
+    return SkPngEncoder::Encode((GrDirectContext*)ctx, image, SkPngEncoder::Options());
+}
+
+sk_sp<SkData> serializeCaptureTypeface(SkTypeface* typeface, void* ctx){
+    return typeface->serialize(SkTypeface::SerializeBehavior::kDoIncludeData);
+}
+
+void finishCapture(SkiaResource* resource){
+    resource->captureCanvas.reset();
+    sk_sp<SkPicture> picture = resource->captureRecorder->finishRecordingAsPicture();
+    resource->captureRecorder.reset();
+
+    SkSerialProcs procs;
+    procs.fImageProc = serializeCaptureImage;
+    procs.fImageCtx = resource->grContext.get();
+    procs.fTypefaceProc = serializeCaptureTypeface;
+
+    sk_sp<SkData> data = picture->serialize(&procs);
+    SkFILEWStream out(resource->capturePath.c_str());
+    if ( !data || !out.isValid() || !out.write(data->data(), data->size()) ){
+        SkDebugf("Could not write frame capture to %s\n", resource->capturePath.c_str());
+    }
+    resource->capturePath.clear();
+}
+
+// True if every pixel in a 32 bit pixmap has an alpha of 0xff.
+bool isOpaque32(const SkPixmap& pixmap){
+    typedef uint32_t Lanes __attribute__((vector_size(16)));
+    const uint32_t alphaMask = 0xff000000;
+    int width = pixmap.width();
+    for (int y = 0; y < pixmap.height(); y++){
+        const uint32_t* row = pixmap.addr32(0, y);
+        Lanes acc = {alphaMask, alphaMask, alphaMask, alphaMask};
+        int x = 0;
+        for (; x + 16 <= width; x += 16){
+            Lanes a, b, c, d;
+            memcpy(&a, row + x, sizeof(a));
+            memcpy(&b, row + x + 4, sizeof(b));
+            memcpy(&c, row + x + 8, sizeof(c));
+            memcpy(&d, row + x + 12, sizeof(d));
+            acc &= a & b & c & d;
+        }
+        uint32_t rest = alphaMask;
+        for (; x < width; x++){
+            rest &= row[x];
+        }
+        if ( ((acc[0] & acc[1] & acc[2] & acc[3] & rest) & alphaMask) != alphaMask ){
+            return false;
+        }
+    }
+    return true;
+}
+
+// Copies BGRA pixels into the surface. Pixels that are opaque, either
+// because the caller says so or because a scan finds them opaque, are
+// tagged opaque so skia copies them without premultiplying. Only
+// unpremultiplied pixels are scanned; premultiplied ones are copied
+// as is either way.
+void writeBGRA(SkiaResource* resource, const SkPixmap& pixmap, int x, int y, SkAlphaType alphaType, bool opaqueHint){
+    SkAlphaType effective = alphaType;
+    if ( opaqueHint || (alphaType == kUnpremul_SkAlphaType && isOpaque32(pixmap)) ){
+        effective = kOpaque_SkAlphaType;
+    }
+    SkPixmap tagged(pixmap.info().makeAlphaType(effective), pixmap.addr(), pixmap.rowBytes());
+    resource->stats->pixelBytes += (int64_t)pixmap.width() * pixmap.height() * 4;
+
+    // Recordings have no pixels to write into, so they get the write as
+    // an unscaled copy of the pixels.
+    auto drawCopy = [&](SkCanvas* canvas){
+        SkPaint paint;
+        paint.setBlendMode(SkBlendMode::kSrc);
+        canvas->save();
+        canvas->resetMatrix();
+        canvas->drawImage(SkImages::RasterFromPixmapCopy(tagged), x, y, SkSamplingOptions(), &paint);
+        canvas->restore();
+    };
+    if ( resource->frameCanvas ){
+        // also reaches a frame capture through getCanvas
+        drawCopy(resource->getCanvas());
+        return;
+    }
+    resource->surface->writePixels(tagged, x, y);
+    if ( resource->captureRecorder ){
+        drawCopy(resource->captureRecorder->getRecordingCanvas());
+    }
+}
+
+void countImageDraw(SkiaResource* resource, SkImage* image){
+    SkiaFrameStats* stats = resource->stats;
+    stats->drawImageCalls++;
+    if ( image->isLazyGenerated() ){
+        stats->lazyImageDraws++;
+    }
+    if ( resource->surface->recordingContext() && !image->isTextureBacked() ){
+        stats->imageUploads++;
+    }
+}
+
+}  // namespace
+
+// MEMORY PRESSURE //
+// Memory pressure can be reported from any thread, but gpu resources can
+// only be freed on the thread that owns their gl context. Notifications
+// just raise a pending level that the run loop takes and applies to each
+// window with skia_handle_memory_pressure.
+namespace {
+
+enum MemoryPressureLevel {
+    kMemoryPressureNone = 0,
+    kMemoryPressureModerate = 1,
+    kMemoryPressureCritical = 2,
+};
+
+std::atomic<int> g_memory_pressure{kMemoryPressureNone};
+
+void notifyMemoryPressure(int level){
+    int pending = g_memory_pressure.load(std::memory_order_relaxed);
+    while ( pending < level &&
+            !g_memory_pressure.compare_exchange_weak(pending, level, std::memory_order_relaxed) ){
+    }
+    if ( level >= kMemoryPressureCritical ){
+        // cpu side caches are thread safe
+        SkGraphics::PurgeResourceCache();
+        SkGraphics::PurgeFontCache();
+    }
+}
+
+#if defined(__linux__)
+// Reads the share of the last 10 seconds, in percent, that some and
+// all tasks stalled on memory.
+bool readMemoryPressure(double* some, double* full){
+    FILE* fp = fopen("/proc/pressure/memory", "re");
+    if ( !fp ){
+        return false;
+    }
+    char kind[8];
+    double avg10;
+    int found = 0;
+    while ( fscanf(fp, "%7s avg10=%lf %*[^\n]", kind, &avg10) == 2 ){
+        if ( strcmp(kind, "some") == 0 ){
+            *some = avg10;
+            found |= 1;
+        } else if ( strcmp(kind, "full") == 0 ){
+            *full = avg10;
+            found |= 2;
+        }
+    }
+    fclose(fp);
+    return found == 3;
+}
+
+// Used when triggers can't be created, e.g. by kernels that only allow
+// privileged processes to make them. Same thresholds as the triggers.
+void pollMemoryPressure(){
+    std::thread([]{
+        double some, full;
+        while ( readMemoryPressure(&some, &full) ){
+            if ( full >= 10 ){
+                notifyMemoryPressure(kMemoryPressureCritical);
+            } else if ( some >= 15 ){
+                notifyMemoryPressure(kMemoryPressureModerate);
+            }
+            std::this_thread::sleep_for(std::chrono::seconds(2));
+        }
+    }).detach();
+}
+
+// Watches /proc/pressure/memory. Stalls where some tasks wait on memory
+// for 15% of the time are moderate, stalls where all of them do for 10%
+// are critical. Unprivileged triggers need a window that is a multiple
+// of 2s.
+bool watchMemoryPressure(){
+    const char* triggers[] = {"some 300000 2000000", "full 200000 2000000"};
+    struct pollfd fds[2];
+    for (int i = 0; i < 2; i++){
+        fds[i].fd = open("/proc/pressure/memory", O_RDWR | O_NONBLOCK | O_CLOEXEC);
+        fds[i].events = POLLPRI;
+        if ( fds[i].fd < 0 || write(fds[i].fd, triggers[i], strlen(triggers[i]) + 1) < 0 ){
+            for (int j = 0; j <= i; j++){
+                if ( fds[j].fd >= 0 ){
+                    close(fds[j].fd);
+                }
+            }
+            double some, full;
+            if ( !readMemoryPressure(&some, &full) ){
+                return false;
+            }
+            pollMemoryPressure();
+            return true;
+        }
+    }
+
+    std::thread([fds]() mutable {
+        while (true){
+            int n = poll(fds, 2, -1);
+            if ( n < 0 ){
+                if ( errno == EINTR ){
+                    continue;
+                }
+                break;
+            }
+            if ( (fds[0].revents | fds[1].revents) & POLLERR ){
+                break;
+            }
+            if ( fds[1].revents & POLLPRI ){
+                notifyMemoryPressure(kMemoryPressureCritical);
+            } else if ( fds[0].revents & POLLPRI ){
+                notifyMemoryPressure(kMemoryPressureModerate);
+            }
+        }
+        close(fds[0].fd);
+        close(fds[1].fd);
+    }).detach();
+    return true;
+}
+#elif defined(__APPLE__)
+void memoryPressureEvent(void* context){
+    dispatch_source_t source = (dispatch_source_t)context;
+    unsigned long flags = dispatch_source_get_data(source);
+    if ( flags & DISPATCH_MEMORYPRESSURE_CRITICAL ){
+        notifyMemoryPressure(kMemoryPressureCritical);
+    } else if ( flags & DISPATCH_MEMORYPRESSURE_WARN ){
+        notifyMemoryPressure(kMemoryPressureModerate);
+    }
+}
+
+bool watchMemoryPressure(){
+    dispatch_source_t source = dispatch_source_create(DISPATCH_SOURCE_TYPE_MEMORYPRESSURE, 0,
+                                                      DISPATCH_MEMORYPRESSURE_WARN | DISPATCH_MEMORYPRESSURE_CRITICAL,
+                                                      dispatch_get_global_queue(QOS_CLASS_UTILITY, 0));
+    if ( !source ){
+        return false;
+    }
+    dispatch_set_context(source, source);
+    dispatch_source_set_event_handler_f(source, memoryPressureEvent);
+    dispatch_resume(source);
+    return true;
+}
+#else
+bool watchMemoryPressure(){
+    return false;
+}
+#endif
+
+}  // namespace
+
+// END MEMORY PRESSURE //
+
+// RENDER THREAD //
+// Moves gpu work off the thread that runs the ui. The ui thread draws
+// each frame into an SkPicture and hands it over; the render thread owns
+// the gl context and plays the pictures back, flushes and swaps. At most
+// one recorded frame waits in the queue, so the ui thread can record
+// frame N+1 while frame N renders and blocks only when it gets further
+// ahead. The render thread in turn waits for the gpu to finish older
+// frames before it starts another one past maxFramesInFlight.
+class RenderThread {
+public:
+    typedef void (*WindowFn)(void*);
+
+    RenderThread(WindowFn makeCurrent, WindowFn swapBuffers, void* window, int maxFramesInFlight)
+        : fMakeCurrent(makeCurrent),
+          fSwapBuffers(swapBuffers),
+          fWindow(window),
+          fMaxFramesInFlight(std::max(1, maxFramesInFlight)),
+          fRecording(nullptr, SkSurfaces::Null(1, 1)){
+        fRecording.rendersOnOtherThread = true;
+        fThread = std::thread([this]{ run(); });
+    }
+
+    ~RenderThread(){
+        push(Command{Command::kStop});
+        fThread.join();
+    }
+
+    // Draws go to this resource on the ui thread.
+    SkiaResource* resource(){
+        return &fRecording;
+    }
+
+    void reshape(int frameBufferWidth, int frameBufferHeight, float xscale, float yscale){
+        fRecording.surface = SkSurfaces::Null(std::max(1, frameBufferWidth), std::max(1, frameBufferHeight));
+        fXScale = xscale;
+        fYScale = yscale;
+
+        Command command{Command::kReshape};
+        command.width = frameBufferWidth;
+        command.height = frameBufferHeight;
+        command.xscale = xscale;
+        command.yscale = yscale;
+        push(std::move(command));
+    }
+
+    // Applied by the render thread, which owns the gpu context.
+    void setResourceCacheLimit(int64_t maxBytes){
+        Command command{Command::kCacheLimit};
+        command.maxBytes = maxBytes;
+        push(std::move(command));
+    }
+
+    void purgeUnusedResources(int64_t msNotUsed){
+        Command command{Command::kPurge};
+        command.msNotUsed = msNotUsed;
+        push(std::move(command));
+    }
+
+    void freeGpuResources(){
+        push(Command{Command::kFreeResources});
+    }
+
+    void handleMemoryPressure(int level){
+        Command command{Command::kMemoryPressure};
+        command.level = level;
+        push(std::move(command));
+    }
+
+    void beginFrame(){
+        SkCanvas* canvas = fRecorder.beginRecording(SkRect::MakeIWH(fRecording.surface->width(),
+                                                                    fRecording.surface->height()));
+        canvas->scale(fXScale, fYScale);
+        fRecording.frameCanvas = canvas;
+    }
+
+    void submitFrame(){
+        if ( fRecording.captureRecorder ){
+            finishCapture(&fRecording);
+        }
+        finishHitRecording(&fRecording);
+        fRecording.frameCanvas = nullptr;
+        fRecording.endFrame();
+
+        Command command{Command::kFrame};
+        command.picture = fRecorder.finishRecordingAsPicture();
+
+        auto submitStart = std::chrono::steady_clock::now();
+        push(std::move(command));
+        auto submitEnd = std::chrono::steady_clock::now();
+
+        // time spent waiting on the render thread shows up as flush time
+        SkiaFrameStats* stats = fRecording.stats;
+        stats->flushNanos += std::chrono::duration_cast<std::chrono::nanoseconds>(submitEnd - submitStart).count();
+        stats->frameNanos = std::chrono::duration_cast<std::chrono::nanoseconds>(submitEnd - fRecording.frameStart).count();
+    }
+
+private:
+    struct Command {
+        enum Type { kFrame, kReshape, kCacheLimit, kPurge, kFreeResources, kMemoryPressure, kStop } type;
+        sk_sp<SkPicture> picture;
+        int width = 0;
+        int height = 0;
+        float xscale = 1;
+        float yscale = 1;
+        int64_t maxBytes = -1;
+        int64_t msNotUsed = 0;
+        int level = 0;
+    };
+
+    static const size_t kMaxQueuedFrames = 1;
+
+    // from the GL_ARB_sync spec
+    static constexpr GrGLenum kSyncGpuCommandsComplete = 0x9117;
+    static constexpr GrGLbitfield kSyncFlushCommandsBit = 0x1;
+    static constexpr GrGLuint64 kTimeoutIgnored = ~GrGLuint64(0);
+
+    void push(Command command){
+        std::unique_lock<std::mutex> lock(fMutex);
+        if ( command.type == Command::kFrame ){
+            fNotFull.wait(lock, [this]{ return fQueuedFrames < kMaxQueuedFrames; });
+            fQueuedFrames++;
+        }
+        fQueue.push_back(std::move(command));
+        fNotEmpty.notify_one();
+    }
+
+    Command pop(){
+        std::unique_lock<std::mutex> lock(fMutex);
+        fNotEmpty.wait(lock, [this]{ return !fQueue.empty(); });
+        Command command = std::move(fQueue.front());
+        fQueue.pop_front();
+        return command;
+    }
+
+    // Lets the ui thread queue another frame once this one has started.
+    void frameStarted(){
+        std::lock_guard<std::mutex> lock(fMutex);
+        fQueuedFrames--;
+        fNotFull.notify_one();
+    }
+
+    static void frameFinished(GrGpuFinishedContext context){
+        ((RenderThread*)context)->fFramesInFlight.fetch_sub(1, std::memory_order_release);
+    }
+
+    // Blocks on the fence of the oldest frame rather than polling skia.
+    // Its finished callback runs once skia sees the frame's work is done.
+    void waitForFramesInFlight(GrDirectContext* context){
+        while ( fFramesInFlight.load(std::memory_order_acquire) >= fMaxFramesInFlight ){
+            if ( fFences.empty() ){
+                // no fences to wait on, so wait for all submitted work
+                context->submit(GrSyncCpu::kYes);
+            } else {
+                const GrGLInterface::Functions& gl = fGL->fFunctions;
+                gl.fClientWaitSync(fFences.front(), kSyncFlushCommandsBit, kTimeoutIgnored);
+                gl.fDeleteSync(fFences.front());
+                fFences.pop_front();
+            }
+            context->checkAsyncWorkCompletion();
+        }
+    }
+
+    void fenceFrame(){
+        if ( !fGL || !fGL->fFunctions.fFenceSync || !fGL->fFunctions.fClientWaitSync ||
+             !fGL->fFunctions.fDeleteSync ){
+            return;
+        }
+        const GrGLInterface::Functions& gl = fGL->fFunctions;
+        // only the newest frames can still be in flight
+        while ( (int)fFences.size() >= fMaxFramesInFlight ){
+            gl.fDeleteSync(fFences.front());
+            fFences.pop_front();
+        }
+        fFences.push_back(gl.fFenceSync(kSyncGpuCommandsComplete, 0));
+    }
+
+    void deleteFences(){
+        for (GrGLsync fence : fFences){
+            fGL->fFunctions.fDeleteSync(fence);
+        }
+        fFences.clear();
+    }
+
+    void render(SkiaResource* resource, const sk_sp<SkPicture>& picture){
+        GrDirectContext* context = resource->grContext.get();
+        waitForFramesInFlight(context);
+
+        // the picture already includes the content scale
+        SkCanvas* canvas = resource->surface->getCanvas();
+        canvas->save();
+        canvas->resetMatrix();
+        canvas->clear(SK_ColorWHITE);
+        canvas->drawPicture(picture);
+        canvas->restore();
+
+        GrFlushInfo info;
+        info.fFinishedProc = frameFinished;
+        info.fFinishedContext = this;
+        fFramesInFlight.fetch_add(1, std::memory_order_relaxed);
+        context->flush(resource->surface.get(), SkSurfaces::BackendSurfaceAccess::kPresent, info);
+        context->submit();
+        fenceFrame();
+
+        fSwapBuffers(fWindow);
+    }
+
+    void run(){
+        fMakeCurrent(fWindow);
+        fGL = GrGLMakeNativeInterface();
+        SkiaResource* resource = skia_init();
+
+        while (true){
+            Command command = pop();
+            if ( command.type == Command::kStop ){
+                break;
+            }
+            if ( command.type == Command::kReshape ){
+                skia_reshape(resource, command.width, command.height, command.xscale, command.yscale);
+                continue;
+            }
+            if ( command.type == Command::kCacheLimit ){
+                skia_set_resource_cache_limit(resource, command.maxBytes);
+                continue;
+            }
+            if ( command.type == Command::kPurge ){
+                skia_purge_unused_resources(resource, command.msNotUsed);
+                continue;
+            }
+            if ( command.type == Command::kFreeResources ){
+                skia_free_gpu_resources(resource);
+                continue;
+            }
+            if ( command.type == Command::kMemoryPressure ){
+                skia_handle_memory_pressure(resource, command.level);
+                continue;
+            }
+
+            frameStarted();
+            if ( resource->surface ){
+                render(resource, command.picture);
+            }
+        }
+
+        if ( resource->grContext ){
+            // run the finished callbacks before the context goes away
+            resource->grContext->flushAndSubmit(GrSyncCpu::kYes);
+        }
+        deleteFences();
+        skia_cleanup(resource);
+        fMakeCurrent(nullptr);
+    }
+
+    WindowFn fMakeCurrent;
+    WindowFn fSwapBuffers;
+    void* fWindow;
+    int fMaxFramesInFlight;
+
+    // ui thread
+    SkiaResource fRecording;
+    SkPictureRecorder fRecorder;
+    float fXScale = 1;
+    float fYScale = 1;
+
+    std::mutex fMutex;
+    std::condition_variable fNotEmpty;
+    std::condition_variable fNotFull;
+    std::deque<Command> fQueue;
+    size_t fQueuedFrames = 0;
+
+    // render thread
+    sk_sp<const GrGLInterface> fGL;
+    // one per frame in flight, oldest first
+    std::deque<GrGLsync> fFences;
+
+    std::atomic<int> fFramesInFlight{0};
+    std::thread fThread;
+};
+
+// END RENDER THREAD //
+
+// SCENE GRAPH //
+// A retained tree of nodes. Each node has a transform, an optional clip,
+// an opacity and a picture of its own content that is drawn before its
+// children. Changing a transform, clip or opacity only recomposites the
+// tree; a node's picture is only recorded again when its content changes.
+class SceneGraph {
+public:
+    static constexpr int64_t kRoot = 0;
+
+    SceneGraph(){
+        fNodes[kRoot];
+    }
+
+    // Moves `id` to position `index` of `parent`'s children, creating it
+    // if needed. A negative index appends. Returns false without changing
+    // anything if `parent` is `id` or one of its descendants.
+    bool setParent(int64_t id, int64_t parent, int index){
+        if ( id == kRoot ){
+            return false;
+        }
+        for (int64_t ancestor = parent; ancestor != kRoot; ){
+            if ( ancestor == id ){
+                return false;
+            }
+            auto it = fNodes.find(ancestor);
+            if ( it == fNodes.end() ){
+                break;
+            }
+            ancestor = it->second.parent;
+        }
+
+        Node& node = fNodes[id];
+        if ( fNodes.find(node.parent) != fNodes.end() ){
+            auto& siblings = fNodes[node.parent].children;
+            siblings.erase(std::remove(siblings.begin(), siblings.end(), id), siblings.end());
+        }
+        node.parent = parent;
+        auto& children = fNodes[parent].children;
+        if ( index < 0 || index >= (int)children.size() ){
+            children.push_back(id);
+        } else {
+            children.insert(children.begin() + index, id);
+        }
+        return true;
+    }
+
+    // Removes `id` and its descendants.
+    void remove(int64_t id){
+        auto it = fNodes.find(id);
+        if ( id == kRoot || it == fNodes.end() ){
+            return;
+        }
+        auto parent = fNodes.find(it->second.parent);
+        if ( parent != fNodes.end() ){
+            auto& siblings = parent->second.children;
+            siblings.erase(std::remove(siblings.begin(), siblings.end(), id), siblings.end());
+        }
+        removeSubtree(id);
+    }
+
+    void setTransform(int64_t id, const SkMatrix& matrix){
+        fNodes[id].matrix = matrix;
+    }
+
+    void setClip(int64_t id, const SkRect* clip){
+        Node& node = fNodes[id];
+        node.clipped = clip != nullptr;
+        if ( clip ){
+            node.clip = *clip;
+        }
+    }
+
+    void setOpacity(int64_t id, float opacity){
+        fNodes[id].opacity = opacity;
+    }
+
+    // Returns a resource whose draws are recorded as the content of `id`.
+    SkiaResource* beginRecording(SkiaResource* resource, int64_t id, const SkRect& bounds){
+        auto recording = std::make_unique<Recording>();
+        recording->id = id;
+        recording->resource.reset(new SkiaResource(resource->grContext, SkSurfaces::Null(1, 1)));
+        recording->resource->shareStats(resource);
+        recording->resource->rendersOnOtherThread = resource->rendersOnOtherThread;
+        recording->resource->paints.pop();
+        recording->resource->paints.emplace(SkPaint(resource->getPaint()));
+        recording->resource->frameCanvas = recording->recorder.beginRecording(bounds);
+
+        SkiaResource* recordingResource = recording->resource.get();
+        fRecordings.push_back(std::move(recording));
+        return recordingResource;
+    }
+
+    void finishRecording(SkiaResource* recordingResource){
+        auto it = std::find_if(fRecordings.begin(), fRecordings.end(), [&](auto& recording){
+            return recording->resource.get() == recordingResource;
+        });
+        if ( it == fRecordings.end() ){
+            return;
+        }
+        (*it)->resource->frameCanvas = nullptr;
+        fNodes[(*it)->id].picture = (*it)->recorder.finishRecordingAsPicture();
+        fRecordings.erase(it);
+    }
+
+    void draw(SkCanvas* canvas){
+        drawNode(canvas, fNodes[kRoot]);
+    }
+
+private:
+    struct Node {
+        int64_t parent = kRoot;
+        std::vector<int64_t> children;
+        SkMatrix matrix;
+        SkRect clip = SkRect::MakeEmpty();
+        bool clipped = false;
+        float opacity = 1;
+        sk_sp<SkPicture> picture;
+    };
+
+    struct Recording {
+        int64_t id;
+        SkPictureRecorder recorder;
+        std::unique_ptr<SkiaResource> resource;
+    };
+
+    void removeSubtree(int64_t id){
+        auto it = fNodes.find(id);
+        if ( it == fNodes.end() ){
+            return;
+        }
+        std::vector<int64_t> children = std::move(it->second.children);
+        fNodes.erase(it);
+        for (int64_t child : children){
+            removeSubtree(child);
+        }
+    }
+
+    void drawNode(SkCanvas* canvas, const Node& node){
+        if ( node.opacity <= 0 ){
+            return;
+        }
+        SkAutoCanvasRestore restore(canvas, true);
+        canvas->concat(node.matrix);
+        if ( node.clipped ){
+            if ( canvas->quickReject(node.clip) ){
+                return;
+            }
+            canvas->clipRect(node.clip);
+        }
+        if ( node.opacity < 1 ){
+            canvas->saveLayerAlphaf(node.clipped ? &node.clip : nullptr, node.opacity);
+        }
+        if ( node.picture ){
+            canvas->drawPicture(node.picture);
+        }
+        for (int64_t child : node.children){
+            auto it = fNodes.find(child);
+            if ( it != fNodes.end() ){
+                drawNode(canvas, it->second);
+            }
+        }
+    }
+
+    std::unordered_map<int64_t, Node> fNodes;
+    std::vector<std::unique_ptr<Recording>> fRecordings;
+};
 
-static sk_sp<SkFontMgr> fontmgr_factory() {
-#if defined(__APPLE__)
-  return SkFontMgr_New_CoreText(nullptr);
-#elif defined(__linux__)
-  return SkFontMgr_New_FontConfig(NULL);
-#elif defined(_WIN32)
-  return SkFontMgr_New_DirectWrite();
-#else
-  return SkFontMgr_New_Custom_Empty(); /* last resort: SkFontMgr::RefEmpty(); */
-#endif
-}
+// END SCENE GRAPH //
 
-sk_sp<SkFontMgr> SkFontMgr_RefDefault() {
-  static std::once_flag flag;
-  static sk_sp<SkFontMgr> mgr;
-  std::call_once(flag, [] {
-    mgr = fontmgr_factory();
-    g_factory_called = true;
-  });
-  return mgr;
-}
 
+extern "C" {
 
+    // Enables the on disk shader cache for gpu contexts created after this call.
+    // strategy: 0 = SkSL, 1 = backend source, 2 = backend binary
+    // The cache must outlive every context, so it is never freed once set.
+    // Versions are kept in a membrane-shader-cache directory inside path.
+    // Does nothing on platforms without posix file apis.
+    void skia_set_shader_cache(const char* path, int64_t maxBytes, int strategy){
+#ifdef MEMBRANE_HAS_POSIX
+        std::lock_guard<std::mutex> lock(g_shader_cache_mutex);
+        if ( g_shader_cache ){
+            return;
+        }
 
-// END FONT STUFF //
+        switch (strategy){
+        case 0: g_shader_cache_strategy = GrContextOptions::ShaderCacheStrategy::kSkSL; break;
+        case 1: g_shader_cache_strategy = GrContextOptions::ShaderCacheStrategy::kBackendSource; break;
+        case 2:
+        default:
+            g_shader_cache_strategy = GrContextOptions::ShaderCacheStrategy::kBackendBinary; break;
+        }
+        g_shader_cache.reset(new DiskShaderCache(path, maxBytes));
+#endif
+    }
 
-#if defined(__APPLE__)
-#import <CoreFoundation/CoreFoundation.h>
+    // Writes loads, hits, stores and total bytes of the shader cache to out.
+    // Returns 0 if no cache is set.
+    int skia_shader_cache_stats(int64_t* out){
+#ifdef MEMBRANE_HAS_POSIX
+        std::lock_guard<std::mutex> lock(g_shader_cache_mutex);
+        if ( g_shader_cache ){
+            g_shader_cache->stats(out);
+            return 1;
+        }
 #endif
+        return 0;
+    }
 
-#define LOG(fmt, ...) \
-            do {FILE *fp; fp = fopen("/var/tmp/membrane.log", "a");fprintf(fp, fmt, __VA_ARGS__); fclose(fp);} while (0)
+    // Starts recording trace events, discarding any previous capture.
+    void skia_trace_start(){
+        std::lock_guard<std::mutex> lock(g_trace_mutex);
+        if ( !g_event_tracer ){
+            MembraneEventTracer* tracer = new MembraneEventTracer();
+            if ( SkEventTracer::SetInstance(tracer, true) ){
+                g_event_tracer = tracer;
+            } else {
+                delete tracer;
+            }
+        }
 
-typedef struct _cef_rect_t {
-  int x;
-  int y;
-  int width;
-  int height;
-} cef_rect_t;
+        g_trace_events.clear();
+        g_trace_strings.clear();
+        g_trace_event_count = 0;
+        g_trace_generation++;
+        if ( g_event_tracer ){
+            g_event_tracer->setEnabled(true);
+        }
+        g_tracing.store(true, std::memory_order_relaxed);
+    }
+
+    // Stops recording and writes the captured events to `path` as chrome trace json.
+    // Only the most recent kMaxTraceEvents are kept, the number dropped is
+    // written as otherData.droppedEvents.
+    // Returns the number of events written or -1 if the file couldn't be written.
+    int skia_trace_stop(const char* path){
+        std::vector<TraceEvent> events;
+        // owns the copied names of `events` until they are written
+        std::unordered_set<std::string> strings;
+        uint64_t dropped;
+        {
+            std::lock_guard<std::mutex> lock(g_trace_mutex);
+            g_tracing.store(false, std::memory_order_relaxed);
+            if ( g_event_tracer ){
+                g_event_tracer->setEnabled(false);
+            }
+            events.swap(g_trace_events);
+            strings.swap(g_trace_strings);
+            dropped = g_trace_event_count - events.size();
+            if ( dropped > 0 ){
+                // oldest first
+                std::rotate(events.begin(), events.begin() + g_trace_event_count % kMaxTraceEvents, events.end());
+            }
+            g_trace_event_count = 0;
+        }
 
-using namespace skia::textlayout;
+        FILE* fp = fopen(path, "w");
+        if ( !fp ){
+            return -1;
+        }
 
+#ifdef MEMBRANE_HAS_POSIX
+        int pid = getpid();
+#else
+        int pid = 0;
+#endif
+        fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+        for (size_t i = 0; i < events.size(); i++){
+            const TraceEvent& event = events[i];
+            fprintf(fp, "%s{\"name\":", i == 0 ? "" : ",\n");
+            writeJSONString(fp, event.name);
+            fprintf(fp, ",\"cat\":");
+            writeJSONString(fp, event.category);
+            fprintf(fp, ",\"ph\":\"%c\",\"ts\":%.3f", event.phase, event.startNanos / 1000.0);
+            if ( event.phase == 'X' ){
+                fprintf(fp, ",\"dur\":%.3f", event.durationNanos / 1000.0);
+            } else if ( event.phase == 'I' || event.phase == 'i' ){
+                fprintf(fp, ",\"s\":\"t\"");
+            }
+            fprintf(fp, ",\"pid\":%d,\"tid\":%d}", pid, event.tid);
+        }
+        fprintf(fp, "\n],\"otherData\":{\"droppedEvents\":%llu}}\n", (unsigned long long)dropped);
 
-extern "C" {
+        if ( fclose(fp) != 0 ){
+            return -1;
+        }
+        return events.size();
+    }
 
     SkiaResource* skia_init(){
 
@@ -158,18 +5103,15 @@ extern "C" {
     }
 
     void skia_reshape(SkiaResource* resource, int frameBufferWidth, int frameBufferHeight, float xscale, float yscale){
+        SKIA_TRACE_FN();
 
         if ( resource->surface){
             resource->surface.reset();
             resource->grContext.reset();
         }
 
-	// https://skia.org/docs/user/api/skcanvas_creation/#gpu
-
 	// You've already created your OpenGL context and bound it.
-	sk_sp<const GrGLInterface> interface = GrGLMakeNativeInterface();
-
-	sk_sp<GrDirectContext> context = GrDirectContexts::MakeGL(interface);
+	sk_sp<GrDirectContext> context = makeGLDirectContext();
 
 	GrGLFramebufferInfo framebufferInfo;
         framebufferInfo.fFBOID = 0;
@@ -190,40 +5132,270 @@ extern "C" {
 	SkCanvas* gpuCanvas = gpuSurface->getCanvas();
 	
 	resource->grContext = context;
-        
+        if ( resource->resourceCacheLimit >= 0 ){
+            context->setResourceCacheLimit(resource->resourceCacheLimit);
+        }
+
         gpuCanvas->scale(xscale, yscale);
 	resource->surface = gpuSurface;
     }
 
+    // Windows created in the same gl share group can use one gpu context,
+    // so glyph atlases, uploaded images and compiled programs are kept
+    // once instead of once per window. The context is made for the
+    // current gl context, which must stay current while drawing with any
+    // of the windows' resources. Framebuffers can't be shared between gl
+    // contexts, so each window draws into a texture that
+    // skia_present_shared copies to its framebuffer.
+    GrDirectContext* skia_shared_context_make(){
+        return makeGLDirectContext().release();
+    }
+
+    void skia_shared_context_delete(GrDirectContext* context){
+        context->flushAndSubmit(GrSyncCpu::kYes);
+        context->unref();
+    }
+
+    SkiaResource* skia_init_shared(GrDirectContext* context){
+        SkiaResource* resource = new SkiaResource(sk_ref_sp(context), nullptr);
+        resource->sharedContext = true;
+        return resource;
+    }
+
+    // Call with the shared context current.
+    void skia_reshape_shared(SkiaResource* resource, int frameBufferWidth, int frameBufferHeight, float xscale, float yscale){
+        SKIA_TRACE_FN();
+        resource->surface.reset();
+        resource->presentTexture = 0;
+
+        SkImageInfo info = SkImageInfo::Make(std::max(1, frameBufferWidth), std::max(1, frameBufferHeight),
+                                             kRGBA_8888_SkColorType, kPremul_SkAlphaType);
+        // bottom left, like the window framebuffer, so presenting is a straight copy
+        sk_sp<SkSurface> surface = SkSurfaces::RenderTarget(resource->grContext.get(), skgpu::Budgeted::kNo, info,
+                                                            0, kBottomLeft_GrSurfaceOrigin, nullptr);
+        if ( !surface ){
+            return;
+        }
+
+        GrBackendTexture texture = SkSurfaces::GetBackendTexture(surface.get(), SkSurfaces::BackendHandleAccess::kFlushRead);
+        GrGLTextureInfo textureInfo;
+        if ( !GrBackendTextures::GetGLTextureInfo(texture, &textureInfo) ){
+            return;
+        }
+
+        surface->getCanvas()->scale(xscale, yscale);
+        resource->surface = surface;
+        resource->presentTexture = textureInfo.fID;
+    }
+
+    // Copies the last flushed frame to the window's framebuffer. Call with
+    // the window's gl context current, before swapping buffers.
+    void skia_present_shared(SkiaResource* resource){
+        SKIA_TRACE_FN();
+        if ( !resource->surface || !resource->presentTexture ){
+            return;
+        }
+
+        static sk_sp<const GrGLInterface> interface = GrGLMakeNativeInterface();
+        const GrGLInterface::Functions& gl = interface->fFunctions;
+
+        const GrGLenum kFramebuffer = 0x8D40;
+        const GrGLenum kReadFramebuffer = 0x8CA8;
+        const GrGLenum kDrawFramebuffer = 0x8CA9;
+        const GrGLenum kColorAttachment0 = 0x8CE0;
+
+        // framebuffer objects belong to the context that made them
+        if ( !resource->presentFramebuffer ){
+            gl.fGenFramebuffers(1, &resource->presentFramebuffer);
+        }
+        gl.fBindFramebuffer(kFramebuffer, resource->presentFramebuffer);
+        // attaching again also picks up the shared context's latest writes
+        gl.fFramebufferTexture2D(kFramebuffer, kColorAttachment0, GL_TEXTURE_2D, resource->presentTexture, 0);
+
+        int width = resource->surface->width();
+        int height = resource->surface->height();
+        gl.fBindFramebuffer(kReadFramebuffer, resource->presentFramebuffer);
+        gl.fBindFramebuffer(kDrawFramebuffer, 0);
+        gl.fBlitFramebuffer(0, 0, width, height, 0, 0, width, height, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+        gl.fBindFramebuffer(kFramebuffer, 0);
+    }
+
+    // Deletes the framebuffer made by skia_present_shared. Call with the
+    // window's gl context current, before the window is destroyed.
+    void skia_release_present_shared(SkiaResource* resource){
+        if ( !resource->presentFramebuffer ){
+            return;
+        }
+        static sk_sp<const GrGLInterface> interface = GrGLMakeNativeInterface();
+        interface->fFunctions.fDeleteFramebuffers(1, &resource->presentFramebuffer);
+        resource->presentFramebuffer = 0;
+    }
+
+    // Turns on the frame arena's debug mode, which faults on use of an
+    // object after its frame ended instead of reusing its memory.
+    void skia_frame_arena_set_debug(int debug){
+        g_frame_arena_debug = debug;
+    }
+
+    // Limits the gpu resource cache. Kept across reshapes. For windows that
+    // share a gpu context, the limit applies to all of them.
+    void skia_set_resource_cache_limit(SkiaResource* resource, int64_t maxBytes){
+        resource->resourceCacheLimit = maxBytes;
+        if ( resource->grContext ){
+            resource->grContext->setResourceCacheLimit(maxBytes);
+        }
+    }
+
+    // Writes the cache's bytes in use, resource count and limit to `usage`.
+    void skia_resource_cache_usage(SkiaResource* resource, int64_t* usage){
+        usage[0] = usage[1] = usage[2] = 0;
+        if ( resource->grContext ){
+            int count;
+            size_t bytes;
+            resource->grContext->getResourceCacheUsage(&count, &bytes);
+            usage[0] = bytes;
+            usage[1] = count;
+            usage[2] = resource->grContext->getResourceCacheLimit();
+        }
+    }
+
+    // The remaining resource cache functions need the resource's gl context current.
+
+    // Frees cached gpu resources that haven't been used in `msNotUsed` milliseconds.
+    void skia_purge_unused_resources(SkiaResource* resource, int64_t msNotUsed){
+        SKIA_TRACE_FN();
+        if ( resource->grContext ){
+            resource->grContext->performDeferredCleanup(std::chrono::milliseconds(msNotUsed));
+        }
+    }
+
+    // Frees every gpu resource that isn't in use, including glyph atlases.
+    void skia_free_gpu_resources(SkiaResource* resource){
+        SKIA_TRACE_FN();
+        if ( resource->grContext ){
+            resource->grContext->freeGpuResources();
+        }
+    }
+
+    // level: 1 = moderate, 2 = critical. Safe to call from any thread.
+    void skia_memory_pressure_notify(int level){
+        notifyMemoryPressure(level);
+    }
+
+    // Returns the highest level reported since the last call, or 0.
+    int skia_memory_pressure_take(){
+        return g_memory_pressure.exchange(kMemoryPressureNone, std::memory_order_relaxed);
+    }
+
+    // Reports pressure from the os (psi on linux, dispatch on macos).
+    // Returns 0 if it isn't available.
+    int skia_memory_pressure_watch(){
+        static std::once_flag once;
+        static bool watching = false;
+        std::call_once(once, []{ watching = watchMemoryPressure(); });
+        return watching;
+    }
+
+    void skia_handle_memory_pressure(SkiaResource* resource, int level){
+        SKIA_TRACE_FN();
+        if ( !resource->grContext ){
+            return;
+        }
+        if ( level >= kMemoryPressureCritical ){
+            resource->grContext->freeGpuResources();
+        } else if ( level == kMemoryPressureModerate ){
+            resource->grContext->purgeUnlockedResources(GrPurgeResourceOptions::kScratchResourcesOnly);
+            resource->grContext->performDeferredCleanup(std::chrono::seconds(5));
+        }
+    }
+
     void skia_clear(SkiaResource* resource){
-        SkCanvas* canvas = resource->surface->getCanvas();
+        SKIA_TRACE_FN();
+        *resource->stats = {};
+        resource->frameStart = std::chrono::steady_clock::now();
+
+        beginHitRecording(resource);
+        if ( !resource->capturePath.empty() && !resource->captureRecorder ){
+            beginCapture(resource);
+        }
+
+        SkCanvas* canvas = resource->getCanvas();
         canvas->clear(SK_ColorWHITE);
     }
 
     void skia_flush_and_submit(SkiaResource* resource){
+        SKIA_TRACE_FN();
+        if ( resource->captureRecorder ){
+            finishCapture(resource);
+        }
+        finishHitRecording(resource);
+        resource->endFrame();
+
+        auto flushStart = std::chrono::steady_clock::now();
+
 	resource->grContext->flush(resource->surface.get());
 	resource->grContext->submit();
+        if ( resource->sharedContext ){
+            // make the frame visible to the window's context before it is presented
+            glFlush();
+        }
+
+        auto flushEnd = std::chrono::steady_clock::now();
+        SkiaFrameStats* stats = resource->stats;
+        stats->flushNanos += std::chrono::duration_cast<std::chrono::nanoseconds>(flushEnd - flushStart).count();
+        stats->frameNanos = std::chrono::duration_cast<std::chrono::nanoseconds>(flushEnd - resource->frameStart).count();
+    }
+
+    // Records the next frame drawn on `resource` (from skia_clear to
+    // skia_flush_and_submit) and writes it to `path` as a serialized
+    // SkPicture (.skp). Images and typefaces are embedded.
+    void skia_capture_next_frame(SkiaResource* resource, const char* path){
+        resource->capturePath = path;
+    }
+
+    // Returns 1 if a capture was requested and its frame hasn't started yet.
+    int skia_capture_pending(SkiaResource* resource){
+        return !resource->capturePath.empty() && !resource->captureRecorder ? 1 : 0;
+    }
+
+    // Copies the counters for the current frame into `stats`.
+    void skia_get_frame_stats(SkiaResource* resource, SkiaFrameStats* stats){
+        *stats = *resource->stats;
+
+        if ( resource->grContext ){
+            int count = 0;
+            size_t bytes = 0;
+            resource->grContext->getResourceCacheUsage(&count, &bytes);
+            stats->gpuResourceCount = count;
+            stats->gpuResourceBytes = bytes;
+            stats->gpuResourceBudgetBytes = resource->grContext->getResourceCacheLimit();
+        }
     }
 
     void skia_cleanup(SkiaResource* resource){
+        SKIA_TRACE_FN();
         delete resource;
     }
 
     void skia_set_scale (SkiaResource* resource, float sx, float sy){
-        resource->surface->getCanvas()->scale(sx, sy);
+        resource->getCanvas()->scale(sx, sy);
     }
     // Should maybe paragraph stuff. See SkParagraphTest.cpp
     // does not currently support kerning see SkTypeface::getKerningPairAdjustments() and https://skia.org/user/tips#kerning
     void skia_render_line(SkiaResource* resource, SkFont* font, const char* text, int text_length, float x, float y){
+        SKIA_TRACE_FN();
 
 
-        SkCanvas* canvas = resource->surface->getCanvas();
+        resource->stats->drawTextCalls++;
+        resource->stats->textBytes += text_length;
+
+        SkCanvas* canvas = resource->getCanvas();
         canvas->drawSimpleText(text, text_length , SkTextEncoding::kUTF8, x,y ,*font, resource->getPaint());
 
     }
 
     void skia_next_line(SkiaResource* resource, SkFont* font){
-        resource->surface->getCanvas()->translate(0, font->getSpacing());
+        resource->getCanvas()->translate(0, font->getSpacing());
     }
 
     float skia_line_height(SkFont* font){
@@ -270,10 +5442,12 @@ extern "C" {
     }
 
     float skia_advance_x(SkFont* font, const char* text, int text_length){
+        SKIA_TRACE_FN();
         return font->measureText(text, text_length, SkTextEncoding::kUTF8, NULL);
     }
 
     void skia_text_bounds(SkFont* font, const char* text, int text_length, float* ox, float* oy, float* width, float* height){
+        SKIA_TRACE_FN();
         *ox = 0;
         *oy = 0;
         *width = 0;
@@ -287,110 +5461,436 @@ extern "C" {
             if ( text[end] == '\n' ){
                 y += font->getSpacing();
 
-                font->measureText(text+start,end - start,  SkTextEncoding::kUTF8, &bounds);
+                font->measureText(text+start,end - start,  SkTextEncoding::kUTF8, &bounds);
+
+                float x0 = bounds.x();
+                float x1 = bounds.x() + bounds.width();
+                float y0 = y;
+                float y1 = y0 + font->getSpacing();
+
+                *ox = std::min(std::min(*ox, x0), x1);
+                *oy = std::min(std::min(*oy, y0), y1);
+
+                *width = std::max(std::max(*width, x0), x1);
+                *height = std::max(std::max(*height, y0), y1);
+                start = end + 1;
+            }
+        }
+        if ( start != end){
+            font->measureText(text+start,end - start,  SkTextEncoding::kUTF8, &bounds);
+
+            float x0 = bounds.x();
+            float x1 = bounds.x() + bounds.width();
+            float y0 = y;
+            float y1 = y0 + font->getSpacing();
+
+            *ox = std::min(std::min(*ox, x0), x1);
+            *oy = std::min(std::min(*oy, y0), y1);
+
+            *width = std::max(std::max(*width, x0), x1);
+            *height = std::max(std::max(*height, y0), y1);
+        }
+
+    }
+
+    SkiaResource* skia_browser_buffer(int width, int height){
+
+        SkImageInfo info = SkImageInfo::Make(width, height, kBGRA_8888_SkColorType, kUnpremul_SkAlphaType);
+
+
+	sk_sp<SkSurface> cpuSurface(SkSurfaces::Raster(info));
+
+        if (!cpuSurface) {
+            SkDebugf("SkSurface::MakeRenderTarget returned null\n");
+        }
+
+        SkiaResource* bufResource = new SkiaResource(NULL, cpuSurface);
+
+        return bufResource;
+    }
+
+    SkiaResource* skia_direct_bgra8888_buffer(void* buf, int width, int height, int rowBytes ) {
+        SkImageInfo info = SkImageInfo::Make(width, height, kBGRA_8888_SkColorType, kUnpremul_SkAlphaType);
+
+        sk_sp<SkSurface> surface =
+            SkSurfaces::WrapPixels(info, buf, rowBytes);
+
+        SkiaResource* bufResource = new SkiaResource(NULL, surface);
+
+        return bufResource;
+    }
+
+    void skia_draw_pixmap(SkiaResource* resource, SkColorType colorType, SkAlphaType alphaType,   void* buffer, int width, int height, int rowBytes){
+        SKIA_TRACE_FN();
+
+        SkImageInfo info = SkImageInfo::Make(width, height, colorType, alphaType);
+
+        sk_sp<SkSurface> sourceSurface =
+            SkSurfaces::WrapPixels(info, buffer, rowBytes);
+
+        resource->stats->drawPixelsCalls++;
+        resource->stats->pixelBytes += (int64_t)rowBytes * height;
+        sourceSurface->draw(resource->getCanvas(), 0, 0, &resource->getPaint());
+    }
+
+    // Like skia_browser_buffer, but the surface uses `alphaType` so
+    // premultiplied or opaque sources can be written without conversion.
+    SkiaResource* skia_browser_buffer2(int width, int height, int alphaType){
+        SkImageInfo info = SkImageInfo::Make(width, height, kBGRA_8888_SkColorType, (SkAlphaType)alphaType);
+        sk_sp<SkSurface> cpuSurface(SkSurfaces::Raster(info));
+        if (!cpuSurface) {
+            SkDebugf("SkSurfaces::Raster returned null\n");
+        }
+        return new SkiaResource(NULL, cpuSurface);
+    }
+
+    // Variants of skia_bgra8888_draw, skia_browser_draw and skia_browser_update
+    // that take the source SkAlphaType. When `opaqueHint` is set, or a scan
+    // finds every pixel opaque, the pixels are copied without premultiplying.
+    void skia_bgra8888_draw2(SkiaResource* resource, const void* buffer, int width, int height, int rowBytes, int alphaType, int opaqueHint){
+        SKIA_TRACE_FN();
+        SkImageInfo info = SkImageInfo::Make(width, height, kBGRA_8888_SkColorType, (SkAlphaType)alphaType);
+        resource->stats->drawPixelsCalls++;
+        writeBGRA(resource, SkPixmap(info, buffer, rowBytes), 0, 0, (SkAlphaType)alphaType, opaqueHint);
+    }
+
+    void skia_browser_draw2(SkiaResource* resource, const void* buffer, int width, int height, int alphaType, int opaqueHint){
+        skia_bgra8888_draw2(resource, buffer, width, height, width * 4, alphaType, opaqueHint);
+    }
+
+    void skia_browser_update2(SkiaResource* resource, int dirtyRectsCount, cef_rect_t const* dirtyRects, const void* buffer, int width, int height, int alphaType, int opaqueHint){
+        SKIA_TRACE_FN();
+        SkImageInfo info = SkImageInfo::Make(width, height, kBGRA_8888_SkColorType, (SkAlphaType)alphaType);
+        SkPixmap pixmap(info, buffer, info.minRowBytes());
+
+        resource->stats->drawPixelsCalls++;
+        for (int i = 0; i < dirtyRectsCount; i++){
+            const cef_rect_t& rect = dirtyRects[i];
+            SkPixmap dirtyPixmap;
+            if ( pixmap.extractSubset(&dirtyPixmap, {rect.x, rect.y, rect.x + rect.width, rect.y + rect.height}) ){
+                // each rect is scanned separately so opaque rects stay on the fast path
+                writeBGRA(resource, dirtyPixmap, rect.x, rect.y, (SkAlphaType)alphaType, opaqueHint);
+            }
+        }
+    }
+
+    // Returns 1 if every pixel of the 32 bit pixels in `buffer` has an
+    // alpha of 0xff. Bytes past `width` pixels in a row are ignored.
+    int skia_bgra8888_is_opaque(const void* buffer, int width, int height, int rowBytes){
+        SkImageInfo info = SkImageInfo::Make(width, height, kBGRA_8888_SkColorType, kUnpremul_SkAlphaType);
+        return isOpaque32(SkPixmap(info, buffer, rowBytes)) ? 1 : 0;
+    }
+
+    // The original entry points, for unpremultiplied pixels.
+    void skia_bgra8888_draw(SkiaResource* resource, const void* buffer, int width, int height, int rowBytes){
+        SKIA_TRACE_FN();
+        skia_bgra8888_draw2(resource, buffer, width, height, rowBytes, kUnpremul_SkAlphaType, 0);
+    }
+
+    void skia_browser_draw(SkiaResource* resource, const void* buffer, int width, int height){
+        SKIA_TRACE_FN();
+        skia_bgra8888_draw2(resource, buffer, width, height, width * 4, kUnpremul_SkAlphaType, 0);
+    }
+
+    void skia_browser_update(SkiaResource* resource,int dirtyRectsCount, cef_rect_t const* dirtyRects, const void* buffer, int width, int height){
+        SKIA_TRACE_FN();
+        skia_browser_update2(resource, dirtyRectsCount, dirtyRects, buffer, width, height, kUnpremul_SkAlphaType, 0);
+    }
+
+    // Creates a triple buffered BGRA pixel buffer in shared memory.
+    // alphaType is a SkAlphaType. The fd from skia_shared_pixels_fd can be
+    // passed to another process and opened with skia_shared_pixels_open.
+    SharedPixels* skia_shared_pixels_create(int width, int height, int alphaType){
+        SKIA_TRACE_FN();
+        return SharedPixels::create(width, height, (SkAlphaType)alphaType);
+    }
+
+    SharedPixels* skia_shared_pixels_open(int fd){
+        SKIA_TRACE_FN();
+        return SharedPixels::open(fd);
+    }
+
+    // Must be called on the thread that draws it, since it may own a texture.
+    void skia_shared_pixels_delete(SharedPixels* pixels){
+        delete pixels;
+    }
+
+    int skia_shared_pixels_fd(SharedPixels* pixels){
+        return pixels->fd();
+    }
+
+    int skia_shared_pixels_row_bytes(SharedPixels* pixels){
+        return pixels->rowBytes();
+    }
+
+    // Producer: returns the buffer to render the next frame into.
+    void* skia_shared_pixels_write_buffer(SharedPixels* pixels){
+        return pixels->writeBuffer();
+    }
+
+    // Producer: publishes the buffer returned by skia_shared_pixels_write_buffer.
+    void skia_shared_pixels_publish(SharedPixels* pixels){
+        pixels->publish();
+    }
+
+    // Consumer: draws the newest published frame without copying it into
+    // the surface. On gpu surfaces the frame is uploaded to a texture once.
+    // Returns 1 if a new frame was drawn. Returns -1 without drawing if
+    // `resource` renders on a render thread, which owns the gpu context
+    // the frame would have to be uploaded with.
+    int skia_shared_pixels_draw(SkiaResource* resource, SharedPixels* pixels){
+        SKIA_TRACE_FN();
+        if ( resource->rendersOnOtherThread ){
+            return -1;
+        }
+        bool fresh = pixels->acquire();
+        if ( !pixels->hasFrame() ){
+            return 0;
+        }
+
+        sk_sp<SkImage> image;
+        SkPixmap pixmap = pixels->readPixmap();
+        if ( resource->surface->recordingContext() && resource->grContext ){
+            bool uploaded;
+            image = pixels->textureImage(resource->grContext.get(), &uploaded);
+            if ( uploaded ){
+                resource->stats->pixelBytes += pixmap.computeByteSize();
+            }
+        } else if ( resource->defersDrawing() ){
+            // the buffer is reused by the producer, so recorded draws need their own copy
+            image = SkImages::RasterFromPixmapCopy(pixmap);
+        } else {
+            image = SkImages::RasterFromPixmap(pixmap, nullptr, nullptr);
+        }
+        if ( !image ){
+            return 0;
+        }
+
+        resource->stats->drawPixelsCalls++;
+        resource->getCanvas()->drawImage(image, 0, 0, SkSamplingOptions(), &resource->getPaint());
+        return fresh ? 1 : 0;
+    }
+
+    // refreshHz is the refresh rate of the window's monitor. wake is
+    // called after each request to wake up the run loop, may be null.
+    FrameScheduler* skia_frame_scheduler_make(double refreshHz, void (*wake)()){
+        return new FrameScheduler(refreshHz, wake);
+    }
+
+    void skia_frame_scheduler_delete(FrameScheduler* scheduler){
+        delete scheduler;
+    }
+
+    void skia_frame_scheduler_set_refresh_rate(FrameScheduler* scheduler, double refreshHz){
+        scheduler->setRefreshRate(refreshHz);
+    }
+
+    // Thread safe. Requests made before the next frame starts are merged.
+    // Calls the scheduler's wake function.
+    void skia_frame_scheduler_request(FrameScheduler* scheduler){
+        scheduler->request();
+    }
+
+    // Returns how long the run loop may wait for events, in seconds,
+    // or -1 if no frame has been requested.
+    double skia_frame_scheduler_wait_timeout(FrameScheduler* scheduler){
+        return scheduler->waitTimeout();
+    }
+
+    // Returns 1 if a frame should be drawn now. Must be followed by
+    // skia_frame_scheduler_end_frame once the frame has been swapped.
+    int skia_frame_scheduler_begin_frame(FrameScheduler* scheduler){
+        return scheduler->beginFrame() ? 1 : 0;
+    }
 
-                float x0 = bounds.x();
-                float x1 = bounds.x() + bounds.width();
-                float y0 = y;
-                float y1 = y0 + font->getSpacing();
+    void skia_frame_scheduler_end_frame(FrameScheduler* scheduler){
+        scheduler->endFrame();
+    }
 
-                *ox = std::min(std::min(*ox, x0), x1);
-                *oy = std::min(std::min(*oy, y0), y1);
+    void skia_frame_scheduler_stats(FrameScheduler* scheduler, SkiaFrameSchedulerStats* stats){
+        scheduler->stats(stats);
+    }
 
-                *width = std::max(std::max(*width, x0), x1);
-                *height = std::max(std::max(*height, y0), y1);
-                start = end + 1;
-            }
-        }
-        if ( start != end){
-            font->measureText(text+start,end - start,  SkTextEncoding::kUTF8, &bounds);
+    SceneGraph* skia_scene_make(){
+        return new SceneGraph();
+    }
 
-            float x0 = bounds.x();
-            float x1 = bounds.x() + bounds.width();
-            float y0 = y;
-            float y1 = y0 + font->getSpacing();
+    void skia_scene_delete(SceneGraph* scene){
+        delete scene;
+    }
 
-            *ox = std::min(std::min(*ox, x0), x1);
-            *oy = std::min(std::min(*oy, y0), y1);
+    // Returns 0 without moving `id` if `parent` is `id` or one of its
+    // descendants, or if `id` is the root.
+    int skia_scene_node_set_parent(SceneGraph* scene, int64_t id, int64_t parent, int index){
+        return scene->setParent(id, parent, index) ? 1 : 0;
+    }
 
-            *width = std::max(std::max(*width, x0), x1);
-            *height = std::max(std::max(*height, y0), y1);
-        }
+    void skia_scene_node_remove(SceneGraph* scene, int64_t id){
+        scene->remove(id);
+    }
 
+    // Same argument order as skia_transform.
+    void skia_scene_node_set_transform(SceneGraph* scene, int64_t id, float scaleX, float skewX, float transX, float skewY, float scaleY, float transY){
+        SkMatrix matrix;
+        float affine[] = {scaleX, skewY, skewX, scaleY, transX, transY};
+        matrix.setAffine(affine);
+        scene->setTransform(id, matrix);
     }
 
-    SkiaResource* skia_browser_buffer(int width, int height){
+    void skia_scene_node_set_clip(SceneGraph* scene, int64_t id, float ox, float oy, float width, float height){
+        SkRect clip = SkRect::MakeXYWH(ox, oy, width, height);
+        scene->setClip(id, &clip);
+    }
 
-        SkImageInfo info = SkImageInfo::Make(width, height, kBGRA_8888_SkColorType, kUnpremul_SkAlphaType);
+    void skia_scene_node_clear_clip(SceneGraph* scene, int64_t id){
+        scene->setClip(id, nullptr);
+    }
 
+    void skia_scene_node_set_opacity(SceneGraph* scene, int64_t id, float opacity){
+        scene->setOpacity(id, opacity);
+    }
 
-	sk_sp<SkSurface> cpuSurface(SkSurfaces::Raster(info));
+    // Draws to the returned resource are recorded as the content of `id`
+    // until skia_scene_node_end_record.
+    SkiaResource* skia_scene_node_begin_record(SceneGraph* scene, SkiaResource* resource, int64_t id, float ox, float oy, float width, float height){
+        SKIA_TRACE_FN();
+        return scene->beginRecording(resource, id, SkRect::MakeXYWH(ox, oy, width, height));
+    }
 
-        if (!cpuSurface) {
-            SkDebugf("SkSurface::MakeRenderTarget returned null\n");
-        }
+    void skia_scene_node_end_record(SceneGraph* scene, SkiaResource* recording){
+        SKIA_TRACE_FN();
+        scene->finishRecording(recording);
+    }
 
-        SkiaResource* bufResource = new SkiaResource(NULL, cpuSurface);
+    void skia_scene_draw(SkiaResource* resource, SceneGraph* scene){
+        SKIA_TRACE_FN();
+        scene->draw(resource->getCanvas());
+    }
 
-        return bufResource;
+    HitIndex* skia_hit_index_make(){
+        return new HitIndex();
     }
 
-    SkiaResource* skia_direct_bgra8888_buffer(void* buf, int width, int height, int rowBytes ) {
-        SkImageInfo info = SkImageInfo::Make(width, height, kBGRA_8888_SkColorType, kUnpremul_SkAlphaType);
+    void skia_hit_index_delete(HitIndex* index){
+        delete index;
+    }
 
-        sk_sp<SkSurface> surface =
-            SkSurfaces::WrapPixels(info, buf, rowBytes);
+    // Records the frames drawn on `resource` into `index`, or stops
+    // recording when `index` is null. Takes effect at the next skia_clear.
+    void skia_hit_index_attach(SkiaResource* resource, HitIndex* index){
+        resource->hitIndex = index;
+        if ( !index ){
+            resource->hitCanvas.reset();
+        }
+    }
 
-        SkiaResource* bufResource = new SkiaResource(NULL, surface);
+    // Ids under the device space point (x, y), topmost first. Queries see
+    // the last finished frame.
+    int skia_hit_index_query_point(HitIndex* index, float x, float y, int64_t* ids, int maxIds){
+        SKIA_TRACE_FN();
+        return index->query(SkRect::MakeXYWH(x, y, 1, 1), true, ids, maxIds);
+    }
 
-        return bufResource;
+    // Ids of everything intersecting the device space rect, topmost first.
+    int skia_hit_index_query_rect(HitIndex* index, float left, float top, float right, float bottom, int64_t* ids, int maxIds){
+        SKIA_TRACE_FN();
+        return index->query(SkRect::MakeLTRB(left, top, right, bottom), false, ids, maxIds);
     }
 
-    void skia_browser_draw(SkiaResource* resource, const void* buffer, int width, int height){
+    // Starts a thread that owns the window's gl context. makeCurrent and
+    // swapBuffers are called with `window`, e.g. glfwMakeContextCurrent and
+    // glfwSwapBuffers. The context must not be current on any other thread.
+    RenderThread* skia_render_thread_start(void (*makeCurrent)(void*), void (*swapBuffers)(void*), void* window, int maxFramesInFlight){
+        return new RenderThread(makeCurrent, swapBuffers, window, maxFramesInFlight);
+    }
 
-        SkImageInfo info = SkImageInfo::Make(width, height, kBGRA_8888_SkColorType, kUnpremul_SkAlphaType);
-        SkPixmap pixmap(info, buffer, info.width() * info.bytesPerPixel());
-        resource->surface->writePixels(pixmap, 0, 0);
+    // Renders the queued frames and releases the gl context.
+    void skia_render_thread_stop(RenderThread* renderThread){
+        delete renderThread;
     }
 
-    void skia_draw_pixmap(SkiaResource* resource, SkColorType colorType, SkAlphaType alphaType,   void* buffer, int width, int height, int rowBytes){
+    // The resource to draw frames into between begin_frame and submit_frame.
+    SkiaResource* skia_render_thread_resource(RenderThread* renderThread){
+        return renderThread->resource();
+    }
 
-        SkImageInfo info = SkImageInfo::Make(width, height, colorType, alphaType);
+    void skia_render_thread_reshape(RenderThread* renderThread, int frameBufferWidth, int frameBufferHeight, float xscale, float yscale){
+        renderThread->reshape(frameBufferWidth, frameBufferHeight, xscale, yscale);
+    }
 
-        sk_sp<SkSurface> sourceSurface =
-            SkSurfaces::WrapPixels(info, buffer, rowBytes);
+    // Limits the gpu resource cache of the render thread's context.
+    void skia_render_thread_set_resource_cache_limit(RenderThread* renderThread, int64_t maxBytes){
+        renderThread->setResourceCacheLimit(maxBytes);
+    }
 
-        sourceSurface->draw(resource->surface->getCanvas(), 0, 0, &resource->getPaint());
+    // Like skia_purge_unused_resources, skia_free_gpu_resources and
+    // skia_handle_memory_pressure, but applied by the render thread before
+    // its next frame.
+    void skia_render_thread_purge_unused_resources(RenderThread* renderThread, int64_t msNotUsed){
+        renderThread->purgeUnusedResources(msNotUsed);
     }
 
-    void skia_bgra8888_draw(SkiaResource* resource, const void* buffer, int width, int height, int rowBytes){
+    void skia_render_thread_free_gpu_resources(RenderThread* renderThread){
+        renderThread->freeGpuResources();
+    }
 
-        SkImageInfo info = SkImageInfo::Make(width, height, kBGRA_8888_SkColorType, kUnpremul_SkAlphaType);
-        SkPixmap pixmap(info, buffer, rowBytes);
-        resource->surface->writePixels(pixmap, 0, 0);
+    void skia_render_thread_handle_memory_pressure(RenderThread* renderThread, int level){
+        renderThread->handleMemoryPressure(level);
     }
 
-    void skia_browser_update(SkiaResource* resource,int dirtyRectsCount, cef_rect_t const* dirtyRects, const void* buffer, int width, int height){
+    void skia_render_thread_begin_frame(RenderThread* renderThread){
+        renderThread->beginFrame();
+    }
 
-        SkImageInfo info = SkImageInfo::Make(width, height, kBGRA_8888_SkColorType, kUnpremul_SkAlphaType);
-        SkPixmap pixmap(info, buffer, info.width() * info.bytesPerPixel());
+    // Hands the frame to the render thread. Blocks while a previous
+    // frame is still waiting to be rendered.
+    void skia_render_thread_submit_frame(RenderThread* renderThread){
+        renderThread->submitFrame();
+    }
 
-        for (int i = 0; i < dirtyRectsCount; i ++){
+    YuvVideo* skia_yuv_video_make(){
+        return new YuvVideo();
+    }
 
-            const cef_rect_t& rect = dirtyRects[i];
-            SkPixmap dirtyPixmap;
-            if(pixmap.extractSubset(&dirtyPixmap, {rect.x, rect.y, rect.x+rect.width, rect.y+rect.height})){
-                resource->surface->writePixels(dirtyPixmap, rect.x, rect.y);
-            }
+    // Must be called on the thread that draws it, since it may own textures.
+    void skia_yuv_video_delete(YuvVideo* video){
+        delete video;
+    }
+
+    // Draws a YUV 4:2:0 frame scaled to dstWidth x dstHeight.
+    // format: 0 = I420 (planes y, u, v), 1 = NV12 (planes y, uv)
+    // colorSpace: 0 = BT.601 limited, 1 = BT.709 limited, 2 = JPEG full range
+    // Plane textures (gpu) or the conversion buffer (raster) are reused by
+    // later frames drawn with the same `video`.
+    // Returns 1 if the frame was drawn, 0 if it couldn't be converted, and
+    // -1 without drawing if `resource` renders on a render thread, which
+    // owns the gpu context the planes would have to be uploaded with.
+    int skia_yuv_video_draw(SkiaResource* resource, YuvVideo* video, int format, int width, int height,
+                            const void* const* planes, const int* strides, int colorSpace,
+                            float dstWidth, float dstHeight){
+        SKIA_TRACE_FN();
+        if ( resource->rendersOnOtherThread ){
+            return -1;
+        }
+        sk_sp<SkImage> image = video->frameImage(resource, format, width, height, planes, strides, colorSpace);
+        if ( !image ){
+            return 0;
         }
+        resource->stats->drawPixelsCalls++;
+        resource->getCanvas()->drawImageRect(image, SkRect::MakeWH(dstWidth, dstHeight),
+                                             SkSamplingOptions(SkFilterMode::kLinear), &resource->getPaint());
+        return 1;
     }
 
     void skia_draw_surface(SkiaResource* destinationResource, SkiaResource* sourceResource){
-        sourceResource->surface->draw(destinationResource->surface->getCanvas(), 0, 0, &destinationResource->getPaint());
+        SKIA_TRACE_FN();
+        destinationResource->stats->drawSurfaceCalls++;
+        sourceResource->surface->draw(destinationResource->getCanvas(), 0, 0, &destinationResource->getPaint());
     }
 
     
     void skia_render_cursor(SkiaResource* resource, SkFont * font, const char* text, int text_length , int cursor){
+        SKIA_TRACE_FN();
         int glyphCount = font->textToGlyphs(text, text_length, SkTextEncoding::kUTF8, NULL, 0);
         std::vector<SkGlyphID> glyphs(glyphCount);
         font->textToGlyphs(text, text_length, SkTextEncoding::kUTF8, glyphs.data(), glyphs.size());
@@ -416,10 +5916,12 @@ extern "C" {
             endX = startX + font->measureText("8",1, SkTextEncoding::kUTF8);
         }
         SkRect rect = SkRect::MakeXYWH(startX, 0, endX - startX, font->getSpacing());
-        resource->surface->getCanvas()->drawRect(rect, resource->getPaint());
+        resource->stats->drawRectCalls++;
+        resource->getCanvas()->drawRect(rect, resource->getPaint());
     }
 
     void skia_render_selection(SkiaResource* resource, SkFont * font, const char* text, int text_length , int selection_start, int selection_end){
+        SKIA_TRACE_FN();
         if ( selection_start == selection_end){ return; }
 
         int glyphCount = font->textToGlyphs(text, text_length, SkTextEncoding::kUTF8, NULL, 0);
@@ -440,12 +5942,14 @@ extern "C" {
         float endX = xposs[endIndex] + widths[endIndex];
 
         SkRect rect = SkRect::MakeXYWH(startX, 0, endX - startX, font->getSpacing());
-        resource->surface->getCanvas()->drawRect(rect, resource->getPaint());
+        resource->stats->drawRectCalls++;
+        resource->getCanvas()->drawRect(rect, resource->getPaint());
 
     }
 
     //https://developer.apple.com/fonts/TrueType-Reference-Manual/
     int skia_index_for_position(SkFont* font, const char* text, int text_length, float px){
+        SKIA_TRACE_FN();
         int glyphCount = font->textToGlyphs(text, text_length, SkTextEncoding::kUTF8, NULL, 0);
         std::vector<SkGlyphID> glyphs(glyphCount);
         font->textToGlyphs(text, text_length, SkTextEncoding::kUTF8, glyphs.data(), glyphs.size());
@@ -474,19 +5978,29 @@ extern "C" {
     }
 
     void skia_save(SkiaResource* resource){
-        resource->surface->getCanvas()->save();
+        resource->getCanvas()->save();
+    }
+
+    // Like skia_save, but while a hit index is attached, draws until the
+    // matching skia_restore are recorded under `id`.
+    void skia_save_id(SkiaResource* resource, int64_t id){
+        SKIA_TRACE_FN();
+        resource->getCanvas()->save();
+        if ( resource->hitCanvas ){
+            static_cast<HitRecordingCanvas*>(resource->hitCanvas.get())->pushId(id);
+        }
     }
 
     void skia_restore(SkiaResource* resource){
-        resource->surface->getCanvas()->restore();
+        resource->getCanvas()->restore();
     }
 
     void skia_translate(SkiaResource* resource, float tx, float ty){
-        resource->surface->getCanvas()->translate(tx, ty);
+        resource->getCanvas()->translate(tx, ty);
     }
 
     void skia_rotate(SkiaResource* resource, float degrees){
-        resource->surface->getCanvas()->rotate(degrees);
+        resource->getCanvas()->rotate(degrees);
     }
 
     void skia_transform(SkiaResource* resource, 
@@ -497,17 +6011,42 @@ extern "C" {
                         float  	scaleY,
                         float  	transY
     ){
+        SKIA_TRACE_FN();
         SkMatrix matrix;
         // float affine[] = {scaleX, skewX, transX, skewY, scaleY, transY};
 
         // column major order
         float affine[] = {scaleX, skewY, skewX, scaleY, transX, transY};
         matrix.setAffine(affine);
-        resource->surface->getCanvas()->concat(matrix);
+        resource->getCanvas()->concat(matrix);
     }
 
     void skia_clip_rect(SkiaResource* resource, float ox, float oy, float width, float height){
-        resource->surface->getCanvas()->clipRect(SkRect::MakeXYWH(ox, oy, width, height));
+        resource->getCanvas()->clipRect(SkRect::MakeXYWH(ox, oy, width, height));
+    }
+
+    // Returns 1 if nothing drawn inside the rect could be visible with
+    // the current matrix and clip.
+    int skia_quick_reject(SkiaResource* resource, float x, float y, float width, float height){
+        return resource->getCanvas()->quickReject(SkRect::MakeXYWH(x, y, width, height));
+    }
+
+    // `rects` holds `count` x, y, width, height quads. Sets bit i of
+    // `visible` (64 per word) when rect i survives skia_quick_reject and
+    // returns the number of visible rects.
+    int skia_quick_reject_batch(SkiaResource* resource, const float* rects, int count, uint64_t* visible){
+        SKIA_TRACE_FN();
+        SkCanvas* canvas = resource->getCanvas();
+        memset(visible, 0, sizeof(uint64_t) * ((count + 63) / 64));
+        int visibleCount = 0;
+        for (int i = 0; i < count; i++){
+            const float* r = rects + 4 * i;
+            if ( !canvas->quickReject(SkRect::MakeXYWH(r[0], r[1], r[2], r[3])) ){
+                visible[i >> 6] |= uint64_t(1) << (i & 63);
+                visibleCount++;
+            }
+        }
+        return visibleCount;
     }
 
     void skia_font_family_name(SkFont* font, char* familyName, size_t len){
@@ -544,53 +6083,126 @@ extern "C" {
     }
 
     SkFont* skia_load_font2(const char* name, float size, int weight, int width, int slant){
-        if ( name ){
-	    sk_sp<SkTypeface> typeface = SkFontMgr_RefDefault()->makeFromFile(name);
-            if ( typeface ){
-                SkFont* font = new SkFont(typeface, size);
+        SKIA_TRACE_FN();
+        FontKey key;
+        key.typeface.hasName = name != NULL;
+        key.typeface.name = name ? name : "";
+        // style only matters for name lookups
+        key.typeface.weight = name ? weight : -1;
+        key.typeface.width = name ? width : -1;
+        key.typeface.slant = name ? slant : -1;
+        key.size = size;
+
+        std::lock_guard<std::mutex> lock(g_font_cache_mutex);
+
+        auto it = g_font_cache.find(key);
+        if ( it != g_font_cache.end() ){
+            it->second.refCount += 1;
+            return it->second.font;
+        }
 
-                return font;
+        sk_sp<SkTypeface> typeface = findTypeface(key.typeface);
+        if ( !typeface ){
+            return NULL;
+        }
 
-            } else {
-                if ( width == -1 ){ width = SkFontStyle::kNormal_Width; }
-                if ( weight == -1 ){ weight = SkFontStyle::kNormal_Weight; }
+        SkFont* font = new SkFont(typeface, size);
+        g_font_cache.emplace(key, CachedFont{font, 1});
+        g_font_keys.emplace(font, key);
+        return font;
+    }
 
-                SkFontStyle::Slant skslant;
-                switch ( slant ){
-                case 2:
-                    skslant = SkFontStyle::kItalic_Slant;
-                    break;
-                case 3:
-                    skslant = SkFontStyle::kOblique_Slant;
-                    break;
-                case -1:
-                case 1:
-                default:
-                    skslant = SkFontStyle::kUpright_Slant;
-                    break;
-                }
+    // Releases a font returned by skia_load_font2.
+    void skia_font_release(SkFont* font){
+        std::lock_guard<std::mutex> lock(g_font_cache_mutex);
+
+        auto keyIt = g_font_keys.find(font);
+        if ( keyIt == g_font_keys.end() ){
+            return;
+        }
 
-                SkFontStyle style(weight, width, skslant);
-                sk_sp<SkTypeface> typeface = SkFontMgr_RefDefault()->legacyMakeTypeface(name, style);
+        auto it = g_font_cache.find(keyIt->second);
+        it->second.refCount -= 1;
+        if ( it->second.refCount <= 0 ){
+            g_font_cache.erase(it);
+            g_font_keys.erase(keyIt);
+            delete font;
+        }
+    }
 
-                if ( typeface ){
-                    return new SkFont(typeface, size);
-                } else {
-                    return NULL;
-                }
+    static void warmupFonts(const std::vector<FontWarmup>& fonts, const std::string& text, float scale){
+        SkFontMgr_RefDefault();
+
+        if ( text.empty() ){
+            return;
+        }
+
+        sk_sp<SkSurface> surface(SkSurfaces::Raster(SkImageInfo::MakeN32Premul(1, 1)));
+        SkCanvas* canvas = surface->getCanvas();
+        canvas->scale(scale, scale);
+
+        SkPaint paint;
+        paint.setAntiAlias(true);
+
+        for (const FontWarmup& warmup : fonts){
+            SkFont* font = skia_load_font2(warmup.hasName ? warmup.name.c_str() : NULL,
+                                           warmup.size, warmup.weight, warmup.width, warmup.slant);
+            if ( font ){
+                canvas->drawSimpleText(text.data(), text.size(), SkTextEncoding::kUTF8, 0, 0, *font, paint);
+                skia_font_release(font);
             }
-        } else{
-            return new SkFont(SkFontMgr_RefDefault()->matchFamilyStyle(NULL, SkFontStyle()), size);
         }
     }
 
+    // Initializes the font manager and rasterizes `glyphs` for each font
+    // on a background thread so the first frame doesn't pay for it.
+    // `names` may contain NULL for the default font.
+    // The glyph masks end up in skia's global strike cache. That is the
+    // only cache warmed: glyphs are uploaded to a gpu context's atlas
+    // when first drawn with it, which has to happen on its own thread.
+    void skia_font_warmup_start(const char** names, const float* sizes,
+                                const int* weights, const int* widths, const int* slants, int fontCount,
+                                const char* glyphs, int glyphsLength, float scale){
+        std::vector<FontWarmup> fonts(fontCount);
+        for (int i = 0; i < fontCount; i++){
+            fonts[i].hasName = names[i] != NULL;
+            fonts[i].name = names[i] ? names[i] : "";
+            fonts[i].size = sizes[i];
+            fonts[i].weight = weights[i];
+            fonts[i].width = widths[i];
+            fonts[i].slant = slants[i];
+        }
+        std::string text(glyphs ? glyphs : "", glyphs ? glyphsLength : 0);
+
+        std::unique_lock<std::mutex> lock(g_warmup_mutex);
+        g_warmup_done.wait(lock, []{ return !g_warmup_running; });
+        g_warmup_running = true;
+
+        std::thread([fonts, text, scale]{
+            warmupFonts(fonts, text, scale);
+
+            std::lock_guard<std::mutex> lock(g_warmup_mutex);
+            g_warmup_running = false;
+            g_warmup_done.notify_all();
+        }).detach();
+    }
+
+    // Blocks until a warmup started with skia_font_warmup_start finishes.
+    void skia_font_warmup_wait(){
+        std::unique_lock<std::mutex> lock(g_warmup_mutex);
+        g_warmup_done.wait(lock, []{ return !g_warmup_running; });
+    }
+
+
 
     SkImage* skia_load_image(const char* path){
+        SKIA_TRACE_FN();
         sk_sp<SkImage> image = SkImages::DeferredFromEncodedData(SkData::MakeFromFileName(path));
         return image.release();
     }
 
     SkImage* skia_load_image_from_memory(const unsigned char *const buffer,int buffer_length){
+        SKIA_TRACE_FN();
 
         sk_sp<SkData> data = SkData::MakeWithCopy(buffer, buffer_length);
 
@@ -600,11 +6212,15 @@ extern "C" {
     }
 
     void skia_draw_image(SkiaResource* resource, SkImage* image){
-        resource->surface->getCanvas()->drawImage(image, 0, 0);
+        SKIA_TRACE_FN();
+        countImageDraw(resource, image);
+        resource->getCanvas()->drawImage(image, 0, 0);
     }
 
     void skia_draw_image_rect(SkiaResource* resource, SkImage* image, float w, float h){
-        resource->surface->getCanvas()->drawImageRect(image, SkRect::MakeXYWH(0.f, 0.f, w, h), SkSamplingOptions(), &resource->getPaint());
+        SKIA_TRACE_FN();
+        countImageDraw(resource, image);
+        resource->getCanvas()->drawImageRect(image, SkRect::MakeXYWH(0.f, 0.f, w, h), SkSamplingOptions(), &resource->getPaint());
     }
 
     void skia_image_bounds(SkImage* image, int* width, int* height){
@@ -612,7 +6228,53 @@ extern "C" {
         *height = image->height();
     }
 
+    AnimatedImage* skia_animated_image_load(const char* path){
+        SKIA_TRACE_FN();
+        return AnimatedImage::Make(SkData::MakeFromFileName(path));
+    }
+
+    AnimatedImage* skia_animated_image_load_from_memory(const unsigned char *const buffer, int buffer_length){
+        SKIA_TRACE_FN();
+        return AnimatedImage::Make(SkData::MakeWithCopy(buffer, buffer_length));
+    }
+
+    void skia_animated_image_delete(AnimatedImage* image){
+        delete image;
+    }
+
+    void skia_animated_image_bounds(AnimatedImage* image, int* width, int* height){
+        *width = image->decoder()->info().width();
+        *height = image->decoder()->info().height();
+    }
+
+    int skia_animated_image_frame_count(AnimatedImage* image){
+        return image->decoder()->frameCount();
+    }
+
+    int skia_animated_image_repetition_count(AnimatedImage* image){
+        return image->decoder()->repetitionCount();
+    }
+
+    int skia_animated_image_frame_duration(AnimatedImage* image, int frame){
+        return image->decoder()->frameDuration(std::clamp(frame, 0, image->decoder()->frameCount() - 1));
+    }
+
+    int skia_animated_image_frame_at(AnimatedImage* image, double ms){
+        return image->decoder()->frameAt(ms);
+    }
+
+    void skia_animated_image_prefetch(AnimatedImage* image, int frame){
+        image->decoder()->prefetch(std::clamp(frame, 0, image->decoder()->frameCount() - 1));
+    }
+
+    void skia_draw_animated_image(SkiaResource* resource, AnimatedImage* image, int frame, float w, float h){
+        SKIA_TRACE_FN();
+        resource->stats->drawImageCalls++;
+        image->draw(resource->getCanvas(), frame, SkRect::MakeWH(w, h), &resource->getPaint());
+    }
+
     void skia_draw_path(SkiaResource* resource, float* points, int count){
+        SKIA_TRACE_FN();
 
         if ( count >= 2){
             SkPath path;
@@ -622,12 +6284,14 @@ extern "C" {
                 path.lineTo(points[i], points[i + 1]);
             }
 
-            resource->surface->getCanvas()->drawPath(path, resource->getPaint());
+            resource->stats->drawPathCalls++;
+            resource->getCanvas()->drawPath(path, resource->getPaint());
 
         }
     }
 
     void skia_draw_polygon(SkiaResource* resource, float* points, int count){
+        SKIA_TRACE_FN();
         if ( count >= 2){
             SkPath path;
             path.moveTo(points[0], points[1]);
@@ -636,7 +6300,8 @@ extern "C" {
                 path.lineTo(points[i], points[i + 1]);
             }
 
-            resource->surface->getCanvas()->drawPath(path, resource->getPaint());
+            resource->stats->drawPathCalls++;
+            resource->getCanvas()->drawPath(path, resource->getPaint());
 
         }
     
@@ -679,19 +6344,23 @@ extern "C" {
     }
 
     void skia_skpath_draw(SkiaResource* resource, SkPath* path){
-        resource->surface->getCanvas()->drawPath(*path, resource->getPaint());
+        SKIA_TRACE_FN();
+        resource->stats->drawPathCalls++;
+        resource->getCanvas()->drawPath(*path, resource->getPaint());
     }
 
     void skia_draw_rounded_rect(SkiaResource* resource, float width, float height, float radius){
+        SKIA_TRACE_FN();
         SkRRect rrect = SkRRect::MakeRectXY({0, 0, width, height}, radius, radius);
-        resource->surface->getCanvas()->drawRRect(rrect, resource->getPaint());
+        resource->stats->drawRectCalls++;
+        resource->getCanvas()->drawRRect(rrect, resource->getPaint());
     }
 
     // works, but not sure about API
     // void skia_draw_rounded_rect_nine_patch(SkiaResource* resource, float width, float height, float leftRad, float topRad, float rightRad, float bottomRad){
     //     SkRRect rrect;
     //     rrect.setNinePatch({0, 0, width, height}, leftRad, topRad, rightRad, bottomRad);
-    //     resource->surface->getCanvas()->drawRRect(rrect, resource->getPaint());
+    //     resource->getCanvas()->drawRRect(rrect, resource->getPaint());
     // }
 
     void skia_push_paint(SkiaResource* resource){
@@ -719,6 +6388,7 @@ extern "C" {
     }
 
     SkiaResource* skia_offscreen_buffer(SkiaResource* resource, int width, int height){
+        SKIA_TRACE_FN();
 
         SkImageInfo info = SkImageInfo:: MakeN32Premul(width, height);
 
@@ -733,6 +6403,8 @@ extern "C" {
         }
 
         SkiaResource* cpuResource = new SkiaResource(resource->grContext, cpuSurface);
+        cpuResource->shareStats(resource);
+        resource->stats->offscreenSurfaces++;
 
         cpuResource->paints.pop();
         cpuResource->paints.emplace(SkPaint(resource->getPaint()));
@@ -741,6 +6413,7 @@ extern "C" {
     }
 
     SkImage* skia_offscreen_image(SkiaResource* resource){
+        SKIA_TRACE_FN();
         sk_sp<SkImage> imgP(resource->surface->makeImageSnapshot());
 
         delete resource;
@@ -769,6 +6442,7 @@ extern "C" {
     }
     
     SkData* skia_encode_image(SkiaResource* resource, int format, int quality){
+        SKIA_TRACE_FN();
         sk_sp<SkImage> img(resource->surface->makeImageSnapshot());
         if (!img) { return 0; }
 
@@ -812,6 +6486,7 @@ extern "C" {
     }
 
     int skia_save_image(SkiaResource* resource, int format, int quality, const char* path){
+        SKIA_TRACE_FN();
 
         SkData* img_data = skia_encode_image(resource, format, quality);
 
@@ -825,6 +6500,148 @@ extern "C" {
     }
 
 
+    // Creates a terminal grid that draws with a copy of `font`.
+    // Cells start out blank. See TerminalCell for the cell layout.
+    TerminalGrid* skia_terminal_grid_make(SkFont* font, int rows, int columns){
+        SKIA_TRACE_FN();
+        return new TerminalGrid(*font, rows, columns);
+    }
+
+    void skia_terminal_grid_delete(TerminalGrid* grid){
+        delete grid;
+    }
+
+    // Content in the overlapping top left region is kept.
+    void skia_terminal_grid_resize(TerminalGrid* grid, int rows, int columns){
+        SKIA_TRACE_FN();
+        grid->resize(rows, columns);
+    }
+
+    // Replaces `rowCount` full rows starting at `startRow`.
+    // Returns the number of rows whose content changed.
+    int skia_terminal_grid_set_cells(TerminalGrid* grid, int startRow, int rowCount, const TerminalCell* cells){
+        SKIA_TRACE_FN();
+        return grid->setCells(startRow, rowCount, cells);
+    }
+
+    // Scrolls rows [top, bottom) up by `count` rows (down if negative).
+    void skia_terminal_grid_scroll(TerminalGrid* grid, int top, int bottom, int count){
+        SKIA_TRACE_FN();
+        grid->scroll(top, bottom, count);
+    }
+
+    // Colors used for cells whose fg or bg is 0.
+    void skia_terminal_grid_set_default_colors(TerminalGrid* grid, SkColor fg, SkColor bg){
+        grid->setDefaultColors(fg, bg);
+    }
+
+    void skia_terminal_grid_cell_size(TerminalGrid* grid, float* width, float* height){
+        *width = grid->cellWidth();
+        *height = grid->cellHeight();
+    }
+
+    void skia_terminal_grid_draw(SkiaResource* resource, TerminalGrid* grid){
+        SKIA_TRACE_FN();
+        grid->draw(resource);
+    }
+
+    // Starts `shell` (or $SHELL) on a new pty with a reader thread that
+    // buffers up to `bufferBytes` of output. Returns NULL on failure.
+    PtySession* skia_pty_session_start(const char* shell, int rows, int columns, int64_t bufferBytes){
+        SKIA_TRACE_FN();
+        PtySession* session = new PtySession(rows, columns, std::max<int64_t>(bufferBytes, 0));
+        if ( !session->start(shell) ){
+            delete session;
+            return NULL;
+        }
+        return session;
+    }
+
+    // Stops the reader thread, hangs up on the shell and frees the session.
+    void skia_pty_session_delete(PtySession* session){
+        delete session;
+    }
+
+    // Parses at most `maxBytes` of buffered output into the screen.
+    // Returns the number of bytes parsed or -1 once the shell has exited
+    // and all of its output has been parsed.
+    int64_t skia_pty_session_poll(PtySession* session, int64_t maxBytes){
+        SKIA_TRACE_FN();
+        return session->poll(maxBytes);
+    }
+
+    // Waits up to `timeoutMillis` for output. Returns 1 if there is
+    // output to poll or the shell has exited.
+    int skia_pty_session_wait(PtySession* session, int timeoutMillis){
+        return session->waitForOutput(timeoutMillis) ? 1 : 0;
+    }
+
+    // Queues input for the shell. The session's reader thread writes it,
+    // so this never blocks. Returns the queued length or -1.
+    int skia_pty_session_write(PtySession* session, const char* data, int length){
+        return session->write(data, length);
+    }
+
+    void skia_pty_session_resize(PtySession* session, int rows, int columns){
+        session->resize(rows, columns);
+    }
+
+    void skia_pty_session_size(PtySession* session, int* rows, int* columns){
+        *rows = session->screen().rows();
+        *columns = session->screen().columns();
+    }
+
+    void skia_pty_session_cursor(PtySession* session, int* row, int* column, int* visible){
+        VtScreen& screen = session->screen();
+        *row = screen.cursorRow();
+        *column = screen.cursorColumn();
+        *visible = screen.cursorVisible();
+    }
+
+    // Writes the indexes of rows changed since the last call into `rows`
+    // and returns how many there were. Rows beyond `maxRows` stay dirty.
+    int skia_pty_session_dirty_rows(PtySession* session, int* rows, int maxRows){
+        VtScreen& screen = session->screen();
+        int count = 0;
+        for (int row = 0; row < screen.rows() && count < maxRows; row++){
+            if ( screen.takeDirty(row) ){
+                rows[count++] = row;
+            }
+        }
+        return count;
+    }
+
+    // Copies one row of the screen into `cells`, which must hold a full row.
+    void skia_pty_session_row(PtySession* session, int row, TerminalCell* cells){
+        VtScreen& screen = session->screen();
+        memcpy(cells, screen.row(row), sizeof(TerminalCell) * screen.columns());
+    }
+
+    // Brings `grid` up to date with the screen, copying only dirty rows.
+    // Returns the number of grid rows that changed.
+    int skia_pty_session_update_grid(PtySession* session, TerminalGrid* grid){
+        SKIA_TRACE_FN();
+        VtScreen& screen = session->screen();
+        int rows = screen.rows();
+        int columns = screen.columns();
+        if ( grid->rows() != rows || grid->columns() != columns ){
+            grid->resize(rows, columns);
+        }
+
+        int scroll = screen.takeScroll();
+        if ( scroll ){
+            grid->scroll(0, rows, scroll);
+        }
+
+        int changed = 0;
+        for (int row = 0; row < rows; row++){
+            if ( screen.takeDirty(row) ){
+                changed += grid->setCells(row, 1, screen.row(row));
+            }
+        }
+        return changed;
+    }
+
     int skia_fork_pty(unsigned short rows, unsigned short columns){
         // struct winsize ws = {.ws_row = rows, .ws_col = columns};
         // int pt;
@@ -875,36 +6692,40 @@ extern "C" {
         o->unref();
     }
 
-    void skia_ParagraphBuilder_delete(ParagraphBuilder* pb){
+    void skia_ParagraphBuilder_delete(ParagraphRecorder* pb){
         delete pb;
     }
 
-    ParagraphBuilder* skia_ParagraphBuilder_make(ParagraphStyle* paragraphStyle){
-
-        auto fontCollection = sk_make_sp<FontCollection>();
-        fontCollection->setDefaultFontManager(SkFontMgr_RefDefault());
-        // fontCollection->enableFontFallback();
+    // Builders record their calls and are built with the font collection
+    // of the thread that builds them, see PARALLEL LAYOUT.
+    ParagraphRecorder* skia_ParagraphBuilder_make(ParagraphStyle* paragraphStyle){
+        SKIA_TRACE_FN();
+        return new ParagraphRecorder(*paragraphStyle);
+    }
 
-        ParagraphBuilder* pb = ParagraphBuilder::make(*paragraphStyle, fontCollection).release();
-        return pb;
+    // Released when `resource`'s frame ends. Never pass to skia_ParagraphBuilder_delete.
+    ParagraphRecorder* skia_ParagraphBuilder_make_frame(SkiaResource* resource, ParagraphStyle* paragraphStyle){
+        SKIA_TRACE_FN();
+        return resource->getFrameArena()->make<ParagraphRecorder>(*paragraphStyle);
     }
-    void skia_ParagraphBuilder_pushStyle(ParagraphBuilder *pb, TextStyle* style){
+    void skia_ParagraphBuilder_pushStyle(ParagraphRecorder *pb, TextStyle* style){
         pb->pushStyle(*style);
     }
-    void skia_ParagraphBuilder_pop(ParagraphBuilder *pb){
+    void skia_ParagraphBuilder_pop(ParagraphRecorder *pb){
         pb->pop();
     }
-    void skia_ParagraphBuilder_addText(ParagraphBuilder *pb, char* text, int len){
+    void skia_ParagraphBuilder_addText(ParagraphRecorder *pb, char* text, int len){
+        SKIA_TRACE_FN();
         pb->addText(text, len);
     }
 
-    void skia_ParagraphBuilder_addPlaceholder(ParagraphBuilder *pb, PlaceholderStyle* placeholderStyle){
+    void skia_ParagraphBuilder_addPlaceholder(ParagraphRecorder *pb, PlaceholderStyle* placeholderStyle){
         pb->addPlaceholder(*placeholderStyle);
     }
 
     // PlaceholderStyle(SkScalar width, SkScalar height, PlaceholderAlignment alignment,
     //                  TextBaseline baseline, SkScalar offset)
-    void skia_ParagraphBuilder_addPlaceholder2(ParagraphBuilder *pb, float width, float height, int alignment, int baseline, float offset){
+    void skia_ParagraphBuilder_addPlaceholder2(ParagraphRecorder *pb, float width, float height, int alignment, int baseline, float offset){
         PlaceholderStyle style(width, height, (PlaceholderAlignment)alignment, (TextBaseline)baseline, offset);
         pb->addPlaceholder(style);
     }
@@ -914,11 +6735,20 @@ extern "C" {
         delete p;
     }
 
-    Paragraph* skia_ParagraphBuilder_build(ParagraphBuilder *pb){
-        return pb->Build().release();
+    Paragraph* skia_ParagraphBuilder_build(ParagraphRecorder *pb){
+        SKIA_TRACE_FN();
+        return pb->build().release();
+    }
+
+    // Builds and lays out `count` paragraphs in parallel. `paragraphs`
+    // receives the paragraphs, to be freed with skia_Paragraph_delete, and
+    // `metrics` [height, maxIntrinsicWidth] for each paragraph.
+    void skia_ParagraphBuilder_build_batch(ParagraphRecorder** pbs, float* widths, int count, Paragraph** paragraphs, float* metrics){
+        SKIA_TRACE_FN();
+        layoutParagraphs(pbs, widths, count, paragraphs, metrics);
     }
-    void skia_ParagraphBuilder_reset(ParagraphBuilder *pb){
-        pb->Reset();
+    void skia_ParagraphBuilder_reset(ParagraphRecorder *pb){
+        pb->reset();
     }
 
     void skia_StrutStyle_delete(StrutStyle* style){
@@ -928,6 +6758,10 @@ extern "C" {
     StrutStyle* skia_StrutStyle_make(){
         return new StrutStyle();
     }
+    // Released when `resource`'s frame ends. Never pass to skia_StrutStyle_delete.
+    StrutStyle* skia_StrutStyle_make_frame(SkiaResource* resource){
+        return resource->getFrameArena()->make<StrutStyle>();
+    }
     void skia_StrutStyle_setFontFamilies(StrutStyle* style, SkString** familiesArr, int familiesCount) { 
 	std::vector<SkString> families(familiesCount);
         for (int i = 0; i < familiesCount; ++i) {
@@ -951,6 +6785,10 @@ extern "C" {
     TextStyle* skia_TextStyle_make(){
         return new TextStyle();
     }
+    // Released when `resource`'s frame ends. Never pass to skia_TextStyle_delete.
+    TextStyle* skia_TextStyle_make_frame(SkiaResource* resource){
+        return resource->getFrameArena()->make<TextStyle>();
+    }
 
     void skia_TextStyle_setColor(TextStyle* style, uint32_t color ){
         style->setColor(color);
@@ -1066,6 +6904,10 @@ extern "C" {
     ParagraphStyle* skia_ParagraphStyle_make(){
         return new ParagraphStyle();
     }
+    // Released when `resource`'s frame ends. Never pass to skia_ParagraphStyle_delete.
+    ParagraphStyle* skia_ParagraphStyle_make_frame(SkiaResource* resource){
+        return resource->getFrameArena()->make<ParagraphStyle>();
+    }
 
     void skia_ParagraphStyle_turnHintingOff(ParagraphStyle* paragraphStyle){
         paragraphStyle->turnHintingOff();
@@ -1146,6 +6988,10 @@ extern "C" {
     SkString* skia_SkString_make_utf8(char *s, int len){
         return new SkString(s, len);
     }
+    // Released when `resource`'s frame ends. Never pass to skia_SkString_delete.
+    SkString* skia_SkString_make_utf8_frame(SkiaResource* resource, char *s, int len){
+        return resource->getFrameArena()->make<SkString>(s, len);
+    }
     void skia_SkString_delete(SkString* s){
         delete s;
     }
@@ -1184,15 +7030,129 @@ extern "C" {
     }
     // ;; virtual void layout(SkScalar width) = 0;
     void skia_Paragraph_layout(Paragraph* para, float width){
+        SKIA_TRACE_FN();
         return para->layout(width);
     }
+
     // ;; virtual void paint(SkCanvas* canvas, SkScalar x, SkScalar y) = 0;
     void skia_Paragraph_paint(Paragraph* para, SkiaResource* resource, float x, float y){
-        SkCanvas* canvas = resource->surface->getCanvas();
+        SKIA_TRACE_FN();
+        resource->stats->drawParagraphCalls++;
+        SkCanvas* canvas = resource->getCanvas();
         return para->paint(canvas, x, y);
     }
     // ;; virtual void paint(ParagraphPainter* painter, SkScalar x, SkScalar y) = 0;
 
+    DocumentLayout* skia_DocumentLayout_make(ParagraphStyle* paragraphStyle, float width){
+        SKIA_TRACE_FN();
+        return new DocumentLayout(*paragraphStyle, width);
+    }
+
+    void skia_DocumentLayout_delete(DocumentLayout* doc){
+        delete doc;
+    }
+
+    void skia_DocumentLayout_setText(DocumentLayout* doc, const char* text, int64_t len){
+        SKIA_TRACE_FN();
+        doc->setText(text, len);
+    }
+
+    void skia_DocumentLayout_replaceLines(DocumentLayout* doc, int start, int count, const char* text, int64_t len){
+        SKIA_TRACE_FN();
+        doc->replaceLines(start, count, text, len);
+    }
+
+    void skia_DocumentLayout_setWidth(DocumentLayout* doc, float width){
+        doc->setWidth(width);
+    }
+
+    int skia_DocumentLayout_getLineCount(DocumentLayout* doc){
+        return doc->lineCount();
+    }
+
+    float skia_DocumentLayout_getHeight(DocumentLayout* doc){
+        return doc->height();
+    }
+
+    float skia_DocumentLayout_getLineTop(DocumentLayout* doc, int line){
+        return doc->top(line);
+    }
+
+    int skia_DocumentLayout_getLineAt(DocumentLayout* doc, float y){
+        return doc->lineAt(y);
+    }
+
+    // Valid until the next edit or paint. Use with the skia_Paragraph_ functions.
+    Paragraph* skia_DocumentLayout_getLineParagraph(DocumentLayout* doc, int line){
+        if ( line < 0 || line >= doc->lineCount() ){
+            return nullptr;
+        }
+        return doc->paragraph(line);
+    }
+
+    void skia_DocumentLayout_paint(DocumentLayout* doc, SkiaResource* resource, float x, float y){
+        SKIA_TRACE_FN();
+        resource->stats->drawParagraphCalls++;
+        doc->paint(resource->getCanvas(), x, y);
+    }
+
+    EditableParagraph* skia_EditableParagraph_make(ParagraphStyle* paragraphStyle, float width){
+        return new EditableParagraph(*paragraphStyle, width);
+    }
+
+    void skia_EditableParagraph_delete(EditableParagraph* para){
+        delete para;
+    }
+
+    void skia_EditableParagraph_replaceText(EditableParagraph* para, int from, int to, const char* text, int len){
+        SKIA_TRACE_FN();
+        para->replaceText(from, to, text, len);
+    }
+
+    void skia_EditableParagraph_setStyle(EditableParagraph* para, int from, int to, TextStyle* style){
+        SKIA_TRACE_FN();
+        para->setStyle(from, to, style);
+    }
+
+    void skia_EditableParagraph_setWidth(EditableParagraph* para, float width){
+        para->setWidth(width);
+    }
+
+    float skia_EditableParagraph_getHeight(EditableParagraph* para){
+        return para->height();
+    }
+
+    float skia_EditableParagraph_getMaxIntrinsicWidth(EditableParagraph* para){
+        return para->maxIntrinsicWidth();
+    }
+
+    void skia_EditableParagraph_paint(EditableParagraph* para, SkiaResource* resource, float x, float y){
+        SKIA_TRACE_FN();
+        resource->stats->drawParagraphCalls++;
+        para->paint(resource->getCanvas(), x, y);
+    }
+
+    int skia_EditableParagraph_getRectsForRange(EditableParagraph* para, int start, int end, int rectHeightStyle, int rectWidthStyle, float* buf, int max){
+        SKIA_TRACE_FN();
+        auto boxes = para->rectsForRange(start, end, (RectHeightStyle)rectHeightStyle, (RectWidthStyle)rectWidthStyle);
+        int cnt = std::min(boxes.size(), (size_t)max);
+        for( int i = 0; i < cnt; i++){
+            SkRect rect(boxes[i].rect);
+            buf[i*4+0] = rect.x();
+            buf[i*4+1] = rect.y();
+            buf[i*4+2] = rect.width();
+            buf[i*4+3] = rect.height();
+        }
+        return boxes.size();
+    }
+
+    void skia_EditableParagraph_getGlyphPositionAtCoordinate(EditableParagraph* para, float dx, float dy, int* pos, int* affinity){
+        SKIA_TRACE_FN();
+        PositionWithAffinity pwa = para->positionAt(dx, dy);
+        *pos = pwa.position;
+        *affinity = pwa.affinity == kUpstream ? 0 : 1;
+    }
+
     // ;; // Returns a vector of bounding boxes that enclose all text between
     // ;; // start and end glyph indexes, including start and excluding end
     // ;; virtual std::vector<TextBox> getRectsForRange(unsigned start,
@@ -1201,6 +7161,7 @@ extern "C" {
     // ;;                                               RectWidthStyle rectWidthStyle) = 0;
 //    skia_Paragraph_getRectsForRange(Paragraph* para);
     int skia_Paragraph_getRectsForRange(Paragraph* para, int start, int end, int rectHeightStyle, int rectWidthStyle, float* buf, int max){
+        SKIA_TRACE_FN();
         auto boxes = para->getRectsForRange(start, end, (RectHeightStyle)rectHeightStyle, (RectWidthStyle)rectWidthStyle);
         int cnt = std::min(boxes.size(), (size_t)max);
         for( int i = 0; i < cnt; i++){
@@ -1213,10 +7174,72 @@ extern "C" {
             
         }
 
-        return cnt;
+        // the full count, so callers can retry with a bigger buffer
+        return boxes.size();
         
     }
 
+    // Rects for `count` ranges given as [start, end) pairs in `ranges`.
+    // `counts` receives the number of rects for each range and `buf` as
+    // many rects as fit in `max`. Returns the total number of rects, so
+    // callers can pass max = 0 to size their buffer first.
+    int skia_Paragraph_getRectsForRanges(Paragraph* para, int* ranges, int count, int rectHeightStyle, int rectWidthStyle, float* buf, int* counts, int max){
+        SKIA_TRACE_FN();
+        int total = 0;
+        for (int r = 0; r < count; r++){
+            auto boxes = para->getRectsForRange(ranges[r*2+0], ranges[r*2+1], (RectHeightStyle)rectHeightStyle, (RectWidthStyle)rectWidthStyle);
+            counts[r] = boxes.size();
+            for (const TextBox& box : boxes){
+                if ( total < max ){
+                    buf[total*4+0] = box.rect.x();
+                    buf[total*4+1] = box.rect.y();
+                    buf[total*4+2] = box.rect.width();
+                    buf[total*4+3] = box.rect.height();
+                }
+                total++;
+            }
+        }
+        return total;
+    }
+
+    // Line metrics for every line. `indices` receives [start, end,
+    // endExcludingWhitespaces, endIncludingNewline, hardBreak] and
+    // `metrics` receives [baseline, ascent, descent, height, width, left]
+    // for up to `max` lines. Returns the number of lines, so callers can
+    // pass max = 0 to size their buffers first.
+    int skia_Paragraph_getLineMetrics(Paragraph* para, int* indices, float* metrics, int max){
+        SKIA_TRACE_FN();
+        std::vector<LineMetrics> lines;
+        para->getLineMetrics(lines);
+        int cnt = std::min(lines.size(), (size_t)max);
+        for (int i = 0; i < cnt; i++){
+            const LineMetrics& line = lines[i];
+            indices[i*5+0] = line.fStartIndex;
+            indices[i*5+1] = line.fEndIndex;
+            indices[i*5+2] = line.fEndExcludingWhitespaces;
+            indices[i*5+3] = line.fEndIncludingNewline;
+            indices[i*5+4] = line.fHardBreak;
+            metrics[i*6+0] = line.fBaseline;
+            metrics[i*6+1] = line.fAscent;
+            metrics[i*6+2] = line.fDescent;
+            metrics[i*6+3] = line.fHeight;
+            metrics[i*6+4] = line.fWidth;
+            metrics[i*6+5] = line.fLeft;
+        }
+        return lines.size();
+    }
+
+    // Glyph positions for `count` points given as [x, y] pairs in
+    // `points`. `out` receives [position, affinity] for each point.
+    void skia_Paragraph_getGlyphPositionsAtCoordinates(Paragraph* para, float* points, int count, int* out){
+        SKIA_TRACE_FN();
+        for (int i = 0; i < count; i++){
+            PositionWithAffinity pwa = para->getGlyphPositionAtCoordinate(points[i*2+0], points[i*2+1]);
+            out[i*2+0] = pwa.position;
+            out[i*2+1] = pwa.affinity == kUpstream ? 0 : 1;
+        }
+    }
+
 
 // struct TextBox {
 //     SkRect rect;
@@ -1226,6 +7249,7 @@ extern "C" {
 // };
     // ;; virtual std::vector<TextBox> getRectsForPlaceholders() = 0;
     int skia_Paragraph_getRectsForPlaceholders(Paragraph* para, float* buf, int max){
+        SKIA_TRACE_FN();
         
         auto boxes = para->getRectsForPlaceholders();
         int cnt = std::min(boxes.size(), (size_t)max);
@@ -1239,7 +7263,7 @@ extern "C" {
             
         }
 
-        return cnt;
+        return boxes.size();
     }
 
 //    skia_Paragraph_getRectsForPlaceHolders(Paragraph* para);
@@ -1247,6 +7271,7 @@ extern "C" {
     // ;; // with the top left corner as the origin, and +y direction as down
     // ;; virtual PositionWithAffinity getGlyphPositionAtCoordinate(SkScalar dx, SkScalar dy) = 0;
     void skia_Paragraph_getGlyphPositionAtCoordinate(Paragraph* para, float dx, float dy, int* pos, int* affinity){
+        SKIA_TRACE_FN();
         PositionWithAffinity pwa = para->getGlyphPositionAtCoordinate(dx, dy);
 
         *pos = pwa.position;
@@ -1288,6 +7313,7 @@ extern "C" {
     }
 
     SkSVGDOM* skia_SkSVGDOM_make(SkStream* stream){
+        SKIA_TRACE_FN();
         auto builder = SkSVGDOM::Builder();
         builder.setFontManager(SkFontMgr_RefDefault());
         builder.setTextShapingFactory(SkShapers::BestAvailable());
@@ -1300,7 +7326,9 @@ extern "C" {
     }
 
     void skia_SkSVGDOM_render(SkSVGDOM* svg, SkiaResource* resource){
-        svg->render(resource->surface->getCanvas());
+        SKIA_TRACE_FN();
+        resource->stats->drawSvgCalls++;
+        svg->render(resource->getCanvas());
     }
 
     void skia_SkSVGDOM_set_container_size(SkSVGDOM* svg, float width, float height){
@@ -1320,6 +7348,11 @@ extern "C" {
         return new SkPaint();
     }
 
+    // Released when `resource`'s frame ends. Never pass to skia_Paint_delete.
+    SkPaint* skia_Paint_make_frame(SkiaResource* resource){
+        return resource->getFrameArena()->make<SkPaint>();
+    }
+
     void skia_Paint_delete(SkPaint* paint){
         delete paint;
     }
@@ -8,7 +8,78 @@
 #include "include/core/SkCanvas.h"
 #include "include/core/SkFont.h"
 #include "SkTextBlob.h"
+#include "SkPictureRecorder.h"
+#include "include/utils/SkNWayCanvas.h"
+#include <chrono>
+#include <memory>
+#include <string>
 
+// Per frame counters. Reset by skia_clear.
+// Every field is an int64_t so the layout is trivial to read over ffi.
+struct SkiaFrameStats {
+    int64_t drawTextCalls;
+    int64_t drawParagraphCalls;
+    int64_t drawPathCalls;
+    int64_t drawRectCalls;
+    int64_t drawImageCalls;
+    int64_t drawPixelsCalls;
+    int64_t drawSurfaceCalls;
+    int64_t drawSvgCalls;
+
+    // utf8 bytes passed to skia_render_line
+    int64_t textBytes;
+    // draws of images that are decoded on demand. This counts draws, not
+    // decodes: skia doesn't report whether the decoded pixels were cached.
+    int64_t lazyImageDraws;
+    // draws of cpu backed images to a gpu surface, uploaded unless cached
+    int64_t imageUploads;
+    // bytes copied from caller buffers
+    int64_t pixelBytes;
+    int64_t offscreenSurfaces;
+
+    int64_t flushNanos;
+    // time from skia_clear to the end of skia_flush_and_submit
+    int64_t frameNanos;
+
+    int64_t gpuResourceCount;
+    int64_t gpuResourceBytes;
+    int64_t gpuResourceBudgetBytes;
+};
+
+// Frame pacing counters, see FrameScheduler in skia.cpp.
+struct SkiaFrameSchedulerStats {
+    int64_t frames;
+    // repaint requests, several requests may be merged into one frame
+    int64_t requests;
+    // frames that presented after the refresh they were meant for
+    int64_t missedDeadlines;
+    // time from the start of drawing until the swap returned
+    int64_t lastFrameNanos;
+    int64_t worstFrameNanos;
+    int64_t periodNanos;
+};
+
+// A single terminal cell, laid out for ffi.
+// A codepoint of 0 is an empty cell. Colors are ARGB and 0 means
+// the grid's default color.
+struct TerminalCell {
+    uint32_t codepoint;
+    uint32_t fg;
+    uint32_t bg;
+    // bold = 1, italic = 2, underline = 4, strike = 8, inverse = 16, conceal = 32
+    uint32_t attrs;
+};
+
+class TerminalGrid;
+class PtySession;
+class SharedPixels;
+class YuvVideo;
+class FrameScheduler;
+class RenderThread;
+class HitIndex;
+class AnimatedImage;
+class SceneGraph;
+class FrameArena;
 
 class SkiaResource {
 
@@ -20,10 +91,40 @@ public:
     sk_sp<SkSurface> surface;
     std::stack<SkPaint> paints;
 
-    ~SkiaResource(){
-        grContext.reset();
-        surface.reset();
-    }
+    // offscreen buffers report into their parent's stats, see shareStats
+    std::shared_ptr<SkiaFrameStats> statsOwner = std::make_shared<SkiaFrameStats>();
+    SkiaFrameStats* stats = statsOwner.get();
+    std::chrono::steady_clock::time_point frameStart;
+
+    // frame capture, see skia_capture_next_frame
+    std::string capturePath;
+    std::unique_ptr<SkPictureRecorder> captureRecorder;
+    std::unique_ptr<SkNWayCanvas> captureCanvas;
+
+    // set while a frame is recorded for a render thread, see RenderThread
+    SkCanvas* frameCanvas = nullptr;
+    // true if frames are replayed on a RenderThread, which owns the gpu
+    // context. Draws that need the context are rejected instead of
+    // silently copying pixels; pixel writes are recorded as image draws.
+    bool rendersOnOtherThread = false;
+
+    // draws are recorded into hitIndex through hitCanvas, see skia_save_id
+    HitIndex* hitIndex = nullptr;
+    std::unique_ptr<SkNWayCanvas> hitCanvas;
+
+    // windows sharing a gpu context draw into a texture that is copied
+    // to the window's framebuffer, see skia_present_shared
+    bool sharedContext = false;
+    unsigned int presentTexture = 0;
+    unsigned int presentFramebuffer = 0;
+
+    // -1 keeps skia's default, see skia_set_resource_cache_limit
+    int64_t resourceCacheLimit = -1;
+
+    // transient objects released when the frame ends, see getFrameArena
+    FrameArena* frameArena = nullptr;
+
+    ~SkiaResource();
 
     SkiaResource(sk_sp<GrDirectContext> _grContext, sk_sp<SkSurface> _surface):grContext(_grContext), surface(_surface){
         paints.emplace(SkPaint());
@@ -37,6 +138,38 @@ public:
         return paints.top();
     }
 
+    // All drawing should go through this canvas so that it can be
+    // redirected while a frame is being captured.
+    SkCanvas* getCanvas(){
+        if ( captureCanvas ){
+            return captureCanvas.get();
+        }
+        return getTargetCanvas();
+    }
+
+    // The canvas a frame capture tees into.
+    SkCanvas* getTargetCanvas(){
+        if ( hitCanvas ){
+            return hitCanvas.get();
+        }
+        if ( frameCanvas ){
+            return frameCanvas;
+        }
+        return surface->getCanvas();
+    }
+
+    // True if draws are recorded and played back later, so pixels
+    // that are reused after the draw call must be copied.
+    bool defersDrawing(){
+        return captureCanvas || frameCanvas;
+    }
+
+    // Reports into `parent`'s stats. They stay valid if `parent` is deleted first.
+    void shareStats(SkiaResource* parent){
+        statsOwner = parent->statsOwner;
+        stats = statsOwner.get();
+    }
+
     void pushPaint(){
         paints.emplace(SkPaint(paints.top()));
     }
@@ -44,6 +177,9 @@ public:
     void popPaint(){
         paints.pop();
     }
+
+    FrameArena* getFrameArena();
+    void endFrame();
 };
 
 
@@ -51,7 +187,25 @@ extern "C"{
     SkiaResource* skia_init();
     SkiaResource* skia_init_cpu(int width, int height);
 
+    void skia_set_shader_cache(const char* path, int64_t maxBytes, int strategy);
+    int skia_shader_cache_stats(int64_t* out);
     void skia_reshape(SkiaResource* resource, int frameBufferWidth, int frameBufferHeight, float xscale, float yscale);
+    GrDirectContext* skia_shared_context_make();
+    void skia_shared_context_delete(GrDirectContext* context);
+    SkiaResource* skia_init_shared(GrDirectContext* context);
+    void skia_reshape_shared(SkiaResource* resource, int frameBufferWidth, int frameBufferHeight, float xscale, float yscale);
+    void skia_present_shared(SkiaResource* resource);
+    void skia_release_present_shared(SkiaResource* resource);
+
+    void skia_set_resource_cache_limit(SkiaResource* resource, int64_t maxBytes);
+    void skia_frame_arena_set_debug(int debug);
+    void skia_resource_cache_usage(SkiaResource* resource, int64_t* usage);
+    void skia_purge_unused_resources(SkiaResource* resource, int64_t msNotUsed);
+    void skia_free_gpu_resources(SkiaResource* resource);
+    void skia_memory_pressure_notify(int level);
+    int skia_memory_pressure_take();
+    int skia_memory_pressure_watch();
+    void skia_handle_memory_pressure(SkiaResource* resource, int level);
     void skia_clear(SkiaResource* resources);
     void skia_flush(SkiaResource* resources);
     void skia_cleanup(SkiaResource* resources);
@@ -86,21 +240,40 @@ extern "C"{
     void skia_text_bounds(SkFont* font, const char* text, int text_length, float* ox, float* oy, float* width, float* height);
 
     void skia_save(SkiaResource* resource);
+    void skia_save_id(SkiaResource* resource, int64_t id);
     void skia_restore(SkiaResource* resource);
     void skia_translate(SkiaResource* resource, float tx, float ty);
     void skia_clip_rect(SkiaResource* resource, float ox, float oy, float width, float height);
+    int skia_quick_reject(SkiaResource* resource, float x, float y, float width, float height);
+    int skia_quick_reject_batch(SkiaResource* resource, const float* rects, int count, uint64_t* visible);
 
     SkImage* skia_load_image(const char* path);
     SkImage* skia_load_image_from_memory(const unsigned char *const buffer,int buffer_length);
     void skia_draw_image(SkiaResource* resource, SkImage* image);
     void skia_draw_image_rect(SkiaResource* resource, SkImage* image, float w, float h);
 
+    AnimatedImage* skia_animated_image_load(const char* path);
+    AnimatedImage* skia_animated_image_load_from_memory(const unsigned char *const buffer, int buffer_length);
+    void skia_animated_image_delete(AnimatedImage* image);
+    void skia_animated_image_bounds(AnimatedImage* image, int* width, int* height);
+    int skia_animated_image_frame_count(AnimatedImage* image);
+    int skia_animated_image_repetition_count(AnimatedImage* image);
+    int skia_animated_image_frame_duration(AnimatedImage* image, int frame);
+    int skia_animated_image_frame_at(AnimatedImage* image, double ms);
+    void skia_animated_image_prefetch(AnimatedImage* image, int frame);
+    void skia_draw_animated_image(SkiaResource* resource, AnimatedImage* image, int frame, float w, float h);
+
     void skia_draw_path(SkiaResource* resource, float* points, int count);
     void skia_draw_polygon(SkiaResource* resource, float* points, int count);
 
     void skia_draw_rounded_rect(SkiaResource* resource, float width, float height, float radius);
 
     SkFont* skia_load_font2(const char* name, float size, int weight, int width, int slant);
+    void skia_font_release(SkFont* font);
+    void skia_font_warmup_start(const char** names, const float* sizes,
+                                const int* weights, const int* widths, const int* slants, int fontCount,
+                                const char* glyphs, int glyphsLength, float scale);
+    void skia_font_warmup_wait();
 
 
     // Paint related calls
@@ -115,9 +288,86 @@ extern "C"{
     SkiaResource* skia_offscreen_buffer(SkiaResource* resource, int width, int height);
     SkImage* skia_offscreen_image(SkiaResource* resource);
 
+    void skia_get_frame_stats(SkiaResource* resource, SkiaFrameStats* stats);
+
+    void skia_capture_next_frame(SkiaResource* resource, const char* path);
+    int skia_capture_pending(SkiaResource* resource);
+
+    void skia_trace_start();
+    int skia_trace_stop(const char* path);
+
     int skia_save_image(SkiaResource* image, int format, int quality, const char* path);
 
     int skia_fork_pty(unsigned short rows, unsigned short columns);
+    TerminalGrid* skia_terminal_grid_make(SkFont* font, int rows, int columns);
+    void skia_terminal_grid_delete(TerminalGrid* grid);
+    void skia_terminal_grid_resize(TerminalGrid* grid, int rows, int columns);
+    int skia_terminal_grid_set_cells(TerminalGrid* grid, int startRow, int rowCount, const TerminalCell* cells);
+    void skia_terminal_grid_scroll(TerminalGrid* grid, int top, int bottom, int count);
+    void skia_terminal_grid_set_default_colors(TerminalGrid* grid, SkColor fg, SkColor bg);
+    void skia_terminal_grid_cell_size(TerminalGrid* grid, float* width, float* height);
+    void skia_terminal_grid_draw(SkiaResource* resource, TerminalGrid* grid);
+    PtySession* skia_pty_session_start(const char* shell, int rows, int columns, int64_t bufferBytes);
+    void skia_pty_session_delete(PtySession* session);
+    int64_t skia_pty_session_poll(PtySession* session, int64_t maxBytes);
+    int skia_pty_session_wait(PtySession* session, int timeoutMillis);
+    int skia_pty_session_write(PtySession* session, const char* data, int length);
+    void skia_pty_session_resize(PtySession* session, int rows, int columns);
+    void skia_pty_session_size(PtySession* session, int* rows, int* columns);
+    void skia_pty_session_cursor(PtySession* session, int* row, int* column, int* visible);
+    int skia_pty_session_dirty_rows(PtySession* session, int* rows, int maxRows);
+    void skia_pty_session_row(PtySession* session, int row, TerminalCell* cells);
+    int skia_pty_session_update_grid(PtySession* session, TerminalGrid* grid);
+    SharedPixels* skia_shared_pixels_create(int width, int height, int alphaType);
+    SharedPixels* skia_shared_pixels_open(int fd);
+    void skia_shared_pixels_delete(SharedPixels* pixels);
+    int skia_shared_pixels_fd(SharedPixels* pixels);
+    int skia_shared_pixels_row_bytes(SharedPixels* pixels);
+    void* skia_shared_pixels_write_buffer(SharedPixels* pixels);
+    void skia_shared_pixels_publish(SharedPixels* pixels);
+    int skia_shared_pixels_draw(SkiaResource* resource, SharedPixels* pixels);
+    FrameScheduler* skia_frame_scheduler_make(double refreshHz, void (*wake)());
+    void skia_frame_scheduler_delete(FrameScheduler* scheduler);
+    void skia_frame_scheduler_set_refresh_rate(FrameScheduler* scheduler, double refreshHz);
+    void skia_frame_scheduler_request(FrameScheduler* scheduler);
+    double skia_frame_scheduler_wait_timeout(FrameScheduler* scheduler);
+    int skia_frame_scheduler_begin_frame(FrameScheduler* scheduler);
+    void skia_frame_scheduler_end_frame(FrameScheduler* scheduler);
+    void skia_frame_scheduler_stats(FrameScheduler* scheduler, SkiaFrameSchedulerStats* stats);
+
+    RenderThread* skia_render_thread_start(void (*makeCurrent)(void*), void (*swapBuffers)(void*), void* window, int maxFramesInFlight);
+    void skia_render_thread_stop(RenderThread* renderThread);
+    SkiaResource* skia_render_thread_resource(RenderThread* renderThread);
+    void skia_render_thread_reshape(RenderThread* renderThread, int frameBufferWidth, int frameBufferHeight, float xscale, float yscale);
+    void skia_render_thread_set_resource_cache_limit(RenderThread* renderThread, int64_t maxBytes);
+    void skia_render_thread_purge_unused_resources(RenderThread* renderThread, int64_t msNotUsed);
+    void skia_render_thread_free_gpu_resources(RenderThread* renderThread);
+    void skia_render_thread_handle_memory_pressure(RenderThread* renderThread, int level);
+    void skia_render_thread_begin_frame(RenderThread* renderThread);
+    void skia_render_thread_submit_frame(RenderThread* renderThread);
+
+    SceneGraph* skia_scene_make();
+    void skia_scene_delete(SceneGraph* scene);
+    int skia_scene_node_set_parent(SceneGraph* scene, int64_t id, int64_t parent, int index);
+    void skia_scene_node_remove(SceneGraph* scene, int64_t id);
+    void skia_scene_node_set_transform(SceneGraph* scene, int64_t id, float scaleX, float skewX, float transX, float skewY, float scaleY, float transY);
+    void skia_scene_node_set_clip(SceneGraph* scene, int64_t id, float ox, float oy, float width, float height);
+    void skia_scene_node_clear_clip(SceneGraph* scene, int64_t id);
+    void skia_scene_node_set_opacity(SceneGraph* scene, int64_t id, float opacity);
+    SkiaResource* skia_scene_node_begin_record(SceneGraph* scene, SkiaResource* resource, int64_t id, float ox, float oy, float width, float height);
+    void skia_scene_node_end_record(SceneGraph* scene, SkiaResource* recording);
+    void skia_scene_draw(SkiaResource* resource, SceneGraph* scene);
+
+    HitIndex* skia_hit_index_make();
+    void skia_hit_index_delete(HitIndex* index);
+    void skia_hit_index_attach(SkiaResource* resource, HitIndex* index);
+    int skia_hit_index_query_point(HitIndex* index, float x, float y, int64_t* ids, int maxIds);
+    int skia_hit_index_query_rect(HitIndex* index, float left, float top, float right, float bottom, int64_t* ids, int maxIds);
+    YuvVideo* skia_yuv_video_make();
+    void skia_yuv_video_delete(YuvVideo* video);
+    int skia_yuv_video_draw(SkiaResource* resource, YuvVideo* video, int format, int width, int height,
+                             const void* const* planes, const int* strides, int colorSpace,
+                             float dstWidth, float dstHeight);
 #if defined(__APPLE__)
     void skia_osx_run_on_main_thread_sync(void(*callback)(void));
 #endif
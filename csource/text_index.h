@@ -0,0 +1,136 @@
+// Text bookkeeping used by skia.cpp's document layout and editable
+// paragraphs. Doesn't depend on skia, so bench can check it directly.
+
+#pragma once
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+// Line sizes in a fenwick tree, so the start of a line and the line at
+// an offset are found in O(log n). Sizes are heights for layout or text
+// lengths for string offsets.
+class LineIndex {
+public:
+    void assign(const std::vector<float>& sizes){
+        int n = (int)sizes.size();
+        fTree.assign(n + 1, 0);
+        for (int i = 1; i <= n; i++){
+            fTree[i] += sizes[i - 1];
+            int parent = i + (i & -i);
+            if ( parent <= n ){
+                fTree[parent] += fTree[i];
+            }
+        }
+        fTopBit = 1;
+        while ( fTopBit * 2 <= n ){
+            fTopBit *= 2;
+        }
+    }
+
+    int size() const {
+        return (int)fTree.size() - 1;
+    }
+
+    // Changes the size of `line` by `delta`.
+    void add(int line, double delta){
+        for (int i = line + 1; i < (int)fTree.size(); i += i & -i){
+            fTree[i] += delta;
+        }
+    }
+
+    // Offset of the start of `line`.
+    double start(int line) const {
+        double sum = 0;
+        for (int i = std::clamp(line, 0, size()); i > 0; i -= i & -i){
+            sum += fTree[i];
+        }
+        return sum;
+    }
+
+    // The line containing offset `y`.
+    int lineAt(double y) const {
+        int n = size();
+        if ( n == 0 ){
+            return 0;
+        }
+        int pos = 0;
+        for (int step = fTopBit; step > 0; step >>= 1){
+            if ( pos + step <= n && fTree[pos + step] <= y ){
+                pos += step;
+                y -= fTree[pos];
+            }
+        }
+        return std::min(pos, n - 1);
+    }
+
+private:
+    std::vector<double> fTree = std::vector<double>(1, 0);
+    int fTopBit = 1;
+};
+
+// Length of utf-8 `text` in utf-16 code units.
+static inline int utf16Length(const std::string& text){
+    int length = 0;
+    for (unsigned char c : text){
+        if ( (c & 0xC0) != 0x80 ){
+            // 4 byte sequences are surrogate pairs
+            length += c >= 0xF0 ? 2 : 1;
+        }
+    }
+    return length;
+}
+
+// Byte offset into utf-8 `text` of utf-16 offset `utf16Offset`.
+static inline size_t utf8Offset(const std::string& text, int utf16Offset){
+    size_t i = 0;
+    while ( i < text.size() && utf16Offset > 0 ){
+        unsigned char c = text[i];
+        int bytes = c < 0x80 ? 1 : c < 0xE0 ? 2 : c < 0xF0 ? 3 : 4;
+        utf16Offset -= bytes == 4 ? 2 : 1;
+        i = std::min(text.size(), i + bytes);
+    }
+    return i;
+}
+
+// Moves sorted, non overlapping style runs, anything with `start` and
+// `end` offsets, after [a, b) was replaced with `inserted` bytes. The
+// inserted text takes the run of the first replaced byte, or when
+// nothing was replaced, continues the run of the byte before it. Runs
+// that are left empty are removed.
+template <typename Run>
+static void adjustRuns(std::vector<Run>* runs, size_t a, size_t b, size_t inserted){
+    size_t newEnd = a + inserted;
+
+    std::vector<Run> adjusted;
+    for (Run& run : *runs){
+        bool owner = a < b
+            ? run.start <= a && a < run.end
+            : run.start < a && a <= run.end;
+
+        size_t start;
+        if ( run.start < a ){
+            start = run.start;
+        } else if ( run.start >= b ){
+            start = run.start - b + newEnd;
+        } else {
+            start = owner ? a : newEnd;
+        }
+
+        size_t end;
+        if ( run.end > b ){
+            end = run.end - b + newEnd;
+        } else if ( owner ){
+            end = newEnd;
+        } else {
+            end = std::min(run.end, a);
+        }
+
+        if ( start < end ){
+            run.start = start;
+            run.end = end;
+            adjusted.push_back(std::move(run));
+        }
+    }
+    *runs = std::move(adjusted);
+}
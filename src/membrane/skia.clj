@@ -368,6 +368,7 @@
 (declare render-text)
 (declare text-bounds)
 (declare load-font)
+(declare skia_font_release)
 
 
 (defc skia_save membraneskialib Void/TYPE [skia-resource])
@@ -456,6 +457,21 @@
 
 
 (def font-dir "/System/Library/Fonts/")
+(defn- font-path
+  "Returns the name or path that should be passed to skia_load_font2 for `font-name`."
+  [font-name]
+  (cond
+    (nil? font-name)
+    nil
+
+    (.startsWith ^String font-name "/")
+    font-name
+
+    (.exists (clojure.java.io/file font-dir font-name))
+    (.getCanonicalPath (clojure.java.io/file font-dir font-name))
+
+    :else font-name))
+
 (defn- get-font-maybe
   "Returns a SkFont pointer. May return nil if not not found.
 
@@ -466,23 +482,23 @@
           font-ptr
           (let [font-name (or (:name font)
                               (:name ui/default-font))
-                font-path (cond
-                            (nil? font-name)
-                            nil
-
-                            (.startsWith ^String font-name "/")
-                            font-name
-
-                            (.exists (clojure.java.io/file font-dir font-name))
-                            (.getCanonicalPath (clojure.java.io/file font-dir font-name))
-
-                            :else font-name)]
+                font-path (font-path font-name)]
             (let [font-size (or (:size font)
                                 (:size ui/default-font))
                   font-ptr (load-font font-path font-size (:weight font) (:width font) (:slant font))]
               (when font-ptr
-                (swap! *font-cache* assoc font font-ptr))
-              font-ptr)))]
+                ;; another thread may have cached the same font meanwhile,
+                ;; keep theirs and give back our reference
+                (let [[old _] (swap-vals! *font-cache*
+                                          (fn [cache]
+                                            (if (contains? cache font)
+                                              cache
+                                              (assoc cache font font-ptr))))]
+                  (if-let [cached (get old font)]
+                    (do
+                      (skia_font_release font-ptr)
+                      cached)
+                    font-ptr))))))]
     font-ptr))
 (defn- get-font
   "Returns a SkFont pointer. Throws exception when font is not found.
@@ -643,6 +659,7 @@
   (int 3))
 
 (defc skia_draw_pixmap membraneskialib void [resource color-type alpha-type buffer width height row-bytes])
+(defc skia_bgra8888_is_opaque membraneskialib Integer/TYPE [buffer width height row-bytes])
 
 (defrecord Pixmap [id buf width height color-type alpha-type row-bytes]
   ui/IOrigin
@@ -662,6 +679,372 @@
   [id buf width height color-type alpha-type row-bytes]
   (->Pixmap id buf (int width) (int height) (int color-type) (int alpha-type) (int row-bytes)))
 
+;; Terminal grid
+;; Cells are packed 16 bytes each: codepoint, fg, bg and attrs as 32 bit ints.
+;; Colors are ARGB and 0 means the grid's default color.
+
+(def terminal-cell-bytes 16)
+(def terminal-cell-attrs
+  {:bold 1
+   :italic 2
+   :underline 4
+   :strike 8
+   :inverse 16
+   :conceal 32})
+
+(defn terminal-color
+  "Converts a membrane color, `[r g b]` or `[r g b a]` with components from 0 to 1, to a packed ARGB int for terminal cells."
+  [[r g b a]]
+  (unchecked-int
+   (bit-or (bit-shift-left (Math/round (* 255.0 (double (or a 1)))) 24)
+           (bit-shift-left (Math/round (* 255.0 (double r))) 16)
+           (bit-shift-left (Math/round (* 255.0 (double g))) 8)
+           (Math/round (* 255.0 (double b))))))
+
+(defc skia_terminal_grid_make membraneskialib Pointer [font rows columns])
+(defc skia_terminal_grid_delete membraneskialib Void/TYPE [grid])
+(defc skia_terminal_grid_resize membraneskialib Void/TYPE [grid rows columns])
+(defc skia_terminal_grid_set_cells membraneskialib Integer/TYPE [grid start-row row-count cells])
+(defc skia_terminal_grid_scroll membraneskialib Void/TYPE [grid top bottom count])
+(defc skia_terminal_grid_set_default_colors membraneskialib Void/TYPE [grid fg bg])
+(defc skia_terminal_grid_cell_size membraneskialib Void/TYPE [grid width* height*])
+(defc skia_terminal_grid_draw membraneskialib Void/TYPE [resource grid])
+
+(declare get-font)
+(defn terminal-grid
+  "Returns a native terminal grid with `rows` x `columns` blank cells drawn with `font`.
+
+  The grid should be released with `delete-terminal-grid!`."
+  [font rows columns]
+  (skia_terminal_grid_make (get-font font) (int rows) (int columns)))
+
+(defn delete-terminal-grid! [grid]
+  (skia_terminal_grid_delete grid))
+
+(defn resize-terminal-grid! [grid rows columns]
+  (skia_terminal_grid_resize grid (int rows) (int columns)))
+
+(defn set-terminal-cells!
+  "Replaces `row-count` full rows starting at `start-row` with the packed cells in `cells`.
+
+  Returns the number of rows that changed. Only changed rows are rebuilt."
+  [grid start-row row-count ^Memory cells]
+  (skia_terminal_grid_set_cells grid (int start-row) (int row-count) cells))
+
+(defn scroll-terminal-grid!
+  "Scrolls rows from `top` (inclusive) to `bottom` (exclusive) up by `n` rows, or down if `n` is negative."
+  [grid top bottom n]
+  (skia_terminal_grid_scroll grid (int top) (int bottom) (int n)))
+
+(defn set-terminal-default-colors!
+  "Sets the colors used for cells with a fg or bg of 0."
+  [grid fg bg]
+  (skia_terminal_grid_set_default_colors grid (terminal-color fg) (terminal-color bg)))
+
+(defn terminal-cell-size
+  "Returns the [width height] of a single cell."
+  [grid]
+  (let [width (FloatByReference.)
+        height (FloatByReference.)]
+    (skia_terminal_grid_cell_size grid width height)
+    [(.getValue width)
+     (.getValue height)]))
+
+(defrecord TerminalGridView [grid rows columns]
+  ui/IOrigin
+  (-origin [_]
+    [0 0])
+
+  IDraw
+  (draw [this]
+    (skia_terminal_grid_draw *skia-resource* grid))
+
+  ui/IBounds
+  (-bounds [_]
+    (let [[cw ch] (terminal-cell-size grid)]
+      [(* cw columns) (* ch rows)])))
+
+(defn terminal-grid-view
+  "Element that draws a native terminal grid created with `terminal-grid`."
+  [grid rows columns]
+  (->TerminalGridView grid rows columns))
+
+;; Hit index
+;; With `:membrane.skia/hit-index`, the device bounds of everything drawn
+;; inside a `hit-target` are recorded under its id, and `hit-test` looks
+;; up ids with an r-tree instead of walking the component tree.
+
+(defc skia_hit_index_make membraneskialib Pointer [])
+(defc skia_hit_index_delete membraneskialib Void/TYPE [index])
+(defc skia_hit_index_attach membraneskialib Void/TYPE [skia-resource index])
+(defc skia_hit_index_query_point membraneskialib Integer/TYPE [index x y ids max-ids])
+(defc skia_hit_index_query_rect membraneskialib Integer/TYPE [index left top right bottom ids max-ids])
+(defc skia_save_id membraneskialib Void/TYPE [skia-resource id])
+
+(defrecord HitTarget [id drawable]
+  ui/IOrigin
+  (-origin [_]
+    [0 0])
+
+  ui/IBounds
+  (-bounds [_]
+    (ui/bounds drawable))
+
+  ui/IChildren
+  (-children [_]
+    [drawable])
+
+  IDraw
+  (draw [this]
+    (try
+      (skia_save_id *skia-resource* (long id))
+      (draw drawable)
+      (finally
+        (Skia/skia_restore *skia-resource*)))))
+
+(defn hit-target
+  "Element that draws `drawable` and records its bounds under the numeric `id` for `hit-test`."
+  [id drawable]
+  (->HitTarget id drawable))
+
+(defn- hit-ids [^Memory buf n]
+  (into []
+        (map #(.getLong buf (* 8 %)))
+        (range n)))
+
+(defn hit-test
+  "Returns the ids of `hit-target`s drawn under `pos`, topmost first.
+
+  `pos` is a window coordinate, like the ones passed to mouse handlers.
+  Pass `[x y width height]` to find every target intersecting a rect instead.
+  Uses the last frame presented by a window started with `:membrane.skia/hit-index`."
+  ([window pos]
+   (hit-test window pos 64))
+  ([window pos max-ids]
+   (when-let [index (::hit-index window)]
+     (let [[sx sy] @(:window-content-scale window)
+           buf (Memory. (* 8 max-ids))
+           [x y w h] pos
+           n (if w
+               (skia_hit_index_query_rect index
+                                          (float (* sx x)) (float (* sy y))
+                                          (float (* sx (+ x w))) (float (* sy (+ y h)))
+                                          buf (int max-ids))
+               (skia_hit_index_query_point index (float (* sx x)) (float (* sy y)) buf (int max-ids)))]
+       (hit-ids buf n)))))
+
+;; Pty sessions
+;; The shell's output is read on a native thread and parsed into a screen
+;; model with `pty-poll!`. Typical use is a background thread that calls
+;; `pty-wait` and posts an empty event, and a draw that calls `pty-poll!`
+;; followed by `pty-update-grid!` before drawing the grid.
+
+(defc skia_pty_session_start membraneskialib Pointer [shell rows columns buffer-bytes])
+(defc skia_pty_session_delete membraneskialib Void/TYPE [session])
+(defc skia_pty_session_poll membraneskialib Long/TYPE [session max-bytes])
+(defc skia_pty_session_wait membraneskialib Integer/TYPE [session timeout-millis])
+(defc skia_pty_session_write membraneskialib Integer/TYPE [session data length])
+(defc skia_pty_session_resize membraneskialib Void/TYPE [session rows columns])
+(defc skia_pty_session_cursor membraneskialib Void/TYPE [session row* column* visible*])
+(defc skia_pty_session_update_grid membraneskialib Integer/TYPE [session grid])
+
+(defn start-pty-session
+  "Starts `shell` (defaults to $SHELL) on a new pty with a `rows` x `columns` screen.
+
+  At most `buffer-bytes` of unparsed output are buffered. Once the buffer is
+  full the shell blocks until the output is parsed by `pty-poll!`.
+  Throws if the pty can't be created. Release with `close-pty-session!`."
+  ([rows columns]
+   (start-pty-session nil rows columns))
+  ([shell rows columns]
+   (start-pty-session shell rows columns (* 4 1024 1024)))
+  ([shell rows columns buffer-bytes]
+   (let [session (skia_pty_session_start shell (int rows) (int columns) (long buffer-bytes))]
+     (when (nil? session)
+       (throw (Exception. "Unable to create pty.")))
+     session)))
+
+(defn close-pty-session! [session]
+  (skia_pty_session_delete session))
+
+(defn pty-poll!
+  "Parses up to `max-bytes` of pending output into the screen.
+
+  Returns the number of bytes parsed, or -1 once the shell has exited and all output has been parsed."
+  ([session]
+   (pty-poll! session (* 1024 1024)))
+  ([session max-bytes]
+   (skia_pty_session_poll session (long max-bytes))))
+
+(defn pty-wait
+  "Blocks for up to `timeout-ms` until there is output to poll. Returns true if there is output or the shell has exited."
+  [session timeout-ms]
+  (= 1 (skia_pty_session_wait session (int timeout-ms))))
+
+(defn pty-write!
+  "Queues a string or byte array for the shell's input.
+
+  The session's reader thread writes it to the pty, so this never blocks."
+  [session data]
+  (let [^bytes bs (if (string? data)
+                    (.getBytes ^String data "utf-8")
+                    data)]
+    (skia_pty_session_write session bs (int (alength bs)))))
+
+(defn pty-resize! [session rows columns]
+  (skia_pty_session_resize session (int rows) (int columns)))
+
+(defn pty-cursor
+  "Returns the cursor as {:row :column :visible?}."
+  [session]
+  (let [row (IntByReference.)
+        column (IntByReference.)
+        visible (IntByReference.)]
+    (skia_pty_session_cursor session row column visible)
+    {:row (.getValue row)
+     :column (.getValue column)
+     :visible? (= 1 (.getValue visible))}))
+
+(defn pty-update-grid!
+  "Copies the rows of the screen that changed since the last update into `grid`. Returns the number of rows that changed."
+  [session grid]
+  (skia_pty_session_update_grid session grid))
+
+;; Shared pixels
+;; Triple buffered BGRA pixels in shared memory. A producer thread (or a
+;; process that opened the fd) renders into `shared-pixels-write-buffer`
+;; and calls `publish-shared-pixels!`. Drawing picks up the newest frame
+;; without copying it into the window surface.
+
+(defc skia_shared_pixels_create membraneskialib Pointer [width height alpha-type])
+(defc skia_shared_pixels_open membraneskialib Pointer [fd])
+(defc skia_shared_pixels_delete membraneskialib Void/TYPE [pixels])
+(defc skia_shared_pixels_fd membraneskialib Integer/TYPE [pixels])
+(defc skia_shared_pixels_row_bytes membraneskialib Integer/TYPE [pixels])
+(defc skia_shared_pixels_write_buffer membraneskialib Pointer [pixels])
+(defc skia_shared_pixels_publish membraneskialib Void/TYPE [pixels])
+(defc skia_shared_pixels_draw membraneskialib Integer/TYPE [resource pixels])
+
+(defn- check-render-thread-draw!
+  "Throws if a native draw returned -1 because the current window renders on a render thread."
+  [result element]
+  (when (neg? result)
+    (throw (ex-info (str element " can't be drawn by a window using :membrane.skia/render-thread.")
+                    {:element element})))
+  result)
+
+(defn shared-pixels
+  "Creates a `width` x `height` BGRA shared pixel buffer. Throws if shared memory can't be allocated."
+  ([width height]
+   (shared-pixels width height kPremul_SkAlphaType))
+  ([width height alpha-type]
+   (let [pixels (skia_shared_pixels_create (int width) (int height) (int alpha-type))]
+     (when (nil? pixels)
+       (throw (Exception. "Unable to create shared pixels.")))
+     pixels)))
+
+(defn open-shared-pixels
+  "Maps a shared pixel buffer from an fd returned by `shared-pixels-fd`, usually in another process."
+  [fd]
+  (skia_shared_pixels_open (int fd)))
+
+(defn delete-shared-pixels!
+  "Releases `pixels`. Should be called from the thread that draws them."
+  [pixels]
+  (skia_shared_pixels_delete pixels))
+
+(defn shared-pixels-fd [pixels]
+  (skia_shared_pixels_fd pixels))
+
+(defn shared-pixels-row-bytes [pixels]
+  (skia_shared_pixels_row_bytes pixels))
+
+(defn shared-pixels-write-buffer
+  "Returns a pointer to the buffer the producer should render the next frame into."
+  [pixels]
+  (skia_shared_pixels_write_buffer pixels))
+
+(defn publish-shared-pixels!
+  "Makes the frame in the current write buffer the newest frame."
+  [pixels]
+  (skia_shared_pixels_publish pixels))
+
+(defrecord SharedPixelsView [pixels width height]
+  ui/IOrigin
+  (-origin [_]
+    [0 0])
+
+  IDraw
+  (draw [this]
+    (check-render-thread-draw! (skia_shared_pixels_draw *skia-resource* pixels)
+                               "shared-pixels-view"))
+
+  ui/IBounds
+  (-bounds [_]
+    [width height]))
+
+(defn shared-pixels-view
+  "Element that draws the newest frame of `pixels`."
+  [pixels width height]
+  (->SharedPixelsView pixels width height))
+
+;; YUV video
+
+(defc skia_yuv_video_make membraneskialib Pointer [])
+(defc skia_yuv_video_delete membraneskialib Void/TYPE [video])
+(defc skia_yuv_video_draw membraneskialib Integer/TYPE [resource video format width height planes strides color-space dst-width dst-height])
+
+(def ^:private yuv-formats
+  {:i420 0
+   :nv12 1})
+(def ^:private yuv-color-spaces
+  {:bt601 0
+   :bt709 1
+   :jpeg 2})
+
+(defn yuv-video
+  "Returns a native handle that keeps plane textures and conversion buffers between frames.
+
+  Should be released with `delete-yuv-video!` from the thread that draws it."
+  []
+  (skia_yuv_video_make))
+
+(defn delete-yuv-video! [video]
+  (skia_yuv_video_delete video))
+
+(defrecord YUVFrame [video format width height planes strides color-space dst-width dst-height]
+  ui/IOrigin
+  (-origin [_]
+    [0 0])
+
+  IDraw
+  (draw [this]
+    (check-render-thread-draw!
+     (skia_yuv_video_draw *skia-resource* video
+                          (int (get yuv-formats format format))
+                          (int width) (int height)
+                          (into-array Pointer planes)
+                          (int-array strides)
+                          (int (get yuv-color-spaces color-space color-space))
+                          (float dst-width) (float dst-height))
+     "yuv-frame"))
+
+  ui/IBounds
+  (-bounds [_]
+    [dst-width dst-height]))
+
+(defn yuv-frame
+  "Element that draws a 4:2:0 YUV frame without converting it to rgb first.
+
+  `format` is :i420 with `planes` [y u v] or :nv12 with `planes` [y uv].
+  `planes` are jna pointers and `strides` are the bytes per row of each plane.
+  `color-space` is one of :bt601, :bt709 or :jpeg.
+  Reusing the same `video` for each frame of a stream reuses its textures."
+  ([video format width height planes strides]
+   (yuv-frame video format width height planes strides :bt601 width height))
+  ([video format width height planes strides color-space dst-width dst-height]
+   (->YUVFrame video format width height planes strides color-space dst-width dst-height)))
+
 (defprotocol ImageFactory
   "gets or creates an opengl image texture given some various types"
   :extend-via-metadata true
@@ -1228,6 +1611,216 @@
      (svg (.getBytes (slurp "/Users/adrian/Downloads/Clojure-Logo.wine.svg") "utf-8"))))
   ,)
 
+(defc skia_animated_image_load membraneskialib Pointer [path])
+(defc skia_animated_image_load_from_memory membraneskialib Pointer [buf buf-length])
+(defc skia_animated_image_delete membraneskialib Void/TYPE [image])
+(defc skia_animated_image_bounds membraneskialib Void/TYPE [image width height])
+(defc skia_animated_image_frame_count membraneskialib Integer/TYPE [image])
+(defc skia_animated_image_frame_at membraneskialib Integer/TYPE [image ms])
+(defc skia_draw_animated_image membraneskialib Void/TYPE [skia-resource image frame w h])
+
+(defn- skia-animated-image-load [source]
+  (let [p (cond
+            (string? source) (skia_animated_image_load source)
+            (instance? java.io.File source) (skia_animated_image_load (.getAbsolutePath ^java.io.File source))
+            (instance? java.net.URL source) (let [^bytes bs (slurp-bytes source)]
+                                              (skia_animated_image_load_from_memory bs (alength bs)))
+            (bytes? source) (skia_animated_image_load_from_memory source (alength ^bytes source)))]
+    (when p
+      (let [ptr (Pointer/nativeValue p)]
+        (.register ^Cleaner @cleaner p
+                   (fn []
+                     (skia_animated_image_delete (Pointer. ptr))))
+        p))))
+
+(defn- load-animated-image [source]
+  (let [k [::animated-image source]]
+    (if-let [image (get @*image-cache* k)]
+      image
+      (when-let [image (skia-animated-image-load source)]
+        (swap! *image-cache* assoc k image)
+        image))))
+
+(defn- animated-image-size [image]
+  (let [width (IntByReference.)
+        height (IntByReference.)]
+    (skia_animated_image_bounds image width height)
+    [(.getValue width) (.getValue height)]))
+
+(defrecord AnimatedImage [source size time]
+  IOrigin
+  (-origin [this]
+    [0 0])
+
+  IBounds
+  (-bounds [this]
+    (or size
+        (if-let [image (load-animated-image source)]
+          (animated-image-size image)
+          [0 0])))
+
+  IDraw
+  (draw [this]
+    (when-let [image (load-animated-image source)]
+      (let [[w h] (or size
+                      (animated-image-size image))
+            frame (skia_animated_image_frame_at image (double (or time 0)))]
+        (skia_draw_animated_image *skia-resource* image (int frame) (float w) (float h))))))
+
+(defn animated-image
+  "Displays an animated gif, webp or apng image at `time`, the number of
+  milliseconds since the animation started.
+
+  `source` can be a path, a java.io.File, a java.net.URL or a byte array.
+  `size` defaults to the size of the image.
+
+  Frames are decoded on a background thread just ahead of when they are shown
+  and only the most recent few are kept in memory. The view doesn't schedule
+  repaints. Animate it by redrawing with a later `time`, e.g. from a timer that
+  calls `repaint!`."
+  ([source time]
+   (AnimatedImage. source nil time))
+  ([source size time]
+   (AnimatedImage. source size time)))
+
+(defc skia_scene_make membraneskialib Pointer [])
+(defc skia_scene_delete membraneskialib Void/TYPE [scene])
+(defc skia_scene_node_set_parent membraneskialib Integer/TYPE [scene id parent index])
+(defc skia_scene_node_remove membraneskialib Void/TYPE [scene id])
+(defc skia_scene_node_set_transform membraneskialib Void/TYPE [scene id scale-x skew-x trans-x skew-y scale-y trans-y])
+(defc skia_scene_node_set_clip membraneskialib Void/TYPE [scene id ox oy w h])
+(defc skia_scene_node_clear_clip membraneskialib Void/TYPE [scene id])
+(defc skia_scene_node_set_opacity membraneskialib Void/TYPE [scene id opacity])
+(defc skia_scene_node_begin_record membraneskialib Pointer [scene skia-resource id ox oy w h])
+(defc skia_scene_node_end_record membraneskialib Void/TYPE [scene recording])
+(defc skia_scene_draw membraneskialib Void/TYPE [skia-resource scene])
+
+(defn scene
+  "Returns a retained native scene graph to be displayed with `scene-view`.
+
+  The scene remembers the nodes it was last drawn with. Redrawing only records
+  the content of nodes whose `:drawable` changed and only updates the transform,
+  clip and opacity of nodes where they changed."
+  []
+  (let [p (skia_scene_make)
+        ptr (Pointer/nativeValue p)]
+    (.register ^Cleaner @cleaner p
+               (fn []
+                 (skia_scene_delete (Pointer. ptr))))
+    {:native p
+     :nodes (atom {})}))
+
+(defrecord SceneNode [id drawable transform clip opacity children])
+
+(defn scene-node
+  "Returns a node of a `scene`.
+
+  `id` must be a long that is unique within the scene and not 0.
+  `drawable` is drawn first, then `children`, a sequence of scene nodes.
+  `transform` is a 6 element affine matrix like `transform`'s.
+  `clip` is `[x y w h]`. `opacity` is between 0 and 1."
+  [{:keys [id drawable transform clip opacity children]}]
+  (assert (and (integer? id)
+               (not (zero? id))))
+  (->SceneNode id drawable transform clip opacity children))
+
+(def ^:private scene-record-padding 5)
+
+(defn- record-scene-node! [native id drawable]
+  (let [[w h] (bounds drawable)
+        padding scene-record-padding
+        recording (skia_scene_node_begin_record native *skia-resource* (long id)
+                                                (float (- padding)) (float (- padding))
+                                                (float (+ w (* 2 padding))) (float (+ h (* 2 padding))))]
+    (try
+      (binding [*skia-resource* recording]
+        (when drawable
+          (draw drawable)))
+      (finally
+        (skia_scene_node_end_record native recording)))))
+
+(defn- sync-scene! [{:keys [native nodes]} roots]
+  (let [prev @nodes
+        next (volatile! (transient {}))]
+    (letfn [(sync-children [parent children]
+              ;; once a sibling moves, place every sibling after it as
+              ;; well so that each one ends up at its index
+              (reduce
+               (fn [moved? [index node]]
+                 (let [{:keys [id drawable transform clip opacity]} node
+                       _ (when (get @next id)
+                           (throw (ex-info "Scene node ids must be unique."
+                                           {:id id
+                                            :parent parent})))
+                       old (get prev id)
+                       moved? (or moved?
+                                  (not= parent (:parent old))
+                                  (not= index (:index old)))]
+                   ;; nodes are placed parents first, so with unique ids a
+                   ;; node's new ancestors are already in place and can't
+                   ;; include the node itself
+                   (when (and moved?
+                              (zero? (skia_scene_node_set_parent native (long id) (long parent) (int index))))
+                     (throw (ex-info "Scene node can't be its own ancestor."
+                                     {:id id
+                                      :parent parent})))
+                   (when (not= transform (:transform old))
+                     (let [[a b c d e f] (or transform [1 0 0 0 1 0])]
+                       (skia_scene_node_set_transform native (long id)
+                                                      (float a) (float b) (float c)
+                                                      (float d) (float e) (float f))))
+                   (when (not= clip (:clip old))
+                     (if-let [[x y w h] clip]
+                       (skia_scene_node_set_clip native (long id) (float x) (float y) (float w) (float h))
+                       (skia_scene_node_clear_clip native (long id))))
+                   (when (not= opacity (:opacity old))
+                     (skia_scene_node_set_opacity native (long id) (float (or opacity 1))))
+                   (when (or (nil? old)
+                             (not= drawable (:drawable old)))
+                     (record-scene-node! native id drawable))
+                   (vswap! next assoc! id {:parent parent
+                                           :index index
+                                           :drawable drawable
+                                           :transform transform
+                                           :clip clip
+                                           :opacity opacity})
+                   (sync-children id (:children node))
+                   moved?))
+               false
+               (map-indexed vector children)))]
+      (sync-children 0 roots))
+    (let [next (persistent! @next)]
+      (doseq [id (keys prev)
+              :when (not (contains? next id))]
+        (skia_scene_node_remove native (long id)))
+      (reset! nodes next))))
+
+(defrecord SceneView [scene roots size]
+  IOrigin
+  (-origin [this]
+    [0 0])
+
+  IBounds
+  (-bounds [this]
+    size)
+
+  IDraw
+  (draw [this]
+    (sync-scene! scene roots)
+    (skia_scene_draw *skia-resource* (:native scene))))
+
+(defn scene-view
+  "Displays `roots`, a sequence of `scene-node`s, using the retained `scene`.
+
+  Only nodes that changed since the scene was last drawn are updated, so
+  animating the `:transform` or `:opacity` of a node doesn't redraw its
+  content. `size` is the `[w h]` bounds of the view.
+
+  Scene views only draw. Mouse and keyboard events aren't passed to the
+  drawables of scene nodes."
+  [scene roots size]
+  (->SceneView scene roots size))
+
 (def ^:dynamic *origin* [0 0 0])
 (def ^:dynamic *view* nil )
 
@@ -1246,6 +1839,81 @@
       (scissor-draw this)))
 
 
+(defc skia_quick_reject membraneskialib Integer/TYPE [skia-resource x y w h])
+(defc skia_quick_reject_batch membraneskialib Integer/TYPE [skia-resource rects n visible])
+
+(defn visible?
+  "Returns true if anything drawn in the rect `[x y w h]` could be visible
+  with the current transform and clip."
+  [x y w h]
+  (zero? (skia_quick_reject *skia-resource* (float x) (float y) (float w) (float h))))
+
+(defn- child-rects
+  "Returns the `[x y w h]` rects of `children` packed in a float array, each grown by `padding` on every side."
+  [children padding]
+  (let [n (count children)
+        rects (float-array (* 4 n))
+        padding (double padding)]
+    (dotimes [i n]
+      (let [child (nth children i)
+            [ox oy] (ui/origin child)
+            [w h] (ui/bounds child)
+            j (* 4 i)]
+        (aset rects j (float (- ox padding)))
+        (aset rects (+ j 1) (float (- oy padding)))
+        (aset rects (+ j 2) (float (+ w padding padding)))
+        (aset rects (+ j 3) (float (+ h padding padding)))))
+    rects))
+
+(defn- visible-children
+  "Returns the elements of `children` whose bit is set in `visible`, 64 children per long."
+  [children ^longs visible]
+  (keep-indexed (fn [i child]
+                  (when (bit-test (aget visible (quot i 64)) (rem i 64))
+                    child))
+                children))
+
+(defn- draw-visible-children
+  "Draws the elements of `children`, skipping those entirely outside the clip."
+  [children padding]
+  (let [n (count children)]
+    (if (< n 16)
+      (run! draw children)
+      (let [visible (long-array (quot (+ n 63) 64))]
+        (skia_quick_reject_batch *skia-resource* (child-rects children padding) (int n) visible)
+        (run! draw (visible-children children visible))))))
+
+(defrecord CulledChildren [children padding]
+  ui/IOrigin
+  (-origin [_]
+    [0 0])
+
+  ui/IBounds
+  (-bounds [_]
+    (ui/bounds children))
+
+  ui/IChildren
+  (-children [_]
+    children)
+
+  IDraw
+  (draw [this]
+    (draw-visible-children children padding)))
+
+(defn culled
+  "Element that only draws the elements of `drawables` that could be visible with the current transform and clip.
+
+  Useful as the body of a `ui/scrollview` with many rows. Elements are tested with their layout bounds
+  grown by `padding` on every side (default 16), so strokes and shadows drawn slightly outside their
+  bounds aren't cut off. Elements that draw further outside their bounds need a larger `padding`.
+
+  The origin and bounds of every element are still computed each frame, only drawing is skipped.
+  For very long lists, passing just the rows near the scroll offset is cheaper."
+  ([drawables]
+   (culled drawables 16))
+  ([drawables padding]
+   (->CulledChildren (vec drawables) padding)))
+
 (defn- scrollview-draw [scrollview]
   (draw
    (ui/->ScissorView [0 0]
@@ -1423,7 +2091,13 @@
             ~ret
             (to-array (vector ~@args))))
 
+;; set when something off the event thread asked for a repaint, so
+;; windows paced by a frame scheduler know to request a frame
+(defonce ^:private ^java.util.concurrent.atomic.AtomicBoolean repaint-posted
+  (java.util.concurrent.atomic.AtomicBoolean. false))
+
 (defn- glfw-post-empty-event []
+  (.set repaint-posted true)
   (glfw-call void glfwPostEmptyEvent))
 
 #_(defmacro gl
@@ -1539,6 +2213,48 @@
 
     font-ptr))
 
+(defc skia_font_release membraneskialib Void/TYPE [font-ptr])
+(defn- release-fonts!
+  "Releases the native references held by `font-cache`.
+
+  Fonts are shared between windows and freed when their last reference is released."
+  [font-cache]
+  (run! skia_font_release (vals @font-cache))
+  (reset! font-cache {}))
+
+(def ^:private ascii-glyphs
+  (apply str (map char (range 32 127))))
+
+(defc skia_font_warmup_start membraneskialib Void/TYPE [names sizes weights widths slants font-count glyphs glyphs-length scale])
+(defn- start-font-warmup!
+  "Initializes the font manager and rasterizes `glyphs` for each of `fonts` on a background thread.
+
+  Only cpu side caches are warmed. The gpu glyph atlas belongs to the window's gpu context
+  and can only be filled on the thread that draws with it.
+
+  `fonts`: a sequence of fonts as created by `membrane.ui/font`.
+  `glyphs`: a string of characters to prerender. Defaults to printable ascii.
+  `scale`: the content scale the glyphs will be drawn at."
+  ([fonts scale]
+   (start-font-warmup! fonts ascii-glyphs scale))
+  ([fonts glyphs scale]
+   (let [fonts (or (seq fonts) [ui/default-font])
+         names (into-array String
+                           (map #(font-path (or (:name %)
+                                                (:name ui/default-font)))
+                                fonts))
+         sizes (float-array (map #(or (:size %)
+                                      (:size ui/default-font))
+                                 fonts))
+         ;; same style lookup as load-font so the warmed typeface is the drawn one
+         weights (int-array (map #(get font-weights (:weight %) (or (:weight %) -1)) fonts))
+         widths (int-array (map #(get font-widths (:width %) (or (:width %) -1)) fonts))
+         slants (int-array (map #(get font-slants (:slant %) (or (:slant %) -1)) fonts))
+         glyph-bytes (.getBytes ^String glyphs "utf-8")]
+     (skia_font_warmup_start names sizes weights widths slants (int (count fonts))
+                             glyph-bytes (int (alength glyph-bytes))
+                             (float scale)))))
+
 (def ^:dynamic *already-drawing* nil)
 
 
@@ -1616,6 +2332,21 @@
     [(.getValue xscale)
      (.getValue yscale)]))
 
+(defn- monitor-refresh-rate
+  "Returns the refresh rate of the primary monitor in hz, defaulting to 60."
+  []
+  (let [monitor (glfw-call Pointer glfwGetPrimaryMonitor)
+        ;; GLFWvidmode is 6 ints, refreshRate is the last one
+        mode (when monitor
+               (glfw-call Pointer glfwGetVideoMode monitor))
+        hz (if mode
+             (.getInt ^Pointer mode 20)
+             0)]
+    (if (pos? hz)
+      hz
+      60)))
+
+(declare paint-window!)
 (defprotocol IWindow
   (init! [_])
   (reshape! [_ width height])
@@ -1653,6 +2384,7 @@
 (def GLFW_CONNECTED (int 0x00040001))
 (def GLFW_DISCONNECTED (int 0x00040002))
 
+(declare request-frame!)
 (deftype Joystickcallback [window handler]
   com.sun.jna.CallbackProxy
   (getParameterTypes [_]
@@ -1681,6 +2413,7 @@
         (handler window (aget args 0)))
       (catch Exception e
         ((or (:error-callback window) println) e)))
+    (request-frame! window)
     nil))
 
 (defn- make-window-close-callback [window handler]
@@ -1689,6 +2422,38 @@
 (defn -window-close-callback [window window-handle]
   nil)
 
+(deftype WindowIconifyCallback [window handler]
+  com.sun.jna.CallbackProxy
+  (getParameterTypes [_]
+    (into-array Class  [Pointer Integer/TYPE]))
+  (getReturnType [_]
+    void)
+  (callback ^void [_ args]
+    (try
+      (binding [*image-cache* (:image-cache window)
+                *font-cache* (:font-cache window)
+                *draw-cache* (:draw-cache window)]
+        (handler window (aget args 0) (aget args 1)))
+      (catch Exception e
+        ((or (:error-callback window) println) e)))
+    (request-frame! window)
+    nil))
+
+(defn- make-window-iconify-callback [window handler]
+  (->WindowIconifyCallback window handler))
+
+(declare free-gpu-resources!)
+(defn -window-iconify-callback
+  "Frees the window's gpu resources while it is minimized.
+
+  Windows started with `:membrane.skia/share-context` keep them, since the other windows
+  sharing the context are still using them."
+  [window window-handle iconified]
+  (when (and (= 1 iconified)
+             (not (::shared-gl-context window)))
+    (free-gpu-resources! window))
+  nil)
+
 (defn -reshape
   ([window window-handle width height]
    (reshape! window width height)))
@@ -1707,6 +2472,7 @@
         (handler window (aget args 0) (aget args 1) (aget args 2) ))
       (catch Exception e
         ((or (:error-callback window) println) e)))
+    (request-frame! window)
     nil))
 
 (defn- make-reshape-callback [window handler]
@@ -1735,6 +2501,7 @@
         (handler window (aget args 0) (aget args 1)))
       (catch Exception e
         ((or (:error-callback window) println) e)))
+    (request-frame! window)
     nil))
 (defn- make-mouse-enter-callback [window handler]
   (MouseEnterCallback. window handler))
@@ -1762,6 +2529,7 @@
         (handler window (aget args 0) (aget args 1)))
       (catch Exception e
         ((or (:error-callback window) println) e)))
+    (request-frame! window)
     nil))
 
 
@@ -1788,6 +2556,7 @@
         (handler window (aget args 0) (aget args 1) (aget args 2) (aget args 3)))
       (catch Exception e
         ((or (:error-callback window) println) e)))
+    (request-frame! window)
     nil))
 
 (defn- make-mouse-button-callback [window handler]
@@ -1817,6 +2586,7 @@
       (catch Exception e
         ((or (:error-callback window) println) e)))
 
+    (request-frame! window)
     nil))
 
 (defn- make-scroll-callback [window handler]
@@ -1824,7 +2594,9 @@
 
 
 (defn- -window-refresh-callback [window window-handle]
-  (repaint! window))
+  ;; the os wants the contents now (e.g. during a live resize),
+  ;; so don't wait for the frame scheduler
+  (paint-window! window))
 
 (deftype WindowRefreshCallback [window handler]
   com.sun.jna.CallbackProxy
@@ -1840,6 +2612,7 @@
         (handler window (aget args 0)))
       (catch Exception e
         ((or (:error-callback window) println) e)))
+    (request-frame! window)
     nil))
 
 (defn- make-window-refresh-callback [window handler]
@@ -1871,6 +2644,7 @@
           (handler window (aget args 0) paths)))
       (catch Exception e
         ((or (:error-callback window) println) e)))
+    (request-frame! window)
     nil))
 
 (defn- make-drop-callback [window handler]
@@ -1907,6 +2681,7 @@
           (handler window (aget args 0) (aget args 1) (aget args 2)))
         (catch Exception e
           ((or (:error-callback window) println) e)))
+    (request-frame! window)
     nil))
 
 (defn- make-cursor-pos-callback [window handler]
@@ -1972,6 +2747,7 @@
         (handler window (aget args 0) (aget args 1) (aget args 2) (aget args 3) (aget args 4)))
       (catch Exception e
         ((or (:error-callback window) println) e)))
+    (request-frame! window)
     nil))
 
 (defn- make-key-callback [window handler]
@@ -2007,6 +2783,7 @@
         (handler window (aget args 0) (aget args 1) ))
       (catch Exception e
         ((or (:error-callback window) println) e)))
+    (request-frame! window)
     nil))
 
 (defn- make-character-callback [window handler]
@@ -2017,6 +2794,298 @@
 (defc skia_init_cpu membraneskialib Pointer [width height])
 (defc skia_reshape membraneskialib Void/TYPE [skia-resource fb-width fb-height xscale yscale])
 (defc skia_cleanup membraneskialib Void/TYPE [skia-resource])
+
+(def ^:private frame-stats-keys
+  [:draw-text-calls
+   :draw-paragraph-calls
+   :draw-path-calls
+   :draw-rect-calls
+   :draw-image-calls
+   :draw-pixels-calls
+   :draw-surface-calls
+   :draw-svg-calls
+   :text-bytes
+   :lazy-image-draws
+   :image-uploads
+   :pixel-bytes
+   :offscreen-surfaces
+   :flush-nanos
+   :frame-nanos
+   :gpu-resource-count
+   :gpu-resource-bytes
+   :gpu-resource-budget-bytes])
+
+(defc skia_get_frame_stats membraneskialib Void/TYPE [skia-resource stats])
+(defn frame-stats
+  "Returns a map of native counters for the current frame of `skia-resource`.
+
+  Counters are reset at the start of every frame. `:gpu-resource-*` keys
+  report the gpu resource cache usage for gpu backed resources.
+  `:lazy-image-draws` and `:image-uploads` count draws that may decode or
+  upload an image. Skia doesn't report whether it found the result cached."
+  [skia-resource]
+  (let [buf (Memory. (* 8 (count frame-stats-keys)))]
+    (skia_get_frame_stats skia-resource buf)
+    (into {}
+          (map-indexed (fn [i k]
+                         [k (.getLong buf (* 8 i))]))
+          frame-stats-keys)))
+
+(defc skia_trace_start membraneskialib Void/TYPE [])
+(defc skia_trace_stop membraneskialib Integer/TYPE [path])
+(defn start-trace!
+  "Start recording native trace events.
+
+  Records the time spent in native entry points and skia's own trace events.
+  Call `stop-trace!` to write the capture to disk."
+  []
+  (skia_trace_start))
+
+(defn stop-trace!
+  "Stop recording native trace events and write them to `path` in the chrome trace event format.
+
+  The file can be opened with chrome://tracing or https://ui.perfetto.dev.
+  Only the most recent 2^20 events of a capture are kept.
+  Returns the number of events written."
+  [path]
+  (let [n (skia_trace_stop (str path))]
+    (when (neg? n)
+      (throw (ex-info "Could not write trace." {:path path})))
+    n))
+
+(defc skia_capture_next_frame membraneskialib Void/TYPE [skia-resource path])
+(defc skia_capture_pending membraneskialib Integer/TYPE [skia-resource])
+(defn capture-next-frame!
+  "Record the next frame drawn by `window` and write it to `path` as a .skp file.
+
+  Images and typefaces are embedded so the capture can be replayed
+  with csource/replay or opened with skia's debugger."
+  [window path]
+  (skia_capture_next_frame (:skia-resource window) (str path))
+  ;; paint-window! draws a frame while a capture is pending, even if the view is unchanged
+  (glfw-post-empty-event)
+  nil)
+
+(defc skia_frame_scheduler_make membraneskialib Pointer [refresh-hz wake])
+(defc skia_frame_scheduler_delete membraneskialib Void/TYPE [scheduler])
+(defc skia_frame_scheduler_request membraneskialib Void/TYPE [scheduler])
+(defc skia_frame_scheduler_wait_timeout membraneskialib Double/TYPE [scheduler])
+(defc skia_frame_scheduler_begin_frame membraneskialib Integer/TYPE [scheduler])
+(defc skia_frame_scheduler_end_frame membraneskialib Void/TYPE [scheduler])
+(defc skia_frame_scheduler_stats membraneskialib Void/TYPE [scheduler stats])
+
+(def ^:private frame-scheduler-stats-keys
+  [:frames
+   :requests
+   :missed-deadlines
+   :last-frame-nanos
+   :worst-frame-nanos
+   :period-nanos])
+
+(defn frame-scheduler-stats
+  "Returns frame pacing counters for a window started with `:membrane.skia/vsync`, or nil."
+  [window]
+  (when-let [scheduler (::frame-scheduler window)]
+    (let [buf (Memory. (* 8 (count frame-scheduler-stats-keys)))]
+      (skia_frame_scheduler_stats scheduler buf)
+      (into {}
+            (map-indexed (fn [i k]
+                           [k (.getLong buf (* 8 i))]))
+            frame-scheduler-stats-keys))))
+
+(defc skia_render_thread_start membraneskialib Pointer [make-current swap-buffers window max-frames-in-flight])
+(defc skia_render_thread_stop membraneskialib Void/TYPE [render-thread])
+(defc skia_render_thread_resource membraneskialib Pointer [render-thread])
+(defc skia_render_thread_reshape membraneskialib Void/TYPE [render-thread fb-width fb-height xscale yscale])
+(defc skia_render_thread_set_resource_cache_limit membraneskialib Void/TYPE [render-thread max-bytes])
+(defc skia_render_thread_purge_unused_resources membraneskialib Void/TYPE [render-thread ms-not-used])
+(defc skia_render_thread_free_gpu_resources membraneskialib Void/TYPE [render-thread])
+(defc skia_render_thread_handle_memory_pressure membraneskialib Void/TYPE [render-thread level])
+(defc skia_render_thread_begin_frame membraneskialib Void/TYPE [render-thread])
+(defc skia_render_thread_submit_frame membraneskialib Void/TYPE [render-thread])
+
+(defn- start-render-thread
+  "Hands `window`'s gl context to a native render thread. Returns the render thread."
+  [window vsync? max-frames-in-flight]
+  ;; the swap interval applies to the context, so set it before letting go
+  (glfw-call Void/TYPE glfwMakeContextCurrent window)
+  (when vsync?
+    (glfw-call void glfwSwapInterval (int 1)))
+  (glfw-call Void/TYPE glfwMakeContextCurrent com.sun.jna.Pointer/NULL)
+  (skia_render_thread_start (.getFunction ^com.sun.jna.NativeLibrary @glfw "glfwMakeContextCurrent")
+                            (.getFunction ^com.sun.jna.NativeLibrary @glfw "glfwSwapBuffers")
+                            window
+                            (int max-frames-in-flight)))
+
+(defc skia_shared_context_make membraneskialib Pointer [])
+(defc skia_shared_context_delete membraneskialib Void/TYPE [context])
+(defc skia_init_shared membraneskialib Pointer [context])
+(defc skia_reshape_shared membraneskialib Void/TYPE [skia-resource fb-width fb-height xscale yscale])
+(defc skia_present_shared membraneskialib Void/TYPE [skia-resource])
+(defc skia_release_present_shared membraneskialib Void/TYPE [skia-resource])
+
+;; {:window hidden-glfw-window :context gr-direct-context :image-cache atom}
+(defonce ^:private shared-gl-context (atom nil))
+
+(defn- get-shared-gl-context
+  "Returns the hidden window and gpu context shared by windows started with `:membrane.skia/share-context`.
+
+  Must be called on the main thread."
+  []
+  (or @shared-gl-context
+      (let [window (glfw-call Pointer
+                              glfwCreateWindow
+                              (int 1)
+                              (int 1)
+                              ""
+                              com.sun.jna.Pointer/NULL
+                              com.sun.jna.Pointer/NULL)
+            _ (glfw-call Void/TYPE glfwMakeContextCurrent window)
+            shared {:window window
+                    :context (skia_shared_context_make)
+                    ;; images uploaded by one window can be drawn by all of them
+                    :image-cache (atom {})}]
+        (reset! shared-gl-context shared))))
+
+(defn- release-shared-gl-context! []
+  (when-let [{:keys [window context]} @shared-gl-context]
+    (glfw-call Void/TYPE glfwMakeContextCurrent window)
+    (skia_shared_context_delete context)
+    (glfw-call Void/TYPE glfwMakeContextCurrent com.sun.jna.Pointer/NULL)
+    (glfw-call void glfwDestroyWindow window)
+    (reset! shared-gl-context nil)))
+
+(defc skia_set_resource_cache_limit membraneskialib Void/TYPE [skia-resource max-bytes])
+(defc skia_resource_cache_usage membraneskialib Void/TYPE [skia-resource usage])
+(defc skia_purge_unused_resources membraneskialib Void/TYPE [skia-resource ms-not-used])
+(defc skia_free_gpu_resources membraneskialib Void/TYPE [skia-resource])
+(defc skia_memory_pressure_notify membraneskialib Void/TYPE [level])
+(defc skia_memory_pressure_take membraneskialib Integer/TYPE [])
+(defc skia_memory_pressure_watch membraneskialib Integer/TYPE [])
+(defc skia_handle_memory_pressure membraneskialib Void/TYPE [skia-resource level])
+
+(defn- make-gpu-context-current!
+  "Makes the gl context that `window`'s gpu resources belong to current.
+
+  Returns false for windows whose context is owned by a render thread."
+  [window]
+  (if (::render-thread window)
+    false
+    (do
+      (glfw-call Void/TYPE glfwMakeContextCurrent (or (:window (::shared-gl-context window))
+                                                      (:window window)))
+      true)))
+
+(defc skia_frame_arena_set_debug membraneskialib Void/TYPE [debug])
+(defn set-frame-arena-debug!
+  "Turns on checks for objects used after the frame they were allocated for.
+
+  Transient native objects, like the styles used to build paragraphs, are
+  allocated per frame and released when the frame ends. With debugging on,
+  released memory is never reused and touching it crashes immediately, which
+  makes a stale pointer easy to find in a debugger. Uses more memory."
+  [debug?]
+  (skia_frame_arena_set_debug (int (if debug? 1 0))))
+
+(defn set-gpu-cache-limit!
+  "Limits the gpu resource cache of `window` to `max-bytes`.
+
+  Windows started with `:membrane.skia/share-context` share one cache. For windows started with
+  `:membrane.skia/render-thread`, the render thread applies the limit before its next frame.
+
+  Must be called on the main thread."
+  [window max-bytes]
+  (if-let [render-thread (::render-thread window)]
+    (skia_render_thread_set_resource_cache_limit render-thread (long max-bytes))
+    (when (make-gpu-context-current! window)
+      (skia_set_resource_cache_limit (:skia-resource window) (long max-bytes)))))
+
+(defn gpu-cache-usage
+  "Returns the `:bytes`, `:count` and `:limit` of `window`'s gpu resource cache.
+
+  All zero for windows started with `:membrane.skia/render-thread`, whose cache is owned by the render thread."
+  [window]
+  (let [buf (Memory. 24)]
+    (skia_resource_cache_usage (:skia-resource window) buf)
+    {:bytes (.getLong buf 0)
+     :count (.getLong buf 8)
+     :limit (.getLong buf 16)}))
+
+(defn purge-gpu-resources!
+  "Frees cached gpu resources of `window` that haven't been used for `ms` milliseconds.
+
+  For windows started with `:membrane.skia/render-thread`, the render thread purges before its next frame.
+
+  Must be called on the main thread."
+  [window ms]
+  (if-let [render-thread (::render-thread window)]
+    (skia_render_thread_purge_unused_resources render-thread (long ms))
+    (when (make-gpu-context-current! window)
+      (skia_purge_unused_resources (:skia-resource window) (long ms)))))
+
+(defn free-gpu-resources!
+  "Frees all gpu resources of `window` that aren't in use, including glyph atlases.
+  They are recreated as needed on the next frame.
+
+  For windows started with `:membrane.skia/render-thread`, the render thread frees them before its next frame.
+
+  Must be called on the main thread."
+  [window]
+  (if-let [render-thread (::render-thread window)]
+    (skia_render_thread_free_gpu_resources render-thread)
+    (when (make-gpu-context-current! window)
+      (skia_free_gpu_resources (:skia-resource window)))))
+
+(defn notify-memory-pressure!
+  "Asks every window to trim its gpu caches on the next turn of the run loop.
+
+  `level` is `:moderate` (purge scratch and stale resources) or `:critical` (free everything unused).
+  Safe to call from any thread. Windows started with `run` also react to pressure reported by the os."
+  [level]
+  (skia_memory_pressure_notify (int (case level
+                                      :moderate 1
+                                      :critical 2))))
+
+(defn- handle-memory-pressure! [windows]
+  (let [level (skia_memory_pressure_take)]
+    (when (pos? level)
+      (doseq [window windows]
+        (if-let [render-thread (::render-thread window)]
+          (skia_render_thread_handle_memory_pressure render-thread (int level))
+          (when (make-gpu-context-current! window)
+            (skia_handle_memory_pressure (:skia-resource window) (int level))))))))
+
+(defc skia_set_shader_cache membraneskialib Void/TYPE [path max-bytes strategy])
+(defn set-shader-cache!
+  "Persist compiled gpu shader programs to `dir` so they don't have to be recompiled on the next launch.
+
+  Must be called before any windows are created. Only the first call has an effect.
+  Entries are stored in a `membrane-shader-cache` directory inside `dir`. Not supported on windows.
+
+  `max-bytes`: the cache is trimmed, least recently used first, when it grows beyond this size. Defaults to 64MB.
+  `strategy`: one of `:sksl`, `:backend-source`, or `:backend-binary` (the default)."
+  ([dir]
+   (set-shader-cache! dir (* 64 1024 1024)))
+  ([dir max-bytes]
+   (set-shader-cache! dir max-bytes :backend-binary))
+  ([dir max-bytes strategy]
+   (skia_set_shader_cache (str dir)
+                          (long max-bytes)
+                          (int (case strategy
+                                 :sksl 0
+                                 :backend-source 1
+                                 :backend-binary 2)))))
+
+(defc skia_shader_cache_stats membraneskialib Integer/TYPE [out])
+(defn shader-cache-stats
+  "Returns the `:loads`, `:hits`, `:stores` and `:bytes` of the shader cache, or nil if `set-shader-cache!` wasn't called."
+  []
+  (let [buf (Memory. 32)]
+    (when (= 1 (skia_shader_cache_stats buf))
+      {:loads (.getLong buf 0)
+       :hits (.getLong buf 8)
+       :stores (.getLong buf 16)
+       :bytes (.getLong buf 24)})))
 (defc skia_clear membraneskialib Void/TYPE [skia-resource])
 
 (defmacro with-cpu-skia-resource [resource-sym size & body]
@@ -2242,24 +3311,46 @@
                            (assert (string? window-title) "If window title is provided, it must be a string")
                            window-title)
                          "Membrane")
+          shared (when (and (::share-context this)
+                            (not (::render-thread this)))
+                   (get-shared-gl-context))
           window (glfw-call Pointer
                             glfwCreateWindow
                             window-width
                             window-height
                             window-title
                             com.sun.jna.Pointer/NULL
-                            com.sun.jna.Pointer/NULL)
+                            (or (:window shared)
+                                com.sun.jna.Pointer/NULL))
+          render-thread (when-let [opt (::render-thread this)]
+                          (start-render-thread window
+                                               (::vsync this)
+                                               (if (true? opt) 2 opt)))
           this
           (assoc this
                  :window window
-                 :image-cache (atom {})
+                 ;; made before the callbacks, which hold on to this map
+                 ::frame-scheduler (when (::vsync this)
+                                     ;; requests from other threads wake up the run loop
+                                     (skia_frame_scheduler_make (double (monitor-refresh-rate))
+                                                                (.getFunction ^com.sun.jna.NativeLibrary @glfw
+                                                                              "glfwPostEmptyEvent")))
+                 ::render-thread render-thread
+                 ::shared-gl-context shared
+                 ::hit-index (when (::hit-index this)
+                               (skia_hit_index_make))
+                 :image-cache (or (:image-cache shared)
+                                  (atom {}))
                  :font-cache (atom {})
                  :draw-cache (java.util.WeakHashMap.)
                  :ui (atom nil)
                  :mouse-position (atom [0 0])
                  :window-content-scale (atom [1 1])
                  :window-size (atom nil)
-                 :skia-resource (Skia/skia_init))
+                 :skia-resource (cond
+                                  render-thread (skia_render_thread_resource render-thread)
+                                  shared (skia_init_shared (:context shared))
+                                  :else (Skia/skia_init)))
           drop-callback (make-drop-callback this (get handlers :drop -drop-callback))
           key-callback (make-key-callback this (get handlers :key -key-callback))
           character-callback (make-character-callback this (get handlers :char -character-callback))
@@ -2269,6 +3360,7 @@
           window-refresh-callback (make-window-refresh-callback this (get handlers :refresh -window-refresh-callback))
           cursor-pos-callback (make-cursor-pos-callback this (get handlers :cursor -cursor-pos-callback))
           window-close-callback (make-window-close-callback this (get handlers :window-close -window-close-callback))
+          window-iconify-callback (make-window-iconify-callback this (get handlers :iconify -window-iconify-callback))
           ;; mouse-enter-callback (make-mouse-enter-callback this (get handlers :mouse-enter -mouse-enter-callback))
           ]
 
@@ -2278,9 +3370,11 @@
           (let [s (.getPointer m 0)]
             (println "error description: " (.getString s 0) ))))
 
-      (glfw-call Void/TYPE glfwMakeContextCurrent window)
+      ;; with a render thread, the gl context belongs to the render thread
+      (when-not render-thread
+        (glfw-call Void/TYPE glfwMakeContextCurrent window)
 
-      (glPixelStorei GL_UNPACK_ALIGNMENT, (int 1)) ;
+        (glPixelStorei GL_UNPACK_ALIGNMENT, (int 1)))
 
       ;; Setting swap interval to 1 is probably the right thing, but currently, the way it blocks
       ;; the event thread messes everything up.
@@ -2295,6 +3389,7 @@
       (glfw-call Pointer glfwSetScrollCallback window scroll-callback)
       (glfw-call Pointer glfwSetWindowRefreshCallback window window-refresh-callback)
       (glfw-call Pointer glfwSetWindowCloseCallback window window-close-callback)
+      (glfw-call Pointer glfwSetWindowIconifyCallback window window-iconify-callback)
       ;; (glfw-call Pointer glfwSetCursorEnterCallback window mouse-enter-callback)
 
       ;; When this input mode is enabled, any callback that receives modifier
@@ -2304,6 +3399,12 @@
 
       (glfw-call void glfwSetWindowPos window window-x window-y)
 
+      (when-let [limit (::gpu-cache-limit this)]
+        (set-gpu-cache-limit! this limit))
+
+      (when-let [index (::hit-index this)]
+        (skia_hit_index_attach (:skia-resource this) index))
+
       ;; reshape must be called before glfw show window
       ;; so that we have the right size buffers set up
       (reshape! this window-width window-height)
@@ -2321,16 +3422,18 @@
                     window-refresh-callback
                     cursor-pos-callback
                     window-close-callback
+                    window-iconify-callback
                     ;; mouse-enter-callback
                     ]))))
 
-  (reshape! [_ width height]
-    (glfw-call Void/TYPE glfwMakeContextCurrent window)
-    
-    (glViewport (int 0) (int 0) width height)
-    (glClearStencil (int 0))
-    (glClear (bit-or GL_COLOR_BUFFER_BIT
-                     GL_STENCIL_BUFFER_BIT))
+  (reshape! [this width height]
+    (when-not (::render-thread this)
+      (glfw-call Void/TYPE glfwMakeContextCurrent window)
+
+      (glViewport (int 0) (int 0) width height)
+      (glClearStencil (int 0))
+      (glClear (bit-or GL_COLOR_BUFFER_BIT
+                       GL_STENCIL_BUFFER_BIT)))
 
     ;; there's some issue with caching when drawing text that's offscreen
     ;; when using gpu renderer in skia.cpp.
@@ -2350,7 +3453,17 @@
                            (int (/ fb-height yscale))])
       ;; force repaint
       (reset! ui nil)
-      (Skia/skia_reshape skia-resource fb-width fb-height xscale yscale))
+      (cond
+        (::render-thread this)
+        (skia_render_thread_reshape (::render-thread this) (int fb-width) (int fb-height) (float xscale) (float yscale))
+
+        (::shared-gl-context this)
+        (do
+          (glfw-call Void/TYPE glfwMakeContextCurrent (:window (::shared-gl-context this)))
+          (skia_reshape_shared skia-resource (int fb-width) (int fb-height) (float xscale) (float yscale)))
+
+        :else
+        (Skia/skia_reshape skia-resource fb-width fb-height xscale yscale)))
 
     nil)
   
@@ -2359,7 +3472,22 @@
       (glfw-call Boolean/TYPE glfwWindowShouldClose window)))
   (cleanup! [this]
     (.clear ^java.util.Map (:draw-cache this))
-    (Skia/skia_cleanup skia-resource)
+    (release-fonts! font-cache)
+    (when-let [scheduler (::frame-scheduler this)]
+      (skia_frame_scheduler_delete scheduler))
+    (if-let [render-thread (::render-thread this)]
+      ;; also frees skia-resource
+      (skia_render_thread_stop render-thread)
+      (do
+        (when-let [shared (::shared-gl-context this)]
+          ;; the present framebuffer belongs to the window's context
+          (glfw-call Void/TYPE glfwMakeContextCurrent window)
+          (skia_release_present_shared skia-resource)
+          ;; the window's texture belongs to the shared context
+          (glfw-call Void/TYPE glfwMakeContextCurrent (:window shared)))
+        (Skia/skia_cleanup skia-resource)))
+    (when-let [index (::hit-index this)]
+      (skia_hit_index_delete index))
     (glfw-call void glfwDestroyWindow window)
     (assoc this
            :window nil
@@ -2370,37 +3498,95 @@
            :draw-cache nil
            :ui nil
            :window-content-scale nil
+           ::render-thread nil
+           ::shared-gl-context nil
+           ::hit-index nil
            :skia-resource nil))
 
 
   (repaint! [this]
+    (if-let [scheduler (::frame-scheduler this)]
+      (skia_frame_scheduler_request scheduler)
+      (paint-window! this))))
+
+(defn- window-view [window]
+  (let [{:keys [window-size window-content-scale view-fn]} window]
+    (view-fn {:container-size @window-size
+              :content-scale @window-content-scale
+              :container window})))
+
+(defn- paint-window! [window]
+  (let [{:keys [image-cache font-cache draw-cache skia-resource ui]} window
+        window-handle (:window window)]
+    ;; *skia-resource* is only bound while drawing. Objects made from its
+    ;; frame arena are released when the frame is flushed, and frames whose
+    ;; view didn't change are never flushed.
     (binding [*image-cache* image-cache
               *font-cache* font-cache
-              *window* this
-              *draw-cache* draw-cache
-              *skia-resource* skia-resource]
-      (let [container-info {:container-size @window-size
-                            :content-scale @window-content-scale
-                            :container this}
-            [last-view view] (reset-vals! ui
-                                          (view-fn container-info))]
+              *window* window
+              *draw-cache* draw-cache]
+      (let [[last-view view] (reset-vals! ui
+                                          (window-view window))]
 
         ;; TODO: should try to implement
         ;; Yes, that's fine.  Another common approach is to record the entire scene normally as an SkPicture, and just play it back into each tile, clipped and translated as appropriate.
         ;; This approach works best if you use SkRTreeFactory when calling beginRecording()... that'll build an R-tree to help us skip issuing draws that fall outside each tile.
 
-        (when (not= view last-view)
-          (glfw-call Void/TYPE glfwMakeContextCurrent window)
+        (when (or (not= view last-view)
+                  (= 1 (skia_capture_pending skia-resource)))
+          (binding [*skia-resource* skia-resource]
+            (cond
+              (::render-thread window)
+              (let [render-thread (::render-thread window)]
+                (skia_render_thread_begin_frame render-thread)
+                (Skia/skia_clear skia-resource)
+                (draw view)
+                ;; flushing and swapping happen on the render thread
+                (skia_render_thread_submit_frame render-thread))
+
+              (::shared-gl-context window)
+              (do
+                ;; draw with the shared context, then copy to the window
+                (glfw-call Void/TYPE glfwMakeContextCurrent (:window (::shared-gl-context window)))
 
-          (Skia/skia_clear skia-resource)
-          (draw view)
-          (Skia/skia_flush_and_submit skia-resource)
+                (Skia/skia_clear skia-resource)
+                (draw view)
+                (Skia/skia_flush_and_submit skia-resource)
 
-          (glfw-call Void/TYPE glfwSwapBuffers window)
+                (glfw-call Void/TYPE glfwMakeContextCurrent window-handle)
+                (skia_present_shared skia-resource)
+                (glfw-call Void/TYPE glfwSwapBuffers window-handle))
+
+              :else
+              (do
+                (glfw-call Void/TYPE glfwMakeContextCurrent window-handle)
 
-          (when-let [on-present (::on-present this)]
+                (Skia/skia_clear skia-resource)
+                (draw view)
+                (Skia/skia_flush_and_submit skia-resource)
+
+                (glfw-call Void/TYPE glfwSwapBuffers window-handle))))
+
+          (when-let [on-present (::on-present window)]
             (on-present view)))))))
 
+(defn- request-frame!
+  "Requests a frame for `window` if it's paced by a frame scheduler.
+
+  Scheduled windows aren't repainted on every turn of the run loop, which would keep the
+  scheduler busy. Instead, every event and `::repaint` requests a frame."
+  [window]
+  (when-let [scheduler (::frame-scheduler window)]
+    (skia_frame_scheduler_request scheduler)))
+
+(defn- paint-scheduled-frame!
+  "Paints `window` if its frame scheduler says a frame is due."
+  [window]
+  (when-let [scheduler (::frame-scheduler window)]
+    (when (= 1 (skia_frame_scheduler_begin_frame scheduler))
+      (paint-window! window)
+      (skia_frame_scheduler_end_frame scheduler))))
+
 (defonce window-chan (chan 1))
 
 (defn run-sync
@@ -2422,6 +3608,34 @@
 
   `:error-callback`: A function to call when an error occurs on the event thread. Defaults to `clojure.core/println`.
 
+  `:membrane.skia/font-warmup`: A map of `:fonts` and `:glyphs`. When provided, the font manager is
+  initialized and `:glyphs` (default printable ascii) are prerendered for each of `:fonts`
+  on a background thread while the window is created. This warms the cpu side caches
+  (typefaces and glyph masks). Uploading glyphs to the gpu atlas still happens on first draw.
+
+  `:membrane.skia/vsync`: When true, repaints are paced to the display refresh. A frame is requested
+  by every event, `::repaint` and `repaint!`. Requests are merged into at most one frame per refresh
+  and no frame is drawn when nothing requested one. Without a render thread, frames are paced by a
+  timer and swapping doesn't wait for the display, so the event thread never blocks on it.
+  See `frame-scheduler-stats`.
+
+  `:membrane.skia/render-thread`: When true, frames are recorded on the event thread and rendered,
+  flushed and swapped on a native render thread that owns the gl context, so the next frame can be
+  built while the gpu works on the previous one. A number limits how many frames the gpu may have
+  in flight (default 2). `shared-pixels-view` and `yuv-frame` need the gl context and throw when drawn
+  into such a window.
+
+  `:membrane.skia/hit-index`: When true, the bounds of elements wrapped with `hit-target` are
+  recorded while drawing so `hit-test` can find them without walking the component tree.
+
+  `:membrane.skia/gpu-cache-limit`: Limits the window's gpu resource cache to this many bytes.
+  See `set-gpu-cache-limit!`.
+
+  `:membrane.skia/share-context`: When true, the window shares one gpu context with every other window
+  started with this option, so glyph atlases, uploaded images and compiled shaders are kept once instead
+  of once per window. Each frame is drawn into a texture and copied to the window. Ignored when
+  `:membrane.skia/render-thread` is set.
+
   `:handlers`: A map of callback backs for glfw events
   The events correspond to the available glfw events. If no `handlers` map is provided, then the defaults are used.
   If a handlers key is provided, it does not replace the defaults, but get merged into the defaults.
@@ -2436,6 +3650,7 @@
   :cursor args are [window window-handle x y]. default is -cursor-pos-callback.
   :mouse-enter args are [window window-handle entered]. default is -mouse-enter-callback.
   :window-close args are [window window-handle]. default is -window-close-callback.
+  :iconify args are [window window-handle iconified]. default is -window-iconify-callback.
 
   For each handler, `window` is the GlfwSkiaWindow and window-handle is a jna pointer to the glfw pointer.
   
@@ -2460,8 +3675,7 @@
    (dispatch-sync!
        (fn []
          (try
-           (run-helper window-chan
-                       (:membrane.skia/on-main options))
+           (run-helper window-chan options)
            (catch Exception e
              ((or (:error-callback options) println) e)))))))
 
@@ -2484,6 +3698,34 @@
 
   `:error-callback`: A function to call when an error occurs on the event thread. Defaults to `clojure.core/println`.
 
+  `:membrane.skia/font-warmup`: A map of `:fonts` and `:glyphs`. When provided, the font manager is
+  initialized and `:glyphs` (default printable ascii) are prerendered for each of `:fonts`
+  on a background thread while the window is created. This warms the cpu side caches
+  (typefaces and glyph masks). Uploading glyphs to the gpu atlas still happens on first draw.
+
+  `:membrane.skia/vsync`: When true, repaints are paced to the display refresh. A frame is requested
+  by every event, `::repaint` and `repaint!`. Requests are merged into at most one frame per refresh
+  and no frame is drawn when nothing requested one. Without a render thread, frames are paced by a
+  timer and swapping doesn't wait for the display, so the event thread never blocks on it.
+  See `frame-scheduler-stats`.
+
+  `:membrane.skia/render-thread`: When true, frames are recorded on the event thread and rendered,
+  flushed and swapped on a native render thread that owns the gl context, so the next frame can be
+  built while the gpu works on the previous one. A number limits how many frames the gpu may have
+  in flight (default 2). `shared-pixels-view` and `yuv-frame` need the gl context and throw when drawn
+  into such a window.
+
+  `:membrane.skia/hit-index`: When true, the bounds of elements wrapped with `hit-target` are
+  recorded while drawing so `hit-test` can find them without walking the component tree.
+
+  `:membrane.skia/gpu-cache-limit`: Limits the window's gpu resource cache to this many bytes.
+  See `set-gpu-cache-limit!`.
+
+  `:membrane.skia/share-context`: When true, the window shares one gpu context with every other window
+  started with this option, so glyph atlases, uploaded images and compiled shaders are kept once instead
+  of once per window. Each frame is drawn into a texture and copied to the window. Ignored when
+  `:membrane.skia/render-thread` is set.
+
   `:handlers`: A map of callback backs for glfw events
   The events correspond to the available glfw events. If no `handlers` map is provided, then the defaults are used.
   If a handlers key is provided, it does not replace the defaults, but get merged into the defaults.
@@ -2496,6 +3738,7 @@
   :scroll args are [window window-handle offset-x offset-y]. default is -scroll-callback.
   :refresh args are [window window-handle]. default is -window-refresh-callback.
   :cursor args are [window window-handle x y]. default is -cursor-pos-callback.
+  :iconify args are [window window-handle iconified]. default is -window-iconify-callback.
 
   For each handler, `window` is the GlfwSkiaWindow and window-handle is a jna pointer to the glfw pointer.
   
@@ -2515,14 +3758,29 @@
 
    {::repaint glfw-post-empty-event}))
 
-(defn- run-helper [window-chan on-main]
+(defn- primary-monitor-content-scale []
+  (let [xscale (FloatByReference.)
+        yscale (FloatByReference.)
+        monitor (glfw-call Pointer glfwGetPrimaryMonitor)]
+    (if monitor
+      (do
+        (glfw-call void glfwGetMonitorContentScale monitor xscale yscale)
+        (.getValue xscale))
+      1)))
+
+(defn- run-helper [window-chan options]
   (with-local-vars [windows #{}]
     (letfn [(init []
               (if (not= 1 (glfw-call Integer/TYPE glfwInit))
                 false
                 (do
                   (.setContextClassLoader (Thread/currentThread) main-class-loader)
+                  (when-let [{:keys [fonts glyphs]} (::font-warmup options)]
+                    (start-font-warmup! fonts
+                                        (or glyphs ascii-glyphs)
+                                        (primary-monitor-content-scale)))
                   (fix-press-and-hold!)
+                  (skia_memory_pressure_watch)
                   ;; (glfw-call void glfwWindowHint GLFW_COCOA_RETINA_FRAMEBUFFER (int 0))
 
                   ;; only call on macosx
@@ -2543,7 +3801,16 @@
                   (var-set windows (conj (var-get windows) (init! window)))
                   (recur (async/poll! window-chan)))))
             (wait-events []
-              (glfw-call void glfwWaitEventsTimeout (double 0.5))
+              (let [timeout (transduce
+                             (comp (keep ::frame-scheduler)
+                                   (map skia_frame_scheduler_wait_timeout)
+                                   (remove neg?))
+                             min
+                             0.5
+                             (var-get windows))]
+                (if (pos? timeout)
+                  (glfw-call void glfwWaitEventsTimeout (double timeout))
+                  (glfw-call void glfwPollEvents)))
               #_(glfw-call void glfwWaitEvents )
               #_(glfw-call void glfwPollEvents)
               #_(java.lang.Thread/sleep 30))
@@ -2554,6 +3821,7 @@
                   (run! cleanup! to-close)
                   (var-set windows (reduce disj ws to-close)))))
             (cleanup []
+              (release-shared-gl-context!)
               (glfw-call Void/TYPE glfwTerminate))
             ]
 
@@ -2571,10 +3839,17 @@
 
             (close-windows!)
 
-            (when on-main
+            (when-let [on-main (::on-main options)]
               (on-main))
 
+            (handle-memory-pressure! (var-get windows))
+
             (run! repaint!
+                  (remove ::frame-scheduler (var-get windows)))
+            (when (.getAndSet repaint-posted false)
+              (run! request-frame!
+                    (var-get windows)))
+            (run! paint-scheduled-frame!
                   (var-get windows))
 
             (when (seq (var-get windows))
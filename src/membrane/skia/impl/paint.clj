@@ -19,6 +19,7 @@
 
    :skia_Paint_delete {:rettype :void :argtypes '[[paint :pointer]]} 
    :skia_Paint_make {:rettype :pointer :argtypes '[]} 
+   :skia_Paint_make_frame {:rettype :pointer :argtypes '[[resource :pointer]]} 
    :skia_Paint_reset {:rettype :void :argtypes '[[paint :pointer]]} 
    :skia_Paint_isAntiAlias {:rettype :int32 :argtypes '[[paint :pointer]]} 
    :skia_Paint_setAntiAlias {:rettype :void :argtypes '[[paint :pointer] [aa :int32]]} 
@@ -261,28 +262,33 @@
                       (~delete-sym (Pointer. ptr#))))
          p#)))
 
+(defn- wrap-paint [p]
+  (proxy [Pointer
+          clojure.lang.ILookup]
+      [(long (dt-ffi/pointer->address p))
+       nil]
+
+      (valAt [k]
+        (case k
+          :anti-alias? (<-bool (skia_Paint_isAntiAlias this))
+          :dither? (<-bool (skia_Paint_isDither this))
+          :color (<-color (skia_Paint_getColor this))
+          :alpha (skia_Paint_getAlphaf this)
+          :stroke-width (skia_Paint_getStrokeWidth this)
+          :stroke-miter (skia_Paint_getStrokeMiter this)
+          :stroke-cap (<-cap (getStrokeCap this))
+          :stroke-join (<-join (skia_Paint_getStrokeJoin this))
+          :blend-mode (<-blend-mode (skia_Paint_getBlendMode_or this -1))
+          ;; else
+          nil))))
+
 (defn- skia-Paint-make []
   (add-cleaner
    Paint
-   
-   (proxy [Pointer
-           clojure.lang.ILookup]
-       [(long (dt-ffi/pointer->address (skia_Paint_make)))
-        nil]
-
-       (valAt [k]
-         (case k
-           :anti-alias? (<-bool (skia_Paint_isAntiAlias this))
-           :dither? (<-bool (skia_Paint_isDither this))
-           :color (<-color (skia_Paint_getColor this))
-           :alpha (skia_Paint_getAlphaf this)
-           :stroke-width (skia_Paint_getStrokeWidth this)
-           :stroke-miter (skia_Paint_getStrokeMiter this)
-           :stroke-cap (<-cap (getStrokeCap this))
-           :stroke-join (<-join (skia_Paint_getStrokeJoin this))
-           :blend-mode (<-blend-mode (skia_Paint_getBlendMode_or this -1))
-           ;; else
-           nil)))))
+   (wrap-paint (skia_Paint_make))))
+
+(defn- skia-Paint-make-frame [resource]
+  (wrap-paint (skia_Paint_make_frame resource)))
 
 (defn ->SkPaint
   ([m]
@@ -307,3 +313,9 @@
                 paint)
               paint
               m)))
+
+(defn ->frame-SkPaint
+  "Like `->SkPaint`, but the paint is released when `resource`'s current frame ends."
+  [resource m]
+  (->SkPaint (skia-Paint-make-frame resource)
+             m))
@@ -20,6 +20,7 @@
                   java.util.function.Supplier
                   (get [_]
                     (java.util.WeakHashMap.))))]
+    ^{::cache cache*}
     (fn
       ([o]
        (let [cache ^java.util.Map (.get ^ThreadLocal cache*)]
@@ -40,6 +41,12 @@
                (.put cache [o1 o2 o3] result)
                result)))))))
 
+(defn- memo-put!
+  "Stores `result` for the args `[o1 o2 o3]` of a `memo123` function."
+  [memo-fn k result]
+  (let [cache ^java.util.Map (.get ^ThreadLocal (::cache (meta memo-fn)))]
+    (.put cache k result)))
+
 
 (def ^:private void Void/TYPE)
 (def cleaner (delay (Cleaner/create)))
@@ -65,11 +72,13 @@
    :skia_SkRefCntBase_unref {:rettype :void :argtypes '[[o :pointer]]}
    :skia_SkString_delete {:rettype :void :argtypes '[[sk-string :pointer]]}
    :skia_SkString_make_utf8 {:rettype :pointer? :argtypes '[[buf :pointer] [len :int32]]}
+   :skia_SkString_make_utf8_frame {:rettype :pointer? :argtypes '[[resource :pointer] [buf :pointer] [len :int32]]}
    :skia_SkColor4f_make {:rettype :int32 :argtypes '[[red :float32] [green :float32] [blue :float32] [alpha :float32] ]}
    :skia_FontStyle_delete {:rettype :void :argtypes '[[style :pointer]]}
    :skia_FontStyle_make {:rettype :pointer? :argtypes '[[make :int32] [width :int32] [slant :int32] ]}
    :skia_ParagraphBuilder_delete {:rettype :void :argtypes '[[pb :pointer]]}
    :skia_ParagraphBuilder_make {:rettype :pointer? :argtypes '[[paragraph-style :pointer]]}
+   :skia_ParagraphBuilder_make_frame {:rettype :pointer? :argtypes '[[resource :pointer] [paragraph-style :pointer]]}
    :skia_ParagraphBuilder_pushStyle {:rettype :void :argtypes '[[builder :pointer] [style :pointer]]}
    :skia_ParagraphBuilder_pop {:rettype :void :argtypes '[[builder :pointer]]}
    :skia_ParagraphBuilder_addText {:rettype :void :argtypes '[[builder :pointer] [text :pointer] [len :int32]]}
@@ -77,10 +86,12 @@
    :skia_ParagraphBuilder_addPlaceholder2 {:rettype :void :argtypes '[[builder :pointer] [width :float32] [height :float32] [alignment :int32] [baseline :int32] [offset :float32]]}
    :skia_Paragraph_delete {:rettype :void :argtypes '[[p :pointer]]}
    :skia_ParagraphBuilder_build {:rettype :pointer? :argtypes '[[builder :pointer]]}
+   :skia_ParagraphBuilder_build_batch {:rettype :void :argtypes '[[builders :pointer] [widths :pointer] [count :int32] [paragraphs :pointer] [metrics :pointer]]}
    :skia_ParagraphBuilder_reset {:rettype :void :argtypes '[[builder :pointer]]}
 
    :skia_StrutStyle_delete {:rettype :void :argtypes '[[style :pointer]]}
    :skia_StrutStyle_make {:rettype :pointer}
+   :skia_StrutStyle_make_frame {:rettype :pointer? :argtypes '[[resource :pointer]]}
    :skia_StrutStyle_setFontFamilies {:rettype :void :argtypes '[[style :pointer] [families :pointer] [families-count :int32]]}
    :skia_StrutStyle_setFontStyle {:rettype :void :argtypes '[[style :pointer] [font-style :pointer]]}
    :skia_StrutStyle_setFontSize {:rettype :void :argtypes '[[style :pointer] [size :float32]]}
@@ -93,6 +104,7 @@
 
    :skia_TextStyle_delete {:rettype :void :argtypes '[[style :pointer]]}
    :skia_TextStyle_make {:rettype :pointer}
+   :skia_TextStyle_make_frame {:rettype :pointer? :argtypes '[[resource :pointer]]}
    :skia_TextStyle_setColor {:rettype :pointer? :argtypes '[[style :pointer] [color :int32]]}
    :skia_TextStyle_setForeground {:rettype :void :argtypes '[[style :pointer] [foreground :pointer]]}
    :skia_TextStyle_clearForegroundColor {:rettype :void :argtypes '[[style :pointer]]}
@@ -120,6 +132,7 @@
    :skia_TextStyle_setPlaceholder {:rettype :void :argtypes '[[style :pointer]]}
    :skia_ParagraphStyle_delete {:rettype :void :argtypes '[[ps :pointer]]}
    :skia_ParagraphStyle_make {:rettype :pointer?}
+   :skia_ParagraphStyle_make_frame {:rettype :pointer? :argtypes '[[resource :pointer]]}
    :skia_ParagraphStyle_turnHintingOff {:rettype  :void :argtypes '[[style :pointer]]}
    :skia_ParagraphStyle_setStrutStyle {:rettype :void :argtypes '[[style :pointer] [strut-style :pointer]]}
    :skia_ParagraphStyle_setTextStyle {:rettype :void :argtypes '[[style :pointer] [text-style :pointer]]}
@@ -142,10 +155,36 @@
    :skia_Paragraph_paint {:rettype :void :argtypes '[[paragraph :pointer] [resource :pointer] [x :float32] [y :float32]]}
    :skia_Paragraph_getRectsForRange {:rettype :int32 :argtypes '[[paragraph :pointer] [start :int32] [end :int32] [rect-style-height :int32] [rect-style-width :int32] [buf :pointer] [max :int32]]}
    :skia_Paragraph_getRectsForPlaceholders {:rettype :int32 :argtypes '[[paragraph :pointer] [buf :pointer] [max :int32]]}
+   :skia_Paragraph_getRectsForRanges {:rettype :int32 :argtypes '[[paragraph :pointer] [ranges :pointer] [count :int32] [rect-style-height :int32] [rect-style-width :int32] [buf :pointer] [counts :pointer] [max :int32]]}
+   :skia_Paragraph_getLineMetrics {:rettype :int32 :argtypes '[[paragraph :pointer] [indices :pointer?] [metrics :pointer?] [max :int32]]}
+   :skia_Paragraph_getGlyphPositionsAtCoordinates {:rettype :void :argtypes '[[paragraph :pointer] [points :pointer] [count :int32] [out :pointer]]}
    :skia_Paragraph_getGlyphPositionAtCoordinate {:rettype :void :argtypes '[[paragraph :pointer] [dx :float32] [dy :float32] [*pos :pointer] [*affinity :pointer]]}
    :skia_count_font_families {:rettype :int32 :argtypes '[]}
    :skia_get_family_name {:rettype :void :argtypes '[[family-name :pointer] [len :int64] [index :int32]]} 
 
+   :skia_DocumentLayout_make {:rettype :pointer? :argtypes '[[paragraph-style :pointer] [width :float32]]}
+   :skia_DocumentLayout_delete {:rettype :void :argtypes '[[doc :pointer]]}
+   :skia_DocumentLayout_setText {:rettype :void :argtypes '[[doc :pointer] [text :pointer] [len :int64]]}
+   :skia_DocumentLayout_replaceLines {:rettype :void :argtypes '[[doc :pointer] [start :int32] [count :int32] [text :pointer?] [len :int64]]}
+   :skia_DocumentLayout_setWidth {:rettype :void :argtypes '[[doc :pointer] [width :float32]]}
+   :skia_DocumentLayout_getLineCount {:rettype :int32 :argtypes '[[doc :pointer]]}
+   :skia_DocumentLayout_getHeight {:rettype :float32 :argtypes '[[doc :pointer]]}
+   :skia_DocumentLayout_getLineTop {:rettype :float32 :argtypes '[[doc :pointer] [line :int32]]}
+   :skia_DocumentLayout_getLineAt {:rettype :int32 :argtypes '[[doc :pointer] [y :float32]]}
+   :skia_DocumentLayout_getLineParagraph {:rettype :pointer? :argtypes '[[doc :pointer] [line :int32]]}
+   :skia_DocumentLayout_paint {:rettype :void :argtypes '[[doc :pointer] [resource :pointer] [x :float32] [y :float32]]}
+
+   :skia_EditableParagraph_make {:rettype :pointer? :argtypes '[[paragraph-style :pointer] [width :float32]]}
+   :skia_EditableParagraph_delete {:rettype :void :argtypes '[[para :pointer]]}
+   :skia_EditableParagraph_replaceText {:rettype :void :argtypes '[[para :pointer] [from :int32] [to :int32] [text :pointer?] [len :int32]]}
+   :skia_EditableParagraph_setStyle {:rettype :void :argtypes '[[para :pointer] [from :int32] [to :int32] [style :pointer?]]}
+   :skia_EditableParagraph_setWidth {:rettype :void :argtypes '[[para :pointer] [width :float32]]}
+   :skia_EditableParagraph_getHeight {:rettype :float32 :argtypes '[[para :pointer]]}
+   :skia_EditableParagraph_getMaxIntrinsicWidth {:rettype :float32 :argtypes '[[para :pointer]]}
+   :skia_EditableParagraph_paint {:rettype :void :argtypes '[[para :pointer] [resource :pointer] [x :float32] [y :float32]]}
+   :skia_EditableParagraph_getRectsForRange {:rettype :int32 :argtypes '[[para :pointer] [start :int32] [end :int32] [rect-style-height :int32] [rect-style-width :int32] [buf :pointer] [max :int32]]}
+   :skia_EditableParagraph_getGlyphPositionAtCoordinate {:rettype :void :argtypes '[[para :pointer] [dx :float32] [dy :float32] [*pos :pointer] [*affinity :pointer]]}
+
    ,})
 
 (dt-ffi/define-library-interface
@@ -189,6 +228,12 @@
                       (~delete-sym (dt-ffi/->pointer ptr#))))
          p#))))
 
+;; While a frame is being drawn, transient objects like styles and
+;; builders are allocated from the resource's frame arena and released
+;; together when the frame ends instead of one by one by the cleaner.
+(defn- frame-resource []
+  backend/*skia-resource*)
+
 (defn- ref-count [p name]
   (let [ptr (dt-ffi/pointer->address p)]
     (.register ^Cleaner @cleaner p
@@ -200,9 +245,11 @@
 (defn- ->SkString [^String s]
   (let [buf (dt-ffi/string->c s)
         len (dec (count buf))]
-    (add-cleaner
-     SkString
-     (skia_SkString_make_utf8 buf len))))
+    (if-let [resource (frame-resource)]
+      (skia_SkString_make_utf8_frame resource buf len)
+      (add-cleaner
+       SkString
+       (skia_SkString_make_utf8 buf len)))))
 
 
 ;; SkColor skia_SkColor4f_make(float red, float green, float blue, float alpha)
@@ -278,10 +325,11 @@
 
 (defn- skia-ParagraphBuilder-make [paragraph-style]
   (assert (pointer? paragraph-style))
-  
-  (add-cleaner
-   ParagraphBuilder
-   (skia_ParagraphBuilder_make paragraph-style)))
+  (if-let [resource (frame-resource)]
+    (skia_ParagraphBuilder_make_frame resource paragraph-style)
+    (add-cleaner
+     ParagraphBuilder
+     (skia_ParagraphBuilder_make paragraph-style))))
 
 (defn- skia-ParagraphBuilder-pushStyle [builder style]
   (assert (pointer? builder))
@@ -349,7 +397,7 @@
   {:alphabetic 0 
    :ideographic 1})
 
-;; void skia_ParagraphBuilder_addPlaceholder2(ParagraphBuilder *pb, float width, float height, int alignment, int baseline, float offset){
+;; void skia_ParagraphBuilder_addPlaceholder2(ParagraphRecorder *pb, float width, float height, int alignment, int baseline, float offset){
 (defn- skia-ParagraphBuilder-addPlaceholder2 [builder placeholder]
   (assert (pointer? builder))
   (let [width (float (:width placeholder))
@@ -378,9 +426,11 @@
 
 
 (defn- skia-StrutStyle-make []
-  (add-cleaner
-   StrutStyle
-   (skia_StrutStyle_make)))
+  (if-let [resource (frame-resource)]
+    (skia_StrutStyle_make_frame resource)
+    (add-cleaner
+     StrutStyle
+     (skia_StrutStyle_make))))
 
 ;; skia_StrutStyle_setFontFamilies(StrutStyle* style, SkString** familiesArr, int familiesCount)
 (defn- skia-StrutStyle-setFontFamilies [style families]
@@ -444,9 +494,11 @@
   style)
 
 (defn- skia-TextStyle-make []
-  (add-cleaner
-   TextStyle
-   (skia_TextStyle_make)))
+  (if-let [resource (frame-resource)]
+    (skia_TextStyle_make_frame resource)
+    (add-cleaner
+     TextStyle
+     (skia_TextStyle_make))))
 
 (defn- skia-TextStyle-setColor [style [r g b a]]
   (let [color (skia_SkColor4f_make (float r)
@@ -623,9 +675,11 @@
   style)
 
 (defn- skia-ParagraphStyle-make []
-  (add-cleaner
-   ParagraphStyle
-   (skia_ParagraphStyle_make)))
+  (if-let [resource (frame-resource)]
+    (skia_ParagraphStyle_make_frame resource)
+    (add-cleaner
+     ParagraphStyle
+     (skia_ParagraphStyle_make))))
 
 (defn- skia-ParagraphStyle-turnHintingOff [style]
   (skia_ParagraphStyle_turnHintingOff style)
@@ -803,41 +857,107 @@
 ;;                                               unsigned end,
 ;;                                               RectHeightStyle rectHeightStyle,
 ;;                                               RectWidthStyle rectWidthStyle) = 0;
+(def ^:private rect-size (* 4 4))
+
+(defn- read-rect [buf i]
+  {:x       (native-buffer/read-float buf  (+  (*  4  0)  (*  rect-size  i)))
+   :y       (native-buffer/read-float buf  (+  (*  4  1)  (*  rect-size  i)))
+   :width   (native-buffer/read-float buf  (+  (*  4  2)  (*  rect-size  i)))
+   :height  (native-buffer/read-float buf  (+  (*  4  3)  (*  rect-size  i)))})
+
+(defn- read-rects
+  "Calls `(f buf max)`, which writes up to `max` rects to `buf` and returns how
+  many rects there are. Calls `f` again with a big enough buffer when they don't fit."
+  [f]
+  (let [max (quot (ffi-buf-size)
+                  rect-size)
+        buf (ffi-buf)
+        n (f buf max)
+        buf (if (> n max)
+              (let [buf (native-buffer/malloc (* n rect-size)
+                                              {:uninitialized? true
+                                               :resource-type :auto})]
+                (f buf n)
+                buf)
+              buf)]
+    (into []
+          (map #(read-rect buf %))
+          (range n))))
+
 (defn- skia-Paragraph-getRectsForRange [paragraph start end rect-style-height rect-style-width]
   (assert (pointer? paragraph))
-  (let [buf (ffi-buf)
-        rect-size (* 4 4)
-        max (quot (ffi-buf-size)
-                  rect-size)
+  (read-rects
+   (fn [buf max]
+     (skia_Paragraph_getRectsForRange paragraph start end
+                                      (or (->rect-height-style rect-style-height)
+                                          (int 0))
+                                      (or (->rect-width-style rect-style-width)
+                                          (int 0))
+                                      buf max))))
+;; virtual std::vector<TextBox> getRectsForPlaceholders() = 0;
 
-        n (skia_Paragraph_getRectsForRange paragraph start end
-                                           (or (->rect-height-style rect-style-height)
-                                               (int 0))
-                                           (or (->rect-width-style rect-style-width)
-                                               (int 0))
-                                           buf max)]
+(defn- skia-Paragraph-getRectsForPlaceholders [paragraph]
+  (assert (pointer? paragraph))
+  (read-rects
+   (fn [buf max]
+     (skia_Paragraph_getRectsForPlaceholders paragraph buf max))))
+
+(defn- skia-Paragraph-getRectsForRanges [paragraph ranges rect-style-height rect-style-width]
+  (assert (pointer? paragraph))
+  (let [n (count ranges)
+        native-ranges (dtype/make-container :native-heap :int32
+                                            (into [] cat ranges))
+        counts (dtype/make-container :native-heap :int32 n)
+        rects (read-rects
+               (fn [buf max]
+                 (skia_Paragraph_getRectsForRanges paragraph native-ranges (int n)
+                                                   (or (->rect-height-style rect-style-height)
+                                                       (int 0))
+                                                   (or (->rect-width-style rect-style-width)
+                                                       (int 0))
+                                                   buf counts max)))]
+    (loop [i 0
+           rects rects
+           result (transient [])]
+      (if (< i n)
+        (let [cnt (nth counts i)]
+          (recur (inc i)
+                 (subvec rects cnt)
+                 (conj! result (subvec rects 0 cnt))))
+        (persistent! result)))))
+
+(defn- skia-Paragraph-getLineMetrics [paragraph]
+  (assert (pointer? paragraph))
+  (let [n (skia_Paragraph_getLineMetrics paragraph nil nil (int 0))
+        indices (dtype/make-container :native-heap :int32 (* 5 n))
+        metrics (dtype/make-container :native-heap :float32 (* 6 n))]
+    (skia_Paragraph_getLineMetrics paragraph indices metrics (int n))
     (into []
           (map (fn [i]
-                 {:x       (native-buffer/read-float buf  (+  (*  4  0)  (*  rect-size  i)))
-                  :y       (native-buffer/read-float buf  (+  (*  4  1)  (*  rect-size  i)))
-                  :width   (native-buffer/read-float buf  (+  (*  4  2)  (*  rect-size  i)))
-                  :height  (native-buffer/read-float buf  (+  (*  4  3)  (*  rect-size  i)))}))
+                 {:start-index (nth indices (+ 0 (* 5 i)))
+                  :end-index (nth indices (+ 1 (* 5 i)))
+                  :end-excluding-whitespaces (nth indices (+ 2 (* 5 i)))
+                  :end-including-newline (nth indices (+ 3 (* 5 i)))
+                  :hard-break? (= 1 (nth indices (+ 4 (* 5 i))))
+                  :baseline (nth metrics (+ 0 (* 6 i)))
+                  :ascent (nth metrics (+ 1 (* 6 i)))
+                  :descent (nth metrics (+ 2 (* 6 i)))
+                  :height (nth metrics (+ 3 (* 6 i)))
+                  :width (nth metrics (+ 4 (* 6 i)))
+                  :left (nth metrics (+ 5 (* 6 i)))}))
           (range n))))
-;; virtual std::vector<TextBox> getRectsForPlaceholders() = 0;
 
-(defn- skia-Paragraph-getRectsForPlaceholders [paragraph]
+(defn- skia-Paragraph-getGlyphPositionsAtCoordinates [paragraph points]
   (assert (pointer? paragraph))
-  (let [buf (ffi-buf)
-        rect-size (* 4 4)
-        max (quot (ffi-buf-size)
-                  rect-size)
-        n (skia_Paragraph_getRectsForPlaceholders paragraph buf max )]
+  (let [n (count points)
+        native-points (dtype/make-container :native-heap :float32
+                                            (into [] cat points))
+        out (dtype/make-container :native-heap :int32 (* 2 n))]
+    (skia_Paragraph_getGlyphPositionsAtCoordinates paragraph native-points (int n) out)
     (into []
           (map (fn [i]
-                 {:x       (native-buffer/read-float buf  (+  (*  4  0)  (*  rect-size  i)))
-                  :y       (native-buffer/read-float buf  (+  (*  4  1)  (*  rect-size  i)))
-                  :width   (native-buffer/read-float buf  (+  (*  4  2)  (*  rect-size  i)))
-                  :height  (native-buffer/read-float buf  (+  (*  4  3)  (*  rect-size  i)))}))
+                 [(nth out (* 2 i))
+                  (nth out (inc (* 2 i)))]))
           (range n))))
 
 
@@ -914,7 +1034,9 @@
                  :text-style/typeface style
                  :text-style/foreground style
                  :text-style/shadows style
-                 :text-style/background-color (skia-TextStyle-setBackgroundColor style (paint/->SkPaint v))
+                 :text-style/background-color (skia-TextStyle-setBackgroundColor style (if-let [resource (frame-resource)]
+                                                                                                       (paint/->frame-SkPaint resource v)
+                                                                                                       (paint/->SkPaint v)))
 
                  ;; else
                  style))
@@ -994,6 +1116,16 @@
     (doto (skia-ParagraphStyle-make)
       (skia-ParagraphStyle-setTextStyle text-style))))
 
+(defn- paragraph-builder [text paragraph-style]
+  (let [paragraph-style (if paragraph-style
+                          (->ParagraphStyle paragraph-style)
+                          (default-paragraph-style))
+        pb (skia-ParagraphBuilder-make paragraph-style)]
+    (add-text pb text)))
+
+(defn- build-paragraph [text paragraph-style]
+  (skia-ParagraphBuilder-build (paragraph-builder text paragraph-style)))
+
 (defn- make-paragraph*
   ([text]
    (make-paragraph* text Float/POSITIVE_INFINITY))
@@ -1003,12 +1135,7 @@
    (assert (or (nil? width)
                (>= width 0)))
    (let [width (or width Float/POSITIVE_INFINITY)
-         paragraph-style (if paragraph-style
-                           (->ParagraphStyle paragraph-style)
-                           (default-paragraph-style))
-         pb (skia-ParagraphBuilder-make paragraph-style)
-         pb (add-text pb text)
-         paragraph (doto (skia-ParagraphBuilder-build pb)
+         paragraph (doto (build-paragraph text paragraph-style)
                      (skia-Paragraph-layout width))]
      paragraph)))
 
@@ -1058,6 +1185,67 @@
     (let [paragraph (make-paragraph paragraph width paragraph-style)]
       (skia-Paragraph-paint paragraph backend/*skia-resource* 0 0))))
 
+(defn line-metrics
+  "Returns the metrics of every line of `para`, a view returned by `paragraph`, in one call.
+
+  Each line is a map with `:start-index`, `:end-index`, `:end-excluding-whitespaces`,
+  `:end-including-newline`, `:hard-break?`, `:baseline`, `:ascent`, `:descent`,
+  `:height`, `:width` and `:left`."
+  [para]
+  (let [{:keys [paragraph width paragraph-style]} para]
+    (skia-Paragraph-getLineMetrics (make-paragraph paragraph width paragraph-style))))
+
+(defn rects-for-ranges
+  "Returns the rects for each `[start end]` range of `ranges` in one call.
+  See `get-rects-for-range`."
+  [para ranges height-style width-style]
+  (let [{:keys [paragraph width paragraph-style]} para]
+    (skia-Paragraph-getRectsForRanges (make-paragraph paragraph width paragraph-style)
+                                      ranges height-style width-style)))
+
+(defn glyph-positions-at-coordinates
+  "Returns `[index affinity]` for each `[x y]` of `points` in one call.
+  See `glyph-position-at-coordinate`."
+  [para points]
+  (let [{:keys [paragraph width paragraph-style]} para]
+    (skia-Paragraph-getGlyphPositionsAtCoordinates (make-paragraph paragraph width paragraph-style)
+                                                   points)))
+
+(defn layout-paragraphs
+  "Builds and lays out `paras`, views returned by `paragraph`, in parallel on native worker threads.
+
+  Returns the `[width height]` bounds of each paragraph. Drawing or measuring the
+  paragraphs afterwards on the same thread reuses the layout, so calling this with
+  every visible message after a resize spreads the work over all cores."
+  [paras]
+  (let [paras (vec paras)
+        n (count paras)]
+    (if (zero? n)
+      []
+      (let [widths (mapv #(or (:width %) Float/POSITIVE_INFINITY) paras)
+            builders (mapv #(paragraph-builder (:paragraph %) (:paragraph-style %)) paras)
+            builder-ptrs (dtype/make-container :native-heap :int64
+                                               (mapv #(dt-ffi/pointer->address %) builders))
+            native-widths (dtype/make-container :native-heap :float32 widths)
+            native-ptrs (dtype/make-container :native-heap :int64 n)
+            metrics (dtype/make-container :native-heap :float32 (* 2 n))]
+        (skia_ParagraphBuilder_build_batch builder-ptrs native-widths (int n) native-ptrs metrics)
+        ;; the cleaner mustn't free the builders while the workers read them
+        (java.lang.ref.Reference/reachabilityFence builders)
+        (into []
+              (map (fn [i]
+                     (let [{:keys [paragraph width paragraph-style]} (nth paras i)
+                           native (add-cleaner
+                                   Paragraph
+                                   (dt-ffi/->pointer (nth native-ptrs i)))]
+                       (memo-put! make-paragraph [paragraph width paragraph-style] native)
+                       [(if (or (nil? width)
+                                (= ##Inf width))
+                          (nth metrics (inc (* 2 i)))
+                          width)
+                        (nth metrics (* 2 i))])))
+              (range n))))))
+
 (defn intrinsic-width [para]
   (let [{:keys [paragraph width paragraph-style]} para
         para (make-paragraph paragraph width paragraph-style)]
@@ -1083,3 +1271,226 @@
   ([text width paragraph-style]
    (->Paragraph text width paragraph-style)))
 
+
+;; Document layout
+;; Long text laid out one paragraph per line. Only lines near the visible
+;; region are shaped, so opening a large file costs about as much as
+;; splitting it into lines, and edits only lay out the lines they touch.
+
+(defn- string->utf8 [^String s]
+  (let [buf (dt-ffi/string->c s)]
+    [buf (dec (count buf))]))
+
+(defn document-layout
+  "Returns a mutable native layout of `text` for very long documents.
+
+  `text` is split into lines and each line is laid out as its own paragraph
+  when it first comes into view. `width` wraps lines (default: no wrapping).
+  `paragraph-style` is a map like the one accepted by `paragraph`.
+
+  See `document-view`, `replace-document-lines!`."
+  ([text]
+   (document-layout text nil nil))
+  ([text width]
+   (document-layout text width nil))
+  ([text width paragraph-style]
+   (let [ps (if paragraph-style
+              (->ParagraphStyle paragraph-style)
+              (default-paragraph-style))
+         doc (add-cleaner
+              DocumentLayout
+              (skia_DocumentLayout_make ps (float (or width Float/POSITIVE_INFINITY))))
+         [buf len] (string->utf8 text)]
+     (skia_DocumentLayout_setText doc buf len)
+     doc)))
+
+(defn set-document-text!
+  "Replaces all of the text of `doc`."
+  [doc text]
+  (let [[buf len] (string->utf8 text)]
+    (skia_DocumentLayout_setText doc buf len))
+  doc)
+
+(defn replace-document-lines!
+  "Replaces `n` lines of `doc` starting at line `start` with the lines of `text`.
+
+  Pass `nil` for `text` to remove lines. Only the replaced lines are laid out again."
+  [doc start n text]
+  (if text
+    (let [[buf len] (string->utf8 text)]
+      (skia_DocumentLayout_replaceLines doc (int start) (int n) buf len))
+    (skia_DocumentLayout_replaceLines doc (int start) (int n) nil 0))
+  doc)
+
+(defn set-document-width!
+  "Sets the wrapping width of `doc`. Lines are laid out again as they come into view."
+  [doc width]
+  (skia_DocumentLayout_setWidth doc (float (or width Float/POSITIVE_INFINITY)))
+  doc)
+
+(defn document-line-count [doc]
+  (skia_DocumentLayout_getLineCount doc))
+
+(defn document-height
+  "Height of `doc`. Lines that haven't been laid out count as single lines."
+  [doc]
+  (skia_DocumentLayout_getHeight doc))
+
+(defn document-line-top
+  "Offset of the top of `line` in `doc`."
+  [doc line]
+  (skia_DocumentLayout_getLineTop doc (int line)))
+
+(defn document-line-at
+  "The line of `doc` at vertical offset `y`."
+  [doc y]
+  (skia_DocumentLayout_getLineAt doc (float y)))
+
+(defn document-position-at
+  "Returns `[line index]` for the point `x`, `y` in `doc`, where `index` is a glyph position in `line`."
+  [doc x y]
+  (let [line (document-line-at doc y)]
+    (if-let [para (skia_DocumentLayout_getLineParagraph doc (int line))]
+      (let [[idx aff] (skia-Paragraph-getGlyphPositionAtCoordinate para x (- y (document-line-top doc line)))]
+        [line (if (= 1 aff)
+                idx
+                (dec idx))])
+      [line 0])))
+
+(defn document-rects-for-range
+  "Returns rects, relative to `doc`, that enclose glyphs `start` to `end` of `line`."
+  [doc line start end]
+  (when-let [para (skia_DocumentLayout_getLineParagraph doc (int line))]
+    (let [top (document-line-top doc line)]
+      (into []
+            (map #(update % :y + top))
+            (skia-Paragraph-getRectsForRange para start end :tight :tight)))))
+
+(defrecord DocumentView [doc width]
+  ui/IOrigin
+  (-origin [this]
+    [0 0])
+
+  ui/IBounds
+  (-bounds [this]
+    [width (document-height doc)])
+
+  backend/IDraw
+  (draw [this]
+    (skia_DocumentLayout_paint doc backend/*skia-resource* (float 0) (float 0))))
+
+(defn document-view
+  "Returns a view of a `document-layout`. Only lines inside the current clip are painted,
+  so wrap it in a scrollview to show part of a long document."
+  [doc width]
+  (->DocumentView doc width))
+
+
+;; Editable paragraphs
+;; Styled text that is edited in place. The text is kept as one native
+;; paragraph per line, so an edit only shapes and wraps the lines it
+;; touches instead of the whole text.
+
+(defn editable-paragraph
+  "Returns a mutable native paragraph of `text` that can be edited in place.
+
+  `width` wraps lines (default: no wrapping). `paragraph-style` is a map like
+  the one accepted by `paragraph`. Indexes are string indexes, like the other
+  `IParagraph` functions.
+
+  The text is shaped one hard line at a time, so an edit only reshapes the
+  lines it touches. Long lines are shaped in chunks of about 4KB. When `width`
+  wraps, each chunk starts a new line, so a long line may wrap early where a
+  chunk ends.
+
+  See `replace-text!`, `set-text-style!`, `editable-paragraph-view`."
+  ([text]
+   (editable-paragraph text nil nil))
+  ([text width]
+   (editable-paragraph text width nil))
+  ([text width paragraph-style]
+   (let [ps (if paragraph-style
+              (->ParagraphStyle paragraph-style)
+              (default-paragraph-style))
+         para (add-cleaner
+               EditableParagraph
+               (skia_EditableParagraph_make ps (float (or width Float/POSITIVE_INFINITY))))
+         [buf len] (string->utf8 text)]
+     (skia_EditableParagraph_replaceText para (int 0) (int 0) buf (int len))
+     para)))
+
+(defn replace-text!
+  "Replaces `start` to `end` of `para` with `text`.
+
+  Text inserted at the end of a styled range takes that range's style."
+  [para start end text]
+  (let [[buf len] (string->utf8 text)]
+    (skia_EditableParagraph_replaceText para (int start) (int end) buf (int len)))
+  para)
+
+(defn set-text-style!
+  "Sets the style of `start` to `end` of `para`. `style` is a text style map like
+  the `:style` of `paragraph` text. Pass `nil` to restore the default style."
+  [para start end style]
+  (skia_EditableParagraph_setStyle para (int start) (int end)
+                                   (when style
+                                     (->TextStyle style)))
+  para)
+
+(defn set-editable-paragraph-width!
+  "Sets the wrapping width of `para`. Lines are wrapped again without being reshaped."
+  [para width]
+  (skia_EditableParagraph_setWidth para (float (or width Float/POSITIVE_INFINITY)))
+  para)
+
+(defrecord EditableParagraphView [para width]
+  IParagraph
+  (get-rects-for-range [_ start end height-style width-style]
+    (read-rects
+     (fn [buf max]
+       (skia_EditableParagraph_getRectsForRange para start end
+                                                (or (->rect-height-style height-style)
+                                                    (int 0))
+                                                (or (->rect-width-style width-style)
+                                                    (int 0))
+                                                buf max))))
+  (get-rects-for-placeholders [_]
+    [])
+  (glyph-position-at-coordinate [_ x y]
+    (let [*pos (-> (native-buffer/malloc 4
+                                         {:uninitialized? true
+                                          :resource-type :auto})
+                   (native-buffer/set-native-datatype :int32))
+          *affinity (-> (native-buffer/malloc 4
+                                              {:uninitialized? true
+                                               :resource-type :auto})
+                        (native-buffer/set-native-datatype :int32))]
+      (skia_EditableParagraph_getGlyphPositionAtCoordinate para
+                                                           (float x)
+                                                           (float y)
+                                                           *pos
+                                                           *affinity)
+      [(nth *pos 0)
+       (nth *affinity 0)]))
+
+  ui/IOrigin
+  (-origin [this]
+    [0 0])
+
+  ui/IBounds
+  (-bounds [this]
+    [(if (or (nil? width)
+             (= ##Inf width))
+       (skia_EditableParagraph_getMaxIntrinsicWidth para)
+       width)
+     (skia_EditableParagraph_getHeight para)])
+
+  backend/IDraw
+  (draw [this]
+    (skia_EditableParagraph_paint para backend/*skia-resource* (float 0) (float 0))))
+
+(defn editable-paragraph-view
+  "Returns a view of an `editable-paragraph`. `width` should match the width
+  `para` wraps at."
+  [para width]
+  (->EditableParagraphView para width))
@@ -992,6 +992,76 @@
                    (skia/->Cached
                     (terminal-line {:tline tline}))))))
 
+;; Native grid rendering
+;; Packs the terminal lines into skia's terminal grid cells. The grid
+;; hashes each row, so only rows that changed are shaped and repainted.
+
+(defn- cell-codepoint [c]
+  (cond
+    (char? c) (int c)
+    (and (string? c) (pos? (count c))) (.codePointAt ^String c 0)
+    :else 0))
+
+(defn- cell-attr-bits [attrs]
+  (reduce-kv (fn [bits k flag]
+               (if (get attrs k)
+                 (bit-or bits flag)
+                 bits))
+             0
+             skia/terminal-cell-attrs))
+
+(defn- cell-color [color]
+  (if color
+    (skia/terminal-color (term-color color))
+    0))
+
+(defn- pack-term-cells ^Memory [lines rows cols]
+  (let [mem (Memory. (* (max 1 (* rows cols)) skia/terminal-cell-bytes))]
+    (.clear mem)
+    (doseq [[i line] (map-indexed vector (take rows lines))
+            [j {:keys [c attrs]}] (map-indexed vector (take cols line))
+            :let [offset (* (+ (* i cols) j) skia/terminal-cell-bytes)]]
+      (.setInt mem offset (int (cell-codepoint c)))
+      (.setInt mem (+ offset 4) (int (cell-color (:fg attrs))))
+      (.setInt mem (+ offset 8) (int (cell-color (:bg attrs))))
+      (.setInt mem (+ offset 12) (int (cell-attr-bits attrs))))
+    mem))
+
+(defrecord GridTerminal [grid term]
+  ui/IOrigin
+  (-origin [_]
+    [0 0])
+
+  ui/IBounds
+  (-bounds [_]
+    (let [[rows cols] (:size term)
+          [cw ch] (skia/terminal-cell-size grid)]
+      [(* cw cols) (* ch rows)]))
+
+  skia/IDraw
+  (draw [this]
+    (let [[rows cols] (:size term)
+          [cw ch] (skia/terminal-cell-size grid)
+          {:keys [row col]} (:cursor term)]
+      (skia/resize-terminal-grid! grid rows cols)
+      (skia/set-terminal-cells! grid 0 rows (pack-term-cells (:lines term) rows cols))
+      (skia/draw (skia/terminal-grid-view grid rows cols))
+      (skia/draw (ui/translate (* col cw) (* row ch)
+                               (ui/filled-rectangle [0.5725490196078431
+                                                     0.5725490196078431
+                                                     0.5725490196078431
+                                                     0.4]
+                                                    cw ch))))))
+
+(defn grid-terminal
+  "Element that draws terminal state `term` with a native terminal grid.
+
+  `grid` is created with `membrane.skia/terminal-grid` and is resized to
+  the terminal's size as needed. Unlike `terminal`, unchanged rows aren't
+  redrawn."
+  [grid term]
+  (->GridTerminal grid term))
+
 
 
 (def history (atom []))
@@ -1015,6 +1085,9 @@
 #_(writec-bytes pty [97])
 
 
+(defonce test-term-grid
+  (delay (skia/terminal-grid term-font 40 80)))
+
 (let [writec-bytes (fn [pty bts]
                      (async/put! write-ch bts))
       writec-str (fn [pty s]
@@ -1108,9 +1181,13 @@
         
         nil)
       
-      (terminal {:term (if hindex
-                         (-> history (nth hindex) second)
-                         term)})
+      (grid-terminal @test-term-grid
+                     (if hindex
+                       (-> history (nth hindex) second)
+                       term))
+      #_(terminal {:term (if hindex
+                           (-> history (nth hindex) second)
+                           term)})
       #_(skia/->Cached
          (draw-term (if hindex
                       (-> history (nth hindex) second)
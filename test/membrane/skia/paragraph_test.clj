@@ -0,0 +1,141 @@
+(ns membrane.skia.paragraph-test
+  (:require [clojure.test :refer :all]
+            [clojure.string :as str]
+            [tech.v3.datatype.native-buffer :as native-buffer]
+            [membrane.ui :as ui]
+            [membrane.skia.paragraph :as para]))
+
+(defn- fake-rects
+  "Returns an `(f buf max)` for `read-rects` that has `n` rects and records the `max` of each call."
+  [n calls]
+  (fn [buf max]
+    (swap! calls conj max)
+    (dotimes [i (min n max)]
+      (dotimes [j 4]
+        (native-buffer/write-float buf (+ (* 16 i) (* 4 j)) (float (+ (* 4 i) j)))))
+    n))
+
+(defn- expected-rects [n]
+  (into []
+        (map (fn [i]
+               {:x (float (* 4 i))
+                :y (float (+ (* 4 i) 1))
+                :width (float (+ (* 4 i) 2))
+                :height (float (+ (* 4 i) 3))}))
+        (range n)))
+
+(deftest read-rects-fit
+  (let [calls (atom [])]
+    (is (= (expected-rects 3)
+           (#'para/read-rects (fake-rects 3 calls))))
+    (is (= 1 (count @calls))))
+
+  (let [calls (atom [])]
+    (is (= []
+           (#'para/read-rects (fake-rects 0 calls))))
+    (is (= 1 (count @calls)))))
+
+(deftest read-rects-retry
+  (let [calls (atom [])
+        ;; one more than fits in the shared buffer
+        n (inc (quot 4096 16))]
+    (is (= (expected-rects n)
+           (#'para/read-rects (fake-rects n calls))))
+    (is (= 2 (count @calls)))
+    (is (< (first @calls) n))
+    (is (= n (second @calls)))))
+
+;; The tests below use the native library.
+
+(defn- check-document-lines
+  "Checks that line tops and `document-line-at` agree for every line of `doc`."
+  [doc]
+  (let [n (para/document-line-count doc)
+        tops (mapv #(para/document-line-top doc %) (range (inc n)))]
+    (is (zero? (first tops)))
+    (is (apply < tops))
+    (is (== (para/document-height doc) (peek tops)))
+    (doseq [line (range n)]
+      (is (= line (para/document-line-at doc (+ (nth tops line) 0.25))))
+      (is (= line (para/document-line-at doc (- (nth tops (inc line)) 0.25)))))))
+
+(deftest document-line-index
+  (let [lines (mapv #(str/join " " (repeat (mod (* 7 %) 23) "word"))
+                    (range 300))
+        doc (para/document-layout (str/join "\n" lines) 150)]
+    (is (= 300 (para/document-line-count doc)))
+    (check-document-lines doc)
+
+    (testing "lines change height when laid out"
+      (doseq [line (range 0 300 3)]
+        (para/document-rects-for-range doc line 0 1))
+      (check-document-lines doc))
+
+    (testing "replacing lines"
+      (para/replace-document-lines! doc 10 5 "one\ntwo")
+      (is (= 297 (para/document-line-count doc)))
+      (check-document-lines doc)
+
+      (para/replace-document-lines! doc 0 0 (str/join "\n" (take 40 lines)))
+      (is (= 337 (para/document-line-count doc)))
+      (check-document-lines doc)
+
+      (para/replace-document-lines! doc 100 200 nil)
+      (is (= 137 (para/document-line-count doc)))
+      (check-document-lines doc))))
+
+(defn- editable-rects [para start end]
+  (para/get-rects-for-range (para/editable-paragraph-view para nil) start end :tight :tight))
+
+(defn- editable-height [para]
+  (second (ui/bounds (para/editable-paragraph-view para nil))))
+
+(defn- editable-position [para x y]
+  (first (para/glyph-position-at-coordinate (para/editable-paragraph-view para nil) x y)))
+
+(deftest editable-paragraph-utf16-offsets
+  (let [para (para/editable-paragraph "a\uD83D\uDE00b\nc")]
+    ;; the emoji is two utf-16 code units
+    (is (= 1 (count (editable-rects para 1 3))))
+    (is (= 4 (editable-position para 1e6 1)))
+    (is (= 7 (editable-position para 1e6 (dec (editable-height para)))))
+
+    (para/replace-text! para 3 4 "xy")
+    (is (= 5 (editable-position para 1e6 1)))
+    (is (= 8 (editable-position para 1e6 (dec (editable-height para)))))))
+
+(deftest editable-paragraph-long-line
+  (let [line (str/join " " (repeat 4000 "word"))
+        para (para/editable-paragraph line)]
+    ;; long lines are shaped in chunks that share a row
+    (is (== (editable-height (para/editable-paragraph "word"))
+            (editable-height para)))
+    (is (= (count line) (editable-position para 1e7 1)))
+
+    (para/replace-text! para 10000 10000 "inserted ")
+    (is (= (+ (count line) 9) (editable-position para 1e7 1)))
+    (is (seq (editable-rects para 9995 10015)))
+    (is (seq (editable-rects para (- (count line) 10) (+ (count line) 9))))))
+
+(defn- rect-height [para start end]
+  (:height (first (editable-rects para start end))))
+
+(deftest editable-paragraph-style-runs
+  (let [para (para/editable-paragraph "hello world")
+        plain (editable-height para)]
+    (para/set-text-style! para 6 11 {:text-style/font-size 48})
+    (let [styled (editable-height para)]
+      (is (> styled plain))
+
+      (testing "editing before a run moves it"
+        (para/replace-text! para 0 6 "")
+        (is (== styled (editable-height para))))
+
+      (testing "text typed at the end of a run continues it"
+        (para/replace-text! para 5 5 "!")
+        (is (== (rect-height para 0 1) (rect-height para 5 6))))
+
+      (testing "removing the styled text removes the run"
+        (para/replace-text! para 0 6 "")
+        (para/replace-text! para 0 0 "plain")
+        (is (== plain (editable-height para)))))))
@@ -0,0 +1,254 @@
+(ns membrane.skia-test
+  (:require [clojure.test :refer :all]
+            [clojure.java.io :as io]
+            [membrane.ui :as ui]
+            [membrane.skia :as skia])
+  (:import com.phronemophobic.membrane.Skia
+           com.sun.jna.Pointer))
+
+(deftest visible-children-bitmask
+  (let [children (vec (range 130))
+        visible (long-array 3)
+        drawn [0 1 62 63 64 65 127 128 129]]
+    (doseq [i drawn]
+      (aset visible (quot i 64) (bit-set (aget visible (quot i 64)) (rem i 64))))
+    (is (= drawn
+           (#'skia/visible-children children visible))))
+
+  (testing "no bits set"
+    (is (empty? (#'skia/visible-children (vec (range 70)) (long-array 2)))))
+
+  (testing "all bits set"
+    (is (= (range 70)
+           (#'skia/visible-children (vec (range 70)) (long-array [-1 -1]))))))
+
+(deftest child-rects-padding
+  (let [children [(ui/translate 0 10 (ui/spacer 10 5))
+                  (ui/translate 3 20 (ui/spacer 1 2))]]
+    (is (= [0.0 10.0 10.0 5.0
+            3.0 20.0 1.0 2.0]
+           (vec (#'skia/child-rects children 0))))
+    (is (= [-2.0 8.0 14.0 9.0
+            1.0 18.0 5.0 6.0]
+           (vec (#'skia/child-rects children 2))))))
+
+;; A model of the native scene graph, to check the calls sync-scene! makes.
+
+(defn- fake-ancestor? [state id node]
+  (loop [node node]
+    (cond
+      (= node id) true
+      (or (nil? node) (zero? node)) false
+      :else (recur (get-in state [:parent node])))))
+
+(defn- fake-set-parent [state id parent index]
+  (let [old (get-in state [:parent id])
+        state (if old
+                (update-in state [:children old] #(filterv (complement #{id}) %))
+                state)
+        children (get-in state [:children parent] [])
+        children (if (or (neg? index) (>= index (count children)))
+                   (conj children id)
+                   (into (conj (subvec children 0 index) id)
+                         (subvec children index)))]
+    (-> state
+        (assoc-in [:parent id] parent)
+        (assoc-in [:children parent] children))))
+
+(defn- fake-remove [state id]
+  (let [parent (get-in state [:parent id])
+        state (update-in state [:children parent] #(filterv (complement #{id}) %))]
+    (loop [state state
+           ids [id]]
+      (if-let [[id & more] (seq ids)]
+        (recur (-> state
+                   (update :parent dissoc id)
+                   (update :children dissoc id))
+               (concat more (get-in state [:children id])))
+        state))))
+
+(defn- sync-fake! [scene fake roots]
+  (with-redefs [skia/skia_scene_node_set_parent
+                (fn [_ id parent index]
+                  (if (fake-ancestor? @fake id parent)
+                    (int 0)
+                    (do
+                      (swap! fake fake-set-parent id parent index)
+                      (int 1))))
+                skia/skia_scene_node_remove
+                (fn [_ id]
+                  (swap! fake fake-remove id))
+                skia/skia_scene_node_set_transform (constantly nil)
+                skia/skia_scene_node_set_clip (constantly nil)
+                skia/skia_scene_node_clear_clip (constantly nil)
+                skia/skia_scene_node_set_opacity (constantly nil)
+                skia/record-scene-node! (constantly nil)]
+    (#'skia/sync-scene! scene roots)))
+
+(defn- node [id & children]
+  (skia/scene-node {:id id
+                    :children children}))
+
+(defn- expected-children
+  "Returns a map of id to child ids for `roots`, with 0 as the root."
+  [roots]
+  (letfn [(walk [m parent nodes]
+            (reduce (fn [m node]
+                      (walk m (:id node) (:children node)))
+                    (assoc m parent (mapv :id nodes))
+                    nodes))]
+    (walk {} 0 roots)))
+
+(deftest sync-scene-order
+  (let [scene {:native nil
+               :nodes (atom {})}
+        fake (atom {:parent {}
+                    :children {0 []}})]
+    (doseq [roots [[(node 1 (node 2) (node 3) (node 4)) (node 5)]
+                   ;; reorder
+                   [(node 5) (node 1 (node 4) (node 2) (node 3))]
+                   [(node 5) (node 1 (node 3) (node 4) (node 2))]
+                   ;; reparent and remove
+                   [(node 5 (node 3)) (node 1 (node 4))]
+                   ;; a child becomes its old parent's parent
+                   [(node 4 (node 1)) (node 5 (node 3))]
+                   [(node 3 (node 5 (node 4 (node 1))))]
+                   [(node 6) (node 3 (node 4) (node 5 (node 1)))]
+                   []]]
+      (sync-fake! scene fake roots)
+      (let [expected (expected-children roots)]
+        (doseq [[id children] expected]
+          (is (= children (get-in @fake [:children id] []))
+              (str "children of " id " after syncing " (pr-str expected))))
+        (is (= (set (keys (dissoc expected 0)))
+               (set (keys (:parent @fake)))))))))
+
+(deftest sync-scene-rejects-cycles
+  (let [scene {:native nil
+               :nodes (atom {})}
+        fake (atom {:parent {}
+                    :children {0 []}})]
+    (is (thrown-with-msg? clojure.lang.ExceptionInfo #"unique"
+                 (sync-fake! scene fake [(node 1 (node 2 (node 1)))])))))
+
+(deftest sync-scene-rejects-duplicate-ids
+  (doseq [roots [[(node 1) (node 1)]
+                 [(node 1 (node 2)) (node 3 (node 2))]]]
+    (let [scene {:native nil
+                 :nodes (atom {})}
+          fake (atom {:parent {}
+                      :children {0 []}})]
+      (is (thrown-with-msg? clojure.lang.ExceptionInfo #"unique"
+                            (sync-fake! scene fake roots))
+          (pr-str roots)))))
+(defn- bgra-pixels
+  "Returns a native buffer of opaque `width` x `height` pixels with rows `stride` pixels apart.
+  Pixels past `width` in each row are transparent."
+  ^com.sun.jna.Memory [width height stride]
+  (let [buf (com.sun.jna.Memory. (* 4 stride height))]
+    (doseq [y (range height)
+            x (range stride)]
+      (.setInt buf (* 4 (+ x (* y stride)))
+               (unchecked-int (if (< x width) 0xff336699 0x00336699))))
+    buf))
+
+(defn- opaque? [buf width height stride]
+  (= 1 (#'skia/skia_bgra8888_is_opaque buf (int width) (int height) (int (* 4 stride)))))
+
+(deftest bgra8888-opaque-scan
+  ;; 37 = two 16 pixel blocks and a 5 pixel tail
+  (doseq [width [1 15 16 37]
+          stride [width (+ width 3)]]
+    (let [height 3]
+      (is (opaque? (bgra-pixels width height stride) width height stride)
+          (str "opaque " width "x" height " stride " stride))
+      (doseq [x [0 (quot width 2) (dec width)]
+              y [0 (dec height)]]
+        (let [buf (bgra-pixels width height stride)]
+          (.setInt buf (* 4 (+ x (* y stride))) (unchecked-int 0xfe336699))
+          (is (not (opaque? buf width height stride))
+              (str "translucent pixel at " [x y] " of " width "x" height " stride " stride)))))))
+
+;; The shader cache test needs a gl context. It makes a hidden glfw window
+;; and does nothing where one can't be made.
+
+(defn- glfw [ret fn-name & args]
+  (.invoke ^com.sun.jna.Function (.getFunction ^com.sun.jna.NativeLibrary @@#'skia/glfw fn-name)
+           ret
+           (to-array args)))
+
+(defn- with-hidden-gl-context
+  "Calls `f` with the gl context of a hidden window current."
+  [f]
+  (when (and @@#'skia/glfw
+             (= 1 (glfw Integer/TYPE "glfwInit")))
+    (when @@#'skia/objlib
+      (glfw Void/TYPE "glfwWindowHint" skia/GLFW_CONTEXT_VERSION_MAJOR (int 3))
+      (glfw Void/TYPE "glfwWindowHint" skia/GLFW_CONTEXT_VERSION_MINOR (int 2))
+      (glfw Void/TYPE "glfwWindowHint" skia/GLFW_OPENGL_PROFILE skia/GLFW_OPENGL_CORE_PROFILE)
+      (glfw Void/TYPE "glfwWindowHint" skia/GLFW_OPENGL_FORWARD_COMPAT skia/GL_TRUE))
+    (glfw Void/TYPE "glfwWindowHint" skia/GLFW_VISIBLE (int 0))
+    (when-let [window (glfw Pointer "glfwCreateWindow" (int 64) (int 64) "" Pointer/NULL Pointer/NULL)]
+      (try
+        (glfw Void/TYPE "glfwMakeContextCurrent" window)
+        (f)
+        (finally
+          (glfw Void/TYPE "glfwMakeContextCurrent" Pointer/NULL)
+          (glfw Void/TYPE "glfwDestroyWindow" window))))))
+
+(defn- draw-with-new-gpu-context!
+  "Draws a few frames with a new gpu context for the current gl context, like a new window would."
+  []
+  (let [resource (Skia/skia_init)
+        font-cache (atom {})]
+    (try
+      (#'skia/skia_reshape resource (int 200) (int 200) (float 1) (float 1))
+      (binding [skia/*skia-resource* resource
+                skia/*font-cache* font-cache
+                skia/*image-cache* (atom {})]
+        (dotimes [_ 3]
+          (Skia/skia_clear resource)
+          (skia/draw (ui/vertical-layout
+                      (ui/label "shader cache")
+                      (ui/with-style ::ui/style-stroke
+                        (ui/path [0 0] [40 60] [80 0]))
+                      (ui/rounded-rectangle 80 40 8)
+                      (ui/with-color [1 0 0 0.5]
+                        (ui/rectangle 50 50))))
+          (Skia/skia_flush_and_submit resource)))
+      (finally
+        (#'skia/release-fonts! font-cache)
+        (Skia/skia_cleanup resource)))))
+
+(defn- shader-cache-disk-bytes
+  "Bytes of the entries in the cache's version directories."
+  [dir]
+  (->> (.listFiles (io/file dir "membrane-shader-cache"))
+       (filter #(re-matches #"v[0-9a-f]{16}" (.getName ^java.io.File %)))
+       (mapcat #(.listFiles ^java.io.File %))
+       (map #(.length ^java.io.File %))
+       (reduce + 0)))
+
+(deftest shader-cache-reload
+  (let [dir (.toFile (java.nio.file.Files/createTempDirectory
+                      "membrane-shader-cache-test"
+                      (make-array java.nio.file.attribute.FileAttribute 0)))
+        ;; looks like a cache version, but wasn't made by the cache
+        decoy (io/file dir "membrane-shader-cache" "vdecoy" "keep")]
+    (io/make-parents decoy)
+    (spit decoy "")
+    (skia/set-shader-cache! dir 0)
+    (when (skia/shader-cache-stats)
+      (with-hidden-gl-context
+        (fn []
+          (draw-with-new-gpu-context!)
+          (let [first-stats (skia/shader-cache-stats)
+                _ (draw-with-new-gpu-context!)
+                second-stats (skia/shader-cache-stats)]
+            (is (pos? (:stores first-stats)))
+            ;; the second context loads every program instead of compiling it
+            (is (= (:stores first-stats) (:stores second-stats)))
+            (is (>= (- (:hits second-stats) (:hits first-stats))
+                    (:stores first-stats)))
+            (is (= (:bytes second-stats) (shader-cache-disk-bytes dir)))
+            (is (.exists decoy))))))))